@@ -0,0 +1,100 @@
+#ifndef __centroid_reassignment_hpp_included
+#define __centroid_reassignment_hpp_included
+
+/* K-means style refinement of the clusters once their centroids have converged: every sequence moves to the cluster with the nearest centroid,
+   after which only the clusters whose membership changed need their centroids reconverging (from where they were, so usually in a few rounds).
+   There are only as many centroids as clusters, so the sequence vs. centroid DTWs are done on the CPU threads, abandoning each as soon
+   as it can no longer beat the nearest centroid found so far. */
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "cpu_utils.hpp" // for parallelFor()
+
+/* The DTW distance of the two sequences with the same step pattern, open end handling and normalization as the DTWDistance GPU kernel (first is the
+ * vertical, fully aligned, sequence), or max() as soon as every cell of a column of the cost matrix exceeds abandon_above. That's safe as costs never decrease
+ * along a path, and in every mode any complete path passes through each column, or can be extended for free across it. */
+template<typename T>
+__host__
+double
+dtwDistanceEarlyAbandon(const T *first_seq, size_t first_seq_length, const T *second_seq, size_t second_seq_length, int use_open_start, int use_open_end, double abandon_above){
+	double normalization = (use_open_end && !use_open_start || !use_open_end && use_open_start) ? first_seq_length : 1;
+	double abandon_cost = abandon_above == std::numeric_limits<double>::max() ? abandon_above : (abandon_above*normalization)*(abandon_above*normalization);
+	std::vector<double> column(first_seq_length), previous_column(first_seq_length);
+	for(size_t j = 0; j < second_seq_length; j++){
+		double first_diff = (double) first_seq[0]-second_seq[j];
+		column[0] = (j ? previous_column[0] : 0) + (use_open_start ? 0 : first_diff*first_diff);
+		double column_min = column[0];
+		for(size_t i = 1; i < first_seq_length; i++){
+			double diff = (double) first_seq[i]-second_seq[j];
+			double up_cost = column[i-1]+diff*diff;
+			if(!j){
+				column[i] = up_cost;
+			}
+			else{
+				double diag_cost = previous_column[i-1]+diff*diff;
+				// Consuming more of the second sequence along the top is free in open end mode
+				double right_cost = previous_column[i]+(use_open_end && i == first_seq_length-1 ? 0 : diff*diff);
+				column[i] = std::min(diag_cost, std::min(up_cost, right_cost));
+			}
+			column_min = std::min(column_min, column[i]);
+		}
+		if(column_min > abandon_cost){
+			return std::numeric_limits<double>::max();
+		}
+		column.swap(previous_column);
+	}
+	return sqrt(previous_column[first_seq_length-1])/normalization;
+}
+
+/* Move each sequence to the cluster whose centroid is nearest, except for the cluster medoids, which anchor their clusters (their names and value scaling
+ * identify the centroids in the output, and no cluster can end up empty). As in DBA, the shorter of the pair is the fully aligned one in open end mode.
+ * Flags the clusters that gained or lost members in cluster_changed, and returns the number of sequences moved. */
+template<typename T>
+__host__
+size_t
+reassignToNearestCentroids(T **sequences, size_t *sequence_lengths, int num_sequences, T **centroids, size_t *centroid_lengths, int num_clusters, int *medoidIndices,
+                           int use_open_start, int use_open_end, int *memberships, std::vector<char> &cluster_changed){
+	std::vector<char> is_medoid(num_sequences, 0);
+	for(int c = 0; c < num_clusters; c++){
+		is_medoid[medoidIndices[c]] = 1;
+	}
+	std::vector<int> new_memberships(memberships, memberships+num_sequences);
+	parallelFor(num_sequences, [&](size_t i, int thread_index){
+		if(is_medoid[i]){
+			return;
+		}
+		auto distanceTo = [&](int c, double abandon_above){
+			if(use_open_end && centroid_lengths[c] < sequence_lengths[i]){
+				return dtwDistanceEarlyAbandon(centroids[c], centroid_lengths[c], sequences[i], sequence_lengths[i], use_open_start, use_open_end, abandon_above);
+			}
+			return dtwDistanceEarlyAbandon(sequences[i], sequence_lengths[i], centroids[c], centroid_lengths[c], use_open_start, use_open_end, abandon_above);
+		};
+		// Starting with the current cluster usually gives a tight bound to abandon the others with right away
+		double nearest_distance = distanceTo(memberships[i], std::numeric_limits<double>::max());
+		for(int c = 0; c < num_clusters; c++){
+			if(c == memberships[i]){
+				continue;
+			}
+			double distance = distanceTo(c, nearest_distance);
+			if(distance < nearest_distance){
+				nearest_distance = distance;
+				new_memberships[i] = c;
+			}
+		}
+	});
+	cluster_changed.assign(num_clusters, 0);
+	size_t num_moved = 0;
+	for(int i = 0; i < num_sequences; i++){
+		if(new_memberships[i] != memberships[i]){
+			cluster_changed[memberships[i]] = 1;
+			cluster_changed[new_memberships[i]] = 1;
+			memberships[i] = new_memberships[i];
+			num_moved++;
+		}
+	}
+	return num_moved;
+}
+
+#endif
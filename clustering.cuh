@@ -4,103 +4,918 @@
 #define ARITH_SERIES_SUM(n) (((n)*(n+1))/2)
 // Convenience macro to calculate data row offset in upper right triangle of all vs. all pairwise distances 1D "matrix" representation
 #define PAIRWISE_DIST_ROW(i,num_seqs) (ARITH_SERIES_SUM(num_seqs-1)-ARITH_SERIES_SUM(num_seqs - i - 1))
- 
-/* Iteratively define clusters from the leaves up, using permutation testing to see if the clusters predefined in the provided 'merge' array 
- * (the results of complete linkage) are non-random. */
 
-template<typename T>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "cpu_utils.hpp" // for parallelFor() and getNumCPUThreads()
+#include "io_utils.hpp" // for writeClusterMembership()
+#include "submodules/hclust-cpp/fastcluster.h"
+
+/* Assign cluster memberships by cutting the complete linkage dendrogram (as described by hclust's merge and height arrays) according to cdist:
+ * > 1 is K-means style (excluding singletons), 1 puts everything in one cluster, [0,1) is a fixed height cutoff in the normalized tree. 
+ * Returns the number of clusters. */
 __host__
-void 
-merge_clusters(T **gpu_sequences, size_t *sequence_lengths, size_t num_sequences, T *dtwPairwiseDistances, int *merge, float cluster_p_value, int *memberships, int use_open_start, int use_open_end, cudaStream_t stream){
-
-        for(int i = 0; i < num_sequences; i++){
-		memberships[i] = i; // everything starts in its own cluster
-                // NB: indices of observables in merge start at 1 (R convention)
-                // The hclust convention is a (n-1)*2 matrix for n sequences in a clustering result, where for each merge pair,
-                // leaf nodes are indicated with a negative number
-                // (m1,m2) = merge[i,] node pair
-                int m1 = merge[i];
-                int m2 = merge[num_sequences-1+i];
-                if (m1 < 0 && m2 < 0) { // both leaf nodes single observables in the complete linkage results
-                        // For each leaf node, see if its joining leaf after complete linkage is lower cost than x% of all possible pairings for that leaf
-                        // (since we've precomputed all pairwise alignments, we might as well use the data).
-                        // Count the distances greater between this leaf and all other non-merge leaves, to find the rank of the
-                        // joined leafs within that list to get an exact p-value for this merge
-                        // For simplicity, make m1 the earlier index, and for sanity's sake change to zero-based indexing
-                        if(m1 < m2){ // note they are negative numbers by R convention, so < is actually > once we flip the signs later
-                                int temp = m1;
-                                m1 = m2;
-                                m2 = temp;
-                        }
-                        m1 = -m1-1;
-                        m2 = -m2-1;
-                        //std::cerr << i << " " << sequence_names[m1] << ":" << sequence_names[m1] << std::endl;
-                        int dists_smaller = 0;
-                        int m1row_index_offset = PAIRWISE_DIST_ROW(m1, num_sequences);
-                        T merge_dist = dtwPairwiseDistances[m1row_index_offset+m2-m1-1];
-                        // Check the m1 column for all rows before m1 in the upper right triangle of pairwise distances
-                        for(int j = 0; j < m1; ++j){
-                                if(dtwPairwiseDistances[PAIRWISE_DIST_ROW(j, num_sequences)+m1-j-1] < merge_dist){ // -1 because we aren't storing the diagonal zeroes
-                                        dists_smaller++;
-                                }
-                        }
-                        // Check the row for m1
-                        for(int j = m1; j < num_sequences - 1; ++j){
-                                if(dtwPairwiseDistances[m1row_index_offset+j-m1-1] < merge_dist){
-                                        dists_smaller++;
-                                }
+int
+cutDendrogram(size_t num_sequences, int *merge, double *height, double cdist, int *memberships, bool verbose=true){
+	if(cdist > 1){ // assume you want to do k-means clustering
+		int new_k = cdist;
+		if(new_k > num_sequences){
+			// Everything is in its own cluster
+			new_k = num_sequences;
+		}
+		if(verbose) std::cerr << std::endl << "Using K-means clustering (excluding singletons)" << std::endl;
+		// Exclude any singletons as being considered "clusters"
+		int num_multimember_clusters;
+		do{
+			cutree_k(num_sequences, merge, new_k, memberships);
+			int* num_members_per_cluster = new int[new_k](); // zero-initialized
+			for(int i = 0; i < num_sequences; i++){
+				num_members_per_cluster[memberships[i]]++;
+			}
+			num_multimember_clusters = 0;
+			for(int i = 0; i < new_k; i++){
+				if(num_members_per_cluster[i] > 1){
+					num_multimember_clusters++;
+				}
                         }
-                        float p_value = ((float) dists_smaller + 1)/(num_sequences-1);  // There are n-1 possible pairings,
-                                                                                        // counted the smaller dists, so picking the most optimistic
-                                                                                        // p-value in case there are ties.
-                        if(dists_smaller == 0 || p_value < cluster_p_value){
+			//std::cerr << "Found " << num_multimember_clusters << " multicluster members with K set to " << new_k << std::endl;
+			delete[] num_members_per_cluster; // overkill maybe?
+			new_k += ((int) cdist) - num_multimember_clusters; // adjust K to compensate for singletons eating up real cluster space
+		} while(num_multimember_clusters < ((int) cdist) && new_k < num_sequences);
+		if(verbose) std::cerr << "Final K to compensate for singletons: " << new_k << std::endl;
+		
+	}
+        else if(cdist == 1){
+		// Special case for 1, always everything in one cluster. Avoids cutree_cdist split of two-leaf-only dendrograms
+		// and other simple topologies with branch length 1.
+		for(int i = 0; i < num_sequences; i++){
+			memberships[i] = 0;
+		}
+	}
+	else{
+		// Stop clustering at step with cluster distance >= cdist
+		if(verbose) std::cerr << std::endl << "Using dendrogram fixed height clustering cutoff" << std::endl;
+		cutree_cdist(num_sequences, merge, height, cdist, memberships);
+	}
+
+	int num_clusters = 1;
+	for(int i = 0; i < num_sequences; i++){
+		if(memberships[i] >= num_clusters){
+			num_clusters = memberships[i]+1;
+		}
+	}
+	return num_clusters;
+}
 
-				// Perform DTW, then average the two (no convergence required)
-				std::string NO_FILE_OUTPUT = std::string(); //empty
-				size_t TWO_SEQS = 2;
-				T *medoidSequence = gpu_sequences[m2]; // The convention is to pick the longer of the two. Since we sort by size, m2 is the longer (or same length) one.
-				size_t medoidLength = sequence_lengths[m2];
-				T *leafSequences[2] = {gpu_sequences[m1], gpu_sequences[m2]};
-				size_t leaf_sequence_lengths[2] = {sequence_lengths[m1], sequence_lengths[m2]};
+// Nearest neighbour searches and cluster distance updates are only spread across threads when there are enough active clusters to amortize handing them out.
+#define LINKAGE_PARALLEL_MIN_ACTIVE 16384
+#define LINKAGE_PARALLEL_GRAIN 4096
 
-				T *leavesAveragedSequence;
-				cudaMallocManaged(leavesAveragedSequence, sizeof(unsigned int)*medoidLength); CUERR("Allocating GPU memory for two leaf mean sequence pileup");
+// One merge of two clusters, identified by the indices of their representative sequences (i.e. matrix rows).
+struct linkage_step{
+	size_t node1;
+	size_t node2;
+	double height;
+};
 
-				DBAUpdate(medoidSequence, medoidLength, leafSequences, TWO_SEQS, leaf_sequence_lengths, use_open_start, use_open_end, leavesAveragedSequence, NO_FILE_OUTPUT, stream);
+template<typename D>
+__host__ inline D &linkageDistance(D *dtwPairwiseDistances, size_t num_sequences, size_t i, size_t j){
+	return i < j ? dtwPairwiseDistances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1] : dtwPairwiseDistances[PAIRWISE_DIST_ROW(j, num_sequences)+i-j-1];
+}
 
-				memberships[m2] = i;
-                        }
+/* Helper threads started once for a whole completeLinkage() call, since it does O(N) nearest neighbour searches and distance updates and starting threads 
+ * for each (as parallelFor() does) would cost more than they save. Each run() hands the chunks of the active cluster list out to the helpers and the calling thread alike. */
+struct linkage_worker_pool{
+	std::vector<CUTThread> threads;
+	std::mutex mutex;
+	std::condition_variable changed;
+	const std::function<void(size_t,size_t)> *job;
+	size_t num_items;
+	std::atomic<size_t> next_item;
+	size_t generation;
+	size_t busy_workers;
+	bool stopping;
+
+	linkage_worker_pool(int num_threads) : job(0), num_items(0), next_item(0), generation(0), busy_workers(0), stopping(false) {
+		for(int t = 1; t < num_threads; t++){
+			threads.push_back(cutStartThread((CUT_THREADROUTINE) workerThread, this));
+		}
+	}
+
+	__host__ void
+	work(){
+		for(size_t begin = next_item.fetch_add(LINKAGE_PARALLEL_GRAIN); begin < num_items; begin = next_item.fetch_add(LINKAGE_PARALLEL_GRAIN)){
+			(*job)(begin, std::min(begin+LINKAGE_PARALLEL_GRAIN, num_items));
+		}
+	}
+
+	static CUT_THREADPROC
+	workerThread(void *void_pool){
+		linkage_worker_pool *pool = (linkage_worker_pool *) void_pool;
+		size_t seen_generation = 0;
+		std::unique_lock<std::mutex> lock(pool->mutex);
+		while(true){
+			pool->changed.wait(lock, [pool, seen_generation]{return pool->stopping || pool->generation != seen_generation;});
+			if(pool->stopping){
+				break;
+			}
+			seen_generation = pool->generation;
+			lock.unlock();
+			pool->work();
+			lock.lock();
+			if(--pool->busy_workers == 0){
+				pool->changed.notify_all();
+			}
+		}
+		CUT_THREADEND;
+	}
+
+	// Calls func(begin, end) for consecutive LINKAGE_PARALLEL_GRAIN sized ranges covering positions [0,num_items) of the active cluster list, 
+	// or just once for the whole list if it's short. Returns once all ranges are done.
+	__host__ void
+	run(size_t num_items, const std::function<void(size_t,size_t)> &func){
+		if(threads.empty() || num_items < LINKAGE_PARALLEL_MIN_ACTIVE){
+			func(0, num_items);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &func;
+			this->num_items = num_items;
+			next_item = 0;
+			busy_workers = threads.size();
+			generation++;
+		}
+		changed.notify_all();
+		work();
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]{return busy_workers == 0;});
+	}
+
+	~linkage_worker_pool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		if(!threads.empty()){
+			cutWaitForThreads(&threads[0], threads.size());
+		}
+	}
+};
+
+// The active cluster closest to cluster a, choosing 'preferred' in case of a tie (as the chain algorithm requires to terminate), unless it's num_sequences (i.e. none).
+template<typename D>
+__host__ size_t nearestActiveCluster(D *dtwPairwiseDistances, size_t num_sequences, const std::vector<size_t> &active, size_t a, size_t preferred, linkage_worker_pool &workers){
+	size_t num_chunks = workers.threads.empty() || active.size() < LINKAGE_PARALLEL_MIN_ACTIVE ? 1 : (active.size()+LINKAGE_PARALLEL_GRAIN-1)/LINKAGE_PARALLEL_GRAIN;
+	std::vector<size_t> chunk_nearest(num_chunks, num_sequences);
+	std::vector<float> chunk_nearest_distance(num_chunks, std::numeric_limits<float>::max());
+	workers.run(active.size(), [&](size_t begin, size_t end){
+		size_t chunk = begin/LINKAGE_PARALLEL_GRAIN;
+		for(size_t k = begin; k < end; k++){
+			if(active[k] != a){
+				float distance = widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, a, active[k]));
+				if(distance < chunk_nearest_distance[chunk]){
+					chunk_nearest_distance[chunk] = distance;
+					chunk_nearest[chunk] = active[k];
+				}
+			}
+		}
+	});
+	// Lowest index wins ties between chunks, same as a serial scan
+	size_t nearest = chunk_nearest[0];
+	float nearest_distance = chunk_nearest_distance[0];
+	for(size_t chunk = 1; chunk < num_chunks; chunk++){
+		if(chunk_nearest_distance[chunk] < nearest_distance){
+			nearest = chunk_nearest[chunk];
+			nearest_distance = chunk_nearest_distance[chunk];
+		}
+	}
+	if(preferred != num_sequences && widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, a, preferred)) <= nearest_distance){
+		return preferred;
+	}
+	return nearest;
+}
+
+/* Complete linkage hierarchical clustering with the nearest neighbour chain algorithm, giving the same merge and height arrays (R hclust conventions, 
+ * as used by cutree_k() and cutree_cdist()) as hclust_fast() in submodules/hclust-cpp, but working directly on the stored pairwise distances. 
+ * The Lance-Williams update for complete linkage (max of the two merged clusters' distances) is applied in place, with the smaller of the two distances 
+ * swapped into the merged away cluster's (no longer read) slot and its sign bit marking the swap, so the original distances can be put back afterwards 
+ * without a second copy of the matrix. Heights are divided by max_distance, i.e. in [0,1]. Uses num_threads threads for big enough inputs, all the CPU's if 0. */
+template<typename D>
+__host__
+void
+completeLinkage(size_t num_sequences, D *dtwPairwiseDistances, float max_distance, int *merge, double *height, int num_threads = 0){
+	std::vector<size_t> active(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		active[i] = i;
+	}
+	std::vector<linkage_step> steps;
+	steps.reserve(num_sequences-1);
+	std::vector<size_t> chain;
+	chain.reserve(num_sequences);
+	linkage_worker_pool workers(num_sequences < LINKAGE_PARALLEL_MIN_ACTIVE ? 1 : (num_threads < 1 ? getNumCPUThreads() : num_threads));
+	while(steps.size() < num_sequences-1){
+		if(chain.empty()){
+			chain.push_back(active[0]);
+		}
+		// Follow nearest neighbours until two clusters are each other's nearest, which can be merged right away for a reducible linkage like this one.
+		size_t a, b;
+		for(;;){
+			a = chain.back();
+			size_t previous = chain.size() > 1 ? chain[chain.size()-2] : num_sequences;
+			b = nearestActiveCluster(dtwPairwiseDistances, num_sequences, active, a, previous, workers);
+			if(b == previous){
+				break;
+			}
+			chain.push_back(b);
+		}
+		chain.pop_back();
+		chain.pop_back();
+
+		// The merged cluster keeps the larger index's row
+		size_t removed = std::min(a, b);
+		size_t kept = std::max(a, b);
+		linkage_step step = {removed, kept, ((double) widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, a, b)))/max_distance};
+		steps.push_back(step);
+		active.erase(std::lower_bound(active.begin(), active.end(), removed));
+		workers.run(active.size(), [&](size_t begin, size_t end){
+			for(size_t k = begin; k < end; k++){
+				if(active[k] != kept){
+					D &kept_distance = linkageDistance(dtwPairwiseDistances, num_sequences, kept, active[k]);
+					D &removed_distance = linkageDistance(dtwPairwiseDistances, num_sequences, removed, active[k]);
+					if(widenDistance(kept_distance) < widenDistance(removed_distance)){
+						D smaller_distance = kept_distance;
+						kept_distance = removed_distance;
+						// Distances are never negative, so a set sign bit (even on a zero) means swapped
+						removed_distance = narrowDistance<D>(-widenDistance(smaller_distance));
+					}
+				}
+			}
+		});
+	}
+
+	// Undo the updates last merge first, bringing each merged away cluster back into the active list as it was when it was merged.
+	for(size_t s = steps.size(); s-- > 0;){
+		size_t removed = steps[s].node1;
+		size_t kept = steps[s].node2;
+		workers.run(active.size(), [&](size_t begin, size_t end){
+			for(size_t k = begin; k < end; k++){
+				if(active[k] != kept){
+					D &kept_distance = linkageDistance(dtwPairwiseDistances, num_sequences, kept, active[k]);
+					D &removed_distance = linkageDistance(dtwPairwiseDistances, num_sequences, removed, active[k]);
+					if(std::signbit(widenDistance(removed_distance))){
+						D smaller_distance = narrowDistance<D>(-widenDistance(removed_distance));
+						removed_distance = kept_distance;
+						kept_distance = smaller_distance;
+					}
+				}
+			}
+		});
+		active.insert(std::lower_bound(active.begin(), active.end(), removed), removed);
+	}
+
+	// Number the merges in order of height, then relabel with R's conventions: singleton i is -(i+1), the cluster formed in merge step s is s (1-based).
+	std::stable_sort(steps.begin(), steps.end(), [](const linkage_step &x, const linkage_step &y){ return x.height < y.height; });
+	std::vector<size_t> cluster_of(2*num_sequences-1); // union-find parents, node num_sequences+s is formed by step s
+	for(size_t i = 0; i < cluster_of.size(); i++){
+		cluster_of[i] = i;
+	}
+	for(size_t s = 0; s < num_sequences-1; s++){
+		size_t nodes[2] = {steps[s].node1, steps[s].node2};
+		for(int i = 0; i < 2; i++){
+			while(cluster_of[nodes[i]] != nodes[i]){
+				cluster_of[nodes[i]] = cluster_of[cluster_of[nodes[i]]];
+				nodes[i] = cluster_of[nodes[i]];
+			}
+		}
+		cluster_of[nodes[0]] = cluster_of[nodes[1]] = num_sequences+s;
+		if(nodes[0] > nodes[1]){
+			std::swap(nodes[0], nodes[1]);
+		}
+		merge[s] = nodes[0] < num_sequences ? -((int) nodes[0])-1 : (int) (nodes[0]-num_sequences+1);
+		merge[s+num_sequences-1] = nodes[1] < num_sequences ? -((int) nodes[1])-1 : (int) (nodes[1]-num_sequences+1);
+		height[s] = steps[s].height;
+	}
+}
+
+/* Pick the medoid of each cluster: the member with the smallest sum of squared DTW distances to the other members of its cluster 
+ * (dtwSoS already holds this for the single cluster case), or the longer sequence of a two member cluster. 
+ * Members are bucketed by cluster in one counting sort pass, then the sums for all members of all clusters are calculated in parallel, i.e. O(N + sum of m^2) work. */
+template<typename T>
+__host__
+int*
+findClusterMedoids(T *dtwPairwiseDistances, double *dtwSoS, size_t num_sequences, size_t *sequence_lengths, int *memberships, int num_clusters, bool verbose=true){
+	int *medoidIndices = new int[num_clusters];
+
+	// Cluster c's members (in index order) are cluster_members[cluster_start[c]] to cluster_members[cluster_start[c+1]-1]
+	std::vector<size_t> cluster_start(num_clusters+1, 0);
+	for(size_t i = 0; i < num_sequences; ++i){
+		cluster_start[memberships[i]+1]++;
+	}
+	for(int currCluster = 0; currCluster < num_clusters; currCluster++){
+		cluster_start[currCluster+1] += cluster_start[currCluster];
+	}
+	std::vector<size_t> cluster_members(num_sequences);
+	std::vector<size_t> cluster_cursor(cluster_start.begin(), cluster_start.end()-1);
+	for(size_t i = 0; i < num_sequences; ++i){
+		cluster_members[cluster_cursor[memberships[i]]++] = i;
+	}
+
+	// Indexed by sequence rather than cluster member ordinal, so every cluster uses its own (disjoint) portion of this array.
+	double *clusterDtwSoS = num_clusters == 1 ? dtwSoS : new double[num_sequences]();
+	if(num_clusters > 1){
+		// Each member sums its own row of the cluster's distances, so no two threads write the same element
+		parallelFor(num_sequences, [&](size_t member, int thread_index){
+			size_t i = cluster_members[member];
+			int currCluster = memberships[i];
+			size_t num_cluster_members = cluster_start[currCluster+1]-cluster_start[currCluster];
+			if(num_cluster_members < 3){
+				return;
+			}
+			double sos = 0;
+			for(size_t other = cluster_start[currCluster]; other < cluster_start[currCluster+1]; other++){
+				size_t j = cluster_members[other];
+				if(j != i){
+					double paired_distance = widenDistance(i < j ? dtwPairwiseDistances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1] : 
+					                                               dtwPairwiseDistances[PAIRWISE_DIST_ROW(j, num_sequences)+i-j-1]);
+					sos += paired_distance*paired_distance;
+				}
+			}
+			clusterDtwSoS[i] = sos;
+		}, 0, 16);
+	}
+	for(int currCluster = 0; currCluster < num_clusters; currCluster++){
+		size_t *clusterIndices = &cluster_members[0]+cluster_start[currCluster];
+		size_t num_cluster_members = cluster_start[currCluster+1]-cluster_start[currCluster];
+		if(verbose) std::cerr << "Processing cluster " << currCluster << " membership=" << num_cluster_members << ", ";
+		int medoidIndex = -1;
+		// Pick the smallest squared distance across all the sequences in this cluster.
+		if(num_cluster_members > 2){
+			double lowestSoS = std::numeric_limits<double>::max();
+			for(size_t i = 0; i < num_cluster_members; ++i){
+				if (clusterDtwSoS[clusterIndices[i]] < lowestSoS) {
+					medoidIndex = clusterIndices[i];
+					lowestSoS = clusterDtwSoS[clusterIndices[i]];
+				}
+			}
+		} 
+		else if(num_cluster_members == 2){
+			// Pick the longest sequence that contributed to the cumulative distance if we only have 2 sequences
+			medoidIndex = sequence_lengths[clusterIndices[0]] > sequence_lengths[clusterIndices[1]] ? clusterIndices[0] : clusterIndices[1];
+		}
+		else if(num_cluster_members == 1){	// Single member cluster
+			medoidIndex = clusterIndices[0];
+		}
+		// Sanity check
+		if(medoidIndex == -1){
+			std::cerr << "Logic error in medoid finding routine, please e-mail the developer (gordonp@ucalgary.ca)." << std::endl;
+			exit(MEDOID_FINDING_ERROR);
+		}
+		medoidIndices[currCluster] = medoidIndex;
+		if(verbose) std::cerr << "medoid is " << medoidIndex << std::endl;
+	}
+	if(num_clusters != 1){
+		delete[] clusterDtwSoS;
+	}
+	return medoidIndices;
+}
 
-                }
-                // Else it's a leaf connected to an internal node of the tree and we'll need to compare that sequence to the centroid sequence of the
-                // inner node (which still needs to be computed).
+// FasterPAM swap candidates are evaluated in batches of this many per thread, and assignment updates after a swap are split into chunks of this many sequences.
+#define KMEDOIDS_CANDIDATES_PER_THREAD 4
+#define KMEDOIDS_UPDATE_GRAIN 4096
+// Stop swapping after this many passes over all the sequences even if the total deviation is still (very slowly) improving
+#define KMEDOIDS_MAX_PASSES 100
 
-        }
-        std::cerr << std::endl;
-        //std::cerr << "Found " << clusterIndicesInMerge.size() << " cluster seed pairs with p-value < " << cluster_p_value << std::endl;
+template<typename D>
+__host__ inline float kMedoidsDistance(D *dtwPairwiseDistances, size_t num_sequences, size_t i, size_t j){
+	return i == j ? 0 : widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, i, j));
+}
+
+/* K-medoids clustering directly on the pairwise DTW distances with the FasterPAM algorithm (Schubert & Rousseeuw 2021), as an alternative to 
+ * cutting the dendrogram into K clusters. Each pass over the non-medoid sequences evaluates swapping each one in for the best medoid to remove in O(N), 
+ * and does the swap right away if it lowers the total deviation (the sum of distances to the nearest medoid). A batch of consecutive candidates 
+ * is evaluated in parallel against the current medoids, and the first improving one in the batch is swapped in, so the result is the same 
+ * as the serial algorithm's regardless of the number of threads (num_threads, all the CPU's if 0). Sets memberships, and returns the medoid of each cluster 
+ * (numbered in order of their first member) so that findClusterMedoids() isn't needed. */
+template<typename D>
+__host__
+int*
+kMedoids(size_t num_sequences, D *dtwPairwiseDistances, int k, int *memberships, bool verbose=true, int num_threads = 0){
+	if(k > num_sequences){
+		k = num_sequences;
+	}
+	if(num_threads < 1){
+		num_threads = getNumCPUThreads();
+	}
+	if(verbose) std::cerr << std::endl << "Using K-medoids (FasterPAM) clustering with K=" << k << std::endl;
+	std::vector<size_t> medoids(k);
+	if(k == 1){
+		// No swaps to consider, it's just the sequence with the smallest sum of distances
+		std::vector<double> sums(num_sequences, 0);
+		parallelFor(num_sequences, [&](size_t i, int thread_index){
+			for(size_t j = 0; j < num_sequences; j++){
+				sums[i] += kMedoidsDistance(dtwPairwiseDistances, num_sequences, i, j);
+			}
+		}, num_threads);
+		medoids[0] = std::min_element(sums.begin(), sums.end())-sums.begin();
+	}
+	else{
+		// Start with medoids spread evenly through the sequences (which are sorted by length) so the result is reproducible.
+		std::vector<char> is_medoid(num_sequences, 0);
+		for(int m = 0; m < k; m++){
+			medoids[m] = (size_t) (((double) m+0.5)*num_sequences/k);
+			is_medoid[medoids[m]] = 1;
+		}
+		// The nearest and second nearest medoid (slot) of each sequence, and the distances to them.
+		std::vector<int> nearest(num_sequences), second(num_sequences);
+		std::vector<float> nearest_distance(num_sequences), second_distance(num_sequences);
+		auto assign = [&](size_t o){
+			nearest_distance[o] = second_distance[o] = std::numeric_limits<float>::max();
+			for(int m = 0; m < k; m++){
+				float distance = kMedoidsDistance(dtwPairwiseDistances, num_sequences, o, medoids[m]);
+				if(distance < nearest_distance[o] || distance == nearest_distance[o] && medoids[m] == o){
+					second[o] = nearest[o];
+					second_distance[o] = nearest_distance[o];
+					nearest[o] = m;
+					nearest_distance[o] = distance;
+				}
+				else if(distance < second_distance[o]){
+					second[o] = m;
+					second_distance[o] = distance;
+				}
+			}
+		};
+		size_t num_chunks = (num_sequences+KMEDOIDS_UPDATE_GRAIN-1)/KMEDOIDS_UPDATE_GRAIN;
+		parallelFor(num_chunks, [&](size_t chunk, int thread_index){
+			for(size_t o = chunk*KMEDOIDS_UPDATE_GRAIN; o < std::min((chunk+1)*KMEDOIDS_UPDATE_GRAIN, num_sequences); o++){
+				assign(o);
+			}
+		}, num_threads);
+		// The increase in total deviation from removing each medoid, were its sequences to all go to their second nearest medoid instead
+		std::vector<double> removal_loss(k);
+		auto calculateRemovalLoss = [&](){
+			std::fill(removal_loss.begin(), removal_loss.end(), 0);
+			for(size_t o = 0; o < num_sequences; o++){
+				removal_loss[nearest[o]] += second_distance[o]-nearest_distance[o];
+			}
+		};
+		calculateRemovalLoss();
 
-        for(int i = 0; i < num_sequences; i++){
-		// merge[i][] contains the merged nodes in step i, and it's a (n-1)x2 matrix (2*(n-1) array)
-		// merge[i][j] is negative when the node is an atom
-		// For each new cluster we need to generate the centroid
-		int m1 = merge[i];
-                int m2 = merge[num_sequences-1+i];
+		size_t batch_size = num_threads == 1 ? 1 : num_threads*KMEDOIDS_CANDIDATES_PER_THREAD;
+		std::vector<std::vector<double> > candidate_delta(batch_size, std::vector<double>(k));
+		std::vector<double> candidate_change(batch_size);
+		std::vector<int> candidate_slot(batch_size);
+		size_t candidate = 0, num_unimproved = 0, num_evaluated = 0, num_swaps = 0;
+		while(num_unimproved < num_sequences){
+			if(num_evaluated >= KMEDOIDS_MAX_PASSES*num_sequences){
+				std::cerr << "Warning: stopping K-medoids swaps after " << KMEDOIDS_MAX_PASSES << " passes without converging" << std::endl;
+				break;
+			}
+			size_t batch = std::min(batch_size, num_sequences-num_unimproved);
+			parallelFor(batch, [&](size_t b, int thread_index){
+				size_t x = (candidate+b)%num_sequences;
+				candidate_change[b] = 0;
+				if(is_medoid[x]){
+					return;
+				}
+				std::vector<double> &delta = candidate_delta[b];
+				std::copy(removal_loss.begin(), removal_loss.end(), delta.begin());
+				double gain = 0; // from the sequences that would move to x
+				for(size_t o = 0; o < num_sequences; o++){
+					float distance = kMedoidsDistance(dtwPairwiseDistances, num_sequences, o, x);
+					if(distance < nearest_distance[o]){
+						gain += distance-nearest_distance[o];
+						// They no longer go to their second nearest if their nearest medoid is removed
+						delta[nearest[o]] += nearest_distance[o]-second_distance[o];
+					}
+					else if(distance < second_distance[o]){
+						// x is a better fallback than the second nearest if their nearest medoid is removed
+						delta[nearest[o]] += distance-second_distance[o];
+					}
+				}
+				candidate_slot[b] = std::min_element(delta.begin(), delta.end())-delta.begin();
+				candidate_change[b] = delta[candidate_slot[b]]+gain;
+			}, num_threads);
+			num_evaluated += batch;
+			size_t b = 0;
+			while(b < batch && candidate_change[b] >= 0){
+				b++;
+			}
+			if(b == batch){
+				candidate = (candidate+batch)%num_sequences;
+				num_unimproved += batch;
+				continue;
+			}
+			// Swap in the first improving candidate, later ones in the batch were evaluated against the old medoids so they'll be looked at again.
+			size_t x = (candidate+b)%num_sequences;
+			int slot = candidate_slot[b];
+			is_medoid[medoids[slot]] = 0;
+			medoids[slot] = x;
+			is_medoid[x] = 1;
+			parallelFor(num_chunks, [&](size_t chunk, int thread_index){
+				for(size_t o = chunk*KMEDOIDS_UPDATE_GRAIN; o < std::min((chunk+1)*KMEDOIDS_UPDATE_GRAIN, num_sequences); o++){
+					if(nearest[o] == slot || second[o] == slot){
+						assign(o);
+						continue;
+					}
+					float distance = kMedoidsDistance(dtwPairwiseDistances, num_sequences, o, x);
+					if(distance < nearest_distance[o]){
+						second[o] = nearest[o];
+						second_distance[o] = nearest_distance[o];
+						nearest[o] = slot;
+						nearest_distance[o] = distance;
+					}
+					else if(distance < second_distance[o]){
+						second[o] = slot;
+						second_distance[o] = distance;
+					}
+				}
+			}, num_threads);
+			calculateRemovalLoss();
+			num_swaps++;
+			candidate = (x+1)%num_sequences;
+			num_unimproved = 1; // x itself
+		}
+		if(verbose) std::cerr << "K-medoids finished after " << num_swaps << " swaps and " << num_evaluated << " candidate evaluations" << std::endl;
+	}
 
-		// There are three meaningful cases possible: merging two leaves, merging a single sequence in to an existing cluster, or merging two existing clusters. 
-		// Anything else is a stop condition as clustering depends on commutative union operations amongst the members for us.
-		if(m1 < 0 && m2 < 0){ // leaf merger, we computed their suitability in the previous loop as indicated by having same membership
+	// Number the clusters in order of their first member, and make sure each medoid is in its own cluster in case of duplicate sequences.
+	std::vector<int> slot_of(num_sequences, -1);
+	for(int m = 0; m < k; m++){
+		slot_of[medoids[m]] = m;
+	}
+	std::vector<int> renumbered(k, -1);
+	int *medoidIndices = new int[k];
+	int next_cluster = 0;
+	double total_deviation = 0;
+	for(size_t o = 0; o < num_sequences; o++){
+		int slot = slot_of[o];
+		if(slot == -1){
+			float nearest_distance = std::numeric_limits<float>::max();
+			for(int m = 0; m < k; m++){
+				float distance = kMedoidsDistance(dtwPairwiseDistances, num_sequences, o, medoids[m]);
+				if(distance < nearest_distance){
+					nearest_distance = distance;
+					slot = m;
+				}
+			}
+			total_deviation += nearest_distance;
+		}
+		if(renumbered[slot] == -1){
+			medoidIndices[next_cluster] = medoids[slot];
+			renumbered[slot] = next_cluster++;
+		}
+		memberships[o] = renumbered[slot];
+	}
+	if(verbose) std::cerr << "Total deviation from the medoids is " << total_deviation << std::endl;
+	return medoidIndices;
+}
 
-			if(memberships[m1] == memberships[m2]){
+/* Cut the same dendrogram at each of the requested thresholds in parallel, writing the memberships and medoids of each cut to 
+ * <output_prefix>.cluster_membership.<cut>.txt, so that a range of candidate cuts can be compared without recomputing the 
+ * all-vs-all DTW distances or the linkage. With k_medoids, thresholds > 1 are done with kMedoids() instead of cutting the dendrogram. */
+template<typename T>
+__host__
+void
+sweepDendrogramCuts(const std::vector<double> &cdist_sweep, size_t num_sequences, int *merge, double *height, T *dtwPairwiseDistances, double *dtwSoS, 
+                    size_t *sequence_lengths, char **sequence_names, char *output_prefix, bool k_medoids){
+	std::vector<int> num_clusters_per_cut(cdist_sweep.size());
+	parallelFor(cdist_sweep.size(), [&](size_t cut, int thread_index){
+		int *cut_memberships = new int[num_sequences];
+		int num_clusters;
+		int *cut_medoidIndices;
+		if(k_medoids && cdist_sweep[cut] > 1){
+			num_clusters = std::min((size_t) cdist_sweep[cut], num_sequences);
+			cut_medoidIndices = kMedoids(num_sequences, dtwPairwiseDistances, num_clusters, cut_memberships, false);
+		}
+		else{
+			num_clusters = cutDendrogram(num_sequences, merge, height, cdist_sweep[cut], cut_memberships, false);
+			cut_medoidIndices = findClusterMedoids(dtwPairwiseDistances, dtwSoS, num_sequences, sequence_lengths, cut_memberships, num_clusters, false);
+		}
+		std::ostringstream cut_name;
+		cut_name << cdist_sweep[cut];
+		writeClusterMembership(CONCAT4(output_prefix, ".cluster_membership.", cut_name.str(), ".txt").c_str(), cdist_sweep[cut], 
+		                       sequence_names, num_sequences, cut_memberships, cut_medoidIndices);
+		num_clusters_per_cut[cut] = num_clusters;
+		delete[] cut_memberships;
+		delete[] cut_medoidIndices;
+	});
+	for(size_t cut = 0; cut < cdist_sweep.size(); cut++){
+		std::cerr << "Clustering threshold " << cdist_sweep[cut] << " yields " << num_clusters_per_cut[cut] << " clusters, written to " 
+		          << output_prefix << ".cluster_membership." << cdist_sweep[cut] << ".txt" << std::endl;
+	}
+}
+ 
+/* Iteratively define clusters from the leaves up, using permutation testing to see if the clusters predefined in the provided 'merge' array 
+ * (the results of complete linkage) are non-random. Since we've precomputed all pairwise alignments, we might as well use the data: 
+ * each merge's complete linkage distance is ranked amongst the distances from the smaller of the two clusters to every sequence outside of both, 
+ * for an exact p-value. A merge is kept if it passes and so did the merges that formed its two clusters. Merges only depend on their own subtrees, 
+ * so all those at the same depth of the dendrogram (starting with every leaf pair) are tested concurrently (by num_threads threads, all the CPU's if 0). 
+ * Returns the number of clusters, singletons included. */
+template<typename D>
+__host__
+int
+merge_clusters(size_t num_sequences, D *dtwPairwiseDistances, int *merge, double cluster_p_value, int *memberships, bool verbose=true, int num_threads = 0){
+	size_t num_merges = num_sequences-1;
+	// NB: indices of observables in merge start at 1 (R convention)
+	// The hclust convention is a (n-1)*2 matrix for n sequences in a clustering result, where for each merge pair,
+	// leaf nodes are indicated with a negative number, and clusters by the (1-based) merge step that formed them.
+	std::vector<size_t> cluster_size(num_merges);
+	std::vector<std::vector<size_t> > waves;
+	std::vector<size_t> depth(num_merges);
+	for(size_t s = 0; s < num_merges; s++){
+		size_t child_depth = 0;
+		cluster_size[s] = 0;
+		for(int child = 0; child < 2; child++){
+			int node = merge[s+child*num_merges];
+			cluster_size[s] += node < 0 ? 1 : cluster_size[node-1];
+			if(node > 0 && depth[node-1]+1 > child_depth){
+				child_depth = depth[node-1]+1;
 			}
 		}
-		else if(m1 < 0 && m2 > 0 || m1 > 0 && m2 < 0){ // merger of either a leaf and a cluster
-			// To get a p-value, compare the DTW distance between 1) the leaf and the cluster centroid to 2) the distances between the cluster centroid and all
-			// leafs that aren't already part of the centroid (a.k.a. a hypergeometric test)
+		depth[s] = child_depth;
+		if(waves.size() <= child_depth){
+			waves.resize(child_depth+1);
+		}
+		waves[child_depth].push_back(s);
+	}
+
+	// All the sequences in the subtree under a merge node, leaves given as-is in R convention
+	auto clusterMembers = [&](int node, std::vector<size_t> &members){
+		std::vector<int> pending(1, node);
+		while(!pending.empty()){
+			int next = pending.back();
+			pending.pop_back();
+			if(next < 0){
+				members.push_back(-next-1);
+			}
+			else{
+				pending.push_back(merge[next-1]);
+				pending.push_back(merge[next-1+num_merges]);
+			}
 		}
-		else{	// two clusters that have passed the stats tests
+	};
 
+	if(num_threads < 1){
+		num_threads = getNumCPUThreads();
+	}
+	std::vector<std::vector<char> > in_merge(num_threads, std::vector<char>(num_sequences, 0)); // per thread scratch marking the sequences of the merge being tested
+	std::vector<char> accepted(num_merges, 0);
+	for(size_t w = 0; w < waves.size(); w++){
+		const std::vector<size_t> &wave = waves[w];
+		parallelFor(wave.size(), [&](size_t wave_index, int thread_index){
+			size_t s = wave[wave_index];
+			int m1 = merge[s];
+			int m2 = merge[s+num_merges];
+			// Clustering depends on commutative union operations amongst the members, so a merge of a cluster that failed its own test is a stop condition.
+			if(m1 > 0 && !accepted[m1-1] || m2 > 0 && !accepted[m2-1]){
+				return;
+			}
+			// Rank from the smaller cluster's point of view, or the earlier index for two leaves (m1 is always the lower label).
+			size_t m1_size = m1 < 0 ? 1 : cluster_size[m1-1];
+			size_t m2_size = m2 < 0 ? 1 : cluster_size[m2-1];
+			if(m2_size < m1_size){
+				std::swap(m1, m2);
+			}
+			std::vector<size_t> smaller_members, other_members;
+			clusterMembers(m1, smaller_members);
+			clusterMembers(m2, other_members);
+			std::vector<char> &in_this_merge = in_merge[thread_index];
+			float merge_dist = 0;
+			for(size_t a = 0; a < smaller_members.size(); a++){
+				in_this_merge[smaller_members[a]] = 1;
+				for(size_t b = 0; b < other_members.size(); b++){
+					merge_dist = std::max(merge_dist, widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, smaller_members[a], other_members[b])));
+				}
+			}
+			for(size_t b = 0; b < other_members.size(); b++){
+				in_this_merge[other_members[b]] = 1;
+			}
+			// Count the outside sequences that the smaller cluster would have joined at a lower complete linkage distance
+			size_t dists_smaller = 0;
+			for(size_t x = 0; x < num_sequences; x++){
+				if(in_this_merge[x]){
+					continue;
+				}
+				size_t a = 0;
+				while(a < smaller_members.size() && widenDistance(linkageDistance(dtwPairwiseDistances, num_sequences, smaller_members[a], x)) < merge_dist){
+					a++;
+				}
+				if(a == smaller_members.size()){
+					dists_smaller++;
+				}
+			}
+			for(size_t a = 0; a < smaller_members.size(); a++){
+				in_this_merge[smaller_members[a]] = 0;
+			}
+			for(size_t b = 0; b < other_members.size(); b++){
+				in_this_merge[other_members[b]] = 0;
+			}
+			// There are as many possible pairings as outside sequences plus the merge partner, 
+			// counted the smaller dists, so picking the most optimistic p-value in case there are ties.
+			double p_value = ((double) dists_smaller + 1)/(num_sequences-cluster_size[s]+1);
+			accepted[s] = dists_smaller == 0 || p_value < cluster_p_value;
+		}, num_threads);
+	}
+	size_t num_accepted = 0;
+	for(size_t s = 0; s < num_merges; s++){
+		num_accepted += accepted[s];
+	}
+
+	// Each maximal accepted subtree is a cluster (checking from the top down), anything left over is a singleton.
+	for(size_t i = 0; i < num_sequences; i++){
+		memberships[i] = -1;
+	}
+	int num_clusters = 0;
+	for(size_t s = num_merges; s-- > 0;){
+		std::vector<size_t> members;
+		if(accepted[s]){
+			clusterMembers(s+1, members);
+		}
+		if(members.empty() || memberships[members[0]] != -1){
+			continue;
+		}
+		for(size_t i = 0; i < members.size(); i++){
+			memberships[members[i]] = num_clusters;
+		}
+		num_clusters++;
+	}
+	for(size_t i = 0; i < num_sequences; i++){
+		if(memberships[i] == -1){
+			memberships[i] = num_clusters++;
+		}
+	}
+	// Number the clusters in order of their first member
+	std::vector<int> renumbered(num_clusters, -1);
+	int next_cluster = 0;
+	for(size_t i = 0; i < num_sequences; i++){
+		if(renumbered[memberships[i]] == -1){
+			renumbered[memberships[i]] = next_cluster++;
+		}
+		memberships[i] = renumbered[memberships[i]];
+	}
+	if(verbose) std::cerr << std::endl << "Using permutation test supported clustering, " << num_accepted << " of " << num_merges << 
+	                         " dendrogram merges have p-value < " << cluster_p_value << std::endl;
+	return num_clusters;
+}
+
+// Clusters whose members are clustered together at least this often on average are reported as stable
+#define BOOTSTRAP_STABLE_FREQUENCY 0.75
+
+/* Cluster stability by bootstrapping: each of num_replicates replicates resamples the sequences with replacement, and reclusters the distinct ones 
+ * sampled with the same strategy and threshold as the full set (K-medoids, dendrogram cut or permutation test supported merges), using the already 
+ * calculated distances (duplicates are only counted once, as zero distance copies would distort the linkage). For each sequence, writes to 
+ * <output_prefix>.cluster_stability.txt the fraction of its sampled fellow cluster members it was clustered with across the replicates it was sampled in 
+ * (1 for a perfectly stable cluster), and the fraction of the sampled sequences from other clusters it was clustered with (0 for a perfectly distinct cluster).
+ * Each replicate's distances (about 63% of the sequences') are a sizeable fraction of the full matrix, so only as many replicates run at once as there are 
+ * threads (or max_concurrent_replicates, if given) and free memory for the buffers they reuse, sharing the threads between them. Replicates are seeded by 
+ * their number and only add whole counts to the tallies, so the results are the same however many run at once. */
+template<typename D>
+__host__
+void
+bootstrapClusterStability(size_t num_sequences, D *dtwPairwiseDistances, float max_distance, double cdist, bool k_medoids, int *memberships, int num_clusters, 
+                          int num_replicates, char **sequence_names, char *output_prefix, int max_concurrent_replicates = 0){
+	auto sampleReplicate = [&](int replicate, std::vector<size_t> &sampled){
+		std::mt19937_64 generator(replicate);
+		std::uniform_int_distribution<size_t> pick(0, num_sequences-1);
+		std::vector<char> picked(num_sequences, 0);
+		for(size_t i = 0; i < num_sequences; i++){
+			picked[pick(generator)] = 1;
+		}
+		sampled.clear();
+		for(size_t i = 0; i < num_sequences; i++){
+			if(picked[i]){
+				sampled.push_back(i);
+			}
+		}
+	};
+	// Every buffer may have to grow to the largest replicate's sub-matrix
+	std::vector<size_t> replicate_sizes(num_replicates);
+	parallelFor(num_replicates, [&](size_t replicate, int thread_index){
+		std::vector<size_t> sampled;
+		sampleReplicate(replicate, sampled);
+		replicate_sizes[replicate] = sampled.size();
+	});
+	size_t max_sampled = *std::max_element(replicate_sizes.begin(), replicate_sizes.end());
+	size_t sub_matrix_bytes = sizeof(D)*ARITH_SERIES_SUM(max_sampled-1);
+	int num_threads = getNumCPUThreads();
+	int num_concurrent = std::min(max_concurrent_replicates > 0 ? max_concurrent_replicates : num_threads, num_replicates);
+	size_t available_memory = getAvailableCPUMemory();
+	if(available_memory && sub_matrix_bytes && available_memory/sub_matrix_bytes < (size_t) num_concurrent){
+		num_concurrent = (int) std::max((size_t) 1, available_memory/sub_matrix_bytes);
+	}
+	int replicate_threads = std::max(1, num_threads/num_concurrent);
+	std::cerr << "Calculating cluster stability over " << num_replicates << " bootstrap replicates, " << num_concurrent << " at a time" << std::endl;
+
+	std::vector<double> same_cluster(num_sequences, 0);
+	std::vector<double> same_cluster_sampled(num_sequences, 0);
+	std::vector<double> other_cluster(num_sequences, 0);
+	std::vector<double> other_cluster_sampled(num_sequences, 0);
+	std::vector<int> times_sampled(num_sequences, 0);
+	std::mutex tally_mutex;
+	// Only grow, to the largest replicate each has run so far
+	std::vector<std::vector<D> > thread_sub_distances(num_concurrent);
+	parallelFor(num_replicates, [&](size_t replicate, int thread_index){
+		std::vector<size_t> sampled;
+		sampleReplicate(replicate, sampled);
+		size_t num_sampled = sampled.size();
+		std::vector<D> &sub_distances = thread_sub_distances[thread_index];
+		std::vector<int> replicate_memberships(num_sampled, 0);
+		if(num_sampled > 1){
+			if(sub_distances.size() < ARITH_SERIES_SUM(num_sampled-1)){
+				sub_distances.resize(ARITH_SERIES_SUM(num_sampled-1));
+			}
+			parallelFor(num_sampled-1, [&](size_t a, int sub_thread_index){
+				D *sub_row = sub_distances.data()+PAIRWISE_DIST_ROW(a, num_sampled);
+				for(size_t b = a+1; b < num_sampled; b++){
+					sub_row[b-a-1] = linkageDistance(dtwPairwiseDistances, num_sequences, sampled[a], sampled[b]);
+				}
+			}, replicate_threads);
+			if(k_medoids && cdist > 1){
+				delete[] kMedoids(num_sampled, sub_distances.data(), (int) cdist, replicate_memberships.data(), false, replicate_threads);
+			}
+			else{
+				int *merge = new int[2*(num_sampled-1)];
+				double *height = new double[num_sampled-1];
+				// Heights are normalized by the full set's maximum distance, so fixed height cuts mean the same in every replicate.
+				// The linkage puts the distances back as they were, ready for the permutation test.
+				completeLinkage(num_sampled, sub_distances.data(), max_distance, merge, height, replicate_threads);
+				if(cdist < 0){
+					merge_clusters(num_sampled, sub_distances.data(), merge, -cdist, replicate_memberships.data(), false, replicate_threads);
+				}
+				else{
+					cutDendrogram(num_sampled, merge, height, cdist, replicate_memberships.data(), false);
+				}
+				delete[] merge;
+				delete[] height;
+			}
+		}
+
+		// Contingency table of the full set's clusters vs. the replicate's
+		std::map<std::pair<int,int>,size_t> both_counts;
+		std::vector<size_t> full_counts(num_clusters, 0);
+		std::map<int,size_t> replicate_counts;
+		for(size_t a = 0; a < num_sampled; a++){
+			both_counts[std::make_pair(memberships[sampled[a]], replicate_memberships[a])]++;
+			full_counts[memberships[sampled[a]]]++;
+			replicate_counts[replicate_memberships[a]]++;
+		}
+		std::lock_guard<std::mutex> lock(tally_mutex);
+		for(size_t a = 0; a < num_sampled; a++){
+			size_t i = sampled[a];
+			size_t num_both = both_counts[std::make_pair(memberships[i], replicate_memberships[a])];
+			same_cluster[i] += num_both-1;
+			same_cluster_sampled[i] += full_counts[memberships[i]]-1;
+			other_cluster[i] += replicate_counts[replicate_memberships[a]]-num_both;
+			other_cluster_sampled[i] += num_sampled-full_counts[memberships[i]];
+			times_sampled[i]++;
+		}
+	}, num_concurrent);
+
+	std::string stability_file_name = CONCAT2(output_prefix, ".cluster_stability.txt");
+	std::ofstream stability_file(stability_file_name.c_str());
+	if(!stability_file.is_open()){
+		std::cerr << "Cannot open cluster stability file " << stability_file_name << " for writing" << std::endl;
+		exit(CANNOT_WRITE_MEMBERSHIP);
+	}
+	stability_file << "## cluster co-membership frequencies over " << num_replicates << " bootstrap replicates, cluster distance threshold was " << cdist << std::endl;
+	stability_file << "#sequence\tcluster\ttimes sampled\tsame cluster co-clustering\tother cluster co-clustering" << std::endl;
+	std::vector<double> cluster_stability_sum(num_clusters, 0);
+	std::vector<int> cluster_stability_count(num_clusters, 0);
+	for(size_t i = 0; i < num_sequences; i++){
+		// Singletons are trivially stable
+		double same_frequency = same_cluster_sampled[i] ? same_cluster[i]/same_cluster_sampled[i] : 1;
+		double other_frequency = other_cluster_sampled[i] ? other_cluster[i]/other_cluster_sampled[i] : 0;
+		stability_file << sequence_names[i] << "\t" << memberships[i] << "\t" << times_sampled[i] << "\t" << same_frequency << "\t" << other_frequency << std::endl;
+		if(same_cluster_sampled[i]){
+			cluster_stability_sum[memberships[i]] += same_frequency;
+			cluster_stability_count[memberships[i]]++;
+		}
+	}
+	stability_file.close();
+	int num_stable_clusters = 0, num_multimember_clusters = 0;
+	for(int c = 0; c < num_clusters; c++){
+		if(cluster_stability_count[c]){
+			num_multimember_clusters++;
+			if(cluster_stability_sum[c]/cluster_stability_count[c] >= BOOTSTRAP_STABLE_FREQUENCY){
+				num_stable_clusters++;
+			}
 		}
 	}
+	std::cerr << num_stable_clusters << " of " << num_multimember_clusters << " multi-member clusters have members co-clustering in at least " << 
+	             (100*BOOTSTRAP_STABLE_FREQUENCY) << "% of bootstrap replicates, " <<
+	             "per sequence details are in " << stability_file_name << std::endl;
 }
 
 #endif
@@ -0,0 +1,461 @@
+#ifndef __cpu_dba_update_hpp_included
+#define __cpu_dba_update_hpp_included
+
+/* A host-side alternative to DBAUpdate() for machines where the CPU cores are the better resource for the centroid updates (e.g. many short sequences,
+   where each GPU DTW launch has little work to do, or the GPUs are busy with other runs). Each worker thread aligns its share of the cluster members
+   to the centroid and backtraces their paths into its own centroid element sums and counts, so there are no atomic operations and no waiting
+   between sequences. Each path is reduced to runs of the same move as soon as it's backtraced (so each thread reuses one path matrix buffer), and both the accumulation and the path
+   output (see dtw_path_writer.hpp) work from the runs. The per thread accumulators are combined pairwise in a tree at the end. The step pattern, open end handling and tie-breaking are the
+   same as the DTWDistance kernel and updateCentroid(), so the updated centroid is the same as the GPU version's (up to floating point summation order).
+
+   Across the rounds of convergeCentroid(), the update can also be incremental: late rounds typically only move the centroid towards its end, and the DTW costs (and so moves)
+   for the part of the matrix before the first moved centroid position can't have changed. Each sequence keeps its cumulative costs at a few checkpoint positions along
+   the centroid, so only the matrix past the last checkpoint before the first moved position is recalculated. The new backtrace is spliced onto last round's path where it
+   rejoins it (and the sequence is fully realigned if it doesn't), so the result is exactly what a full realignment would give. */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "cpu_utils.hpp" // for parallelFor()
+#include "dtw.hpp" // for the move codes
+#include "dtw_path_writer.hpp"
+
+// Number of centroid positions at which each sequence's cumulative DTW costs are kept between incremental update rounds
+#define INCREMENTAL_DBA_CHECKPOINTS 8
+
+/* Fill in the full path matrix (row major, pathPitch bytes per row, first sequence on the Y axis) of moves for the optimal DTW alignment of the two sequences,
+ * as DTWDistance would. Only two columns of costs are kept. If resume_after is not negative, only the cells past that index along the centroid's axis (the first sequence's
+ * if centroid_is_first, otherwise the second's) are calculated, starting from resume_costs (the cumulative costs at that centroid index along the whole other sequence),
+ * and the rest of the path matrix is left as is. The cumulative costs at each of the checkpoint_indices along the centroid are copied into checkpoints if given. */
+template<typename T>
+__host__
+void
+dtwPathMatrixCPU(const T *first_seq, size_t first_seq_length, const T *second_seq, size_t second_seq_length, int use_open_start, int use_open_end,
+                 unsigned char *pathMatrix, size_t pathPitch, int centroid_is_first = 0, long resume_after = -1, const T *resume_costs = 0,
+                 const std::vector<size_t> *checkpoint_indices = 0, std::vector<std::vector<T> > *checkpoints = 0){
+	std::vector<T> column(first_seq_length), previous_column(first_seq_length);
+	size_t first_row = 0;
+	size_t first_column = 0;
+	if(resume_after >= 0){
+		if(centroid_is_first){
+			first_row = resume_after+1;
+		}
+		else{
+			first_column = resume_after+1;
+			previous_column.assign(resume_costs, resume_costs+first_seq_length);
+		}
+	}
+	for(size_t j = first_column; j < second_seq_length; j++){
+		T diff = use_open_start ? 0 : first_seq[0]-second_seq[j];
+		if(first_row > 0){
+			column[first_row-1] = resume_costs[j];
+		}
+		else if(j == 0){
+			column[0] = diff*diff;
+			pathMatrix[pitchedCoord(0,0,pathPitch)] = use_open_start ? NIL_OPEN_RIGHT : NIL;
+		}
+		else{
+			column[0] = previous_column[0]+diff*diff;
+			pathMatrix[pitchedCoord(j,0,pathPitch)] = use_open_start ? OPEN_RIGHT : RIGHT;
+		}
+		for(size_t i = first_row > 0 ? first_row : 1; i < first_seq_length; i++){
+			diff = first_seq[i]-second_seq[j];
+			T up_cost = column[i-1]+diff*diff;
+			if(j == 0){
+				column[i] = up_cost;
+				pathMatrix[pitchedCoord(0,i,pathPitch)] = UP;
+				continue;
+			}
+			T diag_cost = previous_column[i-1]+diff*diff;
+			// No extra cost to consume an element of the second sequence along the top of the matrix in open end mode
+			bool open_right = use_open_end && i == first_seq_length-1;
+			T right_cost = previous_column[i]+(open_right ? 0 : diff*diff);
+			unsigned char right_move = open_right ? OPEN_RIGHT : RIGHT;
+			// White-Neely step pattern (a diagonal move is preferred to right-up or up-right if costs are equivalent)
+			if(diag_cost > up_cost){
+				column[i] = up_cost > right_cost ? right_cost : up_cost;
+				pathMatrix[pitchedCoord(j,i,pathPitch)] = up_cost > right_cost ? right_move : UP;
+			}
+			else{
+				column[i] = diag_cost > right_cost ? right_cost : diag_cost;
+				pathMatrix[pitchedCoord(j,i,pathPitch)] = diag_cost > right_cost ? right_move : DIAGONAL;
+			}
+		}
+		if(checkpoints){
+			for(size_t k = 0; k < checkpoint_indices->size(); k++){
+				size_t centroid_index = (*checkpoint_indices)[k];
+				if(centroid_is_first && centroid_index >= first_row){
+					(*checkpoints)[k][j] = column[centroid_index];
+				}
+				else if(!centroid_is_first && centroid_index == j){
+					(*checkpoints)[k] = column;
+				}
+			}
+		}
+		column.swap(previous_column);
+	}
+}
+
+/* Backtrace the optimal path from the upper right corner of the path matrix (first sequence on the Y axis, the centroid if flip_seq_order),
+ * as updateCentroid() does, into its run-length form (in path order, i.e. starting at the anchor). If computed_after is not negative, the backtrace stops
+ * when it reaches a cell at or before that centroid index (which is passed back through the exit indices), and false is returned. */
+__host__
+bool
+dtwPathRunsCPU(const unsigned char *pathMatrix, size_t pathColumns, size_t pathRows, size_t pathPitch, int flip_seq_order, std::vector<dtw_path_run> &runs,
+               long computed_after = -1, size_t *exit_seq_index = 0, size_t *exit_centroid_index = 0){
+	// moveI and moveJ are defined device-side in dtw.hpp, but we are host side so we need to replicate
+	const int moveI[] = { -1, -1, 0, -1, 0, 0, 0 };
+	const int moveJ[] = { -1, -1, -1, 0, -1, -1, -1 };
+	runs.clear();
+	int i = pathRows-1;
+	int j = pathColumns-1;
+	while(true){
+		if(computed_after >= 0 && (long) (flip_seq_order ? i : j) <= computed_after){
+			*exit_seq_index = flip_seq_order ? j : i;
+			*exit_centroid_index = flip_seq_order ? i : j;
+			std::reverse(runs.begin(), runs.end());
+			return false;
+		}
+		unsigned char move = pathMatrix[pitchedCoord(j,i,pathPitch)];
+		dtw_path_run run;
+		run.move = move;
+		run.length = 1;
+		if(move == NIL || move == NIL_OPEN_RIGHT){
+			run.seq_start = run.centroid_start = 0;
+			run.seq_step = run.centroid_step = 0;
+			runs.push_back(run);
+			break;
+		}
+		// Follow the same move as far as it goes (within the calculated part of the matrix)
+		while(true){
+			int next_i = i+moveI[move]*((int) run.length);
+			int next_j = j+moveJ[move]*((int) run.length);
+			if((computed_after >= 0 && (long) (flip_seq_order ? next_i : next_j) <= computed_after) || pathMatrix[pitchedCoord(next_j,next_i,pathPitch)] != move){
+				break;
+			}
+			run.length++;
+		}
+		i += moveI[move]*((int) run.length-1);
+		j += moveJ[move]*((int) run.length-1);
+		run.seq_start = flip_seq_order ? j : i;
+		run.centroid_start = flip_seq_order ? i : j;
+		run.seq_step = flip_seq_order ? -moveJ[move] : -moveI[move];
+		run.centroid_step = flip_seq_order ? -moveI[move] : -moveJ[move];
+		runs.push_back(run);
+		i += moveI[move];
+		j += moveJ[move];
+	}
+	std::reverse(runs.begin(), runs.end());
+	return true;
+}
+
+/* Stripe mode counterpart of dtwPathRunsCPU(): backtrace the path through one stripe of the path matrix (its columns starting at column_offset) from the stripe's
+ * last column in row *stripe_rows-1, as writeDTWPath() does, leaving the row to continue from in the stripe to the left in *stripe_rows. The runs are appended
+ * in backtrace order across the stripes (the leftmost one, column_offset 0, ends with the anchor), so reverse them once the whole path is done. */
+__host__
+void
+dtwStripePathRunsCPU(const unsigned char *pathMatrix, size_t stripeColumns, size_t pathPitch, int flip_seq_order, size_t column_offset, int *stripe_rows,
+                     std::vector<dtw_path_run> &backtrace_runs){
+	const int moveI[] = { -1, -1, 0, -1, 0, 0, 0 };
+	const int moveJ[] = { -1, -1, -1, 0, -1, -1, -1 };
+	int i = *stripe_rows-1;
+	int j = stripeColumns-1;
+	while(i >= 0 && j >= 0){
+		unsigned char move = pathMatrix[pitchedCoord(j,i,pathPitch)];
+		size_t seq_index = flip_seq_order ? column_offset+j : i;
+		size_t centroid_index = flip_seq_order ? i : column_offset+j;
+		if(move == NIL || move == NIL_OPEN_RIGHT){
+			dtw_path_run anchor;
+			anchor.seq_start = seq_index;
+			anchor.centroid_start = centroid_index;
+			anchor.length = 1;
+			anchor.move = move;
+			anchor.seq_step = anchor.centroid_step = 0;
+			backtrace_runs.push_back(anchor);
+			break;
+		}
+		// The same move as the cell before it in the backtrace extends that run (including across the stripe boundary)
+		if(!backtrace_runs.empty() && backtrace_runs.back().move == move){
+			backtrace_runs.back().seq_start = seq_index;
+			backtrace_runs.back().centroid_start = centroid_index;
+			backtrace_runs.back().length++;
+		}
+		else{
+			dtw_path_run run;
+			run.seq_start = seq_index;
+			run.centroid_start = centroid_index;
+			run.length = 1;
+			run.move = move;
+			run.seq_step = flip_seq_order ? -moveJ[move] : -moveI[move];
+			run.centroid_step = flip_seq_order ? -moveI[move] : -moveJ[move];
+			backtrace_runs.push_back(run);
+		}
+		i += moveI[move];
+		j += moveJ[move];
+	}
+	*stripe_rows = i+1;
+}
+
+/* Prefix the path remainder in suffix_runs with the part of previous_runs up to and including the given cell, where the backtrace left the recalculated
+ * part of the matrix. Returns false (leaving suffix_runs as is) if the previous path doesn't go through that cell. */
+__host__
+bool
+spliceDTWPathRunsCPU(const std::vector<dtw_path_run> &previous_runs, size_t seq_index, size_t centroid_index, std::vector<dtw_path_run> &suffix_runs){
+	for(size_t r = 0; r < previous_runs.size(); r++){
+		const dtw_path_run &run = previous_runs[r];
+		// Offsets before the run's start wrap around to large values, so they fail the length check
+		size_t seq_offset = seq_index-run.seq_start;
+		size_t centroid_offset = centroid_index-run.centroid_start;
+		size_t offset = run.seq_step ? seq_offset : centroid_offset;
+		if(offset >= run.length || seq_offset != offset*run.seq_step || centroid_offset != offset*run.centroid_step){
+			continue;
+		}
+		std::vector<dtw_path_run> runs(previous_runs.begin(), previous_runs.begin()+r+1);
+		runs.back().length = offset+1;
+		runs.insert(runs.end(), suffix_runs.begin(), suffix_runs.end());
+		suffix_runs.swap(runs);
+		return true;
+	}
+	return false;
+}
+
+/* Add the sequence's values (weight times) to the centroid elements they align to along the path, a run at a time so the compiler can vectorize each case:
+ * diagonal runs are element-wise adds, runs of several sequence elements on one centroid element are a sum, and one sequence element across several
+ * centroid elements is a broadcast. Open end moves don't contribute to the consensus. */
+template<typename T>
+__host__
+void
+accumulateCentroidRunsCPU(const std::vector<dtw_path_run> &runs, const T *seq, T *centroidElementSums, unsigned int *nElementsForMean, unsigned int weight){
+	const T seq_weight = (T) weight;
+	for(size_t r = 0; r < runs.size(); r++){
+		const dtw_path_run &run = runs[r];
+		if(run.move == OPEN_RIGHT || run.move == NIL_OPEN_RIGHT){
+			continue;
+		}
+		const T *run_seq = seq+run.seq_start;
+		T *run_sums = centroidElementSums+run.centroid_start;
+		unsigned int *run_counts = nElementsForMean+run.centroid_start;
+		if(run.seq_step && run.centroid_step){
+			for(size_t k = 0; k < run.length; k++){
+				run_sums[k] += run_seq[k]*seq_weight;
+				run_counts[k] += weight;
+			}
+		}
+		else if(run.seq_step){
+			T run_sum = 0;
+			for(size_t k = 0; k < run.length; k++){
+				run_sum += run_seq[k];
+			}
+			run_sums[0] += run_sum*seq_weight;
+			run_counts[0] += weight*run.length;
+		}
+		else{
+			const T value = run_seq[0]*seq_weight;
+			for(size_t k = 0; k < run.length; k++){
+				run_sums[k] += value;
+				run_counts[k] += weight;
+			}
+		}
+	}
+}
+
+// What a sequence's alignment to the last round's centroid leaves behind for the next incremental update round
+template<typename T>
+struct incremental_dba_alignment{
+	std::vector<dtw_path_run> runs;
+	std::vector<std::vector<T> > checkpoints; // cumulative DTW costs along the whole sequence at each checkpoint centroid index
+};
+
+// Carried across the DBAUpdateCPU() rounds of one centroid's convergence, along with the last round's counts of how much realignment was skipped
+template<typename T>
+struct incremental_dba_state{
+	std::vector<T> centroid; // the one last round's alignments were to
+	std::vector<size_t> checkpoint_indices;
+	std::vector<incremental_dba_alignment<T> > alignments;
+	size_t num_resumed_alignments;
+	size_t num_calculated_cells;
+	size_t num_total_cells;
+};
+
+/**
+ * Same contract as DBAUpdate(): updates the centroid against all the sequences, handing each sequence's DTW path to the path_writer if one is given,
+ * and returns the delta (max movement of a single point in the centroid). The path matrix of each sequence in progress is held in host memory until backtraced,
+ * i.e. each worker thread needs (the longest) sequence length times centroid length bytes.
+ *
+ * @param C a gpu-side centroid sequence array
+ *
+ * @param updatedMean a cpu-side location for the result of the DBA update to the centroid sequence
+ *
+ * @param sequence_weights optional number of times each sequence counts in the average, 1 for all if not given
+ *
+ * @param incremental optional state kept between calls for the same sequences, so each round only recalculates the part of each DTW matrix the centroid change can affect.
+ * Each sequence then keeps INCREMENTAL_DBA_CHECKPOINTS times its length of cumulative costs and its path runs in host memory.
+ *
+ * @param num_threads how many worker threads to use, all the CPU's if 0 (e.g. fewer when several clusters are being updated at once)
+ */
+template<typename T>
+__host__ double
+DBAUpdateCPU(T *C, size_t centerLength, T **sequences, char **sequence_names, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end,
+             T *updatedMean, dtw_path_writer<T> *path_writer, const unsigned int *sequence_weights = 0, incremental_dba_state<T> *incremental = 0, int num_threads = 0){
+	T *cpu_centroid;
+	cudaMallocHost(&cpu_centroid, sizeof(T)*centerLength); CUERR("Allocating CPU memory for incoming centroid");
+	cudaMemcpy(cpu_centroid, C, sizeof(T)*centerLength, cudaMemcpyDeviceToHost); CUERR("Copying incoming GPU centroid to CPU");
+
+	if(num_threads < 1){
+		num_threads = getNumCPUThreads();
+	}
+	if(num_sequences < (size_t) num_threads){
+		num_threads = num_sequences;
+	}
+	std::vector<std::vector<T> > thread_centroidElementSums(num_threads, std::vector<T>(centerLength, 0));
+	std::vector<std::vector<unsigned int> > thread_nElementsForMean(num_threads, std::vector<unsigned int>(centerLength, 0));
+	std::vector<std::vector<dtw_path_run> > thread_runs(num_threads);
+	std::vector<std::vector<dtw_path_run> > thread_suffix_runs(num_threads);
+	// Each thread's path matrix buffer grows to the biggest needed so far, rather than being allocated for every sequence
+	std::vector<std::vector<unsigned char> > thread_path_matrices(num_threads);
+
+	// The costs up to the first centroid position that moved since the last round (if any) are unchanged
+	size_t first_moved_index = 0;
+	if(incremental){
+		if(incremental->centroid.size() != centerLength || incremental->alignments.size() != num_sequences){
+			incremental->centroid.clear();
+			incremental->alignments.assign(num_sequences, incremental_dba_alignment<T>());
+			incremental->checkpoint_indices.clear();
+			size_t checkpoint_spacing = std::max((size_t) 1, centerLength/(INCREMENTAL_DBA_CHECKPOINTS+1));
+			for(size_t k = 1; k <= INCREMENTAL_DBA_CHECKPOINTS && k*checkpoint_spacing < centerLength; k++){
+				incremental->checkpoint_indices.push_back(k*checkpoint_spacing-1);
+			}
+		}
+		else{
+			while(first_moved_index < centerLength && incremental->centroid[first_moved_index] == cpu_centroid[first_moved_index]){
+				first_moved_index++;
+			}
+		}
+	}
+	std::atomic<size_t> num_resumed_alignments(0), num_calculated_cells(0);
+	size_t num_total_cells = 0;
+	for(size_t seq_index = 0; seq_index < num_sequences; seq_index++){
+		num_total_cells += sequence_lengths[seq_index]*centerLength;
+	}
+	std::atomic<size_t> num_sequences_done(0);
+	int dotsPrinted = 0; // only touched by the first thread
+	parallelFor(num_sequences, [&](size_t seq_index, int thread_index){
+		size_t seq_length = sequence_lengths[seq_index];
+		// As on the GPU, flip the comparison so the centroid has the open end if the sequence is longer
+		int flip_seq_order = use_open_end && centerLength < seq_length;
+		size_t num_rows = flip_seq_order ? centerLength : seq_length;
+		size_t num_columns = flip_seq_order ? seq_length : centerLength;
+		incremental_dba_alignment<T> *previous = incremental ? &incremental->alignments[seq_index] : 0;
+		std::vector<dtw_path_run> &runs = previous ? previous->runs : thread_runs[thread_index];
+		// Use the last checkpoint before the first moved centroid position to resume the alignment from, if there is one
+		int resume_checkpoint = -1;
+		if(previous && !runs.empty()){
+			for(int k = (int) incremental->checkpoint_indices.size()-1; k >= 0; k--){
+				if(incremental->checkpoint_indices[k] < first_moved_index){
+					resume_checkpoint = k;
+					break;
+				}
+			}
+		}
+		bool resumed = false;
+		if(previous && !runs.empty() && first_moved_index == centerLength){
+			resumed = true; // nothing moved, so the path is the same as last round's
+		}
+		else if(resume_checkpoint >= 0){
+			long resume_after = incremental->checkpoint_indices[resume_checkpoint];
+			// Only the run-length form of the path is kept once it's backtraced, and only the recalculated part of the path matrix is ever read
+			std::vector<unsigned char> &pathMatrix = thread_path_matrices[thread_index];
+			if(pathMatrix.size() < num_rows*num_columns){
+				pathMatrix.resize(num_rows*num_columns);
+			}
+			if(flip_seq_order){
+				dtwPathMatrixCPU(cpu_centroid, centerLength, sequences[seq_index], seq_length, use_open_start, use_open_end, pathMatrix.data(), num_columns, 1,
+				                 resume_after, previous->checkpoints[resume_checkpoint].data(), &incremental->checkpoint_indices, &previous->checkpoints);
+			}
+			else{
+				dtwPathMatrixCPU(sequences[seq_index], seq_length, cpu_centroid, centerLength, use_open_start, use_open_end, pathMatrix.data(), num_columns, 0,
+				                 resume_after, previous->checkpoints[resume_checkpoint].data(), &incremental->checkpoint_indices, &previous->checkpoints);
+			}
+			num_calculated_cells += seq_length*(centerLength-resume_after-1);
+			std::vector<dtw_path_run> &suffix_runs = thread_suffix_runs[thread_index];
+			size_t exit_seq_index, exit_centroid_index;
+			if(dtwPathRunsCPU(pathMatrix.data(), num_columns, num_rows, num_columns, flip_seq_order, suffix_runs, resume_after, &exit_seq_index, &exit_centroid_index) ||
+			   spliceDTWPathRunsCPU(runs, exit_seq_index, exit_centroid_index, suffix_runs)){
+				runs.swap(suffix_runs);
+				resumed = true;
+			}
+		}
+		if(resumed){
+			num_resumed_alignments++;
+		}
+		else{
+			if(previous){
+				previous->checkpoints.assign(incremental->checkpoint_indices.size(), std::vector<T>(seq_length));
+			}
+			std::vector<unsigned char> &pathMatrix = thread_path_matrices[thread_index];
+			if(pathMatrix.size() < num_rows*num_columns){
+				pathMatrix.resize(num_rows*num_columns);
+			}
+			if(flip_seq_order){
+				dtwPathMatrixCPU(cpu_centroid, centerLength, sequences[seq_index], seq_length, use_open_start, use_open_end, pathMatrix.data(), num_columns, 1,
+				                 -1, (T *) 0, previous ? &incremental->checkpoint_indices : 0, previous ? &previous->checkpoints : 0);
+			}
+			else{
+				dtwPathMatrixCPU(sequences[seq_index], seq_length, cpu_centroid, centerLength, use_open_start, use_open_end, pathMatrix.data(), num_columns, 0,
+				                 -1, (T *) 0, previous ? &incremental->checkpoint_indices : 0, previous ? &previous->checkpoints : 0);
+			}
+			num_calculated_cells += seq_length*centerLength;
+			dtwPathRunsCPU(pathMatrix.data(), num_columns, num_rows, num_columns, flip_seq_order, runs);
+		}
+		accumulateCentroidRunsCPU(runs, sequences[seq_index], thread_centroidElementSums[thread_index].data(), thread_nElementsForMean[thread_index].data(), 
+		                          sequence_weights ? sequence_weights[seq_index] : 1);
+		if(path_writer){
+			path_writer->write(seq_index, sequence_names[seq_index], sequences[seq_index], seq_length, runs);
+		}
+		size_t done = ++num_sequences_done;
+		if(thread_index == 0){
+			dotsPrinted = updatePercentageComplete(done, num_sequences, dotsPrinted);
+		}
+	}, num_threads);
+
+	// Pairwise tree reduction of the per thread accumulators into those of thread 0
+	for(int stride = 1; stride < num_threads; stride *= 2){
+		parallelFor((num_threads+2*stride-1)/(2*stride), [&](size_t pair, int thread_index){
+			size_t into = pair*2*stride;
+			size_t from = into+stride;
+			if(from < (size_t) num_threads){
+				for(size_t t = 0; t < centerLength; t++){
+					thread_centroidElementSums[into][t] += thread_centroidElementSums[from][t];
+					thread_nElementsForMean[into][t] += thread_nElementsForMean[from][t];
+				}
+			}
+		}, num_threads);
+	}
+	for(size_t t = 0; t < centerLength; t++){
+		// No sequence aligned to this position (possible in the open end modes, especially for a small mini-batch), so it stays where it was
+		updatedMean[t] = thread_nElementsForMean[0][t] ? thread_centroidElementSums[0][t]/thread_nElementsForMean[0][t] : cpu_centroid[t];
+	}
+
+	// Calculate the difference between the old and new barycenter.
+	// Convergence is defined as when all points in the old and new differ by less than a
+	// given delta (relative to std dev since every sequence is Z-normalized), so return the max point delta.
+	double max_delta = (double) 0.0f;
+	for(size_t t = 0; t < centerLength; t++) {
+		double delta = std::abs((double) (cpu_centroid[t]-updatedMean[t]));
+		if(delta > max_delta){
+			max_delta = delta;
+		}
+	}
+	if(incremental){
+		incremental->centroid.assign(cpu_centroid, cpu_centroid+centerLength);
+		incremental->num_resumed_alignments = num_resumed_alignments;
+		incremental->num_calculated_cells = num_calculated_cells;
+		incremental->num_total_cells = num_total_cells;
+	}
+	cudaFreeHost(cpu_centroid); CUERR("Freeing CPU memory for the incoming centroid");
+	return max_delta;
+}
+
+#endif
@@ -13,6 +13,15 @@
 #include <cstring>
 #include <algorithm>
 #include <cerrno>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#if defined(_WIN32)
+	#include <Windows.h>
+#else
+	#include <unistd.h>
+#endif
 
 #if SLOW5_SUPPORTED == 1
 #include "submodules/slow5lib/include/slow5/slow5.h"
@@ -622,4 +631,122 @@ int readSequenceBinaryFiles(char **filenames, int num_files, T ***sequences, cha
 	std::cerr << std::endl;
 	return actual_count;
 }
+
+// Number of host worker threads to use for CPU-side parallel loops (distance matrix post-processing, clustering, etc.)
+__host__
+int getNumCPUThreads(){
+	int num_threads = (int) std::thread::hardware_concurrency();
+	return num_threads > 0 ? num_threads : 1;
+}
+
+// Physical memory currently free for the host to use, in bytes (0 if it can't be determined), for sizing optional working buffers
+__host__
+size_t getAvailableCPUMemory(){
+#if defined(_WIN32)
+	MEMORYSTATUSEX memory_status;
+	memory_status.dwLength = sizeof(memory_status);
+	return GlobalMemoryStatusEx(&memory_status) ? (size_t) memory_status.ullAvailPhys : 0;
+#elif defined(_SC_AVPHYS_PAGES)
+	long available_pages = sysconf(_SC_AVPHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	return available_pages > 0 && page_size > 0 ? (size_t) available_pages*page_size : 0;
+#else
+	return 0;
+#endif
+}
+
+// Work sharing state for parallelFor(): each worker thread repeatedly claims the next 'grain' items until none are left, 
+// so uneven per-item costs (e.g. clusters of very different sizes) still balance across the threads.
+template <typename F>
+struct parallel_for_workload {
+	F *func;
+	std::atomic<size_t> *next_item;
+	size_t num_items;
+	size_t grain;
+	int thread_index;
+};
+
+template <typename F>
+__host__
+CUT_THREADPROC parallelForWorker(void *void_arg){
+	parallel_for_workload<F> *workload = (parallel_for_workload<F> *) void_arg;
+	for(size_t start = workload->next_item->fetch_add(workload->grain); start < workload->num_items; start = workload->next_item->fetch_add(workload->grain)){
+		size_t end = std::min(start + workload->grain, workload->num_items);
+		for(size_t i = start; i < end; i++){
+			(*(workload->func))(i, workload->thread_index);
+		}
+	}
+	CUT_THREADEND;
+}
+
+// Calls func(item_index, thread_index) for every item in [0,num_items) using the portable thread library in multithreading.h.
+// The thread_index (in [0,num_threads)) lets callers keep per-thread accumulators without atomics. Returns once all items are done.
+template <typename F>
+__host__
+void parallelFor(size_t num_items, F func, int num_threads = 0, size_t grain = 1){
+	if(num_threads < 1){
+		num_threads = getNumCPUThreads();
+	}
+	if(num_items < (size_t) num_threads){
+		num_threads = (int) num_items;
+	}
+	if(num_threads <= 1){
+		for(size_t i = 0; i < num_items; i++){
+			func(i, 0);
+		}
+		return;
+	}
+	std::atomic<size_t> next_item(0);
+	std::vector<parallel_for_workload<F> > workloads(num_threads);
+	std::vector<CUTThread> threads(num_threads);
+	for(int t = 0; t < num_threads; t++){
+		workloads[t].func = &func;
+		workloads[t].next_item = &next_item;
+		workloads[t].num_items = num_items;
+		workloads[t].grain = grain < 1 ? 1 : grain;
+		workloads[t].thread_index = t;
+		threads[t] = cutStartThread((CUT_THREADROUTINE) parallelForWorker<F>, &workloads[t]);
+	}
+	cutWaitForThreads(&threads[0], num_threads);
+}
+
+// Splits the CPU threads between jobs running at the same time (e.g. clusters converging concurrently) in proportion to each job's size. 
+// Jobs ask for their share each time they start a parallel step, so the threads of the jobs that have finished go to the ones still running.
+struct cpu_thread_shares {
+	int num_threads;
+	std::mutex mutex;
+	std::map<int,size_t> running_sizes;
+	size_t running_total;
+
+	cpu_thread_shares(int num_threads = 0) : num_threads(num_threads < 1 ? getNumCPUThreads() : num_threads), running_total(0) {}
+
+	__host__ void
+	start(int job, size_t size){
+		std::lock_guard<std::mutex> lock(mutex);
+		if(running_sizes.insert(std::make_pair(job, size)).second){
+			running_total += size;
+		}
+	}
+
+	__host__ void
+	finish(int job){
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<int,size_t>::iterator running = running_sizes.find(job);
+		if(running != running_sizes.end()){
+			running_total -= running->second;
+			running_sizes.erase(running);
+		}
+	}
+
+	// At least one thread, even for a job too small to round up to one
+	__host__ int
+	share(int job){
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<int,size_t>::iterator running = running_sizes.find(job);
+		if(running == running_sizes.end() || running_total == 0){
+			return num_threads;
+		}
+		return std::max(1, (int) (((double) num_threads)*running->second/running_total));
+	}
+};
 #endif
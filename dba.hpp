@@ -5,7 +5,12 @@
 #include <thrust/sort.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <random>
+#include <mutex>
+#include <algorithm>
 #if defined(_WIN32)
 	#include <Windows.h>
 	extern "C"{
@@ -26,15 +31,195 @@
 #include "submodules/hclust-cpp/fastcluster.h"
 #include "read_mode_codes.h"
 #include "mem_export.h" // for in - memory model of dba result for return to programmatic callers to performDBA()
+#include "dba_options.h"
+#include "distance_cache.hpp"
+#include "knn_graph.hpp"
+#include "landmark_clustering.hpp"
+#include "centroid_reassignment.hpp"
+#include "cpu_dba_update.hpp"
+#include "dba_workspace.hpp"
 
 #define CLUSTER_ONLY 1
 #define CONSENSUS_ONLY 2
 #define CLUSTER_AND_CONSENSUS 3
 
+// Minimum wall time between flushes of completed all-vs-all DTW distance rows to the checkpoint file
+#define PAIRWISE_DIST_CHECKPOINT_SECONDS 300
+// Mini-batch DBA rounds align about this many times the cluster's membership in total before the full-membership rounds take over
+#define STOCHASTIC_DBA_EPOCHS 2
+// Mini-batch round r moves the centroid 1/(1+r*STOCHASTIC_DBA_STEP_DECAY) of the way to the mini-batch's DBA update
+#define STOCHASTIC_DBA_STEP_DECAY 0.5
+// Mini-batch rounds also stop once a step moves no centroid element more than this (in std devs of Z-normalized data)
+#define STOCHASTIC_DBA_MIN_STEP 0.001
+
 using namespace cudahack; // for device-side numeric limits
 
+// Gather the finished all-vs-all DTW distance rows [first_row,last_row) from the devices that calculated them (round robin starting at 
+// start_row) into the host's copy of the upper right pair matrix. Both copies start at pair index stored_offset if they only hold some of the rows.
+template<typename T>
+__host__ void copyPairwiseDistanceRowsToHost(T *cpu_dtwPairwiseDistances, T **gpu_dtwPairwiseDistances, size_t num_sequences, size_t start_row, size_t first_row, size_t last_row, int deviceCount,
+                                             size_t stored_offset = 0){
+	for(size_t j = first_row; j < last_row; j++){
+		int device = (j - start_row) % deviceCount;
+		cudaSetDevice(device);
+		size_t offset = PAIRWISE_DIST_ROW(j, num_sequences)-stored_offset;
+		cudaMemcpy(cpu_dtwPairwiseDistances + offset, 
+		           gpu_dtwPairwiseDistances[device] + offset, 
+		           sizeof(T)*(num_sequences-j-1), cudaMemcpyDeviceToHost); CUERR("Copying DTW pairwise distances to CPU");
+	}
+}
+
+// One parallel pass over the upper right pair matrix that writes its text version, accumulates each sequence's sum of squared distances into dtwSoS, 
+// and returns the largest distance. Rows are formatted a block at a time so the text goes out in order without all being held in memory.
+template<typename D>
+__host__ float summarizePairwiseDistances(D *dtwPairwiseDistances, size_t num_sequences, char **sequence_names, std::ostream &mats, double *dtwSoS){
+	int num_threads = getNumCPUThreads();
+	std::vector<float> thread_max_distance(num_threads, 0.0f);
+	// Column sums are spread across all the rows, so each thread keeps its own to be reduced at the end
+	std::vector<std::vector<double> > thread_dtwSoS(num_threads, std::vector<double>(num_sequences, 0.0));
+	size_t block_rows = 4*num_threads;
+	std::vector<std::string> block_text(block_rows);
+	for(size_t block_start = 0; block_start < num_sequences-1; block_start += block_rows){
+		size_t num_block_rows = std::min(block_rows, num_sequences-1-block_start);
+		parallelFor(num_block_rows, [&](size_t block_row, int thread_index){
+			size_t seq_index = block_start+block_row;
+			D *row_distances = dtwPairwiseDistances+PAIRWISE_DIST_ROW(seq_index, num_sequences);
+			double *column_SoS = &thread_dtwSoS[thread_index][0];
+			float row_max_distance = 0.0f;
+			double row_SoS = 0.0;
+			std::ostringstream row_text;
+			row_text << sequence_names[seq_index] << std::string(seq_index, '\t') << "\t0"; //self-distance
+			for(size_t paired_seq_index = seq_index + 1; paired_seq_index < num_sequences; ++paired_seq_index){
+				float dtwPairwiseDistance = widenDistance(row_distances[paired_seq_index-seq_index-1]);
+				if(row_max_distance < dtwPairwiseDistance){
+					row_max_distance = dtwPairwiseDistance;
+				}
+				row_text << "\t" << dtwPairwiseDistance;
+				double dtwPairwiseDistanceSquared = ((double) dtwPairwiseDistance)*dtwPairwiseDistance;
+				row_SoS += dtwPairwiseDistanceSquared;
+				column_SoS[paired_seq_index] += dtwPairwiseDistanceSquared;
+			}
+			column_SoS[seq_index] += row_SoS;
+			if(thread_max_distance[thread_index] < row_max_distance){
+				thread_max_distance[thread_index] = row_max_distance;
+			}
+			row_text << "\n";
+			block_text[block_row] = row_text.str();
+		}, num_threads);
+		for(size_t block_row = 0; block_row < num_block_rows; block_row++){
+			mats << block_text[block_row];
+		}
+	}
+	parallelFor(num_sequences, [&](size_t seq_index, int thread_index){
+		for(int t = 0; t < num_threads; t++){
+			dtwSoS[seq_index] += thread_dtwSoS[t][seq_index];
+		}
+	}, num_threads, 1024);
+	float max_distance = 0.0f;
+	for(int t = 0; t < num_threads; t++){
+		if(max_distance < thread_max_distance[t]){
+			max_distance = thread_max_distance[t];
+		}
+	}
+	return max_distance;
+}
+
+// Fill in the pairwise distances between sequences that were already compared in the previous run with the given output prefix (matching by name),
+// and list the ascending indices of the sequences new to this run in new_seq_indices. Returns the number of new sequences.
+// With open ends the DTW distance depends on which sequence of the pair is aligned as the first, so a previously compared pair that's now in the 
+// opposite order (equal length sequences sorted differently) is not reused but listed by column in reoriented_columns[row] for recalculation.
+// If dtwPairwiseDistances only holds the rows [first_row,last_row) (e.g. a shard's), only those are filled in.
 template<typename T>
-__host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end, char *output_prefix, double *cdist, int *memberships, cudaStream_t stream) {
+__host__ size_t loadPreviousPairDists(const char *previous_prefix, char **sequence_names, size_t num_sequences, T *dtwPairwiseDistances, size_t *new_seq_indices,
+                                      int use_open_start, int use_open_end, std::vector<std::vector<size_t> > &reoriented_columns, size_t first_row = 0, size_t last_row = 0){
+	if(!last_row){
+		last_row = num_sequences-1;
+	}
+	std::vector<std::string> previous_names;
+	std::vector<T> previous_distances;
+	readPreviousPairDists(previous_prefix, previous_names, previous_distances);
+	size_t num_previous_sequences = previous_names.size();
+
+	std::unordered_map<std::string,size_t> previous_index_by_name;
+	for(size_t i = 0; i < num_previous_sequences; i++){
+		previous_index_by_name[previous_names[i]] = i;
+	}
+	std::vector<size_t> previous_indices(num_sequences);
+	size_t num_new_sequences = 0;
+	for(size_t i = 0; i < num_sequences; i++){
+		std::unordered_map<std::string,size_t>::iterator it = previous_index_by_name.find(sequence_names[i]);
+		if(it == previous_index_by_name.end()){
+			previous_indices[i] = num_previous_sequences; // sentinel for "new"
+			new_seq_indices[num_new_sequences++] = i;
+		}
+		else{
+			previous_indices[i] = it->second;
+		}
+	}
+	if(num_sequences - num_new_sequences < num_previous_sequences){
+		std::cerr << "Warning: " << (num_previous_sequences - num_sequences + num_new_sequences) << " sequences from the previous run " << previous_prefix 
+		          << " are not in the current input, their distances will be left out" << std::endl;
+	}
+	std::cerr << "Reusing distances for " << (num_sequences - num_new_sequences) << " previously compared sequences, calculating those for " 
+	          << num_new_sequences << " new sequences" << std::endl;
+
+	parallelFor(last_row-first_row, [&](size_t r, int thread_index){
+		size_t i = first_row+r;
+		size_t previous_i = previous_indices[i];
+		if(previous_i == num_previous_sequences){
+			return;
+		}
+		size_t row_offset = PAIRWISE_DIST_ROW(i, num_sequences)-PAIRWISE_DIST_ROW(first_row, num_sequences);
+		for(size_t j = i+1; j < num_sequences; j++){
+			size_t previous_j = previous_indices[j];
+			if(previous_j == num_previous_sequences){
+				continue;
+			}
+			// Sequences are sorted by length in both runs, so the previous pair order only differs for equal length sequences (same distance in global alignment).
+			if(previous_i > previous_j && (use_open_start || use_open_end)){
+				reoriented_columns[i].push_back(j);
+				continue;
+			}
+			size_t previous_row = std::min(previous_i, previous_j);
+			size_t previous_column = std::max(previous_i, previous_j);
+			dtwPairwiseDistances[row_offset+j-i-1] = previous_distances[PAIRWISE_DIST_ROW(previous_row, num_previous_sequences)+previous_column-previous_row-1];
+		}
+	});
+	return num_new_sequences;
+}
+
+// Pick the contiguous block of all-vs-all rows [*first_row,*last_row) for shard shard_index (1-based) of num_shards, such that each shard has about 
+// the same amount of DTW work. Row i costs about length(i) * sum of the lengths of the sequences after it, which is far from uniform as sequences are sorted by length.
+__host__ void shardRowRange(size_t *sequence_lengths, size_t num_sequences, int shard_index, int num_shards, size_t *first_row, size_t *last_row){
+	std::vector<double> cumulative_cost(num_sequences, 0); // cost of all rows before row i
+	double later_lengths = 0;
+	std::vector<double> row_cost(num_sequences, 0);
+	for(size_t i = num_sequences-1; i > 0; i--){
+		later_lengths += sequence_lengths[i];
+		row_cost[i-1] = ((double) sequence_lengths[i-1])*later_lengths;
+	}
+	for(size_t i = 1; i < num_sequences; i++){
+		cumulative_cost[i] = cumulative_cost[i-1] + row_cost[i-1];
+	}
+	double total_cost = cumulative_cost[num_sequences-1];
+	// Shard k starts at the first row whose preceding cost reaches its share of the total
+	*first_row = std::lower_bound(cumulative_cost.begin(), cumulative_cost.end(), total_cost*(shard_index-1)/num_shards) - cumulative_cost.begin();
+	*last_row = shard_index == num_shards ? num_sequences-1 : 
+	            std::lower_bound(cumulative_cost.begin(), cumulative_cost.end(), total_cost*shard_index/num_shards) - cumulative_cost.begin();
+	if(*first_row > num_sequences-1) *first_row = num_sequences-1;
+	if(*last_row > num_sequences-1) *last_row = num_sequences-1;
+}
+
+// If sums_of_squares is given, each sequence's sum of squared DTW distances to all the others is copied there (when the full distance matrix or sums only mode is used).
+template<typename T, typename D>
+__host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end, char *output_prefix, double *cdist, int *memberships, const dba_options &options, cudaStream_t stream, double *sums_of_squares = 0) {
+	// The sparse alternatives to everything below
+	if(options.knn_neighbours){
+		return knnGraphMedoidIndices(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, use_open_start, use_open_end, output_prefix, *cdist, options.knn_neighbours, memberships);
+	}
+	if(options.num_landmarks){
+		return landmarkMedoidIndices(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, use_open_start, use_open_end, *cdist, options.num_landmarks, memberships);
+	}
 	int deviceCount;
  	cudaGetDeviceCount(&deviceCount); CUERR("Getting GPU device count in medoid approximation method");
 
@@ -47,16 +232,166 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 		}
 	}
 
-	T **gpu_dtwPairwiseDistances = 0;
-	cudaMallocHost(&gpu_dtwPairwiseDistances,sizeof(T *)*deviceCount);  CUERR("Allocating CPU memory for GPU DTW pairwise distances' pointers");
+	D **gpu_dtwPairwiseDistances = 0;
+	cudaMallocHost(&gpu_dtwPairwiseDistances,sizeof(D *)*deviceCount);  CUERR("Allocating CPU memory for GPU DTW pairwise distances' pointers");
+	// In sums only mode each device accumulates its own partial sums of every sequence's squared distances instead, for O(N) rather than O(N^2) memory.
+	// These are doubles whatever the sequence type T or distance type D, so integer sequences don't truncate the distances and big N doesn't lose their precision.
+	double **gpu_dtwSoS = 0;
+	cudaMallocHost(&gpu_dtwSoS,sizeof(double *)*deviceCount);  CUERR("Allocating CPU memory for GPU DTW pairwise distance sums of squares' pointers");
 
 	size_t numPairwiseDistances = ARITH_SERIES_SUM(num_sequences-1); // arithmetic series of 1..(n-1)
+	size_t start_row = 0;
+	size_t end_row = num_sequences-1;
+	// A shard only calculates (and so only stores) the pair matrix rows [start_row,end_row), so the rest of the matrix never needs to fit in its job's memory.
+	size_t storedDistancesOffset = 0;
+	size_t numStoredDistances = numPairwiseDistances;
+	if(options.num_shards){
+		// This process is just one of several independent jobs calculating the distances (no checkpointing, the shard is the unit of restart).
+		shardRowRange(sequence_lengths, num_sequences, options.shard_index, options.num_shards, &start_row, &end_row);
+		std::cerr << "Calculating all-vs-all DTW distance rows " << start_row << " to " << end_row << " of " << (num_sequences-1) 
+		          << " as shard " << options.shard_index << "/" << options.num_shards << std::endl;
+		storedDistancesOffset = PAIRWISE_DIST_ROW(start_row, num_sequences);
+		numStoredDistances = PAIRWISE_DIST_ROW(end_row, num_sequences)-storedDistancesOffset;
+	}
 	for(int i = 0; i < deviceCount; i++){
 		cudaSetDevice(i);
-		cudaMalloc(&gpu_dtwPairwiseDistances[i], sizeof(T)*numPairwiseDistances); CUERR("Allocating GPU memory for DTW pairwise distances");
+		gpu_dtwPairwiseDistances[i] = 0;
+		gpu_dtwSoS[i] = 0;
+		if(options.sums_only_medoid){
+			cudaMalloc(&gpu_dtwSoS[i], sizeof(double)*num_sequences); CUERR("Allocating GPU memory for DTW pairwise distance sums of squares");
+			cudaMemset(gpu_dtwSoS[i], 0, sizeof(double)*num_sequences); CUERR("Zeroing GPU memory for DTW pairwise distance sums of squares");
+		}
+		else{
+			cudaMalloc(&gpu_dtwPairwiseDistances[i], sizeof(D)*numStoredDistances); CUERR("Allocating GPU memory for DTW pairwise distances");
+		}
+	}
+	D *cpu_dtwPairwiseDistances = 0;
+	if(!options.sums_only_medoid){
+		cudaMallocHost(&cpu_dtwPairwiseDistances, sizeof(D)*numStoredDistances); CUERR("Allocating page locked CPU memory for DTW pairwise distances");
+	}
+
+	// Pick up where a previous (killed) run on the same input left off, if it checkpointed any completed rows.
+	std::string pair_dist_checkpoint_name = CONCAT2(output_prefix, ".pair_dists.ckpt");
+	unsigned long long input_fingerprint = pairDistInputFingerprint(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, sequence_names, use_open_start, use_open_end);
+	// Distances stored at a different precision can't be reused (float's fingerprint is left as-is for compatibility with existing checkpoints).
+	int distance_precision = distancePrecisionCode<D>();
+	if(distance_precision != DISTANCE_PRECISION_FLOAT){
+		input_fingerprint = fnv1aHash(&distance_precision, sizeof(int), input_fingerprint);
+	}
+	if(options.merge_shards){
+		mergePairDistShards(output_prefix, options.merge_shards, cpu_dtwPairwiseDistances, num_sequences, input_fingerprint);
+		writePairDistCheckpoint(pair_dist_checkpoint_name.c_str(), cpu_dtwPairwiseDistances, 0, numPairwiseDistances, num_sequences-1, num_sequences, input_fingerprint);
+		start_row = end_row;
+	}
+	else if(!options.num_shards && !options.sums_only_medoid){
+		start_row = readPairDistCheckpoint(pair_dist_checkpoint_name.c_str(), cpu_dtwPairwiseDistances, num_sequences, input_fingerprint);
+	}
+	size_t checkpointed_rows = start_row;
+	time_t last_checkpoint_time = time(0);
+
+	// Each row normally compares a sequence to all the ones after it (null list), but when some of those distances are reused
+	// the row's remaining comparisons are given as an explicit list of sequence indices for the DTW kernel.
+	std::vector<const size_t *> row_column_lists(num_sequences, (const size_t *) 0);
+	std::vector<size_t> row_column_counts(num_sequences);
+	for(size_t row = 0; row < num_sequences; row++){
+		row_column_counts[row] = num_sequences-row-1;
+	}
+	bool reusing_distances = false;
+
+	// In append mode, rows of previously compared sequences only need their comparisons against the (later) new sequences calculated.
+	size_t *new_seq_indices = 0;
+	size_t *reoriented_columns_pool = 0;
+	if(!options.append_prefix.empty() && start_row < end_row){
+		cudaMallocManaged(&new_seq_indices, sizeof(size_t)*num_sequences); CUERR("Allocating managed memory for new sequence indices");
+		std::vector<std::vector<size_t> > reoriented_columns(num_sequences);
+		size_t num_new_sequences = loadPreviousPairDists(options.append_prefix.c_str(), sequence_names, num_sequences, cpu_dtwPairwiseDistances, new_seq_indices,
+		                                                 use_open_start, use_open_end, reoriented_columns, options.num_shards ? start_row : 0, end_row);
+		size_t num_reoriented_pairs = 0, reoriented_pool_size = 0;
+		for(size_t row = start_row; row < end_row; row++){
+			if(!std::binary_search(new_seq_indices, new_seq_indices+num_new_sequences, row)){
+				row_column_lists[row] = std::upper_bound(new_seq_indices, new_seq_indices+num_new_sequences, row);
+				row_column_counts[row] = new_seq_indices+num_new_sequences-row_column_lists[row];
+				if(!reoriented_columns[row].empty()){
+					num_reoriented_pairs += reoriented_columns[row].size();
+					reoriented_pool_size += reoriented_columns[row].size()+row_column_counts[row];
+				}
+			}
+		}
+		// Rows with pairs to recalculate besides those with new sequences need their own explicit column lists
+		if(num_reoriented_pairs){
+			std::cerr << "Recalculating " << num_reoriented_pairs << " previously compared pairs now aligned in the opposite order (open end DTW is not symmetric)" << std::endl;
+			cudaMallocManaged(&reoriented_columns_pool, sizeof(size_t)*reoriented_pool_size); CUERR("Allocating managed memory for reoriented sequence indices");
+			size_t pool_cursor = 0;
+			for(size_t row = start_row; row < end_row; row++){
+				if(row_column_lists[row] && !reoriented_columns[row].empty()){
+					size_t *row_columns = reoriented_columns_pool+pool_cursor;
+					std::merge(reoriented_columns[row].begin(), reoriented_columns[row].end(), row_column_lists[row], row_column_lists[row]+row_column_counts[row], row_columns);
+					row_column_lists[row] = row_columns;
+					row_column_counts[row] += reoriented_columns[row].size();
+					pool_cursor += row_column_counts[row];
+				}
+			}
+		}
+		reusing_distances = true;
+	}
+
+	// Any remaining comparisons already in the on-disk distance cache (from any previous run) don't need calculating either.
+	distance_cache cache;
+	cache.fd = -1;
+	cache.replacement_fd = -1;
+	std::vector<unsigned long long> seq_hashes;
+	unsigned long long cache_mode = distanceCacheMode<T,D>(use_open_start, use_open_end);
+	size_t *uncached_columns_pool = 0;
+	size_t num_uncached_pairs = 0;
+	if(!options.distance_cache.empty() && start_row < end_row){
+		seq_hashes.resize(num_sequences);
+		for(size_t i = 0; i < num_sequences; i++){
+			seq_hashes[i] = fnv1aHash(gpu_sequences+i*maxSeqLength, sizeof(T)*sequence_lengths[i]);
+		}
+		openDistanceCache(options.distance_cache.c_str(), &cache);
+		std::vector<std::vector<size_t> > uncached_columns(end_row-start_row);
+		parallelFor(end_row-start_row, [&](size_t r, int thread_index){
+			size_t row = start_row+r;
+			size_t row_offset = PAIRWISE_DIST_ROW(row, num_sequences)-storedDistancesOffset;
+			for(size_t c = 0; c < row_column_counts[row]; c++){
+				size_t column = row_column_lists[row] ? row_column_lists[row][c] : row+1+c;
+				double cached_distance;
+				if(lookupDistanceCache(&cache, seq_hashes[row], seq_hashes[column], cache_mode, &cached_distance)){
+					cpu_dtwPairwiseDistances[row_offset+column-row-1] = narrowDistance<D>((float) cached_distance);
+				}
+				else{
+					uncached_columns[r].push_back(column);
+				}
+			}
+		});
+		releaseDistanceCache(&cache);
+		for(size_t r = 0; r < uncached_columns.size(); r++){
+			num_uncached_pairs += uncached_columns[r].size();
+		}
+		if(num_uncached_pairs){
+			cudaMallocManaged(&uncached_columns_pool, sizeof(size_t)*num_uncached_pairs); CUERR("Allocating managed memory for uncached sequence indices");
+		}
+		size_t pool_cursor = 0;
+		for(size_t r = 0; r < uncached_columns.size(); r++){
+			size_t row = start_row+r;
+			if(uncached_columns[r].size() != row_column_counts[row]){ // some hits, so list what's left explicitly
+				std::copy(uncached_columns[r].begin(), uncached_columns[r].end(), uncached_columns_pool+pool_cursor);
+				row_column_lists[row] = uncached_columns_pool+pool_cursor;
+				row_column_counts[row] = uncached_columns[r].size();
+				reusing_distances = true;
+			}
+			pool_cursor += uncached_columns[r].size();
+		}
+		std::cerr << "Found " << (numStoredDistances-num_uncached_pairs) << " of " << numStoredDistances << " pairwise distances in the cache or otherwise already known" << std::endl;
+	}
+
+	// The rows are copied back from the devices in full, so they need the reused distances too.
+	if(reusing_distances){
+		for(int i = 0; i < deviceCount; i++){
+			cudaSetDevice(i);
+			cudaMemcpy(gpu_dtwPairwiseDistances[i], cpu_dtwPairwiseDistances, sizeof(D)*numStoredDistances, cudaMemcpyHostToDevice); CUERR("Copying reused DTW pairwise distances to GPU");
+		}
 	}
-	T *cpu_dtwPairwiseDistances = 0;
-	cudaMallocHost(&cpu_dtwPairwiseDistances, sizeof(T)*numPairwiseDistances); CUERR("Allocating page locked CPU memory for DTW pairwise distances");
 
 	int priority_high, priority_low, descendingPriority;
 	cudaDeviceGetStreamPriorityRange(&priority_low, &priority_high);
@@ -64,7 +399,7 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 	// To save on space while still calculating all possible DTW paths, we process all DTWs for one sequence at the same time.
         // So allocate space for the dtwCost to get to each point on the border between grid vertical swaths of the total cost matrix.
 	int dotsPrinted = 0;
-	for(size_t seq_index = 0; seq_index < num_sequences-1; seq_index+=deviceCount){
+	for(size_t seq_index = start_row; seq_index < end_row; seq_index+=deviceCount){
 		// An issue can pop up with extremely long sequences that we are typically launching a kernel every 256 or 1024 sequence elements, and an async copy.
 		// So, a stream can get 900+ kernel launches queued up in it once it becomes 450K elements long. The kernel launch queue for a stream is 
 		// not specifically defined, but with near 1000 launches queued up, another kernel launch will sit synchronously and wait for something to come off the queue.
@@ -79,13 +414,21 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 		T *dtwCostSoFar[deviceCount];
 		T *newDtwCostSoFar[deviceCount];
 		cudaStream_t seq_stream[deviceCount]; 
-		for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < num_sequences-1; currDevice++){
+		size_t row_pairs[deviceCount]; // how many comparisons to make for each device's row
+		const size_t *row_columns[deviceCount]; // explicit list of sequences to compare the row to, or null for all those after it
+		for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < end_row; currDevice++){
+			size_t row = seq_index+currDevice;
+			row_columns[currDevice] = row_column_lists[row];
+			row_pairs[currDevice] = row_column_counts[row];
+			if(!row_pairs[currDevice]){
+				continue; // all distances for this row were reused
+			}
 			cudaSetDevice(currDevice);
-			size_t current_seq_length = sequence_lengths[seq_index+currDevice];
+			size_t current_seq_length = sequence_lengths[row];
 			// We are allocating each time rather than just once at the start because if the sequences have a large
                 	// range of lengths and we sort them from shortest to longest we will be allocating the minimum amount of
 			// memory necessary.
-        		dim3 gridDim((num_sequences-seq_index-currDevice-1), 1, 1);
+        		dim3 gridDim(row_pairs[currDevice], 1, 1);
 			dtwCostSoFarSize[currDevice] = sizeof(T)*current_seq_length*gridDim.x;
 			size_t freeGPUMem;
 			size_t totalGPUMem;
@@ -136,9 +479,12 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 		// diagonal moves over right moves, though the "choice" is immaterial in simple total cost calculation.
 		
 		for(size_t offset_within_seq = 0; offset_within_seq < maxSeqLength; offset_within_seq += threadblockDim.x){
-			for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < num_sequences-1; currDevice++){
+			for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < end_row; currDevice++){
+				if(!row_pairs[currDevice]){
+					continue;
+				}
 				cudaSetDevice(currDevice);
-        			dim3 gridDim((num_sequences-seq_index-currDevice-1), 1, 1);
+        			dim3 gridDim(row_pairs[currDevice], 1, 1);
 				// We have a circular buffer in shared memory of three diagonals for minimal proper DTW calculation, and an array for an inline findMin()
         			int shared_memory_required = threadblockDim.x*3*sizeof(T);
 				// Null unsigned char pointer arg below means we aren't storing the path for each alignment right now.
@@ -146,17 +492,32 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 				DTWDistance<<<gridDim,threadblockDim,shared_memory_required,seq_stream[currDevice]>>>((T *) 0, (size_t) 0, (T *) 0, (size_t) 0, seq_index+currDevice, offset_within_seq, gpu_sequences, maxSeqLength,
 										num_sequences, sequence_lengths, dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], 
 										(unsigned char *) 0, (size_t) 0, gpu_dtwPairwiseDistances[currDevice], 
-										use_open_start, use_open_end); CUERR("DTW vertical swath calculation with cost storage");
+										use_open_start, use_open_end, row_columns[currDevice], gpu_dtwSoS[currDevice], (D *) 0, storedDistancesOffset); CUERR("DTW vertical swath calculation with cost storage");
 				cudaMemcpyAsync(dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], dtwCostSoFarSize[currDevice], cudaMemcpyDeviceToDevice, seq_stream[currDevice]); CUERR("Copying DTW pairwise distance intermediate values");
 				if(offset_within_seq+threadblockDim.x >= maxSeqLength){
-					dotsPrinted = updatePercentageComplete(seq_index+currDevice, num_sequences-1, dotsPrinted);
+					dotsPrinted = updatePercentageComplete(seq_index+currDevice-start_row, end_row-start_row, dotsPrinted);
 				}
 			}
 		} 
 		// Will cause memory to be freed in callback after seq DTW completion, so the sleep_for() polling above can 
 		// eventually release to launch more kernels as free memory increases (if it's not already limited by the kernel grid block queue).
-		for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < num_sequences-1; currDevice++){
-			addStreamCleanupCallback(dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], 0, seq_stream[currDevice]);
+		for(int currDevice = 0; currDevice < deviceCount && seq_index + currDevice < end_row; currDevice++){
+			if(row_pairs[currDevice]){
+				addStreamCleanupCallback(dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], 0, seq_stream[currDevice]);
+			}
+		}
+		// Periodically drain the devices and flush the finished rows, so an HPC job hitting its wall time limit doesn't have to redo them.
+		size_t rows_launched = std::min(seq_index+deviceCount, end_row);
+		if(rows_launched < end_row && !options.num_shards && !options.sums_only_medoid && difftime(time(0), last_checkpoint_time) >= PAIRWISE_DIST_CHECKPOINT_SECONDS){
+			for(int i = 0; i < deviceCount; i++){
+				cudaSetDevice(i);
+				cudaDeviceSynchronize(); CUERR("Synchronizing CUDA device before DTW pairwise distance checkpoint");
+			}
+			copyPairwiseDistanceRowsToHost(cpu_dtwPairwiseDistances, gpu_dtwPairwiseDistances, num_sequences, start_row, checkpointed_rows, rows_launched, deviceCount);
+			writePairDistCheckpoint(pair_dist_checkpoint_name.c_str(), cpu_dtwPairwiseDistances, PAIRWISE_DIST_ROW(checkpointed_rows, num_sequences), 
+			                        PAIRWISE_DIST_ROW(rows_launched, num_sequences)-PAIRWISE_DIST_ROW(checkpointed_rows, num_sequences), rows_launched, num_sequences, input_fingerprint);
+			checkpointed_rows = rows_launched;
+			last_checkpoint_time = time(0);
 		}
 	}
 	std::cerr << std::endl;
@@ -167,43 +528,80 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 		cudaDeviceSynchronize(); CUERR("Synchronizing CUDA device after all DTW calculations");
 	}
 
-	T *dtwSoS;
+	double *dtwSoS;
 	// Technically dtsSoS does not need to be page locked as it doesn't get copied to the GPU, but we're futureproofing it and it's going 
 	// to be in an existing page most likely anyway, given all the cudaMallocHost() calls before this.
-	cudaMallocHost(&dtwSoS, sizeof(T)*num_sequences); CUERR("Allocating CPU memory for DTW pairwise distance sums of squares");
-	std::memset(dtwSoS, 0, sizeof(T)*num_sequences);
-        // Reassemble the whole pair matrix (upper right only) from the rows that each device processed.
+	cudaMallocHost(&dtwSoS, sizeof(double)*num_sequences); CUERR("Allocating CPU memory for DTW pairwise distance sums of squares");
+	std::memset(dtwSoS, 0, sizeof(double)*num_sequences);
+	if(options.sums_only_medoid){
+		// Combine the devices' partial sums, then the medoid of the one and only cluster is simply the lowest sum.
+		double *device_dtwSoS = new double[num_sequences];
+		for(int i = 0; i < deviceCount; i++){
+			cudaSetDevice(i);
+			cudaMemcpy(device_dtwSoS, gpu_dtwSoS[i], sizeof(double)*num_sequences, cudaMemcpyDeviceToHost); CUERR("Copying DTW pairwise distance sums of squares to CPU");
+			cudaFree(gpu_dtwSoS[i]); CUERR("Freeing GPU memory for DTW pairwise distance sums of squares");
+			for(size_t j = 0; j < num_sequences; j++){
+				dtwSoS[j] += device_dtwSoS[j];
+			}
+		}
+		delete[] device_dtwSoS;
+		if(sums_of_squares){
+			memcpy(sums_of_squares, dtwSoS, sizeof(double)*num_sequences);
+		}
+		cudaFreeHost(gpu_dtwSoS); CUERR("Freeing CPU memory for GPU DTW pairwise distance sums of squares' pointers");
+		cudaFreeHost(gpu_dtwPairwiseDistances); CUERR("Freeing CPU memory for GPU DTW pairwise distances' pointers");
+		std::memset(memberships, 0, sizeof(int)*num_sequences);
+		int *medoidIndices = findClusterMedoids((D *) 0, dtwSoS, num_sequences, sequence_lengths, memberships, 1);
+		cudaFreeHost(dtwSoS); CUERR("Freeing CPU memory for DTW pairwise distance sum of squares");
+		return medoidIndices;
+	}
+	cudaFreeHost(gpu_dtwSoS); CUERR("Freeing CPU memory for GPU DTW pairwise distance sums of squares' pointers");
+        // Reassemble the whole pair matrix (upper right only) from the rows that each device processed since the last checkpoint.
+	copyPairwiseDistanceRowsToHost(cpu_dtwPairwiseDistances, gpu_dtwPairwiseDistances, num_sequences, start_row, checkpointed_rows, end_row, deviceCount, storedDistancesOffset);
 	for(int i = 0; i < deviceCount; i++){
 		cudaSetDevice(i);
-		for(int j = i; j < num_sequences-1; j+= deviceCount){
-			size_t offset = PAIRWISE_DIST_ROW(j, num_sequences);
-			cudaMemcpy(cpu_dtwPairwiseDistances + offset, 
-                                   gpu_dtwPairwiseDistances[i] + offset, 
-				   sizeof(T)*(num_sequences-j-1), cudaMemcpyDeviceToHost); CUERR("Copying DTW pairwise distances to CPU");
+		cudaFree(gpu_dtwPairwiseDistances[i]); CUERR("Freeing GPU memory for DTW pairwise distances");
+	}
+	cudaFreeHost(gpu_dtwPairwiseDistances); CUERR("Freeing CPU memory for GPU DTW pairwise distances' pointers");
+	// Share the newly calculated distances with future runs.
+	if(cache.fd != -1){
+		beginDistanceCacheUpdate(&cache, num_uncached_pairs);
+		for(size_t row = start_row; row < end_row; row++){
+			size_t row_offset = PAIRWISE_DIST_ROW(row, num_sequences)-storedDistancesOffset;
+			for(size_t c = 0; c < row_column_counts[row]; c++){
+				size_t column = row_column_lists[row] ? row_column_lists[row][c] : row+1+c;
+				addToDistanceCache(&cache, seq_hashes[row], seq_hashes[column], cache_mode, (double) widenDistance(cpu_dtwPairwiseDistances[row_offset+column-row-1]));
+			}
 		}
+		endDistanceCacheUpdate(&cache);
+		closeDistanceCache(&cache);
+	}
+	if(new_seq_indices){
+		cudaFree(new_seq_indices); CUERR("Freeing managed memory for new sequence indices");
+	}
+	if(uncached_columns_pool){
+		cudaFree(uncached_columns_pool); CUERR("Freeing managed memory for uncached sequence indices");
+	}
+	if(reoriented_columns_pool){
+		cudaFree(reoriented_columns_pool); CUERR("Freeing managed memory for reoriented sequence indices");
+	}
+	// A shard's job is done once its rows are on disk, the clustering happens after they are all merged.
+	if(options.num_shards){
+		writePairDistShard(pairDistShardFileName(output_prefix, options.shard_index, options.num_shards).c_str(), cpu_dtwPairwiseDistances, 
+		                   num_sequences, start_row, end_row, input_fingerprint);
+		cudaFreeHost(cpu_dtwPairwiseDistances); CUERR("Freeing page locked CPU memory for DTW pairwise distances");
+		return 0;
+	}
+	// A complete checkpoint lets a run killed during clustering or convergence skip the all-vs-all entirely on restart.
+	if(checkpointed_rows < num_sequences-1){
+		writePairDistCheckpoint(pair_dist_checkpoint_name.c_str(), cpu_dtwPairwiseDistances, PAIRWISE_DIST_ROW(checkpointed_rows, num_sequences), 
+		                        numPairwiseDistances-PAIRWISE_DIST_ROW(checkpointed_rows, num_sequences), num_sequences-1, num_sequences, input_fingerprint);
 	}
 
-	size_t index_offset = 0;
-	T max_distance = (T) 0;
 	std::ofstream mats((std::string(output_prefix)+std::string(".pair_dists.txt")).c_str());
-	for(size_t seq_index = 0; seq_index < num_sequences-1; seq_index++){
-		mats << sequence_names[seq_index];
-		for(size_t pad = 0; pad < seq_index; ++pad){
-			mats << "\t";
-		}
-		mats << "\t0"; //self-distance
-		for(size_t paired_seq_index = seq_index + 1; paired_seq_index < num_sequences; ++paired_seq_index){
-			T dtwPairwiseDistanceSquared = cpu_dtwPairwiseDistances[index_offset+paired_seq_index-seq_index-1];
-			if(max_distance < dtwPairwiseDistanceSquared){
-				max_distance = dtwPairwiseDistanceSquared;
-			}	
-			mats << "\t" << dtwPairwiseDistanceSquared;
-			dtwPairwiseDistanceSquared *= dtwPairwiseDistanceSquared;
-			dtwSoS[seq_index] += dtwPairwiseDistanceSquared;
-			dtwSoS[paired_seq_index] += dtwPairwiseDistanceSquared;
-		}
-		index_offset += num_sequences - seq_index - 1;
-		mats << std::endl;
+	float max_distance = summarizePairwiseDistances(cpu_dtwPairwiseDistances, num_sequences, sequence_names, mats, dtwSoS);
+	if(sums_of_squares){
+		memcpy(sums_of_squares, dtwSoS, sizeof(double)*num_sequences);
 	}
 	
 	// If sequences are the same then max_distance would be 0. We set it to 1 because any number divided by 1 will still be itself. Saves us from dividing by 0 later.
@@ -215,72 +613,36 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
         }
 	mats << "0" << std::endl;
 
-	// Don't allocate to the heap, this number can get big, and not enough heap space, and cause a seg fault when accessed
-	double *cpu_double_dtwPairwiseDistances = 0;
-	cpu_double_dtwPairwiseDistances = (double *) calloc(ARITH_SERIES_SUM(num_sequences-1), sizeof(double));
-	if(!cpu_double_dtwPairwiseDistances){ // should only really happen if allocating > 2^32 on a 32 but system
-		std::cerr << "Cannot allocate pairwise distance matrix for medoid clustering" << std::endl;
-		exit(CANNOT_ALLOCATE_PAIRWISE_DIST_ARRAY);
-	}
-	for(int i = 0; i < ARITH_SERIES_SUM(num_sequences-1); i++){
-		cpu_double_dtwPairwiseDistances[i] = ((double) cpu_dtwPairwiseDistances[i])/((double) max_distance); // move into [0,1] range
-	}
-
 	// A dataset may contain logical subdivisions of sequences (e.g. classic UCR time series "gun vs. no-gun", or different 
 	// transcripts in Oxford Nanopore Technologies direct RNA data), in which case it can be useful
 	// to generate average sequences for each of the subdivisions rather than merging their unique characteristics.
-	int* merge = new int[2*(num_sequences-1)];
-	double* height = new double[num_sequences-1];
-	hclust_fast(num_sequences, cpu_double_dtwPairwiseDistances, HCLUST_METHOD_COMPLETE, merge, height);
-	free(cpu_double_dtwPairwiseDistances);
-
-	// Three possible strategies for clustering
-	if(*cdist > 1){ // assume you want to do k-means clustering
-		int new_k = *cdist;
-		if(new_k > num_sequences){
-			// Everything is in its own cluster
-			new_k = num_sequences;
-		}
-		std::cerr << std::endl << "Using K-means clustering (excluding singletons)" << std::endl;
-		// Exclude any singletons as being considered "clusters"
-		int num_multimember_clusters;
-		do{
-			cutree_k(num_sequences, merge, new_k, memberships);
-			int* num_members_per_cluster = new int[new_k](); // zero-initialized
-			for(int i = 0; i < num_sequences; i++){
-				num_members_per_cluster[memberships[i]]++;
-			}
-			num_multimember_clusters = 0;
-			for(int i = 0; i < new_k; i++){
-				if(num_members_per_cluster[i] > 1){
-					num_multimember_clusters++;
-				}
-                        }
-			//std::cerr << "Found " << num_multimember_clusters << " multicluster members with K set to " << new_k << std::endl;
-			delete[] num_members_per_cluster; // overkill maybe?
-			new_k += ((int) *cdist) - num_multimember_clusters; // adjust K to compensate for singletons eating up real cluster space
-		} while(num_multimember_clusters < ((int) *cdist) && new_k < num_sequences);
-		std::cerr << "Final K to compensate for singletons: " << new_k << std::endl;
-		
+	// K-medoids works on the distances directly, so the dendrogram is only needed for the other strategies.
+	int* merge = 0;
+	double* height = 0;
+	if(!options.k_medoids || *cdist <= 1 || !options.cdist_sweep.empty()){
+		merge = new int[2*(num_sequences-1)];
+		height = new double[num_sequences-1];
+		// The clustering updates the distances in place but puts them back before returning, so the medoid selection etc. below see the originals.
+		completeLinkage(num_sequences, cpu_dtwPairwiseDistances, max_distance, merge, height);
 	}
-        else if(*cdist == 1){
-		// Special case for 1, always everything in one cluster. Avoids cutree_cdist split of two-leaf-only dendrograms
-		// and other simple topologies with branch length 1.
-		for(int i = 0; i < num_sequences; i++){
-			memberships[i] = 0;
-		}
+
+	// Evaluate any extra requested thresholds against the same dendrogram before the primary cut below.
+	if(!options.cdist_sweep.empty()){
+		sweepDendrogramCuts(options.cdist_sweep, num_sequences, merge, height, cpu_dtwPairwiseDistances, dtwSoS, sequence_lengths, sequence_names, output_prefix, 
+		                    options.k_medoids);
+	}
+
+	// Four possible strategies for clustering
+	int *medoidIndices = 0;
+	if(options.k_medoids && *cdist > 1){
+		medoidIndices = kMedoids(num_sequences, cpu_dtwPairwiseDistances, (int) *cdist, memberships);
 	}
 	else if(*cdist >= 0){
-		// Stop clustering at step with cluster distance >= cdist
-		std::cerr << std::endl << "Using dendrogram fixed height clustering cutoff" << std::endl;
-		cutree_cdist(num_sequences, merge, height, *cdist, memberships);
+		cutDendrogram(num_sequences, merge, height, *cdist, memberships);
 	}
-	else{ 	/* TODO
-		// Negative number means we want to use permutation statistics supported cluster building
-		float cluster_p_value = 0.05;
-		merge_clusters(gpu_sequences, sequence_lengths, num_sequences, cpu_dtwPairwiseDistances, merge, cluster_p_value, 
-			       memberships, use_open_start, use_open_end, stream); 
-		*/
+	else{
+		// Negative number means we want to use permutation statistics supported cluster building, with -cdist as the p-value threshold
+		merge_clusters(num_sequences, cpu_dtwPairwiseDistances, merge, -(*cdist), memberships);
 	}
 	delete[] merge;
 	delete[] height;
@@ -292,73 +654,16 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
 		}
 	}
 	std::cerr << "There are " << num_clusters << " clusters" << std::endl;
-	int *medoidIndices = new int[num_clusters];
-
-	T *clusterDtwSoS = num_clusters == 1 ? dtwSoS : new T[num_sequences](); // will use some portion of this max for each cluster
-	for(int currCluster = 0; currCluster < num_clusters; currCluster++){
-		std::cerr << "Processing cluster " << currCluster;
-		int num_cluster_members = 0;
-		for(size_t i = 0; i < num_sequences; ++i){
-			if(memberships[i] == currCluster){
-				num_cluster_members++;
-			}
-		}
-		int *clusterIndices = new int[num_cluster_members];
-		std::cerr << " membership=" << num_cluster_members << ", ";
-		int cluster_cursor = 0;
-		for(size_t i = 0; i < num_sequences; ++i){
-			if(memberships[i] == currCluster){
-				clusterIndices[cluster_cursor++] = i;
-			}
-		}
-		if(num_clusters > 1){
-			for(size_t i = 0; i < num_cluster_members - 1; ++i){
-				// Where in the upper right matrix we are i.e. the whole matrix minus what down and to the right of this row's start
-				int index_offset = PAIRWISE_DIST_ROW(i, num_sequences); 
-				for(size_t j = i + 1; j < num_cluster_members; ++j){
-					T paired_distance = cpu_dtwPairwiseDistances[index_offset+j-i-1];
-					clusterDtwSoS[i] += paired_distance*paired_distance;
-					clusterDtwSoS[j] += paired_distance*paired_distance;
-				}
-			}
-		}
-		int medoidIndex = -1;
-		// Pick the smallest squared distance across all the sequences in this cluster.
-		if(num_cluster_members > 2){
-			T lowestSoS = std::numeric_limits<T>::max();
-			for(size_t i = 0; i < num_cluster_members; ++i){
-				if (clusterDtwSoS[i] < lowestSoS) {
-					medoidIndex = clusterIndices[i];
-					lowestSoS = clusterDtwSoS[i];
-				}
-			}
-		} 
-		else if(num_cluster_members == 2){
-			// Pick the longest sequence that contributed to the cumulative distance if we only have 2 sequences
-			medoidIndex = sequence_lengths[clusterIndices[0]] > sequence_lengths[clusterIndices[1]] ? clusterIndices[0] : clusterIndices[1];
-		}
-		else{	// Single member cluster
-			medoidIndex = clusterIndices[0];
-		}
-		// Sanity check
-		if(medoidIndex == -1){
-			std::cerr << "Logic error in medoid finding routine, please e-mail the developer (gordonp@ucalgary.ca)." << std::endl;
-			exit(MEDOID_FINDING_ERROR);
-		}
-		medoidIndices[currCluster] = medoidIndex;
-		std::cerr << "medoid is " << medoidIndex << std::endl;
-		delete[] clusterIndices;
+	// K-medoids already picked them
+	if(!medoidIndices){
+		medoidIndices = findClusterMedoids(cpu_dtwPairwiseDistances, dtwSoS, num_sequences, sequence_lengths, memberships, num_clusters);
 	}
-	if(num_clusters != 1){
-		delete[] clusterDtwSoS;
+	if(options.bootstrap_replicates){
+		bootstrapClusterStability(num_sequences, cpu_dtwPairwiseDistances, max_distance, *cdist, options.k_medoids, memberships, num_clusters, 
+		                          options.bootstrap_replicates, sequence_names, output_prefix);
 	}
 	cudaFreeHost(dtwSoS); CUERR("Freeing CPU memory for DTW pairwise distance sum of squares");
 	cudaFreeHost(cpu_dtwPairwiseDistances); CUERR("Freeing page locked CPU memory for DTW pairwise distances");
-	for(int i = 0; i < deviceCount; i++){
-		cudaSetDevice(i); // not sure this is necessary?
-		cudaFree(gpu_dtwPairwiseDistances[i]); CUERR("Freeing GPU memory for DTW pairwise distances");
-	}
-	cudaFreeHost(gpu_dtwPairwiseDistances); CUERR("Freeing CPU memory for GPU DTW pairwise distances' pointers");
 	mats.close();
 	//std::cerr << "Returning medoid indices" << std::endl;
 	return medoidIndices;
@@ -373,7 +678,7 @@ __host__ int* approximateMedoidIndices(T *gpu_sequences, size_t maxSeqLength, si
  */
 template<typename T>
 __global__
-void updateCentroid(T *seq, T *centroidElementSums, unsigned int *nElementsForMean, unsigned char *pathMatrix, size_t pathColumns, size_t pathRows, size_t pathMemPitch, int flip_seq_order, int column_offset = 0, int *stripe_rows = 0){
+void updateCentroid(T *seq, T *centroidElementSums, unsigned int *nElementsForMean, unsigned char *pathMatrix, size_t pathColumns, size_t pathRows, size_t pathMemPitch, int flip_seq_order, int column_offset = 0, int *stripe_rows = 0, unsigned int weight = 1){
 	// Backtrack from the end of both sequences to the start to get the optimal path.
 	int j = pathColumns - 1;
 	int i = pathRows - 1; 
@@ -394,8 +699,9 @@ void updateCentroid(T *seq, T *centroidElementSums, unsigned int *nElementsForMe
 		// Don't count open end moves as contributing to the consensus.
 		if(move != OPEN_RIGHT){ 
 			// flip_seq_order indicates that the consensus is on the Y axis for this path matrix rather than the X axis.
-			atomicAdd(&centroidElementSums[flip_seq_order ? i : j+column_offset], seq[flip_seq_order ? j+column_offset : i]);
-			atomicInc(&nElementsForMean[flip_seq_order ? i : j+column_offset], numeric_limits<unsigned int>::max());
+			// A sequence standing in for several (e.g. a consensus of a group) counts that many times.
+			atomicAdd(&centroidElementSums[flip_seq_order ? i : j+column_offset], seq[flip_seq_order ? j+column_offset : i]*((T) weight));
+			atomicAdd(&nElementsForMean[flip_seq_order ? i : j+column_offset], weight);
 		}
 		// moveI and moveJ are defined device-side in dtw.hpp
 		i += (size_t) moveI[move];
@@ -410,8 +716,8 @@ void updateCentroid(T *seq, T *centroidElementSums, unsigned int *nElementsForMe
 			asm("trap;"); 
 	        }
 		if(move != NIL_OPEN_RIGHT) {
-			atomicAdd_system(&centroidElementSums[0], seq[0]);
-			atomicInc_system(&nElementsForMean[0], numeric_limits<unsigned int>::max());
+			atomicAdd_system(&centroidElementSums[0], seq[0]*((T) weight));
+			atomicAdd_system(&nElementsForMean[0], weight);
 		}
 	}
 	else if(j != -1 || i < 0){ // if in stripe mode we should have traversed past the left edge, but not past the bottom
@@ -428,42 +734,40 @@ void updateCentroid(T *seq, T *centroidElementSums, unsigned int *nElementsForMe
  * @param C a gpu-side centroid sequence array
  *
  * @param updatedMean a cpu-side location for the result of the DBAUpdate to the centroid sequence
+ *
+ * @param sequence_weights optional (managed memory) number of times each sequence counts in the average, 1 for all if not given
+ *
+ * @param workspace optional buffers kept between calls (e.g. the rounds of convergeCentroid()), otherwise they only last for this call
+ *
+ * @param path_writer optional destination for each sequence's DTW path to the centroid
  */
 template<typename T>
 __host__ double 
-DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end, T *updatedMean, std::string output_prefix, cudaStream_t stream) {
+DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end, T *updatedMean, std::string output_prefix, cudaStream_t stream, const unsigned int *sequence_weights = 0,
+          dba_workspace<T> *workspace = 0, dtw_path_writer<T> *path_writer = 0) {
+	dba_workspace<T> call_workspace;
+	if(!workspace){
+		workspace = &call_workspace;
+	}
+	workspace->setup();
+	workspace->reserveCentroid(centerLength);
 
-	T *gpu_centroidAlignmentSums;
 	// cudaSetDevice(#); not strictly necessary here since all the consensus variables are managed memory, which in the unified memory model are accessible across all devices
 	// we do require compute capability 6.0+ so that atomicAdd "system" flavor works across devices
-	cudaMallocManaged(&gpu_centroidAlignmentSums, sizeof(T)*centerLength); CUERR("Allocating GPU memory for barycenter update sequence element sums");
+	T *gpu_centroidAlignmentSums = workspace->gpu_centroidAlignmentSums;
 	cudaMemset(gpu_centroidAlignmentSums, 0, sizeof(T)*centerLength); CUERR("Initialzing GPU memory for barycenter update sequence element sums to zero");
 	
-	T *cpu_centroid;
-        cudaMallocHost(&cpu_centroid, sizeof(T)*centerLength); CUERR("Allocating CPU memory for incoming centroid");
+	T *cpu_centroid = workspace->cpu_centroid;
 	cudaMemcpy(cpu_centroid, C, sizeof(T)*centerLength, cudaMemcpyDeviceToHost); CUERR("Copying incoming GPU centroid to CPU");
 
-	int deviceCount;
-        cudaGetDeviceCount(&deviceCount); CUERR("Getting GPU device count in DBA update function");
-#if DEBUG == 1
-	// Device parallelism is not compatible with debug printing of intermediate path cost matrix columns
-	deviceCount = 1;
-#endif
+	int deviceCount = workspace->deviceCount;
 	// TODO: parallelize within devices
-        unsigned int *maxThreads = getMaxThreadsPerDevice(deviceCount);
-	// For testing purposes, see if 1024 is faster than maxThreads
-        for(int i = 0; i < deviceCount; i++){
-                maxThreads[i] = 1024;
-        }
+        unsigned int *maxThreads = workspace->maxThreads;
 
-	unsigned int *nElementsForMean, *cpu_nElementsForMean; // Using unsigned int rather than size_t so we can use CUDA atomic operations on their GPU counterparts.
-	cudaMallocManaged(&nElementsForMean, sizeof(unsigned int)*centerLength); CUERR("Allocating GPU memory for barycenter update sequence pileup");
+	// Using unsigned int rather than size_t so we can use CUDA atomic operations on their GPU counterparts.
+	unsigned int *nElementsForMean = workspace->nElementsForMean;
+	unsigned int *cpu_nElementsForMean = workspace->cpu_nElementsForMean;
 	cudaMemset(nElementsForMean, 0, sizeof(unsigned int)*centerLength); CUERR("Initialzing GPU memory for barycenter update sequence pileup to zero");
-	cudaMallocHost(&cpu_nElementsForMean, sizeof(unsigned int)*centerLength); CUERR("Allocating CPU memory for barycenter sequence pileup");
-
-        int priority_high, priority_low, descendingPriority;
-        cudaDeviceGetStreamPriorityRange(&priority_low, &priority_high);
-        descendingPriority = priority_high;
 
         // Allocate space for the dtwCost to get to each point on the border between grid vertical swaths of the total cost matrix against the consensus C.
 	// Generate the path matrix though for each sequence relative to the centroid, and update the centroid means accordingly.
@@ -474,22 +778,21 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
         cudaStream_t seq_stream[deviceCount];
 	T **dtwCostSoFar = new T * [deviceCount](); // parentheses zero-initializes
         T **newDtwCostSoFar = new T * [deviceCount]();
+	bool freeCostBuffers[deviceCount]; // only the stripe mode ones, the full path mode ones belong to the workspace
 	int *gpu_backtrace_rows[deviceCount] = {}; // for consensus update: backtracking indicator of first (vertical) seq in the DTW cost matrix for use with stripe mode
        	size_t pathPitch[deviceCount];
        	unsigned char *pathMatrix[deviceCount] = {};
 	bool usingStripePath[deviceCount];
 	int cpu_backtrace_rows[deviceCount] = {}; // for printing DTW path: backtracking indicator of first (vertical) seq in the DTW cost matrix for use with stripe mode
-	std::ofstream **cpu_backtrace_outputstream = new std::ofstream *[deviceCount]; // for printing DTW path: defined outside print method so that we can print in multiple parts during stripe mode
-	unsigned char **cpu_stepMatrix = new unsigned char *[deviceCount]; // for client side copy of DTW path matrix that we're going to print
+	unsigned char **cpu_stepMatrix = new unsigned char *[deviceCount](); // for client side copy of DTW path matrix that we're going to print
+	T *cpu_seq[deviceCount]; // host copy of the sequence for the path writer
 	for(size_t seq_index = 0; seq_index < num_sequences; seq_index++){
                 int currDevice = seq_index%deviceCount;
                 cudaSetDevice(currDevice);
                 dim3 threadblockDim(maxThreads[currDevice], 1, 1);
                 current_seq_length[currDevice] = sequence_lengths[seq_index];
 
-                // We are allocating each time rather than just once at the start because if the sequences have a large
-                // range of lengths and we sort them from shortest to longest we will be allocating the minimum amount of
-                // memory necessary.
+                // The workspace's buffers grow with the sequences (sorted from shortest to longest), so only as much memory as the longest so far is held.
                 size_t pathMatrixSize = sizeof(unsigned char)*current_seq_length[currDevice]*centerLength;
                 size_t freeGPUMem;
                 size_t totalGPUMem;
@@ -499,18 +802,9 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 			flip_seq_order[currDevice] = 1;
 			dtwCostSoFarSize = sizeof(T)*centerLength;
 		}
-                // Make calls to DTWDistance serial within each seq, but allow multiple seqs on the GPU at once.
-                cudaStreamCreateWithPriority(&seq_stream[currDevice], cudaStreamNonBlocking, descendingPriority); CUERR("Creating prioritized CUDA stream");
-                if(descendingPriority < priority_low){
-                        descendingPriority++;
-                }
-
-		std::string path_filename = output_prefix+std::string(".path")+std::to_string(seq_index)+".txt";
-		cpu_backtrace_outputstream[currDevice] = new std::ofstream(path_filename);
-                if(! (*(cpu_backtrace_outputstream[currDevice])).is_open()){
-                        std::cerr << "Cannot write to " << path_filename << std::endl;
-                        return CANNOT_WRITE_DTW_PATH_MATRIX;
-                }
+                // Make calls to DTWDistance serial within each seq, but allow multiple seqs (one per device) on the GPU at once.
+                seq_stream[currDevice] = workspace->stream(currDevice);
+		workspace->devices[currDevice].path_runs.clear();
 	
 		// If there is insufficient GPU memory is available for the path matrix, switch to an alternative 'stripe' mode where instead of 
 		// storing all the path choices made, we don't store any during the forward pass through the cost calculations,
@@ -520,15 +814,16 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 		// e.g. 1/1024 x 4 bytes per float vs 1 byte per path element). This allows a 1M x 1M full (unbanded) DTW path calculation in ~4GB of GPU RAM
 		// rather than an impractical 1TB. This is much more efficient than using classic DTW full path matrix and managed memory where the intensive reads and writes across
 		// the CPU bus will slow us down considerably more than the 1.5x GPU-only compute cost.
+		if(path_writer){
+			cpu_seq[currDevice] = workspace->hostSequence(currDevice, sequences[seq_index], current_seq_length[currDevice]);
+		}
 		usingStripePath[currDevice] = false;
                 cudaMemGetInfo(&freeGPUMem, &totalGPUMem);
-                if(freeGPUMem < dtwCostSoFarSize+pathMatrixSize*1.05){ // assume pitching could add up to 5%
+                if(freeGPUMem+workspace->heldDeviceBytes(currDevice) < dtwCostSoFarSize+pathMatrixSize*1.05){ // assume pitching could add up to 5%
 			pathMatrixSize = 0;
 			usingStripePath[currDevice] = true;
-			// Set up the stripe vertical index once if we're in that mode
-			if(gpu_backtrace_rows[currDevice] == 0){
-				cudaMallocManaged(&gpu_backtrace_rows[currDevice], sizeof(int));  CUERR("Allocating a single int for striped GPU backtrace vertical index");
-			}
+			workspace->releaseDevice(currDevice);
+			gpu_backtrace_rows[currDevice] = workspace->backtraceRows(currDevice);
 			// We take up a lot more cost matrix space (X*Y/1024*4 for float) than normal mode (2*Y*4), but still less overall as we no longer allocate path matrix of (X*Y)
 			if(flip_seq_order[currDevice]){
 				int l = (int) centerLength;
@@ -553,24 +848,29 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 			// In the case of a truly massive path matrix or a tiny GPU memory pool, fall back gracefully to using the stripe mode with managed memory
 			// where bits will be loaded in and out of page locked CPU RAM to the GPU (at some cost to performance).
 			cudaMallocManaged(&dtwCostSoFar[currDevice], dtwCostSoFarSize);  CUERR("Allocating managed memory for DTW pairwise distance striped intermediate values in DBA update");
+			newDtwCostSoFar[currDevice] = 0;
+			freeCostBuffers[currDevice] = true;
 			// TODO: for now, we have only one process per device so not necessary, 
 			// but in future if multithreading per device use cudaStreamAttachMemAsync() to reduce memory access barriers.
 			pathMatrix[currDevice] = 0; // this will get populated later as a small matrix stripe for recalc and backtracking, after all the cost DTW calculations for this seq are done
 		}
 		else{ // "Normal" full path matrix calculation
-                	cudaMalloc(&dtwCostSoFar[currDevice], dtwCostSoFarSize);  CUERR("Allocating GPU memory for DTW pairwise distance intermediate values in DBA update");
-                	cudaMalloc(&newDtwCostSoFar[currDevice], dtwCostSoFarSize);  CUERR("Allocating GPU memory for new DTW pairwise distance intermediate values in DBA update");
 			// Under the assumption that long sequences have the same or more information than the centroid, flip the DTW comparison so the centroid has an open end.
 			// Otherwise you're cramming extra sequence data into the wrong spot and the DTW will give up and choose an all-up then all-open right path instead of a diagonal,
 			// which messes with the consensus building.
 			// Column major allocation x-axis is 2nd seq
 			// NB: skipping this potentially large memory allocation step if we're using striped mode
         		if(flip_seq_order[currDevice]){
-				cudaMallocPitch(&pathMatrix[currDevice], &pathPitch[currDevice], current_seq_length[currDevice], centerLength); CUERR("Allocating pitched GPU memory for centroid:sequence path matrix");
+				workspace->reserveFullPath(currDevice, dtwCostSoFarSize, current_seq_length[currDevice], centerLength);
 			}
 			else{
-				cudaMallocPitch(&pathMatrix[currDevice], &pathPitch[currDevice], centerLength, current_seq_length[currDevice]); CUERR("Allocating pitched GPU memory for sequence:centroid path matrix");
+				workspace->reserveFullPath(currDevice, dtwCostSoFarSize, centerLength, current_seq_length[currDevice]);
 			}
+			dtwCostSoFar[currDevice] = workspace->devices[currDevice].dtwCostSoFar;
+			newDtwCostSoFar[currDevice] = workspace->devices[currDevice].newDtwCostSoFar;
+			freeCostBuffers[currDevice] = false;
+			pathMatrix[currDevice] = workspace->devices[currDevice].pathMatrix;
+			pathPitch[currDevice] = workspace->devices[currDevice].pathPitch;
 		}
 
 		int dtw_x_limit = flip_seq_order[currDevice] ? current_seq_length[currDevice] : centerLength;
@@ -632,7 +932,8 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 		cost.close();
 #endif
 		if(!usingStripePath[currDevice]){
-			updateCentroid<<<1,1,0,seq_stream[currDevice]>>>(sequences[seq_index], gpu_centroidAlignmentSums, nElementsForMean, pathMatrix[currDevice], centerLength, current_seq_length[currDevice], pathPitch[currDevice], flip_seq_order[currDevice]);
+			updateCentroid<<<1,1,0,seq_stream[currDevice]>>>(sequences[seq_index], gpu_centroidAlignmentSums, nElementsForMean, pathMatrix[currDevice], centerLength, current_seq_length[currDevice], pathPitch[currDevice], flip_seq_order[currDevice],
+			                                                 0, (int *) 0, sequence_weights ? sequence_weights[seq_index] : 1);
 			CUERR("Launching kernel for centroid update");
 		}
 
@@ -732,7 +1033,8 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 					int pathRows = flip_seq_order[queuedDevice] ? j : centerLength;
 					updateCentroid<<<1,1,0,seq_stream[queuedDevice]>>>(sequences[seq_index-currDevice+queuedDevice], gpu_centroidAlignmentSums, nElementsForMean, pathMatrix[queuedDevice], 
 							pathColumns, pathRows,
-							pathPitch[queuedDevice], flip_seq_order[queuedDevice], offset_within_seq[queuedDevice], gpu_backtrace_rows[queuedDevice]);  CUERR("Launching centroid update using striped path");
+							pathPitch[queuedDevice], flip_seq_order[queuedDevice], offset_within_seq[queuedDevice], gpu_backtrace_rows[queuedDevice],
+							sequence_weights ? sequence_weights[seq_index-currDevice+queuedDevice] : 1);  CUERR("Launching centroid update using striped path");
 					j_completed[queuedDevice] = j;
 				}
 				for(int queuedDevice = 0; queuedDevice <= currDevice; queuedDevice++){ // Print the partial paths serially
@@ -752,12 +1054,9 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 #endif
 					
                         		// Note this stripe's steps for the traceback, before we reuse the pathMatrix buffer for the left-neighbouring stripe.
-					// Even if you don't want to print, you have to do this so that the next kernel launch of DTWDistance above has the updated value for cpu_backtrace_rows.
-					writeDTWPath(cpu_stepMatrix[queuedDevice], cpu_backtrace_outputstream[queuedDevice], sequences[seq_index-currDevice+queuedDevice], 
-					//writeDTWPath(pathMatrix[queuedDevice], cpu_backtrace_outputstream[queuedDevice], sequences[seq_index-currDevice+queuedDevice], 
-							sequence_names[seq_index-currDevice+queuedDevice], current_seq_length[queuedDevice], 
-							cpu_centroid, centerLength, j_completed[queuedDevice], 0, pathPitch[queuedDevice], flip_seq_order[queuedDevice], 
-							offset_within_seq[queuedDevice], &cpu_backtrace_rows[queuedDevice]);
+					// Even if you don't want the path, you have to do this so that the next kernel launch of DTWDistance above has the updated value for cpu_backtrace_rows.
+					dtwStripePathRunsCPU(cpu_stepMatrix[queuedDevice], j_completed[queuedDevice], pathPitch[queuedDevice], flip_seq_order[queuedDevice], 
+							offset_within_seq[queuedDevice], &cpu_backtrace_rows[queuedDevice], workspace->devices[queuedDevice].path_runs);
                 		}
 			} // end while(remaining_offsets_to_process)
 		} // end if(stripeCount)
@@ -765,50 +1064,47 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 		for(int queuedDevice = 0; queuedDevice <= currDevice; queuedDevice++){
 			cudaSetDevice(queuedDevice);
 			cudaStreamSynchronize(seq_stream[queuedDevice]);  CUERR("Synchronizing prioritized CUDA stream in device-parallel update of sequence-centroid path calculations");
-                	cudaFree(dtwCostSoFar[queuedDevice]); CUERR("Freeing DTW intermediate cost values in DBA cleanup");
-			dtwCostSoFar[queuedDevice] = 0;
-                	if(newDtwCostSoFar[queuedDevice] != 0){
-				cudaFree(newDtwCostSoFar[queuedDevice]); CUERR("Freeing new DTW intermediate cost values in DBA cleanup");
-				newDtwCostSoFar[queuedDevice] = 0;
+			if(freeCostBuffers[queuedDevice]){
+                		cudaFree(dtwCostSoFar[queuedDevice]); CUERR("Freeing DTW intermediate cost values in DBA cleanup");
 			}
-        		cudaStreamDestroy(seq_stream[queuedDevice]); CUERR("Removing a CUDA stream after completion of DBA cleanup");
+			dtwCostSoFar[queuedDevice] = 0;
+			newDtwCostSoFar[queuedDevice] = 0;
 
 			int num_columns = centerLength;
 			int num_rows = current_seq_length[queuedDevice];
 			if(flip_seq_order[queuedDevice]){int tmp = num_rows; num_rows = num_columns; num_columns = tmp;}
 		
-			if(!output_prefix.empty() && !usingStripePath[queuedDevice]){ // only works if you have the full path matrix available
-	        		if((cpu_stepMatrix[queuedDevice] = (unsigned char *) std::malloc(sizeof(unsigned char)*pathPitch[queuedDevice]*num_rows)) == 0){
-					std::cerr << "Cannot allocate standard CPU memory for full step matrix" << std::endl;
-					exit(CANNOT_ALLOCATE_HOST_FULL_STEP_MATRIX);
-				}
-        			cudaMemcpy(cpu_stepMatrix[queuedDevice], pathMatrix[queuedDevice], sizeof(unsigned char)*pathPitch[queuedDevice]*num_rows, cudaMemcpyDeviceToHost);  CUERR("Copying GPU to CPU memory for step matrix in DBA update");
+			std::vector<dtw_path_run> &path_runs = workspace->devices[queuedDevice].path_runs;
+			if(path_writer && !usingStripePath[queuedDevice]){ // the stripe mode path was already backtraced a stripe at a time above
+				unsigned char *fullStepMatrix = workspace->stepMatrix(queuedDevice, sizeof(unsigned char)*pathPitch[queuedDevice]*num_rows);
+        			cudaMemcpy(fullStepMatrix, pathMatrix[queuedDevice], sizeof(unsigned char)*pathPitch[queuedDevice]*num_rows, cudaMemcpyDeviceToHost);  CUERR("Copying GPU to CPU memory for step matrix in DBA update");
 
 #if DEBUG == 1
 				/* Start of debugging code, which saves the DTW path for each sequence vs. consensus. Requires C++11 compatibility. */
 				std::string step_filename = output_prefix+std::string("stepmatrix")+std::to_string(seq_index-currDevice+queuedDevice);
-				writeDTWPathMatrix<T>(cpu_stepMatrix[queuedDevice], step_filename.c_str(), num_columns, num_rows, pathPitch[queuedDevice]);
+				writeDTWPathMatrix<T>(fullStepMatrix, step_filename.c_str(), num_columns, num_rows, pathPitch[queuedDevice]);
 #endif
-		
-				writeDTWPath(cpu_stepMatrix[queuedDevice], cpu_backtrace_outputstream[queuedDevice], sequences[seq_index-currDevice+queuedDevice], 
-						sequence_names[seq_index-currDevice+queuedDevice], current_seq_length[queuedDevice], cpu_centroid, 
-						centerLength, num_columns, num_rows, pathPitch[queuedDevice], flip_seq_order[queuedDevice]);
 
+				dtwPathRunsCPU(fullStepMatrix, num_columns, num_rows, pathPitch[queuedDevice], flip_seq_order[queuedDevice], path_runs);
+			}
+			else if(usingStripePath[queuedDevice]){
+				std::reverse(path_runs.begin(), path_runs.end());
 			}
-			(*(cpu_backtrace_outputstream[queuedDevice])).close();
-			delete cpu_backtrace_outputstream[queuedDevice];
-			if(cpu_stepMatrix[queuedDevice]){
+			if(path_writer){
+				path_writer->write(seq_index-currDevice+queuedDevice, sequence_names[seq_index-currDevice+queuedDevice], cpu_seq[queuedDevice], 
+				                   current_seq_length[queuedDevice], path_runs);
+			}
+			if(cpu_stepMatrix[queuedDevice]){ // only allocated in striped mode
 				std::free(cpu_stepMatrix[queuedDevice]);
 				cpu_stepMatrix[queuedDevice] = 0;
 			}
-                	if(pathMatrix[queuedDevice] != 0){ // skip if using striped mode
+                	if(usingStripePath[queuedDevice] && pathMatrix[queuedDevice] != 0){ // the full path matrix belongs to the workspace
 				cudaFree(pathMatrix[queuedDevice]); CUERR("Freeing DTW path matrix in DBA cleanup");
-				pathMatrix[queuedDevice] = 0;
 			}
+			pathMatrix[queuedDevice] = 0;
 		}
 
         }
-	cudaFreeHost(maxThreads); CUERR("Freeing CPU memory for device thread properties");
 
 	// Everything generated in the device-specific streams should be synced when we get here, so this is perfunctory. 
 	// Multiple DBAs could be running on the same device and not interfere with each other at this step.
@@ -818,11 +1114,9 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 	cudaMemcpy(updatedMean, gpu_centroidAlignmentSums, sizeof(T)*centerLength, cudaMemcpyDeviceToHost); CUERR("Copying barycenter update sequence element sums from GPU to CPU");
 	cudaStreamSynchronize(stream);  CUERR("Synchronizing CUDA stream before computing centroid mean");
 	for (int t = 0; t < centerLength; t++) {
-		updatedMean[t] /= cpu_nElementsForMean[t];
+		// No sequence aligned to this position (possible in the open end modes, especially for a small mini-batch), so it stays where it was
+		updatedMean[t] = cpu_nElementsForMean[t] ? updatedMean[t]/cpu_nElementsForMean[t] : cpu_centroid[t];
 	}
-	cudaFree(gpu_centroidAlignmentSums); CUERR("Freeing GPU memory for the barycenter update sequence element sums");
-	cudaFree(nElementsForMean); CUERR("Freeing GPU memory for the barycenter update sequence pileup");
-	cudaFreeHost(cpu_nElementsForMean);  CUERR("Freeing CPU memory for the barycenter update sequence pileup");
 
 	// Calculate the difference between the old and new barycenter.
 	// Convergence is defined as when all points in the old and new differ by less than a 
@@ -834,19 +1128,217 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
 			max_delta = delta;
 		}
 	}
-	cudaFreeHost(cpu_centroid); CUERR("Freeing CPU memory for the incoming centroid");
-
 	delete[] dtwCostSoFar; // Play nice and clean up the dynamic heap allocations.
         delete[] newDtwCostSoFar;
         //delete[] gpu_backtrace_rows;
         //delete[] pathMatrix;
-        delete[] cpu_backtrace_outputstream;
         delete[] cpu_stepMatrix;
 
 	return max_delta;
 
 }
 
+/**
+ * Move the centroid in gpu_barycenter towards the cluster members' barycenter using DBA updates from random mini-batches of minibatch_size members, each round stepping
+ * a decaying fraction of the way to the mini-batch's update. This gets a big cluster's centroid most of the way to convergence for a fraction of the alignments,
+ * and convergeCentroid() then runs full-membership rounds from there so convergence is still judged against all the members.
+ */
+template<typename T>
+__host__ void
+approachCentroidStochastically(T *gpu_barycenter, size_t centerLength, T **cluster_sequences, char **cluster_sequence_names, size_t num_members, size_t *member_lengths, 
+                               int use_open_start, int use_open_end, size_t minibatch_size, int cluster, int num_clusters, std::string output_prefix, cudaStream_t stream,
+                               const unsigned int *member_weights, bool cpu_update, dba_workspace<T> *workspace = 0, cpu_thread_shares *cpu_threads = 0){
+	T **batch_sequences;
+	cudaMallocManaged(&batch_sequences, sizeof(T*)*minibatch_size); CUERR("Allocating GPU memory for array of mini-batch sequence pointers");
+	char **batch_sequence_names;
+	cudaMallocManaged(&batch_sequence_names, sizeof(char*)*minibatch_size); CUERR("Allocating GPU memory for array of mini-batch sequence name pointers");
+	size_t *batch_lengths;
+	cudaMallocManaged(&batch_lengths, sizeof(size_t)*minibatch_size); CUERR("Allocating GPU memory for array of mini-batch sequence lengths");
+	unsigned int *batch_weights = 0;
+	if(member_weights){
+		cudaMallocManaged(&batch_weights, sizeof(unsigned int)*minibatch_size); CUERR("Allocating GPU memory for array of mini-batch sequence weights");
+	}
+	T *centroid, *batch_barycenter;
+	cudaMallocHost(&centroid, sizeof(T)*centerLength); CUERR("Allocating CPU memory for mini-batch DBA centroid");
+	cudaMallocHost(&batch_barycenter, sizeof(T)*centerLength); CUERR("Allocating CPU memory for mini-batch DBA update result");
+	cudaMemcpy(centroid, gpu_barycenter, sizeof(T)*centerLength, cudaMemcpyDeviceToHost); CUERR("Copying initial centroid from GPU for mini-batch DBA");
+
+	std::vector<size_t> member_order(num_members);
+	for(size_t i = 0; i < num_members; i++){
+		member_order[i] = i;
+	}
+	std::mt19937_64 generator(cluster); // reproducible batches
+	size_t num_rounds = STOCHASTIC_DBA_EPOCHS*num_members/minibatch_size;
+	for(size_t round = 0; round < num_rounds; round++){
+		// A partial Fisher-Yates shuffle picks the batch without replacement
+		for(size_t b = 0; b < minibatch_size; b++){
+			size_t pick = b+generator()%(num_members-b);
+			std::swap(member_order[b], member_order[pick]);
+			batch_sequences[b] = cluster_sequences[member_order[b]];
+			batch_sequence_names[b] = cluster_sequence_names[member_order[b]];
+			batch_lengths[b] = member_lengths[member_order[b]];
+			if(batch_weights){
+				batch_weights[b] = member_weights[member_order[b]];
+			}
+		}
+		setupPercentageDisplay("Step 3 of 3 (mini-batch round " + std::to_string(round+1) +  " of max " + std::to_string(num_rounds) + 
+			       ") for cluster " + std::to_string(cluster+1) + "/" + std::to_string(num_clusters) + ": Approaching centroid");
+		if(cpu_update){
+			DBAUpdateCPU(gpu_barycenter, centerLength, batch_sequences, batch_sequence_names, minibatch_size, batch_lengths, use_open_start, use_open_end, 
+			             batch_barycenter, (dtw_path_writer<T> *) 0, batch_weights, (incremental_dba_state<T> *) 0, cpu_threads ? cpu_threads->share(cluster) : 0);
+		}
+		else{
+			DBAUpdate(gpu_barycenter, centerLength, batch_sequences, batch_sequence_names, minibatch_size, batch_lengths, use_open_start, use_open_end, 
+			          batch_barycenter, CONCAT3(output_prefix, ".", std::to_string(cluster)), stream, batch_weights, workspace);
+		}
+		teardownPercentageDisplay();
+		double step_size = 1.0/(1.0+round*STOCHASTIC_DBA_STEP_DECAY);
+		double max_step = 0;
+		// Elements no mini-batch member aligned to (possible in the open end modes) come back unchanged from the update, so they don't step
+		for(size_t t = 0; t < centerLength; t++){
+			T stepped = (T) (centroid[t]+step_size*(batch_barycenter[t]-centroid[t]));
+			double step = std::abs((double) stepped-(double) centroid[t]);
+			if(step > max_step){
+				max_step = step;
+			}
+			centroid[t] = stepped;
+		}
+		std::cerr << "Mini-batch step of size " << step_size << " moved the centroid by up to " << max_step << std::endl;
+		writeCentroidCheckpointToFile(CONCAT4(output_prefix, ".", std::to_string(cluster), ".evolving_centroid.txt").c_str(), centroid, centerLength);
+		cudaMemcpy(gpu_barycenter, centroid, sizeof(T)*centerLength, cudaMemcpyHostToDevice);  CUERR("Copying mini-batch updated DBA centroid to GPU");
+		if(max_step < STOCHASTIC_DBA_MIN_STEP){
+			break;
+		}
+	}
+
+	cudaFree(batch_sequences); CUERR("Freeing GPU memory for array of mini-batch sequence pointers");
+	cudaFree(batch_sequence_names); CUERR("Freeing GPU memory for array of mini-batch sequence name pointers");
+	cudaFree(batch_lengths); CUERR("Freeing GPU memory for array of mini-batch sequence lengths");
+	if(batch_weights){
+		cudaFree(batch_weights); CUERR("Freeing GPU memory for array of mini-batch sequence weights");
+	}
+	cudaFreeHost(centroid); CUERR("Freeing CPU memory for mini-batch DBA centroid");
+	cudaFreeHost(batch_barycenter); CUERR("Freeing CPU memory for mini-batch DBA update result");
+}
+
+/**
+ * Iterate DBA updates of the centroid (starting from whatever gpu_barycenter holds) against the cluster's member sequences until it stops changing,
+ * leaving the converged centroid in new_barycenter. The evolving centroid is checkpointed to <output_prefix>.<cluster>.evolving_centroid.txt after each round.
+ * If member_weights are given, each member counts that many times in the average. With cpu_update, the updates are done by DBAUpdateCPU() instead of on the GPUs,
+ * incrementally from the second round on (only the part of each alignment that the last centroid change could affect is redone), using all the CPU threads, or this 
+ * cluster's share of them in cpu_threads each round if other clusters are converging at the same time.
+ * If minibatch_size is non-zero and the cluster has more than twice that many members, mini-batch rounds (see approachCentroidStochastically()) come first.
+ * The DTW paths of the last round are kept in <output_prefix>.<cluster>.paths.bin, and those of any (1-based) path_rounds in <output_prefix>.<cluster>.round<N>.paths.bin
+ * (see dtw_path_writer.hpp). Only those rounds backtrace and write their paths. Since a round is only known to be the last once it's done, the last round's paths come 
+ * from aligning the members to its starting centroid once more afterwards (nearly free with cpu_update, as none of the alignments need redoing), unless it was one of the path_rounds.
+ */
+template<typename T>
+__host__ void
+convergeCentroid(T *gpu_barycenter, size_t centerLength, T **cluster_sequences, char **cluster_sequence_names, size_t num_members, size_t *member_lengths, 
+                 int use_open_start, int use_open_end, T *new_barycenter, int cluster, int num_clusters, std::string output_prefix, cudaStream_t stream, const unsigned int *member_weights = 0,
+                 bool cpu_update = false, int minibatch_size = 0, const std::vector<int> &path_rounds = std::vector<int>(), cpu_thread_shares *cpu_threads = 0){
+	T *previous_barycenter, *two_previous_barycenter;
+	if(use_open_start || use_open_end){
+		cudaMallocHost(&previous_barycenter, sizeof(T)*centerLength); CUERR("Allocating CPU memory for previous DBA update result");
+		cudaMallocHost(&two_previous_barycenter, sizeof(T)*centerLength); CUERR("Allocating CPU memory for two-back DBA update result");
+	}
+#if DEBUG == 1
+	int maxRounds = 1;
+#else
+	int maxRounds = 250; 
+#endif
+	cudaSetDevice(0);
+	// So the GPU update rounds reuse the buffers of the ones before
+	dba_workspace<T> workspace;
+	if(minibatch_size > 0 && num_members > 2*(size_t) minibatch_size){
+		approachCentroidStochastically(gpu_barycenter, centerLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
+		                               (size_t) minibatch_size, cluster, num_clusters, output_prefix, stream, member_weights, cpu_update, &workspace, cpu_threads);
+	}
+	incremental_dba_state<T> incremental_state;
+	std::string cluster_prefix = CONCAT3(output_prefix, ".", std::to_string(cluster));
+	// One background writer for all the path files of this cluster
+	dtw_path_writer<T> path_file_writer;
+	std::vector<T> round_centroid(output_prefix.empty() ? 0 : centerLength);
+	int last_round = 0;
+	bool last_round_paths_written = false;
+	for (int i = 0; i < maxRounds; i++) {
+		setupPercentageDisplay("Step 3 of 3 (round " + std::to_string(i+1) +  " of max " + std::to_string(maxRounds) + 
+			       " to achieve delta 0) for cluster " + std::to_string(cluster+1) + "/" + std::to_string(num_clusters) + ": Converging centroid");
+		last_round = i+1;
+		dtw_path_writer<T> *path_writer = 0;
+		if(!output_prefix.empty()){
+			cudaMemcpy(round_centroid.data(), gpu_barycenter, sizeof(T)*centerLength, cudaMemcpyDeviceToHost); CUERR("Copying DBA round's centroid from GPU");
+			last_round_paths_written = std::find(path_rounds.begin(), path_rounds.end(), last_round) != path_rounds.end();
+			if(last_round_paths_written){
+				path_file_writer.open(cluster_prefix+".round"+std::to_string(last_round)+".paths.bin", round_centroid.data(), centerLength);
+				path_writer = &path_file_writer;
+			}
+		}
+		double delta = cpu_update ? 
+		               DBAUpdateCPU(gpu_barycenter, centerLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
+				            new_barycenter, path_writer, member_weights, &incremental_state, cpu_threads ? cpu_threads->share(cluster) : 0) :
+		               DBAUpdate(gpu_barycenter, centerLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
+				         new_barycenter, cluster_prefix, stream, member_weights, &workspace, path_writer);
+		if(path_writer){
+			path_writer->close(); // waits for the last of the round's paths to be written
+		}
+		teardownPercentageDisplay();
+		if(cpu_update && i > 0){
+			std::cerr << "Skipped full realignment of " << incremental_state.num_resumed_alignments << "/" << num_members << " sequences (calculated " 
+			          << (100.0*incremental_state.num_calculated_cells/incremental_state.num_total_cells) << "% of DTW matrix cells)" << std::endl;
+		}
+		std::cerr << "New delta for cluster " << (cluster+1) << "/" << num_clusters << " is " << delta << std::endl;
+		if(delta == 0){
+			break; // converged!
+		}
+		// In open end mode (unlike global), it's possible for the centroid to flip between two nearly identical
+		// centroids in perpetuity, so never really "converging". Handle this case with a shortcircuit.
+		if(use_open_start || use_open_end){
+			if(i >= 1 && !memcmp(new_barycenter, two_previous_barycenter, sizeof(T)*centerLength)){
+				std::cerr << "Detected a flip-flop between two alternative converged centroids (should happen only in open end mode), keeping the first one calculated" << std::endl;
+				break;
+			}
+			if(i > 1){
+				cudaMemcpy(two_previous_barycenter, previous_barycenter, centerLength*sizeof(T), cudaMemcpyHostToHost); CUERR("Replacing two-back updated DBA medoid on host");
+			}
+			if(i > 0){
+				cudaMemcpy(previous_barycenter, new_barycenter, centerLength*sizeof(T), cudaMemcpyHostToHost); CUERR("Replacing previously updated DBA medoid on host");
+			}
+		}
+		writeCentroidCheckpointToFile(CONCAT4(output_prefix, ".", std::to_string(cluster), ".evolving_centroid.txt").c_str(), new_barycenter, centerLength);
+		cudaMemcpy(gpu_barycenter, new_barycenter, sizeof(T)*centerLength, cudaMemcpyHostToDevice);  CUERR("Copying updated DBA medoid to GPU");
+	}
+	if(last_round_paths_written){
+		keepDTWPathFile(cluster_prefix+".round"+std::to_string(last_round)+".paths.bin", cluster_prefix+".paths.bin", true);
+	}
+	else if(last_round && !output_prefix.empty()){
+		// The last round's starting centroid (the loop may have moved the GPU copy on to its result)
+		cudaMemcpy(gpu_barycenter, round_centroid.data(), sizeof(T)*centerLength, cudaMemcpyHostToDevice);  CUERR("Copying last round's DBA centroid to GPU for its DTW paths");
+		T *path_barycenter;
+		cudaMallocHost(&path_barycenter, sizeof(T)*centerLength); CUERR("Allocating CPU memory for DTW path round's DBA update result");
+		std::string path_file_name = cluster_prefix+".paths.bin.tmp";
+		path_file_writer.open(path_file_name, round_centroid.data(), centerLength);
+		setupPercentageDisplay("Step 3 of 3 (DTW paths of round " + std::to_string(last_round) + ") for cluster " + std::to_string(cluster+1) + "/" + std::to_string(num_clusters) + 
+		                       ": Writing DTW paths");
+		if(cpu_update){
+			DBAUpdateCPU(gpu_barycenter, centerLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
+			             path_barycenter, &path_file_writer, member_weights, &incremental_state, cpu_threads ? cpu_threads->share(cluster) : 0);
+		}
+		else{
+			DBAUpdate(gpu_barycenter, centerLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
+			          path_barycenter, cluster_prefix, stream, member_weights, &workspace, &path_file_writer);
+		}
+		teardownPercentageDisplay();
+		path_file_writer.close();
+		keepDTWPathFile(path_file_name, cluster_prefix+".paths.bin", false);
+		cudaFreeHost(path_barycenter); CUERR("Freeing CPU memory for DTW path round's DBA update result");
+	}
+	if(use_open_start || use_open_end){
+		cudaFreeHost(previous_barycenter); CUERR("Allocating CPU memory for previous DBA update result");
+		cudaFreeHost(two_previous_barycenter); CUERR("Allocating CPU memory for two back DBA update result");
+	}
+}
+
 /**
  * Performs the DBA averaging by first finding the median over a sample,
  * then doing iterations of the update until  the convergence condition is met.
@@ -859,9 +1351,11 @@ DBAUpdate(T *C, size_t centerLength, T **sequences, char **sequence_names, size_
  *                the length of each member of the ragged array
  * @param algo_mode
  * 		  CLUSTER_ONLY, CONSENSUS_ONLY, or CLUSTER_AND_CONSENSUS
+ * @param sequence_weights
+ *                optional number of times each sequence counts in its cluster's consensus (sorted along with the sequences)
  */
 template <typename T>
-__host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end, char *output_prefix, int norm_sequences, double cdist, char** series_file_names, int num_series, int read_mode, bool is_segmented, int algo_mode, cudaStream_t stream=0) {
+__host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end, char *output_prefix, int norm_sequences, double cdist, char** series_file_names, int num_series, int read_mode, bool is_segmented, int algo_mode, const dba_options &options=dba_options(), cudaStream_t stream=0, unsigned int *sequence_weights=0) {
 
 	//std::cerr << "Seq lengths" << std::endl;
 	// Sanitize the data from potential upstream artifacts or overflow situations
@@ -880,6 +1374,10 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
 		exit(MEMCPY_FAILURE);
 	}
 	thrust::sort_by_key(sequence_lengths_copy, sequence_lengths_copy + num_sequences, sequences); CUERR("Sorting sequences by length");
+	if(sequence_weights){
+		memcpy(sequence_lengths_copy, sequence_lengths, sizeof(size_t)*num_sequences);
+		thrust::sort_by_key(sequence_lengths_copy, sequence_lengths_copy + num_sequences, sequence_weights); CUERR("Sorting sequence weights by length");
+	}
 	thrust::sort_by_key(sequence_lengths, sequence_lengths + num_sequences, sequence_names); CUERR("Sorting sequence names by length");
 	cudaFreeHost(sequence_lengths_copy); CUERR("Freeing CPU memory for sortable copy of sequence lengths");
 	size_t maxLength = sequence_lengths[num_sequences-1];
@@ -925,8 +1423,21 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
 		cudaStreamSynchronize(stream); CUERR("Synchronizing the CUDA stream after sequences' copy to GPU");
         	// Pick a seed sequence from the original input, with the smallest L2 norm (residual sum of squares).
 		setupPercentageDisplay(CONCAT2("Step 2 of 3: Finding initial ",(cdist != 1 ? "clusters and medoids" : "medoid")));
-		medoidIndices = approximateMedoidIndices(gpu_sequences, maxLength, num_sequences, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, 
-	 		                                 &cdist, sequences_membership, stream);
+		// The distance matrix storage type is independent of the sequence value type
+		if(options.distance_precision == DISTANCE_PRECISION_HALF){
+			medoidIndices = approximateMedoidIndices<T,__half>(gpu_sequences, maxLength, num_sequences, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, 
+			                                                   &cdist, sequences_membership, options, stream);
+		}
+#if BFLOAT16_SUPPORTED == 1
+		else if(options.distance_precision == DISTANCE_PRECISION_BFLOAT16){
+			medoidIndices = approximateMedoidIndices<T,__nv_bfloat16>(gpu_sequences, maxLength, num_sequences, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, 
+			                                                          &cdist, sequences_membership, options, stream);
+		}
+#endif
+		else{
+			medoidIndices = approximateMedoidIndices<T,float>(gpu_sequences, maxLength, num_sequences, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, 
+			                                                  &cdist, sequences_membership, options, stream);
+		}
 		cudaFree(gpu_sequences); CUERR("Freeing CPU memory for GPU sequence data");
 	}
 	else if(algo_mode == CONSENSUS_ONLY){
@@ -939,6 +1450,11 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
                 exit(UNKNOWN_ALGO);
 	}
 	teardownPercentageDisplay();	
+	// A shard of a distributed all-vs-all only writes its partial distance matrix, clustering happens in the merge step.
+	if(options.num_shards){
+		delete[] sequences_membership;
+		return;
+	}
 	// Don't need the full complement of evenly space sequences again.
 
 	int num_clusters = 1;
@@ -949,18 +1465,24 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
         }
 	// No need to rewrite the (unchanged) membership file if we're in CONSENSUS_ONLY mode
 	if(cdist != 1 && algo_mode != CONSENSUS_ONLY){ // in cluster mode
-		std::ofstream membership_file(CONCAT2(output_prefix, ".cluster_membership.txt").c_str());
-        	if(!membership_file.is_open()){
-                	std::cerr << "Cannot open sequence cluster membership file " << CONCAT2(output_prefix, ".cluster_membership.txt").c_str() << " for writing" << std::endl;
-                	exit(CANNOT_WRITE_MEMBERSHIP);
-        	}
-		membership_file << "## cluster distance threshold was " << cdist << std::endl;
-
-		for (int i = 0; i < num_sequences; i++) {
-			membership_file << sequence_names[i] << "\t" << sequences_membership[i] << "\t" << sequence_names[medoidIndices[sequences_membership[i]]] << std::endl;
+		writeClusterMembership(CONCAT2(output_prefix, ".cluster_membership.txt").c_str(), cdist, sequence_names, num_sequences, sequences_membership, medoidIndices);
+		// Same order of precedence as the clustering strategies in approximateMedoidIndices()
+		std::cerr << "Found " << num_clusters << " clusters using ";
+		if(options.knn_neighbours){
+			std::cerr << "the mutual " << options.knn_neighbours << " nearest neighbours graph and cluster distance cutoff " << cdist << std::endl;
+		}
+		else if(options.num_landmarks){
+			std::cerr << "K-means over " << options.num_landmarks << " landmark sequences with K=" << (int) cdist << std::endl;
+		}
+		else if(options.k_medoids && cdist > 1){
+			std::cerr << "K-medoids with K=" << (int) cdist << std::endl;
+		}
+		else if(cdist < 0){
+			std::cerr << "permutation test supported complete linkage with p-value threshold " << -cdist << std::endl;
+		}
+		else{
+			std::cerr << "complete linkage and cluster distance cutoff " << cdist << std::endl;
 		}
-		membership_file.close();
-		std::cerr << "Found " << num_clusters << " clusters using complete linkage and cluster distance cutoff " << cdist << std::endl;
 	}
 	// See if the caller's request was for just membership and act accordingly.
 	if(algo_mode == CLUSTER_ONLY){
@@ -990,14 +1512,43 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
                 exit(CANNOT_WRITE_DBA_AVG);
         }
 
-
-	for(;currCluster < num_clusters; currCluster++){
-		int num_members = 0;
-		for (int i = 0; i < num_sequences; i++) {
-                	if(sequences_membership[i] == currCluster){
-                       		num_members++;
-			}
-                }
+	// Z-normalized copies of the converged centroids, kept if the memberships are going to be refined by reassignment to the nearest centroid.
+	std::vector<std::vector<T> > converged_centroids(options.reassignment_rounds ? num_clusters : 0);
+	// Clusters converge independently, so with the CPU updates they're scheduled largest first across a pool of threads (small clusters fill in the cores a big one
+	// leaves idle, each cluster keeping its own evolving centroid checkpoint). The GPU updates size their buffers to the free GPU memory, so they go one cluster at a time.
+	// Either way the averages are written in cluster order, each as soon as all the clusters before it are done, so the file is still a valid checkpoint.
+	std::vector<int> cluster_sizes(num_clusters, 0);
+	for (int i = 0; i < num_sequences; i++) {
+		if(sequences_membership[i] >= 0 && sequences_membership[i] < num_clusters){
+			cluster_sizes[sequences_membership[i]]++;
+		}
+	}
+	std::vector<int> cluster_schedule;
+	for(int c = currCluster; c < num_clusters; c++){
+		cluster_schedule.push_back(c);
+	}
+	int num_concurrent_clusters = options.cpu_dba_update && cluster_schedule.size() > 1 ? (int) std::min((size_t) getNumCPUThreads(), cluster_schedule.size()) : 1;
+	// The concurrent clusters' updates share the cores rather than each starting a thread per core (and a path matrix buffer per thread). Each round a cluster 
+	// gets threads in proportion to its size amongst those still running, so the big clusters that set the wall time pick up the threads of the small ones as they finish.
+	cpu_thread_shares cluster_thread_shares;
+	if(num_concurrent_clusters > 1){
+		std::stable_sort(cluster_schedule.begin(), cluster_schedule.end(), [&](int a, int b){ return cluster_sizes[a] > cluster_sizes[b]; });
+		// So the first clusters to start don't each take all the threads for their first round before the others have joined
+		for(int i = 0; i < num_concurrent_clusters; i++){
+			cluster_thread_shares.start(cluster_schedule[i], cluster_sizes[cluster_schedule[i]]);
+		}
+		// Interleaved progress bars from concurrent clusters would be unreadable
+		percentageDisplayMuted = true;
+	}
+	std::vector<std::vector<T> > cluster_averages(num_clusters);
+	std::vector<char> cluster_done(num_clusters, 0);
+	int next_cluster_to_write = currCluster;
+	std::mutex avgs_file_mutex;
+	parallelFor(cluster_schedule.size(), [&](size_t schedule_index, int thread_index){
+		int currCluster = cluster_schedule[schedule_index];
+		int num_members = cluster_sizes[currCluster];
+		cluster_thread_shares.start(currCluster, num_members);
+		std::vector<T> &average = cluster_averages[currCluster];
 
         	size_t medoidLength = sequence_lengths[medoidIndices[currCluster]];
 		// Special case is when a cluster contains only one sequence, where we don't need to do anythiong except output the sequence as is.
@@ -1007,14 +1558,14 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
 #if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1
 			cudaMallocHost(&(avgSequences[currCluster]), sizeof(short)*medoidLength);		 CUERR("Allocating GPU memory for single average sequence");
 #endif	
-			avgs_file << sequence_names[medoidIndices[currCluster]];
 			T *seq = sequences[medoidIndices[currCluster]];
+			average.resize(medoidLength);
 			if(norm_sequences) {
                         	/* Rescale to ~original range (may have some floating point precision loss). */
                         	double seqAvg = sequence_means[medoidIndices[currCluster]];
                         	double seqStdDev = sequence_sigmas[medoidIndices[currCluster]];
         			for (size_t i = 0; i < medoidLength; ++i) { 
-                                        avgs_file << "\t" << ((T) (seqAvg+seq[i]*seqStdDev));
+                                        average[i] = (T) (seqAvg+seq[i]*seqStdDev);
 #if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1				
 					avgSequences[currCluster][i] = (short)(seqAvg+seq[i]*seqStdDev);
 #endif				
@@ -1022,129 +1573,231 @@ __host__ void performDBA(T **sequences, int num_sequences, size_t *sequence_leng
 			}
 			else{
 				for (size_t i = 0; i < medoidLength; ++i) {
-                                        avgs_file << "\t" << seq[i];
+                                        average[i] = seq[i];
 #if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1			
 					avgSequences[currCluster][i] = (short)(seq[i]);
 #endif				
 				}
 			}
-			avgs_file << std::endl;
-			avgs_file.flush(); // for checkpointing
-			
 #if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1
 			// Populate average buffers for writing fast5 output
 			avgNames[currCluster] = sequence_names[medoidIndices[currCluster]];
 			avgSeqLengths[currCluster] = medoidLength;
 #endif
-			
-			continue;
+			if(options.reassignment_rounds){
+				converged_centroids[currCluster].assign(seq, seq+medoidLength);
+			}
 		}
+		else{
+			T *gpu_barycenter = 0;
+			cudaMallocManaged(&gpu_barycenter, sizeof(T)*medoidLength); CUERR("Allocating managed GPU memory for DBA result");
+			// See if a partially-converged centroid already exists for this cluster (i.e. we should be picking up from a checkpoint)
+			if(!readCentroidCheckpointFromFile(CONCAT4(output_prefix, ".", std::to_string(currCluster), ".evolving_centroid.txt").c_str(), gpu_barycenter, medoidLength)){
+	        		cudaMemcpyAsync(gpu_barycenter, sequences[medoidIndices[currCluster]], medoidLength*sizeof(T), cudaMemcpyDeviceToDevice, stream);  CUERR("Launching async copy of medoid seed to GPU memory");
+			}
 
-		T *gpu_barycenter = 0;
-		cudaMallocManaged(&gpu_barycenter, sizeof(T)*medoidLength); CUERR("Allocating managed GPU memory for DBA result");
-		// See if a partially-converged centroid already exists for this cluster (i.e. we should be picking up from a checkpoint)
-		if(!readCentroidCheckpointFromFile(CONCAT4(output_prefix, ".", std::to_string(currCluster), ".evolving_centroid.txt").c_str(), gpu_barycenter, medoidLength)){
-        		cudaMemcpyAsync(gpu_barycenter, sequences[medoidIndices[currCluster]], medoidLength*sizeof(T), cudaMemcpyDeviceToDevice, stream);  CUERR("Launching async copy of medoid seed to GPU memory");
-		}
+	        	// Refine the alignment iteratively.
+			T *new_barycenter = 0;
+			cudaMallocHost(&new_barycenter, sizeof(T)*medoidLength); CUERR("Allocating CPU memory for DBA update result");
+
+			std::cerr << "Processing cluster " << (currCluster+1) << " of " << num_clusters << ", " << 
+				  num_members << " members, medoid " << sequence_names[medoidIndices[currCluster]] << " has length " << medoidLength << std::endl;
+			// Allocate storage for an array of pointers to just the sequences from this cluster, so we generate averages for each cluster independently
+			T **cluster_sequences;
+			cudaMallocManaged(&cluster_sequences, sizeof(T**)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence pointers");
+			char **cluster_sequence_names;
+			cudaMallocManaged(&cluster_sequence_names, sizeof(char**)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence name pointers");
+			size_t *member_lengths;
+			cudaMallocManaged(&member_lengths, sizeof(T*)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence pointers");
+			unsigned int *member_weights = 0;
+			if(sequence_weights){
+				cudaMallocManaged(&member_weights, sizeof(unsigned int)*num_members); CUERR("Allocating GPU memory for array of cluster member weights");
+			}
 
-        	// Refine the alignment iteratively.
-		T *new_barycenter = 0, *previous_barycenter, *two_previous_barycenter;
-		cudaMallocHost(&new_barycenter, sizeof(T)*medoidLength); CUERR("Allocating CPU memory for DBA update result");
-		if(use_open_start || use_open_end){
-			cudaMallocHost(&previous_barycenter, sizeof(T)*medoidLength); CUERR("Allocating CPU memory for previous DBA update result");
-			cudaMallocHost(&two_previous_barycenter, sizeof(T)*medoidLength); CUERR("Allocating CPU memory for two-back DBA update result");
-		}
+			num_members = 0;
+			for (int i = 0; i < num_sequences; i++) {
+	                        if(sequences_membership[i] == currCluster){
+					cluster_sequences[num_members] = sequences[i];
+					cluster_sequence_names[num_members] = sequence_names[i];
+					member_lengths[num_members] = sequence_lengths[i];
+					if(member_weights){
+						member_weights[num_members] = sequence_weights[i];
+					}
+	                                num_members++;
+	                        }
+	                }
+
+			convergeCentroid(gpu_barycenter, medoidLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, new_barycenter, 
+			                 currCluster, num_clusters, output_prefix, stream, member_weights, options.cpu_dba_update, options.minibatch_size, options.path_rounds, 
+			                 num_concurrent_clusters > 1 ? &cluster_thread_shares : (cpu_thread_shares *) 0);
+			if(options.reassignment_rounds){
+				converged_centroids[currCluster].assign(new_barycenter, new_barycenter+medoidLength);
+			}
+			// Clean up the GPU memory we don't need any more.
+			cudaFree(cluster_sequences); CUERR("Freeing GPU memory for array of cluster member sequence pointers");
+			cudaFree(cluster_sequence_names); CUERR("Freeing GPU memory for array of cluster member sequence name pointers");
+			cudaFree(member_lengths); CUERR("Freeing GPU memory for array of cluster member lengths");
+			if(member_weights){
+				cudaFree(member_weights); CUERR("Freeing GPU memory for array of cluster member weights");
+			}
+			cudaFree(gpu_barycenter); CUERR("Freeing GPU memory for barycenter");
 
-		std::cerr << "Processing cluster " << (currCluster+1) << " of " << num_clusters << ", " << 
-			  num_members << " members, medoid " << sequence_names[medoidIndices[currCluster]] << " has length " << medoidLength << std::endl;
-		// Allocate storage for an array of pointers to just the sequences from this cluster, so we generate averages for each cluster independently
-		T **cluster_sequences;
-		cudaMallocManaged(&cluster_sequences, sizeof(T**)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence pointers");
-		char **cluster_sequence_names;
-		cudaMallocManaged(&cluster_sequence_names, sizeof(char**)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence name pointers");
-		size_t *member_lengths;
-		cudaMallocManaged(&member_lengths, sizeof(T*)*num_members); CUERR("Allocating GPU memory for array of cluster member sequence pointers");
+			if(norm_sequences) {
+				/* Rescale the average to the centroid's value range. */
+				double medoidAvg = sequence_means[medoidIndices[currCluster]];
+	 			double medoidStdDev = sequence_sigmas[medoidIndices[currCluster]];
+				//std::cout << "Rescaling centroid to medoid's mean and std dev: " << medoidAvg << ", " << medoidStdDev << std::endl;
+				for(int i = 0; i < medoidLength; i++){
+					new_barycenter[i] = (T) (medoidAvg+new_barycenter[i]*medoidStdDev);
+				}
+			}
+			average.assign(new_barycenter, new_barycenter+medoidLength);
+		
+#if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1
+			// Populate medoid buffers for writing fast5 output
+			avgNames[currCluster] = sequence_names[medoidIndices[currCluster]];
+			avgSeqLengths[currCluster] = medoidLength;
+			avgSequences[currCluster] = templateToShort(new_barycenter, avgSeqLengths[currCluster]);
+#endif
+		
+			cudaFreeHost(new_barycenter); CUERR("Allocating CPU memory for DBA update result");
+		}
 
-		num_members = 0;
-		for (int i = 0; i < num_sequences; i++) {
-                        if(sequences_membership[i] == currCluster){
-				cluster_sequences[num_members] = sequences[i];
-				cluster_sequence_names[num_members] = sequence_names[i];
-				member_lengths[num_members] = sequence_lengths[i];
-                                num_members++;
-                        }
-                }
+		cluster_thread_shares.finish(currCluster);
 
-#if DEBUG == 1
-		int maxRounds = 1;
-#else
-		int maxRounds = 250; 
-#endif
-		cudaSetDevice(0);
-		for (int i = 0; i < maxRounds; i++) {
-			setupPercentageDisplay("Step 3 of 3 (round " + std::to_string(i+1) +  " of max " + std::to_string(maxRounds) + 
-				       " to achieve delta 0) for cluster " + std::to_string(currCluster+1) + "/" + std::to_string(num_clusters) + ": Converging centroid");
-			double delta = DBAUpdate(gpu_barycenter, medoidLength, cluster_sequences, cluster_sequence_names, num_members, member_lengths, use_open_start, use_open_end, 
-					         new_barycenter, CONCAT3(output_prefix, ".", std::to_string(currCluster)), stream);
-			teardownPercentageDisplay();
-			std::cerr << "New delta is " << delta << std::endl;
-			if(delta == 0){
-				break; // converged!
+		// Ordered output stage: write out whichever averages are now next in cluster order
+		std::lock_guard<std::mutex> avgs_file_lock(avgs_file_mutex);
+		cluster_done[currCluster] = 1;
+		for(; next_cluster_to_write < num_clusters && cluster_done[next_cluster_to_write]; next_cluster_to_write++){
+			std::vector<T> &next_average = cluster_averages[next_cluster_to_write];
+			avgs_file << sequence_names[medoidIndices[next_cluster_to_write]];
+			for (size_t i = 0; i < next_average.size(); ++i) { 
+				avgs_file << "\t" << next_average[i]; 
+			}
+			avgs_file << std::endl;
+			avgs_file.flush(); // for checkpointing
+			if(cluster_sizes[next_cluster_to_write] > 1){
+				deleteCentroidCheckpointFile(CONCAT4(output_prefix, ".", std::to_string(next_cluster_to_write), ".evolving_centroid.txt").c_str());
+			}
+			std::vector<T>().swap(next_average);
+		}
+	}, num_concurrent_clusters);
+	percentageDisplayMuted = false;
+	
+	if(options.reassignment_rounds && num_clusters > 1){
+		for(int c = 0; c < num_clusters; c++){
+			if(converged_centroids[c].empty()){
+				std::cerr << "Skipping reassignment to the nearest centroids as cluster " << (c+1) << "'s centroid was restored from a checkpoint" << std::endl;
+				converged_centroids.clear();
+				break;
+			}
+		}
+	}
+	if(options.reassignment_rounds && num_clusters > 1 && !converged_centroids.empty()){
+		bool memberships_changed = false;
+		std::vector<T *> centroid_pointers(num_clusters);
+		std::vector<size_t> centroid_lengths(num_clusters);
+		for(int round = 0; round < options.reassignment_rounds; round++){
+			for(int c = 0; c < num_clusters; c++){
+				centroid_pointers[c] = converged_centroids[c].data();
+				centroid_lengths[c] = converged_centroids[c].size();
+			}
+			std::vector<char> cluster_changed;
+			size_t num_moved = reassignToNearestCentroids(sequences, sequence_lengths, num_sequences, centroid_pointers.data(), centroid_lengths.data(), num_clusters, medoidIndices,
+			                                              use_open_start, use_open_end, sequences_membership, cluster_changed);
+			std::cerr << "Reassignment round " << (round+1) << " of max " << options.reassignment_rounds << " moved " << num_moved << 
+			             " sequences to the cluster with the nearest centroid" << std::endl;
+			if(!num_moved){
+				break;
 			}
-			// In open end mode (unlike global), it's possible for the centroid to flip between two nearly identical
-			// centroids in perpetuity, so never really "converging". Handle this case with a shortcircuit.
-			if(use_open_start || use_open_end){
-				if(i >= 1 && !memcmp(new_barycenter, two_previous_barycenter, sizeof(T)*medoidLength)){
-					std::cerr << "Detected a flip-flop between two alternative converged centroids (should happen only in open end mode), keeping the first one calculated" << std::endl;
-					break;
+			memberships_changed = true;
+			// Reconverge only the clusters that changed, starting from their previous centroids
+			for(int c = 0; c < num_clusters; c++){
+				if(!cluster_changed[c]){
+					continue;
+				}
+				std::vector<T *> cluster_sequences;
+				std::vector<char *> cluster_sequence_names;
+				std::vector<size_t> member_lengths;
+				std::vector<unsigned int> member_weights;
+				for(int i = 0; i < num_sequences; i++){
+					if(sequences_membership[i] == c){
+						cluster_sequences.push_back(sequences[i]);
+						cluster_sequence_names.push_back(sequence_names[i]);
+						member_lengths.push_back(sequence_lengths[i]);
+						member_weights.push_back(sequence_weights ? sequence_weights[i] : 1);
+					}
 				}
-				if(i > 1){
-					cudaMemcpy(two_previous_barycenter, previous_barycenter, medoidLength*sizeof(T), cudaMemcpyHostToHost); CUERR("Replacing two-back updated DBA medoid on host");
+				size_t centroidLength = converged_centroids[c].size();
+				// Down to just the medoid
+				if(cluster_sequences.size() == 1){
+					converged_centroids[c].assign(sequences[medoidIndices[c]], sequences[medoidIndices[c]]+centroidLength);
+					continue;
 				}
-				if(i > 0){
-					cudaMemcpy(previous_barycenter, new_barycenter, medoidLength*sizeof(T), cudaMemcpyHostToHost); CUERR("Replacing previously updated DBA medoid on host");
+				std::cerr << "Reconverging cluster " << (c+1) << " of " << num_clusters << ", now " << cluster_sequences.size() << " members" << std::endl;
+				T **gpu_cluster_sequences;
+				cudaMallocManaged(&gpu_cluster_sequences, sizeof(T*)*cluster_sequences.size()); CUERR("Allocating GPU memory for array of cluster member sequence pointers");
+				char **gpu_cluster_sequence_names;
+				cudaMallocManaged(&gpu_cluster_sequence_names, sizeof(char*)*cluster_sequences.size()); CUERR("Allocating GPU memory for array of cluster member sequence name pointers");
+				size_t *gpu_member_lengths;
+				cudaMallocManaged(&gpu_member_lengths, sizeof(size_t)*cluster_sequences.size()); CUERR("Allocating GPU memory for array of cluster member lengths");
+				std::copy(cluster_sequences.begin(), cluster_sequences.end(), gpu_cluster_sequences);
+				std::copy(cluster_sequence_names.begin(), cluster_sequence_names.end(), gpu_cluster_sequence_names);
+				std::copy(member_lengths.begin(), member_lengths.end(), gpu_member_lengths);
+				unsigned int *gpu_member_weights = 0;
+				if(sequence_weights){
+					cudaMallocManaged(&gpu_member_weights, sizeof(unsigned int)*cluster_sequences.size()); CUERR("Allocating GPU memory for array of cluster member weights");
+					std::copy(member_weights.begin(), member_weights.end(), gpu_member_weights);
 				}
+				T *gpu_barycenter = 0;
+				cudaMallocManaged(&gpu_barycenter, sizeof(T)*centroidLength); CUERR("Allocating managed GPU memory for DBA result");
+				cudaMemcpy(gpu_barycenter, converged_centroids[c].data(), sizeof(T)*centroidLength, cudaMemcpyHostToDevice); CUERR("Copying previous centroid to GPU as the DBA warm start");
+				T *new_barycenter = 0;
+				cudaMallocHost(&new_barycenter, sizeof(T)*centroidLength); CUERR("Allocating CPU memory for DBA update result");
+				convergeCentroid(gpu_barycenter, centroidLength, gpu_cluster_sequences, gpu_cluster_sequence_names, cluster_sequences.size(), gpu_member_lengths, use_open_start, use_open_end, 
+				                 new_barycenter, c, num_clusters, output_prefix, stream, gpu_member_weights, options.cpu_dba_update, options.minibatch_size, options.path_rounds);
+				converged_centroids[c].assign(new_barycenter, new_barycenter+centroidLength);
+				deleteCentroidCheckpointFile(CONCAT4(output_prefix, ".", std::to_string(c), ".evolving_centroid.txt").c_str());
+				cudaFree(gpu_cluster_sequences); CUERR("Freeing GPU memory for array of cluster member sequence pointers");
+				cudaFree(gpu_cluster_sequence_names); CUERR("Freeing GPU memory for array of cluster member sequence name pointers");
+				cudaFree(gpu_member_lengths); CUERR("Freeing GPU memory for array of cluster member lengths");
+				if(gpu_member_weights){
+					cudaFree(gpu_member_weights); CUERR("Freeing GPU memory for array of cluster member weights");
+				}
+				cudaFree(gpu_barycenter); CUERR("Freeing GPU memory for barycenter");
+				cudaFreeHost(new_barycenter); CUERR("Freeing CPU memory for DBA update result");
 			}
-			writeCentroidCheckpointToFile(CONCAT4(output_prefix, ".", std::to_string(currCluster), ".evolving_centroid.txt").c_str(), new_barycenter, medoidLength);
-			cudaMemcpy(gpu_barycenter, new_barycenter, sizeof(T)*medoidLength, cudaMemcpyHostToDevice);  CUERR("Copying updated DBA medoid to GPU");
-		}
-		// Clean up the GPU memory we don't need any more.
-		cudaFree(cluster_sequences); CUERR("Freeing GPU memory for array of cluster member sequence pointers");
-		cudaFree(cluster_sequence_names); CUERR("Freeing GPU memory for array of cluster member sequence name pointers");
-		cudaFree(member_lengths); CUERR("Freeing GPU memory for array of cluster member lengths");
-		cudaFree(gpu_barycenter); CUERR("Freeing GPU memory for barycenter");
-
-		if(norm_sequences) {
-			/* Rescale the average to the centroid's value range. */
-			double medoidAvg = sequence_means[medoidIndices[currCluster]];
- 			double medoidStdDev = sequence_sigmas[medoidIndices[currCluster]];
-			//std::cout << "Rescaling centroid to medoid's mean and std dev: " << medoidAvg << ", " << medoidStdDev << std::endl;
-			for(int i = 0; i < medoidLength; i++){
-				new_barycenter[i] = (T) (medoidAvg+new_barycenter[i]*medoidStdDev);
-			}
-		}
-		avgs_file << sequence_names[medoidIndices[currCluster]];
-        	for (size_t i = 0; i < medoidLength; ++i) { 
-			avgs_file << "\t" << ((T *) new_barycenter)[i]; 
 		}
-		avgs_file << std::endl;
-		avgs_file.flush(); // for checkpointing
-		deleteCentroidCheckpointFile(CONCAT4(output_prefix, ".", std::to_string(currCluster), ".evolving_centroid.txt").c_str());
-		
+		// Replace the first pass' outputs (the centroids keep their lengths, and their medoids' names and value scaling)
+		if(memberships_changed){
+			writeClusterMembership(CONCAT2(output_prefix, ".cluster_membership.txt").c_str(), cdist, sequence_names, num_sequences, sequences_membership, medoidIndices);
+			avgs_file.close();
+			avgs_file.open(CONCAT2(output_prefix, ".avg.txt").c_str(), std::ios::trunc);
+			if(!avgs_file.is_open()){
+				std::cerr << "Cannot open sequence averages file " << output_prefix << ".avg.txt for writing" << std::endl;
+				exit(CANNOT_WRITE_DBA_AVG);
+			}
+			for(int c = 0; c < num_clusters; c++){
+				std::vector<T> &centroid = converged_centroids[c];
+				if(norm_sequences){
+					double medoidAvg = sequence_means[medoidIndices[c]];
+					double medoidStdDev = sequence_sigmas[medoidIndices[c]];
+					for(size_t i = 0; i < centroid.size(); i++){
+						centroid[i] = (T) (medoidAvg+centroid[i]*medoidStdDev);
+					}
+				}
+				avgs_file << sequence_names[medoidIndices[c]];
+				for(size_t i = 0; i < centroid.size(); i++){
+					avgs_file << "\t" << centroid[i];
 #if HDF5_SUPPORTED == 1 || SLOW5_SUPPORTED == 1
-		// Populate medoid buffers for writing fast5 output
-		avgNames[currCluster] = sequence_names[medoidIndices[currCluster]];
-		avgSeqLengths[currCluster] = medoidLength;
-		avgSequences[currCluster] = templateToShort(new_barycenter, avgSeqLengths[currCluster]);
+					avgSequences[c][i] = (short) centroid[i];
 #endif
-		
-		cudaFreeHost(new_barycenter); CUERR("Allocating CPU memory for DBA update result");
-		if(use_open_start || use_open_end){
-			cudaFreeHost(previous_barycenter); CUERR("Allocating CPU memory for previous DBA update result");
-			cudaFreeHost(two_previous_barycenter); CUERR("Allocating CPU memory for two back DBA update result");
+				}
+				avgs_file << std::endl;
+			}
 		}
 	}
-	
+
 	if(norm_sequences){
 		cudaFree(sequence_means);
 		cudaFree(sequence_sigmas);
@@ -0,0 +1,58 @@
+#ifndef DBA_OPTIONS_H
+#define DBA_OPTIONS_H
+
+#include <string>
+#include <vector>
+
+// Optional run settings from the command line flags, passed down from setupAndRun() to performDBA() and approximateMedoidIndices() 
+// as one bundle (the positional arguments keep their own parameters).
+struct dba_options{
+	// Clustering thresholds (same semantics as the positional cdist argument) for which to cut the dendrogram,
+	// each written to <prefix>.cluster_membership.<cut>.txt. Empty unless a comma-separated list was given.
+	std::vector<double> cdist_sweep;
+	// False when a threshold sweep was requested without picking a cut to generate the consensus for.
+	bool generate_consensus;
+	// Output prefix of a previous run whose pairwise distances are reused, so only pairs involving sequences new to this run get calculated.
+	std::string append_prefix;
+	// When num_shards is non-zero, only calculate shard shard_index (1-based) of the all-vs-all DTW distances and write it to a partial matrix file.
+	int shard_index;
+	int num_shards;
+	// When non-zero, assemble the all-vs-all DTW distances from this many shard files instead of calculating them.
+	int merge_shards;
+	// File name of a pairwise distance cache shared between runs, consulted before and updated after the all-vs-all DTW calculation.
+	std::string distance_cache;
+	// Only keep each sequence's sum of squared distances to all the others (enough to pick a single medoid), instead of the whole distance matrix.
+	bool sums_only_medoid;
+	// Storage type of the pairwise distance matrix, one of the DISTANCE_PRECISION_* codes in distance_types.hpp (float by default).
+	int distance_precision;
+	// Clustering thresholds > 1 pick K medoids directly from the distances (FasterPAM) rather than cutting the dendrogram into K clusters.
+	bool k_medoids;
+	// When non-zero, cluster the graph of each sequence's (approximate) this many nearest neighbours instead of calculating all the pairwise distances.
+	int knn_neighbours;
+	// When non-zero, K-means cluster an embedding of the sequences based on their distances to this many landmark sequences, K being the clustering threshold.
+	int num_landmarks;
+	// After the centroids converge, up to this many rounds of moving each sequence to the cluster with the nearest centroid and reconverging the changed clusters.
+	int reassignment_rounds;
+	// When non-zero and there are more sequences than this, cluster and average groups of about this many (random, or of similar length if group_by_length),
+	// then cluster and average the group consensuses.
+	int group_size;
+	bool group_by_length;
+	// When non-zero, recluster this many bootstrap resamplings of the sequences (from the same distances) to report how stable each sequence's cluster membership is.
+	int bootstrap_replicates;
+	// Do the DBA centroid updates with the CPU threads (see cpu_dba_update.hpp) rather than the GPUs.
+	bool cpu_dba_update;
+	// When non-zero, clusters with more than twice this many members start converging with DBA updates from random mini-batches of this many members.
+	int minibatch_size;
+	// Convergence rounds (1-based) whose DTW paths are also kept, as <prefix>.<cluster>.round<N>.paths.bin (the final round's are always in <prefix>.<cluster>.paths.bin).
+	std::vector<int> path_rounds;
+	// When non-zero, cluster reads as their files appear in the watched locations (polled this often, in seconds) rather than all at once,
+	// until no new file has appeared for stream_idle_seconds. See streaming.hpp.
+	int stream_poll_seconds;
+	int stream_idle_seconds;
+
+	dba_options() : generate_consensus(true), shard_index(0), num_shards(0), merge_shards(0), sums_only_medoid(false), distance_precision(0), k_medoids(false), 
+	                knn_neighbours(0), num_landmarks(0), reassignment_rounds(0), group_size(0), group_by_length(false), 
+	                bootstrap_replicates(0), cpu_dba_update(false), minibatch_size(0), stream_poll_seconds(0), stream_idle_seconds(0) {}
+};
+
+#endif
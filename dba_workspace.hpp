@@ -0,0 +1,226 @@
+#ifndef __dba_workspace_hpp_included
+#define __dba_workspace_hpp_included
+
+/* Buffers for DBAUpdate() that live across the sequences of a round and across the rounds of a centroid's convergence (see convergeCentroid()),
+   instead of being allocated and freed for every sequence. Each device's buffers grow to the biggest sequence seen so far (the high-water mark) and are
+   then reused, so once the first round has seen the longest member, later rounds make no more allocations outside of the (rare) stripe mode fallback.
+   The device-side buffers are dropped before a stripe mode sequence so it gets all the GPU memory it would have had otherwise. */
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "dtw.hpp" // for dtw_path_run
+#include "exit_codes.hpp"
+#include "cuda_utils.hpp" // for CUERR()
+#include "gpu_utils.hpp" // for getMaxThreadsPerDevice()
+
+template<typename T>
+struct dba_device_workspace{
+	// Full path matrix mode DTW cost swath buffers, each costCapacity bytes
+	T *dtwCostSoFar;
+	T *newDtwCostSoFar;
+	size_t costCapacity;
+	// Pitched path matrix of at least pathWidth bytes by pathHeight rows
+	unsigned char *pathMatrix;
+	size_t pathPitch;
+	size_t pathWidth;
+	size_t pathHeight;
+	// Host copy of the path matrix for writing out the path
+	unsigned char *cpu_stepMatrix;
+	size_t stepMatrixCapacity;
+	// Page-locked host copy of the sequence being aligned, for writing out the path
+	T *cpu_seq;
+	size_t cpuSeqCapacity;
+	// For stripe mode
+	int *gpu_backtrace_rows;
+	cudaStream_t stream;
+	bool hasStream;
+	// Run-length form of the path of the sequence in progress, for the path writer
+	std::vector<dtw_path_run> path_runs;
+
+	dba_device_workspace() : dtwCostSoFar(0), newDtwCostSoFar(0), costCapacity(0), pathMatrix(0), pathPitch(0), pathWidth(0), pathHeight(0),
+	                         cpu_stepMatrix(0), stepMatrixCapacity(0), cpu_seq(0), cpuSeqCapacity(0), gpu_backtrace_rows(0), hasStream(false) {}
+};
+
+template<typename T>
+struct dba_workspace{
+	int deviceCount;
+	dba_device_workspace<T> *devices;
+	unsigned int *maxThreads;
+	// Centroid update accumulators (device side) and their host copies, each for centroidCapacity elements
+	T *gpu_centroidAlignmentSums;
+	unsigned int *nElementsForMean;
+	unsigned int *cpu_nElementsForMean;
+	T *cpu_centroid;
+	size_t centroidCapacity;
+
+	dba_workspace() : deviceCount(0), devices(0), maxThreads(0), gpu_centroidAlignmentSums(0), nElementsForMean(0), cpu_nElementsForMean(0), cpu_centroid(0), centroidCapacity(0) {}
+
+	__host__ void
+	setup(){
+		if(devices){
+			return;
+		}
+		cudaGetDeviceCount(&deviceCount); CUERR("Getting GPU device count for DBA update workspace");
+#if DEBUG == 1
+		// Device parallelism is not compatible with debug printing of intermediate path cost matrix columns
+		deviceCount = 1;
+#endif
+		devices = new dba_device_workspace<T>[deviceCount];
+		maxThreads = getMaxThreadsPerDevice(deviceCount);
+		// For testing purposes, see if 1024 is faster than maxThreads
+		for(int i = 0; i < deviceCount; i++){
+			maxThreads[i] = 1024;
+		}
+	}
+
+	__host__ void
+	reserveCentroid(size_t centerLength){
+		if(centerLength <= centroidCapacity){
+			return;
+		}
+		releaseCentroid();
+		cudaMallocManaged(&gpu_centroidAlignmentSums, sizeof(T)*centerLength); CUERR("Allocating GPU memory for barycenter update sequence element sums");
+		cudaMallocManaged(&nElementsForMean, sizeof(unsigned int)*centerLength); CUERR("Allocating GPU memory for barycenter update sequence pileup");
+		cudaMallocHost(&cpu_nElementsForMean, sizeof(unsigned int)*centerLength); CUERR("Allocating CPU memory for barycenter sequence pileup");
+		cudaMallocHost(&cpu_centroid, sizeof(T)*centerLength); CUERR("Allocating CPU memory for incoming centroid");
+		centroidCapacity = centerLength;
+	}
+
+	// Created once per device, at the highest priority since each device only works on one sequence at a time.
+	__host__ cudaStream_t
+	stream(int device){
+		dba_device_workspace<T> &ws = devices[device];
+		if(!ws.hasStream){
+			int priority_high, priority_low;
+			cudaDeviceGetStreamPriorityRange(&priority_low, &priority_high);
+			cudaStreamCreateWithPriority(&ws.stream, cudaStreamNonBlocking, priority_high); CUERR("Creating prioritized CUDA stream");
+			ws.hasStream = true;
+		}
+		return ws.stream;
+	}
+
+	// GPU memory already held by the device's full path mode buffers, i.e. available to the next sequence in addition to the free memory.
+	__host__ size_t
+	heldDeviceBytes(int device){
+		dba_device_workspace<T> &ws = devices[device];
+		return 2*ws.costCapacity+ws.pathPitch*ws.pathHeight;
+	}
+
+	__host__ void
+	reserveFullPath(int device, size_t costBytes, size_t pathWidth, size_t pathHeight){
+		dba_device_workspace<T> &ws = devices[device];
+		if(costBytes > ws.costCapacity){
+			if(ws.dtwCostSoFar){
+				cudaFree(ws.dtwCostSoFar); CUERR("Freeing outgrown DTW intermediate cost values in DBA workspace");
+				cudaFree(ws.newDtwCostSoFar); CUERR("Freeing outgrown new DTW intermediate cost values in DBA workspace");
+			}
+			cudaMalloc(&ws.dtwCostSoFar, costBytes);  CUERR("Allocating GPU memory for DTW pairwise distance intermediate values in DBA update");
+			cudaMalloc(&ws.newDtwCostSoFar, costBytes);  CUERR("Allocating GPU memory for new DTW pairwise distance intermediate values in DBA update");
+			ws.costCapacity = costBytes;
+		}
+		if(pathWidth > ws.pathPitch || pathHeight > ws.pathHeight){
+			if(ws.pathMatrix){
+				cudaFree(ws.pathMatrix); CUERR("Freeing outgrown DTW path matrix in DBA workspace");
+			}
+			// Grow both dimensions to the largest seen, as the centroid may be on either axis
+			ws.pathWidth = std::max(pathWidth, ws.pathWidth);
+			ws.pathHeight = std::max(pathHeight, ws.pathHeight);
+			cudaMallocPitch(&ws.pathMatrix, &ws.pathPitch, ws.pathWidth, ws.pathHeight); CUERR("Allocating pitched GPU memory for path matrix in DBA workspace");
+		}
+	}
+
+	// Before a stripe mode sequence on the device
+	__host__ void
+	releaseDevice(int device){
+		dba_device_workspace<T> &ws = devices[device];
+		if(ws.dtwCostSoFar){
+			cudaFree(ws.dtwCostSoFar); CUERR("Freeing DTW intermediate cost values in DBA workspace");
+			cudaFree(ws.newDtwCostSoFar); CUERR("Freeing new DTW intermediate cost values in DBA workspace");
+			ws.dtwCostSoFar = ws.newDtwCostSoFar = 0;
+			ws.costCapacity = 0;
+		}
+		if(ws.pathMatrix){
+			cudaFree(ws.pathMatrix); CUERR("Freeing DTW path matrix in DBA workspace");
+			ws.pathMatrix = 0;
+			ws.pathPitch = ws.pathWidth = ws.pathHeight = 0;
+		}
+	}
+
+	__host__ unsigned char *
+	stepMatrix(int device, size_t bytes){
+		dba_device_workspace<T> &ws = devices[device];
+		if(bytes > ws.stepMatrixCapacity){
+			std::free(ws.cpu_stepMatrix);
+			// Using a standard malloc as this is GPU -> CPU read-once memory, no compelling need to burden the OS with massive page locked memory
+			if((ws.cpu_stepMatrix = (unsigned char *) std::malloc(bytes)) == 0){
+				std::cerr << "Cannot allocate standard CPU memory for full step matrix" << std::endl;
+				exit(CANNOT_ALLOCATE_HOST_FULL_STEP_MATRIX);
+			}
+			ws.stepMatrixCapacity = bytes;
+		}
+		return ws.cpu_stepMatrix;
+	}
+
+	__host__ T *
+	hostSequence(int device, T *gpu_seq, size_t length){
+		dba_device_workspace<T> &ws = devices[device];
+		if(length > ws.cpuSeqCapacity){
+			if(ws.cpu_seq){
+				cudaFreeHost(ws.cpu_seq); CUERR("Freeing outgrown CPU memory for query seq in DBA workspace");
+			}
+			cudaMallocHost(&ws.cpu_seq, sizeof(T)*length); CUERR("Allocating CPU memory for query seq in DBA workspace");
+			ws.cpuSeqCapacity = length;
+		}
+		cudaMemcpy(ws.cpu_seq, gpu_seq, sizeof(T)*length, cudaMemcpyDeviceToHost); CUERR("Copying incoming GPU query to CPU in DBA workspace");
+		return ws.cpu_seq;
+	}
+
+	__host__ int *
+	backtraceRows(int device){
+		dba_device_workspace<T> &ws = devices[device];
+		if(ws.gpu_backtrace_rows == 0){
+			cudaMallocManaged(&ws.gpu_backtrace_rows, sizeof(int));  CUERR("Allocating a single int for striped GPU backtrace vertical index");
+		}
+		return ws.gpu_backtrace_rows;
+	}
+
+	__host__ void
+	releaseCentroid(){
+		if(centroidCapacity){
+			cudaFree(gpu_centroidAlignmentSums); CUERR("Freeing GPU memory for the barycenter update sequence element sums");
+			cudaFree(nElementsForMean); CUERR("Freeing GPU memory for the barycenter update sequence pileup");
+			cudaFreeHost(cpu_nElementsForMean);  CUERR("Freeing CPU memory for the barycenter update sequence pileup");
+			cudaFreeHost(cpu_centroid); CUERR("Freeing CPU memory for the incoming centroid");
+			centroidCapacity = 0;
+		}
+	}
+
+	~dba_workspace(){
+		if(!devices){
+			return;
+		}
+		for(int device = 0; device < deviceCount; device++){
+			cudaSetDevice(device);
+			dba_device_workspace<T> &ws = devices[device];
+			releaseDevice(device);
+			std::free(ws.cpu_stepMatrix);
+			if(ws.cpu_seq){
+				cudaFreeHost(ws.cpu_seq); CUERR("Freeing CPU memory for query seq in DBA workspace");
+			}
+			if(ws.gpu_backtrace_rows){
+				cudaFree(ws.gpu_backtrace_rows); CUERR("Freeing striped GPU backtrace vertical index");
+			}
+			if(ws.hasStream){
+				cudaStreamDestroy(ws.stream); CUERR("Removing a CUDA stream in DBA workspace cleanup");
+			}
+		}
+		releaseCentroid();
+		cudaFreeHost(maxThreads); CUERR("Freeing CPU memory for device thread properties");
+		delete[] devices;
+	}
+};
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef __distance_cache_hpp_included
+#define __distance_cache_hpp_included
+
+/* A persistent cache of pairwise DTW distances that can be shared by many runs (and concurrently running processes, such as shards), so that
+   sequences compared in any previous run don't need to be compared again, even when combined with different sequences.
+   Entries are keyed by the content hashes of the two sequences (in the order they were aligned) and a mode word describing the alignment settings
+   and value type. The file is an open addressing (linear probing) hash table that is memory mapped for lookups, so checking a pair costs
+   a probe or two rather than a DTW. Entries are only ever added, never changed.
+
+   Lookups are done under a shared file lock, additions under an exclusive one. Additions that fit are made in place, with a dirty flag in the header
+   set for the duration, so a process killed mid-update leaves a cache that is discarded rather than trusted. A table that needs to grow is instead rehashed
+   into a new file that is renamed over the old one once complete, so a process killed while growing it leaves the previous cache as it was. */
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#else
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include "exit_codes.hpp"
+#include "distance_types.hpp"
+
+#define DISTANCE_CACHE_MAGIC "OpenDBA_cache_1"
+#define DISTANCE_CACHE_MIN_SLOTS 1024
+// Keep the table at most half full so that linear probing stays short
+#define DISTANCE_CACHE_MAX_LOAD 0.5
+
+struct distance_cache_header{
+	char magic[16];
+	unsigned long long num_slots;
+	unsigned long long num_entries;
+	unsigned long long dirty;
+};
+
+struct distance_cache_entry{
+	unsigned long long first_seq_hash;
+	unsigned long long second_seq_hash;
+	unsigned long long mode; // 0 marks an empty slot
+	double distance;
+};
+
+struct distance_cache{
+	int fd;
+	std::string file_name;
+	int replacement_fd; // the grown table's file while it's being filled (see beginDistanceCacheUpdate()), -1 otherwise
+	size_t mapped_bytes;
+	distance_cache_header *header;
+	distance_cache_entry *slots;
+};
+
+// Everything besides the two sequences' content that affects their distance: the value type, the distance storage precision and the alignment ends mode.
+template<typename T, typename D>
+__host__
+unsigned long long distanceCacheMode(int use_open_start, int use_open_end){
+	return (1ULL << 63) | (((unsigned long long) distancePrecisionCode<D>()) << 24) | (((unsigned long long) std::numeric_limits<T>::is_integer) << 16) | 
+	       (((unsigned long long) sizeof(T)) << 8) | (((unsigned long long) use_open_start) << 1) | ((unsigned long long) use_open_end);
+}
+
+__host__
+size_t distanceCacheSlot(unsigned long long first_seq_hash, unsigned long long second_seq_hash, unsigned long long mode, unsigned long long num_slots){
+	// splitmix64 style finalizer over the combined key
+	unsigned long long h = first_seq_hash ^ (second_seq_hash * 0x9E3779B97F4A7C15ULL) ^ (mode * 0xC2B2AE3D27D4EB4FULL);
+	h ^= h >> 30; h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27; h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return (size_t) (h % num_slots);
+}
+
+#if defined(_WIN32)
+__host__ int openDistanceCache(const char *cache_file_name, distance_cache *cache){
+	std::cerr << "Warning: the pairwise distance cache is not supported on Windows, all distances will be calculated" << std::endl;
+	cache->fd = -1;
+	cache->header = 0;
+	return 0;
+}
+__host__ int lookupDistanceCache(const distance_cache *cache, unsigned long long first_seq_hash, unsigned long long second_seq_hash, unsigned long long mode, double *distance){ return 0; }
+__host__ void releaseDistanceCache(distance_cache *cache){}
+__host__ void beginDistanceCacheUpdate(distance_cache *cache, size_t max_new_entries){}
+__host__ void addToDistanceCache(distance_cache *cache, unsigned long long first_seq_hash, unsigned long long second_seq_hash, unsigned long long mode, double distance){}
+__host__ void endDistanceCacheUpdate(distance_cache *cache){}
+__host__ void closeDistanceCache(distance_cache *cache){}
+#else
+
+// Map the whole cache file as it currently is, returns 0 if it's empty or not a usable cache file.
+__host__
+int mapDistanceCache(distance_cache *cache, int writable){
+	cache->header = 0;
+	cache->slots = 0;
+	struct stat file_stats;
+	if(fstat(cache->fd, &file_stats) != 0 || file_stats.st_size < (off_t) sizeof(distance_cache_header)){
+		return 0;
+	}
+	void *mapping = mmap(0, file_stats.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, cache->fd, 0);
+	if(mapping == MAP_FAILED){
+		std::cerr << "Could not memory map the pairwise distance cache file: " << strerror(errno) << std::endl;
+		exit(MEMORY_MAPPING_FAILED);
+	}
+	cache->mapped_bytes = file_stats.st_size;
+	cache->header = (distance_cache_header *) mapping;
+	cache->slots = (distance_cache_entry *) (cache->header+1);
+	if(strncmp(cache->header->magic, DISTANCE_CACHE_MAGIC, sizeof(cache->header->magic)) ||
+	   cache->mapped_bytes != sizeof(distance_cache_header)+cache->header->num_slots*sizeof(distance_cache_entry)){
+		std::cerr << "Warning: ignoring the contents of pairwise distance cache file as it is not in the expected format" << std::endl;
+		return 0;
+	}
+	if(cache->header->dirty){
+		std::cerr << "Warning: ignoring the contents of pairwise distance cache file as a previous update of it did not complete" << std::endl;
+		return 0;
+	}
+	return 1;
+}
+
+__host__
+void unmapDistanceCache(distance_cache *cache){
+	if(cache->header){
+		munmap(cache->header, cache->mapped_bytes);
+		cache->header = 0;
+		cache->slots = 0;
+	}
+}
+
+// Lock the cache file, reopening it if another process replaced it with a grown table while we waited for the lock. Returns 0 if it can't be reopened.
+__host__
+int lockDistanceCache(distance_cache *cache, int operation){
+	for(;;){
+		flock(cache->fd, operation);
+		struct stat locked_stats, current_stats;
+		if(fstat(cache->fd, &locked_stats) == 0 && stat(cache->file_name.c_str(), &current_stats) == 0 && 
+		   locked_stats.st_dev == current_stats.st_dev && locked_stats.st_ino == current_stats.st_ino){
+			return 1;
+		}
+		flock(cache->fd, LOCK_UN);
+		close(cache->fd);
+		cache->fd = open(cache->file_name.c_str(), O_RDWR | O_CREAT, 0644);
+		if(cache->fd == -1){
+			std::cerr << "Cannot reopen pairwise distance cache file " << cache->file_name << " (" << strerror(errno) << "), it will not be used" << std::endl;
+			return 0;
+		}
+	}
+}
+
+// Open (creating if necessary) the cache file and map it for lookups. Returns 0 if the file can't be used, in which case all distances will need calculating.
+__host__
+int openDistanceCache(const char *cache_file_name, distance_cache *cache){
+	cache->header = 0;
+	cache->slots = 0;
+	cache->file_name = cache_file_name;
+	cache->replacement_fd = -1;
+	cache->fd = open(cache_file_name, O_RDWR | O_CREAT, 0644);
+	if(cache->fd == -1){
+		std::cerr << "Cannot open pairwise distance cache file " << cache_file_name << " (" << strerror(errno) << "), all distances will be calculated" << std::endl;
+		return 0;
+	}
+	if(!lockDistanceCache(cache, LOCK_SH)){
+		return 0;
+	}
+	if(!mapDistanceCache(cache, 0)){
+		unmapDistanceCache(cache);
+		return 0;
+	}
+	std::cerr << "Using " << cache->header->num_entries << " cached pairwise distances from " << cache_file_name << std::endl;
+	return 1;
+}
+
+// Returns 1 and sets *distance if the pair is in the cache.
+__host__
+int lookupDistanceCache(const distance_cache *cache, unsigned long long first_seq_hash, unsigned long long second_seq_hash, unsigned long long mode, double *distance){
+	if(!cache->header){
+		return 0;
+	}
+	size_t num_slots = cache->header->num_slots;
+	for(size_t slot = distanceCacheSlot(first_seq_hash, second_seq_hash, mode, num_slots); cache->slots[slot].mode; slot = (slot+1)%num_slots){
+		const distance_cache_entry &entry = cache->slots[slot];
+		if(entry.first_seq_hash == first_seq_hash && entry.second_seq_hash == second_seq_hash && entry.mode == mode){
+			*distance = entry.distance;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Done with lookups, let other processes add to the cache while we calculate the missing distances.
+__host__
+void releaseDistanceCache(distance_cache *cache){
+	if(cache->fd == -1){
+		return;
+	}
+	unmapDistanceCache(cache);
+	flock(cache->fd, LOCK_UN);
+}
+
+__host__
+void insertDistanceCacheEntry(distance_cache_entry *slots, size_t num_slots, const distance_cache_entry &new_entry){
+	size_t slot = distanceCacheSlot(new_entry.first_seq_hash, new_entry.second_seq_hash, new_entry.mode, num_slots);
+	while(slots[slot].mode){
+		slot = (slot+1)%num_slots;
+	}
+	slots[slot] = new_entry;
+}
+
+// Lock the cache for exclusive update, making room for up to max_new_entries additions.
+__host__
+void beginDistanceCacheUpdate(distance_cache *cache, size_t max_new_entries){
+	if(cache->fd == -1 || !lockDistanceCache(cache, LOCK_EX)){
+		return;
+	}
+	// Another process may have grown the file since we last looked, or it may be new or unusable
+	std::vector<distance_cache_entry> existing_entries;
+	size_t num_existing_entries = 0;
+	if(mapDistanceCache(cache, 1)){
+		num_existing_entries = cache->header->num_entries;
+		if(num_existing_entries+max_new_entries <= cache->header->num_slots*DISTANCE_CACHE_MAX_LOAD){
+			cache->header->dirty = 1;
+			msync(cache->header, sizeof(distance_cache_header), MS_SYNC);
+			return;
+		}
+		// Grow: keep the existing entries aside to be rehashed into the bigger table, leaving the current file untouched until that's complete
+		existing_entries.reserve(num_existing_entries);
+		for(size_t slot = 0; slot < cache->header->num_slots; slot++){
+			if(cache->slots[slot].mode){
+				existing_entries.push_back(cache->slots[slot]);
+			}
+		}
+	}
+	unmapDistanceCache(cache);
+
+	size_t num_slots = DISTANCE_CACHE_MIN_SLOTS;
+	while(existing_entries.size()+max_new_entries > num_slots*DISTANCE_CACHE_MAX_LOAD){
+		num_slots *= 2;
+	}
+	size_t file_size = sizeof(distance_cache_header)+num_slots*sizeof(distance_cache_entry);
+	// The bigger table is built in a scratch file, only we can be writing it while we hold the cache file's exclusive lock
+	std::string replacement_file_name = cache->file_name+".tmp";
+	cache->replacement_fd = open(replacement_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(cache->replacement_fd == -1){
+		std::cerr << "Cannot create " << replacement_file_name << " to grow the pairwise distance cache (" << strerror(errno) << "), the new distances will not be cached" << std::endl;
+		flock(cache->fd, LOCK_UN);
+		return;
+	}
+	// Zero the whole file (empty slots) at the new size
+	if(ftruncate(cache->replacement_fd, file_size) != 0){
+		std::cerr << "Cannot size the new pairwise distance cache file to " << file_size << " bytes: " << strerror(errno) << std::endl;
+		exit(MEMORY_MAPPING_FILE_OPEN_FAILED);
+	}
+	void *mapping = mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->replacement_fd, 0);
+	if(mapping == MAP_FAILED){
+		std::cerr << "Could not memory map the pairwise distance cache file: " << strerror(errno) << std::endl;
+		exit(MEMORY_MAPPING_FAILED);
+	}
+	cache->mapped_bytes = file_size;
+	cache->header = (distance_cache_header *) mapping;
+	cache->slots = (distance_cache_entry *) (cache->header+1);
+	strncpy(cache->header->magic, DISTANCE_CACHE_MAGIC, sizeof(cache->header->magic)-1);
+	cache->header->num_slots = num_slots;
+	cache->header->dirty = 1;
+	msync(cache->header, sizeof(distance_cache_header), MS_SYNC);
+	for(size_t i = 0; i < existing_entries.size(); i++){
+		insertDistanceCacheEntry(cache->slots, num_slots, existing_entries[i]);
+	}
+	cache->header->num_entries = existing_entries.size();
+}
+
+// Only valid between beginDistanceCacheUpdate() and endDistanceCacheUpdate(), pairs already in the cache are left as-is.
+__host__
+void addToDistanceCache(distance_cache *cache, unsigned long long first_seq_hash, unsigned long long second_seq_hash, unsigned long long mode, double distance){
+	if(!cache->header){
+		return;
+	}
+	double existing_distance;
+	if(lookupDistanceCache(cache, first_seq_hash, second_seq_hash, mode, &existing_distance)){
+		return;
+	}
+	distance_cache_entry new_entry = {first_seq_hash, second_seq_hash, mode, distance};
+	insertDistanceCacheEntry(cache->slots, cache->header->num_slots, new_entry);
+	cache->header->num_entries++;
+}
+
+__host__
+void endDistanceCacheUpdate(distance_cache *cache){
+	if(!cache->header){
+		return;
+	}
+	msync(cache->header, cache->mapped_bytes, MS_SYNC);
+	cache->header->dirty = 0;
+	msync(cache->header, sizeof(distance_cache_header), MS_SYNC);
+	std::cerr << "Pairwise distance cache now contains " << cache->header->num_entries << " distances" << std::endl;
+	if(cache->replacement_fd != -1){
+		// The grown table is complete on disk, swap it in (processes waiting for the old file's lock will notice and reopen, see lockDistanceCache())
+		std::string replacement_file_name = cache->file_name+".tmp";
+		unmapDistanceCache(cache);
+		if(rename(replacement_file_name.c_str(), cache->file_name.c_str()) != 0){
+			std::cerr << "Warning: could not replace pairwise distance cache file " << cache->file_name << " with the grown one (" << strerror(errno) << 
+			             "), the new distances are not cached" << std::endl;
+			unlink(replacement_file_name.c_str());
+			close(cache->replacement_fd);
+		}
+		else{
+			flock(cache->fd, LOCK_UN);
+			close(cache->fd);
+			cache->fd = cache->replacement_fd;
+		}
+		cache->replacement_fd = -1;
+	}
+	releaseDistanceCache(cache);
+}
+
+__host__
+void closeDistanceCache(distance_cache *cache){
+	if(cache->fd != -1){
+		unmapDistanceCache(cache);
+		close(cache->fd);
+		cache->fd = -1;
+	}
+}
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __distance_types_hpp_included
+#define __distance_types_hpp_included
+
+/* The pairwise DTW distance matrix is the dominant memory cost of clustering large numbers of sequences, so its storage type is decoupled
+   from the sequence value type T. Distances are calculated in single precision and stored as float by default, or optionally in one of
+   the 16 bit floating point formats for half the memory again. Values are widened back to float wherever they are used. */
+
+#include <cuda_runtime_api.h>
+#include <cuda_fp16.h>
+// bfloat16 conversions are available (in software on pre-Ampere cards) since CUDA 11
+#if defined(CUDART_VERSION) && CUDART_VERSION >= 11000
+	#define BFLOAT16_SUPPORTED 1
+	#include <cuda_bf16.h>
+#else
+	#define BFLOAT16_SUPPORTED 0
+#endif
+
+#define DISTANCE_PRECISION_FLOAT 0
+#define DISTANCE_PRECISION_HALF 1
+#define DISTANCE_PRECISION_BFLOAT16 2
+
+// Generic versions are for the sequence value types, which some DTW kernel calls still use when they don't store any distances.
+template<typename D>
+__host__ __device__ inline float widenDistance(D distance){ return (float) distance; }
+__host__ __device__ inline float widenDistance(__half distance){ return __half2float(distance); }
+#if BFLOAT16_SUPPORTED == 1
+__host__ __device__ inline float widenDistance(__nv_bfloat16 distance){ return __bfloat162float(distance); }
+#endif
+
+template<typename D>
+__host__ __device__ inline D narrowDistance(float distance){ return (D) distance; }
+template<>
+__host__ __device__ inline __half narrowDistance<__half>(float distance){ return __float2half_rn(distance); }
+#if BFLOAT16_SUPPORTED == 1
+template<>
+__host__ __device__ inline __nv_bfloat16 narrowDistance<__nv_bfloat16>(float distance){ return __float2bfloat16_rn(distance); }
+#endif
+
+// Recorded with saved distances, since both 16 bit formats are the same size but not interchangeable.
+template<typename D>
+__host__ inline int distancePrecisionCode(){ return DISTANCE_PRECISION_FLOAT; }
+template<>
+__host__ inline int distancePrecisionCode<__half>(){ return DISTANCE_PRECISION_HALF; }
+#if BFLOAT16_SUPPORTED == 1
+template<>
+__host__ inline int distancePrecisionCode<__nv_bfloat16>(){ return DISTANCE_PRECISION_BFLOAT16; }
+#endif
+
+#endif
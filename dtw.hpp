@@ -3,6 +3,7 @@
 
 #include "cuda_utils.hpp"
 #include "limits.hpp" // for device side numeric_limits min() and max()
+#include "distance_types.hpp"
 
 using namespace cudahack; // for device side numeric_limits
 
@@ -20,6 +21,17 @@ using namespace cudahack; // for device side numeric_limits
 __device__ __constant__ short moveI[] = { -1, -1, 0, -1, 0, 0, 0 };
 __device__ __constant__ short moveJ[] = { -1, -1, -1, 0, -1, -1, -1 };
 
+// Compact (run-length) form of a DTW path for host-side use: a maximal stretch of consecutive path cells reached by the same move, with the lowest sequence
+// and centroid indices it covers. Along the run the sequence index increases by seq_step and the centroid index by centroid_step (each 0 or 1) per cell.
+struct dtw_path_run{
+	size_t seq_start;
+	size_t centroid_start;
+	size_t length;
+	unsigned char move;
+	unsigned char seq_step;
+	unsigned char centroid_step;
+};
+
 // How to find the 1D index of (X,Y) in the pitched (i.e. coalescing memory access aligned) memory for the DTW path matrix
 #define pitchedCoord(Column,Row,mem_pitch) ((size_t) ((Row)*(mem_pitch))+(Column))
 
@@ -35,25 +47,32 @@ __device__ T* shared_memory_proxy() {
 /**
  * Compute the distance between a given pair of sequences along every White-Neely step pattern option, for the given vertical swath of the cost matrix.
  * Here "First" sequence is on the Y axis, "Second" sequence is on the X axis with respect to the DTW's up, right and diagonal move options.
+ * By default threadblock x compares first_seq_index to gpu_sequences index first_seq_index+x+1, unless gpu_second_seq_indices provides 
+ * an explicit (ascending, and > first_seq_index if stored in dtwPairwiseDistances) list of the second sequence indices to compare instead, e.g. for only the new sequences in an appended run.
+ * If dtwListDistances is given, threadblock x's distance is also stored at dtwListDistances[x], for callers that only calculate a sparse set of pairs.
+ * If dtwSoS is given, the squared distance is added to both sequences' sums there (in double precision, whatever the sequence and distance types).
+ * If dtwPairwiseDistances only holds some of the rows (e.g. a shard's), dtwPairwiseDistancesOffset is the upper right pair index of its first value.
  */
-template<typename T>
+template<typename T, typename D>
 __global__ void DTWDistance(const T *first_seq_input, const size_t first_seq_input_length, const T *second_seq_input, const size_t second_seq_input_length, const size_t first_seq_index, 
                             const size_t offset_within_second_seq, const T *gpu_sequences, const size_t maxSeqLength, const size_t num_sequences, const size_t *gpu_sequence_lengths, 
-                            T *dtwCostSoFar, T *newDtwCostSoFar, unsigned char *pathMatrix, const size_t pathMemPitch, T *dtwPairwiseDistances, const int use_open_start, const int use_open_end){
+                            T *dtwCostSoFar, T *newDtwCostSoFar, unsigned char *pathMatrix, const size_t pathMemPitch, D *dtwPairwiseDistances, const int use_open_start, const int use_open_end, const size_t *gpu_second_seq_indices = 0, 
+                            double *dtwSoS = 0, D *dtwListDistances = 0, const size_t dtwPairwiseDistancesOffset = 0){
 	// We need temporary storage for three diagonals of the wavefront calculation of the cost matrix to calculate the optimal path steps as a diagonal "wavefront" until we iterate 
 	// through every position of the first sequence.
 	T *costs = shared_memory_proxy<T>();
 
 	// Which two are we comparing in this threadblock?
+	const size_t second_seq_index = gpu_second_seq_indices ? gpu_second_seq_indices[blockIdx.x] : first_seq_index+blockIdx.x+1;
 	// See if there is anything to process in this thread block 
-	const size_t second_seq_length = second_seq_input ? second_seq_input_length : gpu_sequence_lengths[first_seq_index+blockIdx.x+1];
+	const size_t second_seq_length = second_seq_input ? second_seq_input_length : gpu_sequence_lengths[second_seq_index];
 	if(offset_within_second_seq >= second_seq_length){
 		return; // all threads in the threadblock will return
 	}
 
 	const size_t first_seq_length = first_seq_input ? first_seq_input_length : gpu_sequence_lengths[first_seq_index];
 	const T *first_seq = first_seq_input ? first_seq_input : &gpu_sequences[first_seq_index*maxSeqLength];
-	const T *second_seq = second_seq_input ? second_seq_input : &gpu_sequences[(first_seq_index+blockIdx.x+1)*maxSeqLength];
+	const T *second_seq = second_seq_input ? second_seq_input : &gpu_sequences[second_seq_index*maxSeqLength];
 
 	// Point to the correct spot in global memory where the costs are being stored.
 	dtwCostSoFar = &dtwCostSoFar[first_seq_length*blockIdx.x];
@@ -113,15 +132,25 @@ __global__ void DTWDistance(const T *first_seq_input, const size_t first_seq_inp
 				newDtwCostSoFar[0] = numeric_limits<T>::max();
 			}
 			// As we've made a final determination for the cost, record it to GPU memory if we've been given a spot for it.
-        		if(dtwPairwiseDistances != 0 && threadIdx.x == 0 && newDtwCostSoFar != 0){
+        		if((dtwPairwiseDistances != 0 || dtwSoS != 0 || dtwListDistances != 0) && threadIdx.x == 0 && newDtwCostSoFar != 0){
 				// If the alignment has open right end, the medoid calculations will always be biased towards the shortest sequences since the open state is "free",
 				// which is troublesome for retaining consensus features in clusters.  To remove this bias, we will normalize the distance matrix to be relative to the length of the
                         	// shorter sequence with the assumption on average that the shorter sequence is the one generating "free" 
 				// alignment ends that longer sequences can't compete with.
-                        	T normalized_pair_distance = (T) (sqrtf(newDtwCostSoFar[first_seq_length-1])/first_seq_length);
+                        	float normalized_pair_distance = sqrtf(newDtwCostSoFar[first_seq_length-1])/first_seq_length;
 
                         	// 1D index for row into distances upper left pairs triangle is the total size of the triangle, minus all those that haven't been processed yet.
-                        	dtwPairwiseDistances[ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-first_seq_index-1)+blockIdx.x] = normalized_pair_distance;
+				if(dtwPairwiseDistances != 0){
+                        		dtwPairwiseDistances[ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-first_seq_index-1)+second_seq_index-first_seq_index-1-dtwPairwiseDistancesOffset] = narrowDistance<D>(normalized_pair_distance);
+				}
+				if(dtwListDistances != 0){
+					dtwListDistances[blockIdx.x] = narrowDistance<D>(normalized_pair_distance);
+				}
+				if(dtwSoS != 0){
+					double squared_distance = (double) normalized_pair_distance*normalized_pair_distance;
+					atomicAdd(&dtwSoS[first_seq_index], squared_distance);
+					atomicAdd(&dtwSoS[second_seq_index], squared_distance);
+				}
         		}
 			return;
 	  	}
@@ -239,19 +268,32 @@ __global__ void DTWDistance(const T *first_seq_input, const size_t first_seq_inp
 	}
 	// If this is the end of the second sequence, we now know the total cost of the alignment and can populate 
 	// global var dtwPairwiseDistances. This is more efficient than doing a round trip on the PCI bus to the CPU for the same purpose.
+	// Alternatively (or additionally) the squared distance is added to both sequences' sums in dtwSoS, when only those are of interest.
 	if(offset_within_second_seq+blockDim.x >= second_seq_length){
-		if(dtwPairwiseDistances != 0 && threadIdx.x == 0 && newDtwCostSoFar != 0){
-			// 1D index for row into distances upper left pairs triangle is the total size of the triangle, minus all those that haven't been processed yet. 
-			int result_index = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-first_seq_index-1)+blockIdx.x;
-
+		if((dtwPairwiseDistances != 0 || dtwSoS != 0 || dtwListDistances != 0) && threadIdx.x == 0 && newDtwCostSoFar != 0){
+			float distance;
 			// If the alignment has one open end, the medoid calculations will always be biased towards the shortest sequences since the open state is "free",
 			// which is troublesome for retaining consensus features in clusters.  To remove this bias, we will normalize the distance matrix to be relative to the length of the 
 			// shorter sequence with the assumption on average that the shorter sequence is the one generating "free" alignment ends that longer sequences can't compete with.
 			if(use_open_end && !use_open_start || !use_open_end && use_open_start){
-				dtwPairwiseDistances[result_index] = (T) (sqrtf(newDtwCostSoFar[first_seq_length-1])/first_seq_length);
+				distance = sqrtf(newDtwCostSoFar[first_seq_length-1])/first_seq_length;
 			}
 			else{ // use the distance as-is (similar length sequences will tend to cluster together)
-				dtwPairwiseDistances[result_index] = (T) sqrtf(newDtwCostSoFar[first_seq_length-1]);
+				distance = sqrtf(newDtwCostSoFar[first_seq_length-1]);
+			}
+			if(dtwPairwiseDistances != 0){
+				// 1D index for row into distances upper left pairs triangle is the total size of the triangle, minus all those that haven't been processed yet. 
+				size_t result_index = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-first_seq_index-1)+second_seq_index-first_seq_index-1-dtwPairwiseDistancesOffset;
+				// Stored in its own precision (see distance_types.hpp) rather than the sequence value type, e.g. not truncated for integer sequences.
+				dtwPairwiseDistances[result_index] = narrowDistance<D>(distance);
+			}
+			if(dtwListDistances != 0){
+				dtwListDistances[blockIdx.x] = narrowDistance<D>(distance);
+			}
+			if(dtwSoS != 0){
+				double squared_distance = (double) distance*distance;
+				atomicAdd(&dtwSoS[first_seq_index], squared_distance);
+				atomicAdd(&dtwSoS[second_seq_index], squared_distance);
 			}
 		}
 	}
@@ -0,0 +1,299 @@
+#ifndef __dtw_path_writer_hpp_included
+#define __dtw_path_writer_hpp_included
+
+/* Binary DTW path output for the DBA update rounds. Rather than each update thread formatting every cell of every path as text, a dtw_path_writer takes the
+   run-length form of each alignment (see dtw_path_run in dtw.hpp) and a background thread appends it to the current path file, so the update only waits
+   on the disk if the writer falls DTW_PATH_WRITER_QUEUE_LIMIT alignments behind. convertDTWPathFile() (the "paths" subcommand) turns such a file back into
+   the <prefix>.path<N>.txt files of the text format, for scripts like rna_multimodality.sh.
+
+   The file is a dtw_path_file_header, the centroid values, then for each alignment (in the order they finished) a dtw_path_record_header followed by
+   the sequence name, the sequence values and the runs. */
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "dtw.hpp" // for dtw_path_run
+#include "exit_codes.hpp"
+#include "io_utils.hpp" // for writeDTWPathRuns()
+#include "multithreading.h"
+
+// Most alignments waiting to be written before the threads handing them over block
+#define DTW_PATH_WRITER_QUEUE_LIMIT 64
+
+#define DTW_PATH_FILE_MAGIC "OpenDBA_paths_1"
+struct dtw_path_file_header{
+	char magic[16];
+	unsigned long long value_bytes;
+	unsigned long long value_kind; // 'i' (signed integer), 'u' (unsigned integer) or 'f' (floating point)
+	unsigned long long centroid_length;
+};
+
+struct dtw_path_record_header{
+	unsigned long long seq_index;
+	unsigned long long name_length;
+	unsigned long long seq_length;
+	unsigned long long num_runs;
+};
+
+template<typename T>
+struct dtw_path_record{
+	size_t seq_index;
+	std::string name;
+	std::vector<T> seq;
+	std::vector<dtw_path_run> runs;
+};
+
+template<typename T>
+__host__
+unsigned long long dtwPathValueKind(){
+	return std::numeric_limits<T>::is_integer ? (std::numeric_limits<T>::is_signed ? 'i' : 'u') : 'f';
+}
+
+template<typename T>
+struct dtw_path_writer{
+	std::string file_name;
+	std::ofstream file;
+	std::deque<dtw_path_record<T> > queue;
+	std::mutex queue_mutex;
+	std::condition_variable queue_changed;
+	bool writing; // a record taken off the queue is still being written
+	bool finishing;
+	bool finished;
+	CUTThread thread;
+
+	// The background thread lasts as long as the writer, which can write any number of path files one after the other (see open() and close()).
+	dtw_path_writer() : writing(false), finishing(false), finished(false) {
+		thread = cutStartThread((CUT_THREADROUTINE) writerThread, this);
+	}
+
+	// Start a new path file for alignments to the given centroid. The previous one (if any) must have been close()d.
+	__host__ void
+	open(const std::string &path_file_name, const T *centroid, size_t centroid_length){
+		file_name = path_file_name;
+		file.open(file_name.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if(!file.is_open()){
+			std::cerr << "Cannot open DTW path file " << file_name << " for writing" << std::endl;
+			exit(CANNOT_WRITE_DTW_PATH);
+		}
+		dtw_path_file_header header;
+		memset(&header, 0, sizeof(header));
+		strncpy(header.magic, DTW_PATH_FILE_MAGIC, sizeof(header.magic)-1);
+		header.value_bytes = sizeof(T);
+		header.value_kind = dtwPathValueKind<T>();
+		header.centroid_length = centroid_length;
+		file.write((const char *) &header, sizeof(header));
+		file.write((const char *) centroid, sizeof(T)*centroid_length);
+	}
+
+	// Queues a copy of the alignment, so the caller can reuse its buffers right away. Safe to call from several threads at once.
+	__host__ void
+	write(size_t seq_index, const char *seq_name, const T *seq, size_t seq_length, const std::vector<dtw_path_run> &runs){
+		dtw_path_record<T> record;
+		record.seq_index = seq_index;
+		record.name = seq_name;
+		record.seq.assign(seq, seq+seq_length);
+		record.runs = runs;
+		std::unique_lock<std::mutex> lock(queue_mutex);
+		queue_changed.wait(lock, [this]{return queue.size() < DTW_PATH_WRITER_QUEUE_LIMIT;});
+		queue.push_back(std::move(record));
+		queue_changed.notify_all();
+	}
+
+	static CUT_THREADPROC
+	writerThread(void *void_writer){
+		dtw_path_writer<T> *writer = (dtw_path_writer<T> *) void_writer;
+		std::unique_lock<std::mutex> lock(writer->queue_mutex);
+		while(true){
+			writer->queue_changed.wait(lock, [writer]{return !writer->queue.empty() || writer->finishing;});
+			if(writer->queue.empty()){
+				break;
+			}
+			dtw_path_record<T> record = std::move(writer->queue.front());
+			writer->queue.pop_front();
+			writer->writing = true;
+			writer->queue_changed.notify_all();
+			lock.unlock();
+			dtw_path_record_header header;
+			header.seq_index = record.seq_index;
+			header.name_length = record.name.size();
+			header.seq_length = record.seq.size();
+			header.num_runs = record.runs.size();
+			writer->file.write((const char *) &header, sizeof(header));
+			writer->file.write(record.name.data(), record.name.size());
+			writer->file.write((const char *) record.seq.data(), sizeof(T)*record.seq.size());
+			writer->file.write((const char *) record.runs.data(), sizeof(dtw_path_run)*record.runs.size());
+			lock.lock();
+			writer->writing = false;
+			writer->queue_changed.notify_all();
+		}
+		CUT_THREADEND;
+	}
+
+	// Waits for the queued alignments to be written, then closes the current path file.
+	__host__ void
+	close(){
+		if(!file.is_open()){
+			return;
+		}
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_changed.wait(lock, [this]{return queue.empty() && !writing;});
+		}
+		file.close();
+		if(file.fail()){
+			std::cerr << "Could not write DTW path file " << file_name << std::endl;
+			exit(CANNOT_WRITE_DTW_PATH);
+		}
+	}
+
+	// Closes the current path file (if any) and stops the background thread.
+	__host__ void
+	finish(){
+		if(finished){
+			return;
+		}
+		close();
+		{
+			std::lock_guard<std::mutex> lock(queue_mutex);
+			finishing = true;
+		}
+		queue_changed.notify_all();
+		cutEndThread(thread);
+		finished = true;
+	}
+
+	~dtw_path_writer(){
+		finish();
+	}
+};
+
+// Give a finished path file its lasting name, copying it instead if it's still needed under its own name.
+__host__
+void keepDTWPathFile(const std::string &round_file_name, const std::string &kept_file_name, bool copy){
+	if(copy){
+		std::ifstream round_file(round_file_name.c_str(), std::ios::in | std::ios::binary);
+		std::ofstream kept_file(kept_file_name.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		kept_file << round_file.rdbuf();
+		kept_file.close();
+		if(!round_file.is_open() || kept_file.fail()){
+			std::cerr << "Cannot copy DTW path file " << round_file_name << " to " << kept_file_name << std::endl;
+			exit(CANNOT_WRITE_DTW_PATH);
+		}
+		return;
+	}
+#if defined(_WIN32)
+	remove(kept_file_name.c_str()); // rename() does not replace existing files on Windows
+#endif
+	if(rename(round_file_name.c_str(), kept_file_name.c_str())){
+		std::cerr << "Cannot replace DTW path file " << kept_file_name << std::endl;
+		exit(CANNOT_WRITE_DTW_PATH);
+	}
+}
+
+template<typename T>
+__host__
+int convertDTWPathRecords(std::ifstream &path_file, const char *path_file_name, size_t centroid_length, const std::string &text_prefix){
+	std::vector<T> centroid(centroid_length);
+	path_file.read((char *) centroid.data(), sizeof(T)*centroid_length);
+	if(path_file.gcount() != (std::streamsize) (sizeof(T)*centroid_length)){
+		std::cerr << "DTW path file " << path_file_name << " is truncated" << std::endl;
+		return DTW_PATH_FILE_FORMAT_VIOLATION;
+	}
+	dtw_path_record<T> record;
+	dtw_path_record_header header;
+	size_t num_records = 0;
+	while(path_file.read((char *) &header, sizeof(header))){
+		record.name.resize(header.name_length);
+		record.seq.resize(header.seq_length);
+		record.runs.resize(header.num_runs);
+		path_file.read(&record.name[0], header.name_length);
+		path_file.read((char *) record.seq.data(), sizeof(T)*header.seq_length);
+		path_file.read((char *) record.runs.data(), sizeof(dtw_path_run)*header.num_runs);
+		if(!path_file){
+			std::cerr << "DTW path file " << path_file_name << " is truncated after " << num_records << " paths" << std::endl;
+			return DTW_PATH_FILE_FORMAT_VIOLATION;
+		}
+		for(size_t r = 0; r < record.runs.size(); r++){
+			const dtw_path_run &run = record.runs[r];
+			if(run.length == 0 || run.seq_start+(run.length-1)*run.seq_step >= record.seq.size() ||
+			   run.centroid_start+(run.length-1)*run.centroid_step >= centroid_length){
+				std::cerr << "DTW path file " << path_file_name << " has an out of range path for sequence " << header.seq_index << std::endl;
+				return DTW_PATH_FILE_FORMAT_VIOLATION;
+			}
+		}
+		std::string text_file_name = text_prefix+std::string(".path")+std::to_string(header.seq_index)+".txt";
+		std::ofstream text_file(text_file_name.c_str());
+		if(!text_file.is_open()){
+			std::cerr << "Cannot write to " << text_file_name << std::endl;
+			return CANNOT_WRITE_DTW_PATH;
+		}
+		writeDTWPathRuns(record.runs, &text_file, record.seq.data(), const_cast<char *>(record.name.c_str()), centroid.data());
+		text_file.close();
+		if(text_file.fail()){
+			std::cerr << "Could not write " << text_file_name << std::endl;
+			return CANNOT_WRITE_DTW_PATH;
+		}
+		num_records++;
+	}
+	std::cerr << "Wrote " << num_records << " text DTW path files with prefix " << text_prefix << std::endl;
+	return 0;
+}
+
+/* Write each path in a binary DTW path file to <text_prefix>.path<sequence index>.txt, in the text format of writeDTWPathRuns(). If no text_prefix is given,
+ * it's the path file name without its .paths.bin ending, i.e. the text files go where DBA used to write them. Returns 0 or an exit code. */
+__host__
+int convertDTWPathFile(const char *path_file_name, const char *text_prefix = 0){
+	std::ifstream path_file(path_file_name, std::ios::in | std::ios::binary);
+	if(!path_file.is_open()){
+		std::cerr << "Cannot open DTW path file " << path_file_name << " for reading" << std::endl;
+		return CANNOT_READ_DTW_PATH;
+	}
+	dtw_path_file_header header;
+	path_file.read((char *) &header, sizeof(header));
+	if(path_file.gcount() != sizeof(header) || strncmp(header.magic, DTW_PATH_FILE_MAGIC, sizeof(header.magic))){
+		std::cerr << "DTW path file " << path_file_name << " is not in the expected format" << std::endl;
+		return DTW_PATH_FILE_FORMAT_VIOLATION;
+	}
+	std::string prefix;
+	if(text_prefix){
+		prefix = text_prefix;
+	}
+	else{
+		prefix = path_file_name;
+		const std::string ending(".paths.bin");
+		if(prefix.size() > ending.size() && !prefix.compare(prefix.size()-ending.size(), ending.size(), ending)){
+			prefix.erase(prefix.size()-ending.size());
+		}
+	}
+	// The same value types as the DBA input
+	if(header.value_kind == 'i' && header.value_bytes == sizeof(short)){
+		return convertDTWPathRecords<short>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	if(header.value_kind == 'i' && header.value_bytes == sizeof(int)){
+		return convertDTWPathRecords<int>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	if(header.value_kind == 'u' && header.value_bytes == sizeof(unsigned int)){
+		return convertDTWPathRecords<unsigned int>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	if(header.value_kind == 'u' && header.value_bytes == sizeof(unsigned long)){
+		return convertDTWPathRecords<unsigned long>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	if(header.value_kind == 'f' && header.value_bytes == sizeof(float)){
+		return convertDTWPathRecords<float>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	if(header.value_kind == 'f' && header.value_bytes == sizeof(double)){
+		return convertDTWPathRecords<double>(path_file, path_file_name, header.centroid_length, prefix);
+	}
+	std::cerr << "DTW path file " << path_file_name << " has values of an unsupported type" << std::endl;
+	return DTW_PATH_FILE_FORMAT_VIOLATION;
+}
+
+#endif
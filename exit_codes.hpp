@@ -30,4 +30,10 @@
 #define MEMBERSHIP_FILE_FORMAT_VIOLATION 44
 #define CANNOT_READ_DBA_AVG 45
 #define AVG_FILE_FORMAT_VIOLATION 46
+#define CANNOT_READ_DISTANCE_MATRIX 47
+#define DISTANCE_MATRIX_FILE_FORMAT_VIOLATION 48
+#define CANNOT_WRITE_KNN_GRAPH 49
+#define CANNOT_READ_GROUP_CONSENSUSES 50
+#define CANNOT_READ_DTW_PATH 51
+#define DTW_PATH_FILE_FORMAT_VIOLATION 52
 #endif
@@ -14,6 +14,7 @@
 #include <stdexcept>
 #include <string>
 #include <utility>
+#include <vector>
 #include <cstdio>
 
 #if HDF5_SUPPORTED == 1
@@ -216,10 +217,11 @@ int* readMedoidIndices(const char *membership_filename, int num_sequences, char
                     exit(MEMBERSHIP_FILE_FORMAT_VIOLATION);
             }
     }
-    // Rewind to capture the medoids now that we know how many there are.
-    int *medoidIndices = new int[file_num_clusters];
+    // Rewind to capture the medoids now that we know how many there are (cluster numbers start at 0).
+    int *medoidIndices = new int[file_num_clusters+1];
     membership_file.clear();
     membership_file.seekg(0);
+    std::getline(membership_file, line); // the comment line again
     while (std::getline(membership_file, line)) {
 	    // Forgoing checks as input's been validated above.
 	    std::vector<std::string> row_values;
@@ -239,6 +241,22 @@ int* readMedoidIndices(const char *membership_filename, int num_sequences, char
     return medoidIndices;
 }
 
+// One line per sequence with its cluster number and the name of that cluster's medoid, as read back in by readMedoidIndices()
+__host__
+void writeClusterMembership(const char *membership_filename, double cdist, char **sequence_names, int num_sequences, int *sequences_membership, int *medoidIndices){
+	std::ofstream membership_file(membership_filename);
+	if(!membership_file.is_open()){
+		std::cerr << "Cannot open sequence cluster membership file " << membership_filename << " for writing" << std::endl;
+		exit(CANNOT_WRITE_MEMBERSHIP);
+	}
+	membership_file << "## cluster distance threshold was " << cdist << std::endl;
+
+	for (int i = 0; i < num_sequences; i++) {
+		membership_file << sequence_names[i] << "\t" << sequences_membership[i] << "\t" << sequence_names[medoidIndices[sequences_membership[i]]] << std::endl;
+	}
+	membership_file.close();
+}
+
 template <typename T>
 __host__
 int 
@@ -282,17 +300,25 @@ int writeDTWPathMatrix(unsigned char *cpu_stepMatrix, const char *step_filename,
 	return 0;
 }
 
+__host__
+const char *dtwMoveName(unsigned char move){
+	return move == DIAGONAL ? "DIAG" : (move == RIGHT ? "RIGHT" : (move == UP ? "UP" : (move == OPEN_RIGHT ? "OPEN_RIGHT" : (move == NIL ? "NIL" : (move == NIL_OPEN_RIGHT ? "NIL_OPEN_RIGHT" : "?")))));
+}
+
 template <typename T>
 __host__
-int writeDTWPath(unsigned char *cpu_pathMatrix, std::ofstream *path, T *gpu_seq, char *cpu_seqname, size_t gpu_seq_len, T *cpu_centroid, size_t cpu_centroid_len, size_t num_columns, size_t num_rows, size_t pathPitch, int flip_seq_order, int column_offset = 0, int *stripe_rows = 0){
+int writeDTWPath(unsigned char *cpu_pathMatrix, std::ofstream *path, T *gpu_seq, char *cpu_seqname, size_t gpu_seq_len, T *cpu_centroid, size_t cpu_centroid_len, size_t num_columns, size_t num_rows, size_t pathPitch, int flip_seq_order, int column_offset = 0, int *stripe_rows = 0,
+                 T *cpu_seq_copy = 0){
 	if((*path).tellp() == 0){ // Print the sequence name at the top of the file
 		*path << cpu_seqname << std::endl;
 	}
 
-	T *cpu_seq;
-	// TODO: this is pretty inefficient if running multiple rounds of the same seqs (e.g. during convergence, where we never know if it's the last path that we want to capture), ask CPU seq to be passed in
-	cudaMallocHost(&cpu_seq, sizeof(T)*gpu_seq_len); CUERR("Allocating CPU memory for query seq in DTW path printing");
-	cudaMemcpy(cpu_seq, gpu_seq, sizeof(T)*gpu_seq_len, cudaMemcpyDeviceToHost); CUERR("Copying incoming GPU query to CPU in DTW path printing");
+	// Callers printing many paths (e.g. DBAUpdate() during convergence) can pass in a host copy of the sequence they already have
+	T *cpu_seq = cpu_seq_copy;
+	if(!cpu_seq_copy){
+		cudaMallocHost(&cpu_seq, sizeof(T)*gpu_seq_len); CUERR("Allocating CPU memory for query seq in DTW path printing");
+		cudaMemcpy(cpu_seq, gpu_seq, sizeof(T)*gpu_seq_len, cudaMemcpyDeviceToHost); CUERR("Copying incoming GPU query to CPU in DTW path printing");
+	}
 
 	// moveI and moveJ are defined device-side in dtw.hpp, but we are host side so we need to replicate
 	// NIL sentinel value is for the start of the DTW alignment, the stop condition for backtracking (ergo has no corresponding moveI or moveJ)
@@ -304,10 +330,10 @@ int writeDTWPath(unsigned char *cpu_pathMatrix, std::ofstream *path, T *gpu_seq,
 	while (move != NIL && move != NIL_OPEN_RIGHT && (column_offset == 0 || i >= 0 && j >= 0)) { // special stop condition if partially printing the matrix
         	if(flip_seq_order){
 			// Technically NIL and NIL_OPEN_RIGHT should never happen in here, but if they do we know there's a bad bug :-)
-                	*path << column_offset+j << "\t" << cpu_seq[j+column_offset] << "\t" << i << "\t" << cpu_centroid[i] << "\t" << (move == DIAGONAL ? "DIAG" : (move == RIGHT ? "RIGHT" : (move == UP ? "UP" : (move == OPEN_RIGHT ? "OPEN_RIGHT" : (move == NIL ? "NIL" : (move == NIL_OPEN_RIGHT ? "NIL_OPEN_RIGHT" : "?")))))) << std::endl;
+                	*path << column_offset+j << "\t" << cpu_seq[j+column_offset] << "\t" << i << "\t" << cpu_centroid[i] << "\t" << dtwMoveName(move) << std::endl;
         	}
         	else{
-                	*path << i << "\t" << cpu_seq[i] << "\t" << column_offset+j << "\t" << cpu_centroid[j+column_offset] << "\t" << (move == DIAGONAL ? "DIAG" : (move == RIGHT ? "RIGHT" : (move == UP ? "UP" : (move == OPEN_RIGHT ? "OPEN_RIGHT" : (move == NIL ? "NIL" : (move == NIL_OPEN_RIGHT ? "NIL_OPEN_RIGHT" : "?")))))) << std::endl;
+                	*path << i << "\t" << cpu_seq[i] << "\t" << column_offset+j << "\t" << cpu_centroid[j+column_offset] << "\t" << dtwMoveName(move) << std::endl;
         	}
         	i += moveI[move];
         	j += moveJ[move];
@@ -317,11 +343,30 @@ int writeDTWPath(unsigned char *cpu_pathMatrix, std::ofstream *path, T *gpu_seq,
 	if(column_offset == 0){
 		*path << i << "\t" << cpu_seq[i] << "\t" << column_offset+j << "\t" << cpu_centroid[j] << "\t" << (move == NIL ? "NIL" : (move == NIL_OPEN_RIGHT ? "NIL_OPEN_RIGHT" : "?")) << std::endl;
 	}
-	cudaFreeHost(cpu_seq); CUERR("Freeing CPU memory for query seq in DTW path printing");
+	if(!cpu_seq_copy){
+		cudaFreeHost(cpu_seq); CUERR("Freeing CPU memory for query seq in DTW path printing");
+	}
 	if(stripe_rows){*stripe_rows = i+1;}
 	return 0;
 }
 
+/* Same output as writeDTWPath() (the path from its end back to the anchor), but from the run-length form of a path whose sequence and centroid are both already in host memory. */
+template <typename T>
+__host__
+int writeDTWPathRuns(const std::vector<dtw_path_run> &runs, std::ofstream *path, const T *cpu_seq, char *cpu_seqname, const T *cpu_centroid){
+	if((*path).tellp() == 0){ // Print the sequence name at the top of the file
+		*path << cpu_seqname << std::endl;
+	}
+	for(size_t r = runs.size(); r-- > 0; ){
+		for(size_t k = runs[r].length; k-- > 0; ){
+			size_t seq_index = runs[r].seq_start+k*runs[r].seq_step;
+			size_t centroid_index = runs[r].centroid_start+k*runs[r].centroid_step;
+			*path << seq_index << "\t" << cpu_seq[seq_index] << "\t" << centroid_index << "\t" << cpu_centroid[centroid_index] << "\t" << dtwMoveName(runs[r].move) << std::endl;
+		}
+	}
+	return 0;
+}
+
 template <typename T>
 __host__
 int writePairDistMatrix(char *output_prefix, char **sequence_names, size_t num_sequences, T *dtwPairwiseDistances){
@@ -360,6 +405,349 @@ int writePairDistMatrix(char *output_prefix, char **sequence_names, size_t num_s
 	return 0;
 }
 
+// 64-bit FNV-1a hash, used to make sure a distance checkpoint was generated from the same input as the current run.
+__host__
+unsigned long long fnv1aHash(const void *data, size_t num_bytes, unsigned long long hash = 14695981039346656037ULL){
+	const unsigned char *bytes = (const unsigned char *) data;
+	for(size_t i = 0; i < num_bytes; i++){
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Fingerprint of everything that affects the all-vs-all DTW distances: the (sorted, normalized) sequences as laid out for the GPU, their names and the alignment mode.
+template <typename T>
+__host__
+unsigned long long pairDistInputFingerprint(T *evenly_spaced_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end){
+	unsigned long long hash = fnv1aHash(&num_sequences, sizeof(size_t));
+	hash = fnv1aHash(&use_open_start, sizeof(int), hash);
+	hash = fnv1aHash(&use_open_end, sizeof(int), hash);
+	for(size_t i = 0; i < num_sequences; i++){
+		hash = fnv1aHash(sequence_names[i], strlen(sequence_names[i])+1, hash);
+		hash = fnv1aHash(&sequence_lengths[i], sizeof(size_t), hash);
+		hash = fnv1aHash(evenly_spaced_sequences+i*maxSeqLength, sizeof(T)*sequence_lengths[i], hash);
+	}
+	return hash;
+}
+
+// Checkpoint of the all-vs-all DTW distances computed so far: the binary checkpoint file holds the upper right (condensed) distance values
+// in row order, and the text <checkpoint>.manifest says how many rows (and therefore leading values) of it are complete for which input.
+// Only values [first_value, first_value+num_values) are (re)written, so each call costs only the rows completed since the last one.
+// The manifest is replaced only once the data is flushed, so a job killed mid-write resumes from the previous checkpoint.
+template <typename T>
+__host__
+void writePairDistCheckpoint(const char *checkpoint_file_name, T *dtwPairwiseDistances, size_t first_value, size_t num_values,
+                             size_t completed_rows, size_t num_sequences, unsigned long long input_fingerprint){
+	std::fstream checkpoint_file;
+	if(first_value != 0){
+		checkpoint_file.open(checkpoint_file_name, std::ios::in | std::ios::out | std::ios::binary);
+	}
+	if(!checkpoint_file.is_open()){ // new checkpoint, or the existing one disappeared on us
+		checkpoint_file.open(checkpoint_file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+		num_values += first_value;
+		first_value = 0;
+	}
+	if(!checkpoint_file.is_open()){
+		if(!warned_about_checkpoint){
+			warned_about_checkpoint = true;
+			std::cerr << "Cannot open pairwise distance checkpoint file " << checkpoint_file_name <<
+			             " for writing, no checkpointing of the all-vs-all DTW will be done (i.e. computation cannot be resumed if the program dies unexpectedly)" << std::endl;
+		}
+		return;
+	}
+	checkpoint_file.seekp(first_value*sizeof(T));
+	checkpoint_file.write((const char *) (dtwPairwiseDistances+first_value), num_values*sizeof(T));
+	checkpoint_file.close();
+	if(checkpoint_file.fail()){
+		std::cerr << "Warning: could not write pairwise distance checkpoint file " << checkpoint_file_name << std::endl;
+		return;
+	}
+
+	std::string manifest_file_name = CONCAT2(checkpoint_file_name, ".manifest");
+	std::string tmp_manifest_file_name = CONCAT2(manifest_file_name, ".tmp");
+	std::ofstream manifest_file(tmp_manifest_file_name.c_str());
+	if(!manifest_file.is_open()){
+		std::cerr << "Warning: could not write pairwise distance checkpoint manifest file " << tmp_manifest_file_name << std::endl;
+		return;
+	}
+	manifest_file << "num_sequences\t" << num_sequences << std::endl;
+	manifest_file << "value_bytes\t" << sizeof(T) << std::endl;
+	manifest_file << "value_precision\t" << distancePrecisionCode<T>() << std::endl;
+	manifest_file << "input_fingerprint\t" << input_fingerprint << std::endl;
+	manifest_file << "completed_rows\t" << completed_rows << std::endl;
+	manifest_file << "completed_values\t" << (first_value+num_values) << std::endl;
+	manifest_file.close();
+#if defined(_WIN32)
+	remove(manifest_file_name.c_str()); // rename() does not replace existing files on Windows
+#endif
+	if(rename(tmp_manifest_file_name.c_str(), manifest_file_name.c_str()) != 0){
+		std::cerr << "Warning: could not update pairwise distance checkpoint manifest file " << manifest_file_name << std::endl;
+	}
+}
+
+// Load the completed rows of a previous run's all-vs-all DTW distances (see writePairDistCheckpoint()) into dtwPairwiseDistances.
+// Returns the number of complete rows, i.e. the sequence index from which to resume, or 0 if there is no usable checkpoint for this input.
+template <typename T>
+__host__
+size_t readPairDistCheckpoint(const char *checkpoint_file_name, T *dtwPairwiseDistances, size_t num_sequences, unsigned long long input_fingerprint, bool verbose=true){
+	std::string manifest_file_name = CONCAT2(checkpoint_file_name, ".manifest");
+	if(!file_exists(manifest_file_name.c_str())){
+		return 0;
+	}
+	std::ifstream manifest_file(manifest_file_name.c_str());
+	std::string key;
+	unsigned long long value;
+	size_t manifest_num_sequences = 0, value_bytes = 0, completed_rows = 0, completed_values = 0;
+	unsigned long long manifest_fingerprint = 0;
+	int value_precision = DISTANCE_PRECISION_FLOAT;
+	while(manifest_file >> key >> value){
+		if(key == "num_sequences") manifest_num_sequences = value;
+		else if(key == "value_bytes") value_bytes = value;
+		else if(key == "value_precision") value_precision = (int) value;
+		else if(key == "input_fingerprint") manifest_fingerprint = value;
+		else if(key == "completed_rows") completed_rows = value;
+		else if(key == "completed_values") completed_values = value;
+	}
+	manifest_file.close();
+	if(manifest_num_sequences != num_sequences || value_bytes != sizeof(T) || value_precision != distancePrecisionCode<T>() || manifest_fingerprint != input_fingerprint || 
+	   completed_rows >= num_sequences || completed_values > ARITH_SERIES_SUM(num_sequences-1)){
+		std::cerr << "Ignoring existing pairwise distance checkpoint " << checkpoint_file_name <<
+		             " as it was generated from different input data or settings, will recalculate all DTW distances" << std::endl;
+		return 0;
+	}
+
+	std::ifstream checkpoint_file(checkpoint_file_name, std::ios::in | std::ios::binary);
+	if(!checkpoint_file.is_open()){
+		std::cerr << "Cannot open existing pairwise distance checkpoint file " << checkpoint_file_name <<
+		             " for reading, will recalculate all DTW distances" << std::endl;
+		return 0;
+	}
+	checkpoint_file.read((char *) dtwPairwiseDistances, completed_values*sizeof(T));
+	if(checkpoint_file.gcount() != (std::streamsize) (completed_values*sizeof(T))){
+		std::cerr << "Existing pairwise distance checkpoint file " << checkpoint_file_name <<
+		             " is shorter than its manifest says, assuming corrupt checkpoint file and will recalculate all DTW distances" << std::endl;
+		return 0;
+	}
+	checkpoint_file.close();
+	if(verbose){
+		std::cerr << "Resuming all-vs-all DTW distance calculation after " << completed_rows << " of " << (num_sequences-1) <<
+		             " rows based on checkpoint in " << checkpoint_file_name << std::endl;
+	}
+	return completed_rows;
+}
+
+// Header of a binary partial pair distance matrix, as written by each process of a sharded all-vs-all DTW calculation.
+#define PAIR_DIST_SHARD_MAGIC "OpenDBA_shard_2"
+struct pair_dist_shard_header{
+	char magic[16];
+	unsigned long long num_sequences;
+	unsigned long long value_bytes;
+	unsigned long long value_precision; // see distancePrecisionCode()
+	unsigned long long input_fingerprint;
+	unsigned long long first_row; // rows [first_row,last_row) of the upper right matrix, stored contiguously after the header
+	unsigned long long last_row;
+};
+
+__host__
+std::string pairDistShardFileName(const char *output_prefix, int shard_index, int num_shards){
+	std::ostringstream shard_file_name;
+	shard_file_name << output_prefix << ".pair_dists.shard" << shard_index << "of" << num_shards << ".bin";
+	return shard_file_name.str();
+}
+
+// Write the rows [first_row,last_row) of the upper right pairwise distances this shard calculated, which are all dtwPairwiseDistances holds.
+template <typename T>
+__host__
+void writePairDistShard(const char *shard_file_name, T *dtwPairwiseDistances, size_t num_sequences, size_t first_row, size_t last_row, unsigned long long input_fingerprint){
+	std::ofstream shard_file(shard_file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+	if(!shard_file.is_open()){
+		std::cerr << "Cannot open pairwise distance shard file " << shard_file_name << " for writing" << std::endl;
+		exit(CANNOT_WRITE_DISTANCE_MATRIX);
+	}
+	pair_dist_shard_header header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, PAIR_DIST_SHARD_MAGIC, sizeof(header.magic)-1);
+	header.num_sequences = num_sequences;
+	header.value_bytes = sizeof(T);
+	header.value_precision = distancePrecisionCode<T>();
+	header.input_fingerprint = input_fingerprint;
+	header.first_row = first_row;
+	header.last_row = last_row;
+	size_t first_value = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-first_row-1);
+	size_t last_value = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-last_row-1);
+	shard_file.write((const char *) &header, sizeof(header));
+	shard_file.write((const char *) dtwPairwiseDistances, (last_value-first_value)*sizeof(T));
+	shard_file.close();
+	if(shard_file.fail()){
+		std::cerr << "Could not write pairwise distance shard file " << shard_file_name << std::endl;
+		exit(CANNOT_WRITE_DISTANCE_MATRIX);
+	}
+	std::cerr << "Wrote pairwise distance rows " << first_row << " to " << last_row << " to shard file " << shard_file_name << std::endl;
+}
+
+// Binary sparse nearest neighbour graph: the header, then num_edges edges.
+#define KNN_GRAPH_MAGIC "OpenDBA_knn_1"
+struct knn_graph_header{
+	char magic[16];
+	unsigned long long num_sequences;
+	unsigned long long num_neighbours; // K
+	unsigned long long num_edges;
+};
+
+// Sequence indices are in the order of the cluster membership file's lines, first < second.
+struct knn_graph_edge{
+	unsigned long long first;
+	unsigned long long second;
+	double distance;
+};
+
+__host__
+void writeKnnGraph(const char *graph_file_name, size_t num_sequences, int num_neighbours, const std::vector<knn_graph_edge> &edges){
+	std::ofstream graph_file(graph_file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+	if(!graph_file.is_open()){
+		std::cerr << "Cannot open nearest neighbour graph file " << graph_file_name << " for writing" << std::endl;
+		exit(CANNOT_WRITE_KNN_GRAPH);
+	}
+	knn_graph_header header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.magic, KNN_GRAPH_MAGIC, sizeof(header.magic)-1);
+	header.num_sequences = num_sequences;
+	header.num_neighbours = num_neighbours;
+	header.num_edges = edges.size();
+	graph_file.write((const char *) &header, sizeof(header));
+	graph_file.write((const char *) edges.data(), edges.size()*sizeof(knn_graph_edge));
+	graph_file.close();
+	if(graph_file.fail()){
+		std::cerr << "Could not write nearest neighbour graph file " << graph_file_name << std::endl;
+		exit(CANNOT_WRITE_KNN_GRAPH);
+	}
+	std::cerr << "Wrote " << edges.size() << " nearest neighbour graph edges to " << graph_file_name << std::endl;
+}
+
+// Assemble the full upper right pairwise distance matrix from the partial matrices of all num_shards shards of a sharded all-vs-all,
+// checking that they were all generated from this input and that together they cover every row exactly once.
+template <typename T>
+__host__
+void mergePairDistShards(const char *output_prefix, int num_shards, T *dtwPairwiseDistances, size_t num_sequences, unsigned long long input_fingerprint){
+	std::vector<std::pair<unsigned long long,unsigned long long> > row_ranges;
+	for(int shard = 1; shard <= num_shards; shard++){
+		std::string shard_file_name = pairDistShardFileName(output_prefix, shard, num_shards);
+		std::ifstream shard_file(shard_file_name.c_str(), std::ios::in | std::ios::binary);
+		if(!shard_file.is_open()){
+			std::cerr << "Cannot open pairwise distance shard file " << shard_file_name << " for reading, has shard " << shard << "/" << num_shards << " finished?" << std::endl;
+			exit(CANNOT_READ_DISTANCE_MATRIX);
+		}
+		pair_dist_shard_header header;
+		shard_file.read((char *) &header, sizeof(header));
+		if(shard_file.gcount() != sizeof(header) || strncmp(header.magic, PAIR_DIST_SHARD_MAGIC, sizeof(header.magic))){
+			std::cerr << "Pairwise distance shard file " << shard_file_name << " is not in the expected format" << std::endl;
+			exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+		}
+		if(header.num_sequences != num_sequences || header.value_bytes != sizeof(T) || header.value_precision != (unsigned long long) distancePrecisionCode<T>() || header.input_fingerprint != input_fingerprint ||
+		   header.first_row > header.last_row || header.last_row > num_sequences-1){
+			std::cerr << "Pairwise distance shard file " << shard_file_name << " was generated from different input data or settings than this merge" << std::endl;
+			exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+		}
+		size_t first_value = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-header.first_row-1);
+		size_t last_value = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-header.last_row-1);
+		shard_file.read((char *) (dtwPairwiseDistances+first_value), (last_value-first_value)*sizeof(T));
+		if(shard_file.gcount() != (std::streamsize) ((last_value-first_value)*sizeof(T))){
+			std::cerr << "Pairwise distance shard file " << shard_file_name << " is truncated" << std::endl;
+			exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+		}
+		shard_file.close();
+		row_ranges.push_back(std::make_pair(header.first_row, header.last_row));
+	}
+	std::sort(row_ranges.begin(), row_ranges.end());
+	unsigned long long covered_rows = 0;
+	for(size_t i = 0; i < row_ranges.size(); i++){
+		if(row_ranges[i].first != covered_rows){
+			std::cerr << "Pairwise distance shards for " << output_prefix << " do not cover the distance matrix rows exactly once ("
+			          << (row_ranges[i].first < covered_rows ? "overlap" : "gap") << " at row " << std::min(covered_rows, row_ranges[i].first) << ")" << std::endl;
+			exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+		}
+		covered_rows = row_ranges[i].second;
+	}
+	if(covered_rows != num_sequences-1){
+		std::cerr << "Pairwise distance shards for " << output_prefix << " do not cover the distance matrix rows after row " << covered_rows << std::endl;
+		exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+	}
+	std::cerr << "Merged pairwise distances from " << num_shards << " shards" << std::endl;
+}
+
+// Load the sequence catalog (names in matrix order) and the upper right pairwise distances of a previous run with the given output prefix.
+// The exact values come from its complete binary distance checkpoint if available, otherwise they are parsed from the text <prefix>.pair_dists.txt.
+template <typename T>
+__host__
+void readPreviousPairDists(const char *previous_prefix, std::vector<std::string> &sequence_names, std::vector<T> &dtwPairwiseDistances){
+	std::string mats_file_name = CONCAT2(previous_prefix, ".pair_dists.txt");
+	std::ifstream mats(mats_file_name.c_str());
+	if(!mats.is_open()){
+		std::cerr << "Cannot open previous run's pairwise distance file " << mats_file_name << " for reading" << std::endl;
+		exit(CANNOT_READ_DISTANCE_MATRIX);
+	}
+	std::string line;
+	std::vector<std::string> text_values;
+	while(std::getline(mats, line)){
+		std::vector<std::string> row_values;
+		split_line_by_delimiter(line, '\t', row_values);
+		if(row_values.empty()){
+			continue;
+		}
+		// The last line is pro forma (self distance only), and some versions of this program printed it twice
+		if(!sequence_names.empty() && row_values[0] == sequence_names.back() && row_values.size() <= sequence_names.size()+1){
+			continue;
+		}
+		// Row i is the name, i blank padding columns, the self-distance, then the distances to the sequences after it
+		size_t row = sequence_names.size();
+		if(row_values.size() < row+2){
+			std::cerr << "The previous run's pairwise distance file " << mats_file_name << " has a line (#" << (row+1)
+			          << ") with fewer columns than the expected upper right matrix format" << std::endl;
+			exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+		}
+		sequence_names.push_back(row_values[0]);
+		text_values.insert(text_values.end(), row_values.begin()+row+2, row_values.end());
+	}
+	mats.close();
+	size_t num_sequences = sequence_names.size();
+	if(num_sequences < 2 || text_values.size() != ARITH_SERIES_SUM(num_sequences-1)){
+		std::cerr << "The previous run's pairwise distance file " << mats_file_name << " does not contain a complete upper right matrix ("
+		          << text_values.size() << " distances for " << num_sequences << " sequences)" << std::endl;
+		exit(DISTANCE_MATRIX_FILE_FORMAT_VIOLATION);
+	}
+
+	dtwPairwiseDistances.resize(text_values.size());
+	std::string checkpoint_file_name = CONCAT2(previous_prefix, ".pair_dists.ckpt");
+	std::ifstream manifest_file(CONCAT2(checkpoint_file_name, ".manifest").c_str());
+	std::string key;
+	unsigned long long value;
+	size_t manifest_num_sequences = 0, value_bytes = 0, completed_values = 0;
+	int value_precision = DISTANCE_PRECISION_FLOAT;
+	while(manifest_file.is_open() && manifest_file >> key >> value){
+		if(key == "num_sequences") manifest_num_sequences = value;
+		else if(key == "value_bytes") value_bytes = value;
+		else if(key == "value_precision") value_precision = (int) value;
+		else if(key == "completed_values") completed_values = value;
+	}
+	if(manifest_num_sequences == num_sequences && value_bytes == sizeof(T) && value_precision == distancePrecisionCode<T>() && 
+	   completed_values == dtwPairwiseDistances.size()){
+		std::ifstream checkpoint_file(checkpoint_file_name.c_str(), std::ios::in | std::ios::binary);
+		checkpoint_file.read((char *) &dtwPairwiseDistances[0], completed_values*sizeof(T));
+		if(checkpoint_file.gcount() == (std::streamsize) (completed_values*sizeof(T))){
+			std::cerr << "Loaded " << num_sequences << " previously compared sequences from " << checkpoint_file_name << std::endl;
+			return;
+		}
+	}
+	for(size_t i = 0; i < text_values.size(); i++){
+		std::stringstream ss(text_values[i]);
+		float distance;
+		ss >> distance;
+		dtwPairwiseDistances[i] = narrowDistance<T>(distance);
+	}
+	std::cerr << "Loaded " << num_sequences << " previously compared sequences from " << mats_file_name << std::endl;
+}
+
 #if SLOW5_SUPPORTED == 1
 
 // Function to take a SLOW5 file and take a selection of sequences from it. The Raw sequence data of the chosen sequences will be replaced with data passed in from the variable "sequences"
@@ -691,20 +1079,32 @@ int writeFast5Output(const char* fast5_file_name, const char* new_fast5_file, ch
 
 #endif
 
+// Set while several tasks that would each show progress run at once (their titles are still shown)
+bool percentageDisplayMuted = false;
+
 __host__
 void setupPercentageDisplay(std::string title){
 	std::cerr << title << std::endl;
+	if(percentageDisplayMuted){
+		return;
+	}
         std::cerr << "0%        10%       20%       30%       40%       50%       60%       70%       80%       90%       100%" << std::endl;
 }
 
 __host__
 void teardownPercentageDisplay(){
+	if(percentageDisplayMuted){
+		return;
+	}
         std::cerr << std::endl;
 }
 
 __host__
 int updatePercentageComplete(int current_item, int total_items, int alreadyDisplaying){
 	int newDisplayTotal = 100*((float) current_item/total_items);
+	if(percentageDisplayMuted){
+		return newDisplayTotal;
+	}
 	if(newDisplayTotal > alreadyDisplaying){
 		for(; alreadyDisplaying < newDisplayTotal; alreadyDisplaying++){
 			std::cerr << "\b.|";
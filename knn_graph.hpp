@@ -0,0 +1,533 @@
+#ifndef __knn_graph_hpp_included
+#define __knn_graph_hpp_included
+
+/* For very large numbers of sequences the all-vs-all distance matrix is infeasible, but a graph of each sequence's K nearest neighbours (by DTW)
+   is often all that's needed. The graph is approximated with NN-descent (Dong, Moses & Li 2011): starting from random neighbours, the neighbours
+   of neighbours are repeatedly compared, since they are likely to be near each other too. Each round's candidate pairs are calculated on the GPU(s)
+   in batches, after discarding any whose lower bound DTW distance is already too large to improve either sequence's neighbour list.
+   Memory use is O(N*K) rather than O(N^2): each sequence's neighbours of neighbours are O(K^2) pairs, so a round's candidates are generated and
+   calculated a block of sequences at a time, about N*K pairs per batch. */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "cpu_utils.hpp" // for parallelFor()
+#include "cuda_utils.hpp"
+#include "dtw.hpp"
+#include "exit_codes.hpp"
+#include "io_utils.hpp" // for writeKnnGraph()
+
+// Value histogram resolution of each sequence's summary for the DTW lower bound
+#define KNN_LOWER_BOUND_BINS 32
+// Stop NN-descent once a round changes fewer than this fraction of all the neighbour list entries, or after this many rounds
+#define KNN_DESCENT_MIN_UPDATE_FRACTION 0.001
+#define KNN_DESCENT_MAX_ROUNDS 12
+
+struct knn_neighbour{
+	float distance;
+	size_t index;
+	bool is_new; // not yet used to generate candidates
+};
+
+/* Calculate the DTW distances of an explicit (sparse) set of sequence pairs on the GPU(s): for each rows[r] the sequences
+ * columns[column_starts[r]] to columns[column_starts[r+1]-1], which must be ascending and are usually all greater than rows[r] (if not,
+ * rows[r] is still the first, fully aligned, sequence). Distances are written to the matching positions of the distances array. */
+template<typename T>
+__host__
+void
+calculatePairDistanceList(T *gpu_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end,
+                          const std::vector<size_t> &rows, const std::vector<size_t> &column_starts, const std::vector<size_t> &columns, float *distances){
+	if(columns.empty()){
+		return;
+	}
+	int deviceCount;
+	cudaGetDeviceCount(&deviceCount); CUERR("Getting GPU device count in DTW pair list calculation");
+	unsigned int *maxThreads = getMaxThreadsPerDevice(deviceCount);
+	dim3 threadblockDim(maxThreads[0], 1, 1);
+	for(int i = 1; i < deviceCount; i++){
+		if(maxThreads[i] < threadblockDim.x){
+			threadblockDim.x = maxThreads[i];
+		}
+	}
+	cudaFreeHost(maxThreads); CUERR("Freeing CPU memory for device thread properties");
+
+	size_t *gpu_columns;
+	cudaMallocManaged(&gpu_columns, sizeof(size_t)*columns.size()); CUERR("Allocating managed memory for DTW pair list sequence indices");
+	std::copy(columns.begin(), columns.end(), gpu_columns);
+	float *gpu_list_distances;
+	cudaMallocManaged(&gpu_list_distances, sizeof(float)*columns.size()); CUERR("Allocating managed memory for DTW pair list distances");
+
+	int priority_high, priority_low, descendingPriority;
+	cudaDeviceGetStreamPriorityRange(&priority_low, &priority_high);
+	descendingPriority = priority_high;
+	for(size_t r = 0; r < rows.size(); r += deviceCount){
+		size_t dtwCostSoFarSize[deviceCount];
+		T *dtwCostSoFar[deviceCount];
+		T *newDtwCostSoFar[deviceCount];
+		cudaStream_t seq_stream[deviceCount];
+		size_t row_pairs[deviceCount];
+		// Sequences are sorted by length, so the last column of each row is its longest
+		size_t longest_column = 0;
+		for(int currDevice = 0; currDevice < deviceCount && r + currDevice < rows.size(); currDevice++){
+			row_pairs[currDevice] = column_starts[r+currDevice+1]-column_starts[r+currDevice];
+			if(!row_pairs[currDevice]){
+				continue;
+			}
+			longest_column = std::max(longest_column, sequence_lengths[columns[column_starts[r+currDevice+1]-1]]);
+			cudaSetDevice(currDevice);
+			dtwCostSoFarSize[currDevice] = sizeof(T)*sequence_lengths[rows[r+currDevice]]*row_pairs[currDevice];
+			cudaMallocManaged(&dtwCostSoFar[currDevice], dtwCostSoFarSize[currDevice]);  CUERR("Allocating managed memory for DTW pair list intermediate values");
+			cudaMallocManaged(&newDtwCostSoFar[currDevice], dtwCostSoFarSize[currDevice]); CUERR("Allocating managed memory for new DTW pair list intermediate values");
+			cudaStreamCreateWithPriority(&seq_stream[currDevice], cudaStreamNonBlocking, descendingPriority);
+			if(descendingPriority < priority_low){
+				descendingPriority++;
+			}
+		}
+		for(size_t offset_within_seq = 0; offset_within_seq < longest_column; offset_within_seq += threadblockDim.x){
+			for(int currDevice = 0; currDevice < deviceCount && r + currDevice < rows.size(); currDevice++){
+				if(!row_pairs[currDevice]){
+					continue;
+				}
+				cudaSetDevice(currDevice);
+				dim3 gridDim(row_pairs[currDevice], 1, 1);
+				int shared_memory_required = threadblockDim.x*3*sizeof(T);
+				size_t first_pair = column_starts[r+currDevice];
+				DTWDistance<<<gridDim,threadblockDim,shared_memory_required,seq_stream[currDevice]>>>((T *) 0, (size_t) 0, (T *) 0, (size_t) 0, rows[r+currDevice], offset_within_seq, gpu_sequences, maxSeqLength,
+										num_sequences, sequence_lengths, dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice],
+										(unsigned char *) 0, (size_t) 0, (float *) 0, use_open_start, use_open_end, gpu_columns+first_pair, (double *) 0,
+										gpu_list_distances+first_pair); CUERR("DTW vertical swath calculation for pair list");
+				cudaMemcpyAsync(dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], dtwCostSoFarSize[currDevice], cudaMemcpyDeviceToDevice, seq_stream[currDevice]); CUERR("Copying DTW pair list intermediate values");
+			}
+		}
+		for(int currDevice = 0; currDevice < deviceCount && r + currDevice < rows.size(); currDevice++){
+			if(row_pairs[currDevice]){
+				addStreamCleanupCallback(dtwCostSoFar[currDevice], newDtwCostSoFar[currDevice], 0, seq_stream[currDevice]);
+			}
+		}
+	}
+	for(int i = 0; i < deviceCount; i++){
+		cudaSetDevice(i);
+		cudaDeviceSynchronize(); CUERR("Synchronizing CUDA device after DTW pair list calculations");
+	}
+	std::copy(gpu_list_distances, gpu_list_distances+columns.size(), distances);
+	cudaFree(gpu_columns); CUERR("Freeing managed memory for DTW pair list sequence indices");
+	cudaFree(gpu_list_distances); CUERR("Freeing managed memory for DTW pair list distances");
+}
+
+/* A sequence's values summarized as a histogram over bins shared by all sequences, so that a lower bound on its DTW cost against any other sequence
+ * can be had in O(1): every element has to be aligned to at least one element of the other sequence, so costs at least its squared distance to the other's value range.
+ * Stored as prefix sums over the bins of the count, count*(bin's upper edge) and count*(bin's upper edge)^2. */
+struct dtw_lower_bound_summary{
+	double min_value;
+	double max_value;
+	double count[KNN_LOWER_BOUND_BINS+1];
+	double upper_edge_sum[KNN_LOWER_BOUND_BINS+1];
+	double upper_edge_squared_sum[KNN_LOWER_BOUND_BINS+1];
+};
+
+template<typename T>
+__host__
+void
+summarizeForLowerBound(T *sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, std::vector<dtw_lower_bound_summary> &summaries, double *bin_start, double *bin_width){
+	summaries.resize(num_sequences);
+	parallelFor(num_sequences, [&](size_t i, int thread_index){
+		T *sequence = sequences+i*maxSeqLength;
+		summaries[i].min_value = summaries[i].max_value = sequence_lengths[i] ? (double) sequence[0] : 0;
+		for(size_t j = 1; j < sequence_lengths[i]; j++){
+			summaries[i].min_value = std::min(summaries[i].min_value, (double) sequence[j]);
+			summaries[i].max_value = std::max(summaries[i].max_value, (double) sequence[j]);
+		}
+	});
+	*bin_start = summaries[0].min_value;
+	double bin_end = summaries[0].max_value;
+	for(size_t i = 1; i < num_sequences; i++){
+		*bin_start = std::min(*bin_start, summaries[i].min_value);
+		bin_end = std::max(bin_end, summaries[i].max_value);
+	}
+	*bin_width = (bin_end-*bin_start)/KNN_LOWER_BOUND_BINS;
+	parallelFor(num_sequences, [&](size_t i, int thread_index){
+		T *sequence = sequences+i*maxSeqLength;
+		double bin_counts[KNN_LOWER_BOUND_BINS] = {};
+		for(size_t j = 0; j < sequence_lengths[i]; j++){
+			int bin = *bin_width > 0 ? (int) (((double) sequence[j]-*bin_start)/(*bin_width)) : 0;
+			bin_counts[std::min(std::max(bin, 0), KNN_LOWER_BOUND_BINS-1)]++;
+		}
+		summaries[i].count[0] = summaries[i].upper_edge_sum[0] = summaries[i].upper_edge_squared_sum[0] = 0;
+		for(int bin = 0; bin < KNN_LOWER_BOUND_BINS; bin++){
+			double upper_edge = *bin_start+(bin+1)*(*bin_width);
+			summaries[i].count[bin+1] = summaries[i].count[bin]+bin_counts[bin];
+			summaries[i].upper_edge_sum[bin+1] = summaries[i].upper_edge_sum[bin]+bin_counts[bin]*upper_edge;
+			summaries[i].upper_edge_squared_sum[bin+1] = summaries[i].upper_edge_squared_sum[bin]+bin_counts[bin]*upper_edge*upper_edge;
+		}
+	});
+}
+
+// Lower bound on the DTW cost (sum of squared differences) of aligning every element of the summarized sequence to values within [low,high].
+__host__
+inline double
+lowerBoundCostToRange(const dtw_lower_bound_summary &summary, double low, double high, double bin_start, double bin_width){
+	if(bin_width <= 0){
+		return 0;
+	}
+	// Bins entirely below low, i.e. those before the one containing it
+	int low_bin = std::min(std::max((int) ((low-bin_start)/bin_width), 0), KNN_LOWER_BOUND_BINS);
+	double below = low*low*summary.count[low_bin] - 2*low*summary.upper_edge_sum[low_bin] + summary.upper_edge_squared_sum[low_bin];
+	// Bins entirely above high, i.e. those after the one containing it, whose lower edges are their upper edges minus the bin width
+	int high_bin = std::min(std::max((int) ((high-bin_start)/bin_width), 0), KNN_LOWER_BOUND_BINS-1);
+	double count = summary.count[KNN_LOWER_BOUND_BINS]-summary.count[high_bin+1];
+	double lower_edge_sum = summary.upper_edge_sum[KNN_LOWER_BOUND_BINS]-summary.upper_edge_sum[high_bin+1]-bin_width*count;
+	double lower_edge_squared_sum = summary.upper_edge_squared_sum[KNN_LOWER_BOUND_BINS]-summary.upper_edge_squared_sum[high_bin+1] -
+	                                2*bin_width*(summary.upper_edge_sum[KNN_LOWER_BOUND_BINS]-summary.upper_edge_sum[high_bin+1]) + bin_width*bin_width*count;
+	double above = lower_edge_squared_sum - 2*high*lower_edge_sum + high*high*count;
+	return std::max(below, 0.0)+std::max(above, 0.0);
+}
+
+/* Lower bound of the DTW distance (as stored by the DTWDistance kernel) between sequences first < second. The first (shorter) sequence is always
+ * aligned end to end, and so is the second in global mode. */
+__host__
+inline float
+lowerBoundDistance(const std::vector<dtw_lower_bound_summary> &summaries, size_t *sequence_lengths, size_t first, size_t second, int use_open_start, int use_open_end, double bin_start, double bin_width){
+	double cost = lowerBoundCostToRange(summaries[first], summaries[second].min_value, summaries[second].max_value, bin_start, bin_width);
+	if(!use_open_start && !use_open_end){
+		cost = std::max(cost, lowerBoundCostToRange(summaries[second], summaries[first].min_value, summaries[first].max_value, bin_start, bin_width));
+	}
+	// Same normalization as the kernel
+	if(use_open_end && !use_open_start || !use_open_end && use_open_start){
+		return (float) (std::sqrt(cost)/sequence_lengths[first]);
+	}
+	return (float) std::sqrt(cost);
+}
+
+// Add j to i's neighbour list (sorted by distance, at most k long) if it's closer than the current K-th neighbour, returns whether the list changed.
+__host__
+inline bool
+insertNeighbour(std::vector<knn_neighbour> &neighbours, int k, size_t j, float distance){
+	if(neighbours.size() == (size_t) k && distance >= neighbours.back().distance){
+		return false;
+	}
+	for(size_t n = 0; n < neighbours.size(); n++){
+		if(neighbours[n].index == j){
+			return false;
+		}
+	}
+	knn_neighbour new_neighbour = {distance, j, true};
+	neighbours.insert(std::upper_bound(neighbours.begin(), neighbours.end(), new_neighbour,
+	                  [](const knn_neighbour &a, const knn_neighbour &b){ return a.distance < b.distance; }), new_neighbour);
+	if(neighbours.size() > (size_t) k){
+		neighbours.pop_back();
+	}
+	return true;
+}
+
+/* Approximate each sequence's k nearest neighbours with NN-descent. calculatePairs(rows, column_starts, columns, distances) must calculate the listed pairs
+ * (as calculatePairDistanceList() does), and lowerBound(i,j) give a lower bound of the distance between i < j. */
+template<typename L, typename F>
+__host__
+void
+knnDescent(size_t num_sequences, int k, L lowerBound, F calculatePairs, std::vector<std::vector<knn_neighbour> > &neighbours){
+	neighbours.assign(num_sequences, std::vector<knn_neighbour>());
+	std::vector<std::vector<size_t> > candidates(num_sequences);
+	// Start with random neighbours (seeded by sequence so runs are reproducible), or everything if there are no more than k others.
+	parallelFor(num_sequences, [&](size_t i, int thread_index){
+		if(num_sequences-1 <= (size_t) k){
+			for(size_t j = i+1; j < num_sequences; j++){
+				candidates[i].push_back(j);
+			}
+			return;
+		}
+		std::mt19937_64 random_generator(i);
+		while(candidates[i].size() < (size_t) k){
+			size_t j = random_generator()%num_sequences;
+			if(j != i && std::find(candidates[i].begin(), candidates[i].end(), j) == candidates[i].end()){
+				candidates[i].push_back(j);
+			}
+		}
+	});
+	// Candidates are sampled from each sequence's new neighbours (and those that have it as a new neighbour), half a list's worth at a time.
+	size_t sample_size = std::max(1, k/2);
+	size_t num_calculated = 0, num_pruned = 0, total_updates = 0;
+	// Calculate a batch of candidate pairs, each once as (lower index, higher index), leaving out any that are already neighbours or can't become neighbours,
+	// and fold them into the neighbour lists.
+	auto evaluateCandidates = [&](std::vector<std::pair<size_t,size_t> > &pairs){
+		std::sort(pairs.begin(), pairs.end());
+		pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+		std::vector<char> keep_pair(pairs.size());
+		parallelFor(pairs.size(), [&](size_t p, int thread_index){
+			size_t a = pairs[p].first, b = pairs[p].second;
+			for(size_t n = 0; n < neighbours[a].size(); n++){
+				if(neighbours[a][n].index == b){
+					keep_pair[p] = 0;
+					return;
+				}
+			}
+			float kth_a = neighbours[a].size() == (size_t) k ? neighbours[a].back().distance : std::numeric_limits<float>::max();
+			float kth_b = neighbours[b].size() == (size_t) k ? neighbours[b].back().distance : std::numeric_limits<float>::max();
+			keep_pair[p] = lowerBound(a, b) < std::max(kth_a, kth_b);
+		}, 0, 1024);
+		std::vector<size_t> rows, column_starts, columns;
+		for(size_t p = 0; p < pairs.size(); p++){
+			if(!keep_pair[p]){
+				continue;
+			}
+			if(rows.empty() || rows.back() != pairs[p].first){
+				rows.push_back(pairs[p].first);
+				column_starts.push_back(columns.size());
+			}
+			columns.push_back(pairs[p].second);
+		}
+		column_starts.push_back(columns.size());
+		num_pruned += pairs.size()-columns.size();
+		num_calculated += columns.size();
+		std::vector<std::pair<size_t,size_t> >().swap(pairs);
+		std::vector<float> distances(columns.size());
+		calculatePairs(rows, column_starts, columns, distances.data());
+
+		// Each sequence's list is only updated by the thread handling that sequence, from the pairs it's part of (bucketed by counting sort).
+		std::vector<size_t> incident_start(num_sequences+1, 0);
+		for(size_t r = 0; r < rows.size(); r++){
+			incident_start[rows[r]+1] += column_starts[r+1]-column_starts[r];
+			for(size_t c = column_starts[r]; c < column_starts[r+1]; c++){
+				incident_start[columns[c]+1]++;
+			}
+		}
+		for(size_t i = 0; i < num_sequences; i++){
+			incident_start[i+1] += incident_start[i];
+		}
+		std::vector<std::pair<size_t,float> > incident(incident_start[num_sequences]);
+		std::vector<size_t> incident_cursor(incident_start.begin(), incident_start.end()-1);
+		for(size_t r = 0; r < rows.size(); r++){
+			for(size_t c = column_starts[r]; c < column_starts[r+1]; c++){
+				incident[incident_cursor[rows[r]]++] = std::make_pair(columns[c], distances[c]);
+				incident[incident_cursor[columns[c]]++] = std::make_pair(rows[r], distances[c]);
+			}
+		}
+		std::vector<size_t> num_updates(num_sequences, 0);
+		parallelFor(num_sequences, [&](size_t i, int thread_index){
+			for(size_t e = incident_start[i]; e < incident_start[i+1]; e++){
+				num_updates[i] += insertNeighbour(neighbours[i], k, incident[e].first, incident[e].second);
+			}
+		}, 0, 256);
+		for(size_t i = 0; i < num_sequences; i++){
+			total_updates += num_updates[i];
+		}
+	};
+	for(int descent_round = 0; ; descent_round++){
+		num_calculated = num_pruned = total_updates = 0;
+		if(!descent_round){
+			std::vector<std::pair<size_t,size_t> > pairs;
+			for(size_t i = 0; i < num_sequences; i++){
+				for(size_t c = 0; c < candidates[i].size(); c++){
+					pairs.push_back(std::make_pair(std::min(i, candidates[i][c]), std::max(i, candidates[i][c])));
+				}
+			}
+			std::vector<std::vector<size_t> >().swap(candidates);
+			evaluateCandidates(pairs);
+		}
+		else{
+			// Local join: the new neighbours of each sequence (forward and reverse) are compared to each other and to the old ones.
+			std::vector<std::vector<size_t> > new_neighbours(num_sequences), old_neighbours(num_sequences);
+			parallelFor(num_sequences, [&](size_t i, int thread_index){
+				std::vector<size_t> fresh;
+				for(size_t n = 0; n < neighbours[i].size(); n++){
+					if(neighbours[i][n].is_new){
+						fresh.push_back(n);
+					}
+					else{
+						old_neighbours[i].push_back(neighbours[i][n].index);
+					}
+				}
+				if(fresh.size() > sample_size){
+					std::mt19937_64 random_generator(i*KNN_DESCENT_MAX_ROUNDS+descent_round);
+					std::shuffle(fresh.begin(), fresh.end(), random_generator);
+					fresh.resize(sample_size);
+				}
+				for(size_t f = 0; f < fresh.size(); f++){
+					neighbours[i][fresh[f]].is_new = false;
+					new_neighbours[i].push_back(neighbours[i][fresh[f]].index);
+				}
+			}, 0, 256);
+			std::vector<std::vector<size_t> > reverse_new(num_sequences), reverse_old(num_sequences);
+			for(size_t i = 0; i < num_sequences; i++){
+				for(size_t n = 0; n < new_neighbours[i].size(); n++){
+					reverse_new[new_neighbours[i][n]].push_back(i);
+				}
+				for(size_t n = 0; n < old_neighbours[i].size(); n++){
+					reverse_old[old_neighbours[i][n]].push_back(i);
+				}
+			}
+			parallelFor(num_sequences, [&](size_t i, int thread_index){
+				std::mt19937_64 random_generator(i*KNN_DESCENT_MAX_ROUNDS+descent_round);
+				for(int list = 0; list < 2; list++){
+					std::vector<size_t> &reverse = list ? reverse_old[i] : reverse_new[i];
+					if(reverse.size() > sample_size){
+						std::shuffle(reverse.begin(), reverse.end(), random_generator);
+						reverse.resize(sample_size);
+					}
+				}
+				new_neighbours[i].insert(new_neighbours[i].end(), reverse_new[i].begin(), reverse_new[i].end());
+				old_neighbours[i].insert(old_neighbours[i].end(), reverse_old[i].begin(), reverse_old[i].end());
+				std::vector<size_t>().swap(reverse_new[i]);
+				std::vector<size_t>().swap(reverse_old[i]);
+			}, 0, 256);
+			// Each sequence's join is O(K^2) pairs, so they're evaluated for blocks of sequences with about N*K pairs between them, keeping memory use O(N*K).
+			auto joinSize = [&](size_t i){
+				size_t num_new = new_neighbours[i].size();
+				return num_new*(num_new-1)/2+num_new*old_neighbours[i].size();
+			};
+			size_t max_block_pairs = num_sequences*k;
+			for(size_t block_start = 0; block_start < num_sequences; ){
+				std::vector<size_t> join_start(1, 0);
+				size_t block_end = block_start;
+				while(block_end < num_sequences && (block_end == block_start || join_start.back()+joinSize(block_end) <= max_block_pairs)){
+					join_start.push_back(join_start.back()+joinSize(block_end++));
+				}
+				std::vector<std::pair<size_t,size_t> > pairs(join_start.back());
+				parallelFor(block_end-block_start, [&](size_t b, int thread_index){
+					size_t i = block_start+b;
+					std::vector<size_t> &fresh = new_neighbours[i];
+					std::pair<size_t,size_t> *join = pairs.data()+join_start[b];
+					for(size_t f = 0; f < fresh.size(); f++){
+						for(size_t g = f+1; g < fresh.size(); g++){
+							*join++ = std::make_pair(std::min(fresh[f], fresh[g]), std::max(fresh[f], fresh[g]));
+						}
+						for(size_t o = 0; o < old_neighbours[i].size(); o++){
+							*join++ = std::make_pair(std::min(fresh[f], old_neighbours[i][o]), std::max(fresh[f], old_neighbours[i][o]));
+						}
+					}
+				}, 0, 256);
+				// A sequence can be both a forward and reverse neighbour
+				pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [](const std::pair<size_t,size_t> &pair){ return pair.first == pair.second; }), pairs.end());
+				evaluateCandidates(pairs);
+				block_start = block_end;
+			}
+		}
+		std::cerr << "Nearest neighbour search round " << (descent_round+1) << ": calculated " << num_calculated << " DTW distances (" << num_pruned
+		          << " candidate pairs pruned), " << total_updates << " neighbour list updates" << std::endl;
+		if(total_updates <= KNN_DESCENT_MIN_UPDATE_FRACTION*num_sequences*k || descent_round+1 >= KNN_DESCENT_MAX_ROUNDS){
+			break;
+		}
+	}
+}
+
+/* Cluster using the approximate K nearest neighbour graph instead of the all-vs-all distance matrix. Clusters are the connected components
+ * of the mutual nearest neighbours graph (i.e. both sequences are in each other's list), keeping only edges shorter than cdist times
+ * the longest neighbour distance, or as always cdist 1 puts everything in one cluster. The graph is written to <output_prefix>.knn_graph.bin.
+ * Without all the distances, each cluster's medoid is the member with the smallest sum of squared distances over the graph edges within the cluster,
+ * counting missing edges as the cluster's longest one. */
+template<typename T>
+__host__
+int*
+knnGraphMedoidIndices(T *gpu_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end,
+                      char *output_prefix, double cdist, int k, int *memberships){
+	if(k >= num_sequences){
+		k = num_sequences-1;
+	}
+	std::cerr << std::endl << "Approximating the " << k << " nearest neighbours of each sequence" << std::endl;
+	std::vector<dtw_lower_bound_summary> summaries;
+	double bin_start, bin_width;
+	summarizeForLowerBound(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, summaries, &bin_start, &bin_width);
+	std::vector<std::vector<knn_neighbour> > neighbours;
+	knnDescent(num_sequences, k,
+	           [&](size_t first, size_t second){
+	               return lowerBoundDistance(summaries, sequence_lengths, first, second, use_open_start, use_open_end, bin_start, bin_width); },
+	           [&](const std::vector<size_t> &rows, const std::vector<size_t> &column_starts, const std::vector<size_t> &columns, float *distances){
+	               calculatePairDistanceList(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, use_open_start, use_open_end, rows, column_starts, columns, distances); },
+	           neighbours);
+	std::vector<dtw_lower_bound_summary>().swap(summaries);
+
+	// The undirected graph, each edge once with the lower index first
+	std::vector<knn_graph_edge> edges;
+	double max_distance = 0;
+	for(size_t i = 0; i < num_sequences; i++){
+		for(size_t n = 0; n < neighbours[i].size(); n++){
+			knn_graph_edge edge = {std::min(i, neighbours[i][n].index), std::max(i, neighbours[i][n].index), neighbours[i][n].distance};
+			edges.push_back(edge);
+			max_distance = std::max(max_distance, (double) neighbours[i][n].distance);
+		}
+	}
+	std::sort(edges.begin(), edges.end(), [](const knn_graph_edge &a, const knn_graph_edge &b){ return a.first < b.first || a.first == b.first && a.second < b.second; });
+	// An edge appearing twice was in both sequences' lists
+	std::vector<char> is_mutual(edges.size(), 0);
+	size_t num_unique = 0;
+	for(size_t e = 0; e < edges.size(); e++){
+		if(num_unique && edges[num_unique-1].first == edges[e].first && edges[num_unique-1].second == edges[e].second){
+			is_mutual[num_unique-1] = 1;
+		}
+		else{
+			edges[num_unique++] = edges[e];
+		}
+	}
+	edges.resize(num_unique);
+	is_mutual.resize(num_unique);
+	writeKnnGraph(CONCAT2(output_prefix, ".knn_graph.bin").c_str(), num_sequences, k, edges);
+
+	// Connected components by union-find
+	std::vector<size_t> component(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		component[i] = i;
+	}
+	auto findRoot = [&](size_t i){
+		while(component[i] != i){
+			component[i] = component[component[i]];
+			i = component[i];
+		}
+		return i;
+	};
+	double max_edge_distance = cdist*max_distance;
+	for(size_t e = 0; e < edges.size(); e++){
+		if(is_mutual[e] && edges[e].distance < max_edge_distance){
+			size_t a = findRoot(edges[e].first), b = findRoot(edges[e].second);
+			component[std::max(a, b)] = std::min(a, b);
+		}
+	}
+	if(cdist >= 1){
+		std::fill(component.begin(), component.end(), 0);
+	}
+	// Number the clusters in order of their first member
+	std::vector<int> cluster_of_root(num_sequences, -1);
+	int num_clusters = 0;
+	for(size_t i = 0; i < num_sequences; i++){
+		size_t root = findRoot(i);
+		if(cluster_of_root[root] == -1){
+			cluster_of_root[root] = num_clusters++;
+		}
+		memberships[i] = cluster_of_root[root];
+	}
+
+	std::vector<double> sos(num_sequences, 0);
+	std::vector<size_t> degree(num_sequences, 0);
+	std::vector<double> cluster_max_distance(num_clusters, 0);
+	std::vector<size_t> cluster_size(num_clusters, 0);
+	for(size_t i = 0; i < num_sequences; i++){
+		cluster_size[memberships[i]]++;
+	}
+	for(size_t e = 0; e < edges.size(); e++){
+		if(memberships[edges[e].first] == memberships[edges[e].second]){
+			double distance = edges[e].distance;
+			sos[edges[e].first] += distance*distance;
+			sos[edges[e].second] += distance*distance;
+			degree[edges[e].first]++;
+			degree[edges[e].second]++;
+			cluster_max_distance[memberships[edges[e].first]] = std::max(cluster_max_distance[memberships[edges[e].first]], distance);
+		}
+	}
+	int *medoidIndices = new int[num_clusters];
+	std::vector<double> lowest_sos(num_clusters, std::numeric_limits<double>::max());
+	for(size_t i = 0; i < num_sequences; i++){
+		int cluster = memberships[i];
+		double missing_sos = (cluster_size[cluster]-1-degree[i])*cluster_max_distance[cluster]*cluster_max_distance[cluster];
+		// Same as the dense case for two members: the longer one, which is the later one as sequences are sorted by length
+		if(sos[i]+missing_sos < lowest_sos[cluster] || cluster_size[cluster] == 2){
+			lowest_sos[cluster] = sos[i]+missing_sos;
+			medoidIndices[cluster] = i;
+		}
+	}
+	std::cerr << "Found " << num_clusters << " connected components in the mutual nearest neighbours graph" << std::endl;
+	return medoidIndices;
+}
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef __landmark_clustering_hpp_included
+#define __landmark_clustering_hpp_included
+
+/* Approximate clustering into K clusters for read sets too big for the all-vs-all distance matrix. L landmark sequences are picked farthest-first,
+   and only the N*L DTW distances to them are calculated. Landmark MDS (de Silva & Tenenbaum 2004), i.e. the Nystrom approximation of classical
+   multidimensional scaling, then embeds every sequence in (at most) L dimensional Euclidean space preserving its distances to the landmarks,
+   where K-means finds the clusters. Each cluster's medoid is picked with exact DTW distances, but only for the few members nearest the cluster's mean
+   in the embedding. The O(N^2) DTWs become O(N*L). */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "cpu_utils.hpp" // for parallelFor()
+#include "knn_graph.hpp" // for calculatePairDistanceList()
+
+// Split a sequence's comparisons into kernel launches of at most this many pairs, to bound the DTW intermediate values' memory
+#define LANDMARK_PAIRS_PER_LAUNCH 16384
+// Eigenvalues this small relative to the largest (i.e. float distance rounding) don't add an embedding dimension
+#define LANDMARK_MIN_EIGENVALUE_FRACTION 1e-6
+#define LANDMARK_JACOBI_MAX_SWEEPS 50
+#define KMEANS_MAX_ITERATIONS 100
+// Number of members nearest each cluster's mean in the embedding that are medoid candidates
+#define LANDMARK_MEDOID_CANDIDATES 8
+
+// Add the comparisons of sequence row against each of others (ascending) to a DTW pair list, in as many launches as needed.
+__host__
+void
+appendPairListRow(size_t row, const std::vector<size_t> &others, std::vector<size_t> &rows, std::vector<size_t> &column_starts, std::vector<size_t> &columns){
+	for(size_t start = 0; start < others.size(); start += LANDMARK_PAIRS_PER_LAUNCH){
+		if(column_starts.empty()){
+			column_starts.push_back(0);
+		}
+		rows.push_back(row);
+		columns.insert(columns.end(), others.begin()+start, others.begin()+std::min(others.size(), start+LANDMARK_PAIRS_PER_LAUNCH));
+		column_starts.push_back(columns.size());
+	}
+}
+
+/* Eigen decomposition of the symmetric n x n matrix (row major, destroyed) by cyclic Jacobi rotations. The eigenvectors are the columns of eigenvectors.
+ * Fine for the few hundred landmarks this is used with, as it's O(n^3) per sweep. */
+__host__
+void
+symmetricEigen(std::vector<double> &matrix, size_t n, std::vector<double> &eigenvalues, std::vector<double> &eigenvectors){
+	eigenvectors.assign(n*n, 0);
+	for(size_t i = 0; i < n; i++){
+		eigenvectors[i*n+i] = 1;
+	}
+	for(int sweep = 0; sweep < LANDMARK_JACOBI_MAX_SWEEPS; sweep++){
+		double off_diagonal = 0, diagonal = 0;
+		for(size_t p = 0; p < n; p++){
+			diagonal += matrix[p*n+p]*matrix[p*n+p];
+			for(size_t q = p+1; q < n; q++){
+				off_diagonal += matrix[p*n+q]*matrix[p*n+q];
+			}
+		}
+		if(off_diagonal <= 1e-24*diagonal){
+			break;
+		}
+		for(size_t p = 0; p < n; p++){
+			for(size_t q = p+1; q < n; q++){
+				if(matrix[p*n+q] == 0){
+					continue;
+				}
+				// The rotation that zeroes element (p,q)
+				double theta = (matrix[q*n+q]-matrix[p*n+p])/(2*matrix[p*n+q]);
+				double t = (theta < 0 ? -1.0 : 1.0)/(fabs(theta)+sqrt(theta*theta+1));
+				double c = 1/sqrt(t*t+1);
+				double s = t*c;
+				for(size_t k = 0; k < n; k++){
+					double kp = matrix[k*n+p], kq = matrix[k*n+q];
+					matrix[k*n+p] = c*kp-s*kq;
+					matrix[k*n+q] = s*kp+c*kq;
+				}
+				for(size_t k = 0; k < n; k++){
+					double pk = matrix[p*n+k], qk = matrix[q*n+k];
+					matrix[p*n+k] = c*pk-s*qk;
+					matrix[q*n+k] = s*pk+c*qk;
+				}
+				for(size_t k = 0; k < n; k++){
+					double kp = eigenvectors[k*n+p], kq = eigenvectors[k*n+q];
+					eigenvectors[k*n+p] = c*kp-s*kq;
+					eigenvectors[k*n+q] = s*kp+c*kq;
+				}
+			}
+		}
+	}
+	eigenvalues.resize(n);
+	for(size_t i = 0; i < n; i++){
+		eigenvalues[i] = matrix[i*n+i];
+	}
+}
+
+/* Landmark MDS: given each landmark's distances to all the sequences (landmark_distances[l*num_sequences+i]), embed the sequences in as many dimensions
+ * as the double centred squared landmark distance matrix has positive eigenvalues. Returns the number of dimensions, embedding is num_sequences x that. */
+__host__
+size_t
+landmarkEmbedding(const std::vector<float> &landmark_distances, const std::vector<size_t> &landmarks, size_t num_sequences, std::vector<float> &embedding){
+	size_t num_landmarks = landmarks.size();
+	// Squared distances between the landmarks, symmetrized as in the open end modes it matters which one was aligned in full
+	std::vector<double> squared(num_landmarks*num_landmarks);
+	for(size_t a = 0; a < num_landmarks; a++){
+		for(size_t b = 0; b < num_landmarks; b++){
+			double ab = landmark_distances[a*num_sequences+landmarks[b]], ba = landmark_distances[b*num_sequences+landmarks[a]];
+			squared[a*num_landmarks+b] = (ab*ab+ba*ba)/2;
+		}
+	}
+	std::vector<double> mean_squared(num_landmarks, 0);
+	double grand_mean = 0;
+	for(size_t a = 0; a < num_landmarks; a++){
+		for(size_t b = 0; b < num_landmarks; b++){
+			mean_squared[a] += squared[a*num_landmarks+b]/num_landmarks;
+		}
+		grand_mean += mean_squared[a]/num_landmarks;
+	}
+	std::vector<double> centred(num_landmarks*num_landmarks);
+	for(size_t a = 0; a < num_landmarks; a++){
+		for(size_t b = 0; b < num_landmarks; b++){
+			centred[a*num_landmarks+b] = -(squared[a*num_landmarks+b]-mean_squared[a]-mean_squared[b]+grand_mean)/2;
+		}
+	}
+	std::vector<double> eigenvalues, eigenvectors;
+	symmetricEigen(centred, num_landmarks, eigenvalues, eigenvectors);
+	double max_eigenvalue = *std::max_element(eigenvalues.begin(), eigenvalues.end());
+	// Each kept dimension's projection row is its eigenvector scaled by -1/(2*sqrt(eigenvalue))
+	std::vector<double> projection;
+	for(size_t e = 0; e < num_landmarks; e++){
+		if(eigenvalues[e] > 0 && eigenvalues[e] > LANDMARK_MIN_EIGENVALUE_FRACTION*max_eigenvalue){
+			for(size_t a = 0; a < num_landmarks; a++){
+				projection.push_back(-eigenvectors[a*num_landmarks+e]/(2*sqrt(eigenvalues[e])));
+			}
+		}
+	}
+	size_t num_dimensions = projection.size()/num_landmarks;
+	embedding.resize(num_sequences*num_dimensions);
+	parallelFor(num_sequences, [&](size_t i, int thread_index){
+		for(size_t d = 0; d < num_dimensions; d++){
+			double coordinate = 0;
+			for(size_t a = 0; a < num_landmarks; a++){
+				double distance = landmark_distances[a*num_sequences+i];
+				coordinate += projection[d*num_landmarks+a]*(distance*distance-mean_squared[a]);
+			}
+			embedding[i*num_dimensions+d] = (float) coordinate;
+		}
+	}, 0, 256);
+	return num_dimensions;
+}
+
+__host__
+double
+squaredEuclidean(const float *a, const float *b, size_t num_dimensions){
+	double sum = 0;
+	for(size_t d = 0; d < num_dimensions; d++){
+		double diff = (double) a[d]-b[d];
+		sum += diff*diff;
+	}
+	return sum;
+}
+
+/* Lloyd's K-means of the points (num_points x num_dimensions) from a k-means++ (seeded, so runs are reproducible) start, until no point changes cluster.
+ * Means are recalculated per cluster over its members in index order, so the result doesn't depend on the number of threads. */
+__host__
+void
+kMeans(const std::vector<float> &points, size_t num_points, size_t num_dimensions, int k, std::vector<int> &assignments, std::vector<float> &means){
+	means.assign(k*num_dimensions, 0);
+	std::vector<double> nearest_squared(num_points, std::numeric_limits<double>::max());
+	std::mt19937_64 random_generator(0);
+	size_t next_mean = random_generator()%num_points;
+	for(int c = 0; c < k; c++){
+		std::copy(points.begin()+next_mean*num_dimensions, points.begin()+(next_mean+1)*num_dimensions, means.begin()+c*num_dimensions);
+		parallelFor(num_points, [&](size_t i, int thread_index){
+			nearest_squared[i] = std::min(nearest_squared[i], squaredEuclidean(&points[i*num_dimensions], &means[c*num_dimensions], num_dimensions));
+		}, 0, 1024);
+		// The next mean is a point drawn with probability proportional to its squared distance from the nearest mean so far
+		double total = 0;
+		for(size_t i = 0; i < num_points; i++){
+			total += nearest_squared[i];
+		}
+		double target = std::uniform_real_distribution<double>(0, total)(random_generator);
+		for(next_mean = 0; next_mean < num_points-1 && (target -= nearest_squared[next_mean]) >= 0; next_mean++);
+	}
+
+	assignments.assign(num_points, -1);
+	std::vector<size_t> cluster_start(k+1), cluster_members(num_points);
+	for(int iteration = 0; iteration < KMEANS_MAX_ITERATIONS; iteration++){
+		std::vector<char> changed(num_points, 0);
+		parallelFor(num_points, [&](size_t i, int thread_index){
+			int nearest = 0;
+			double nearest_distance = std::numeric_limits<double>::max();
+			for(int c = 0; c < k; c++){
+				double distance = squaredEuclidean(&points[i*num_dimensions], &means[c*num_dimensions], num_dimensions);
+				if(distance < nearest_distance){
+					nearest_distance = distance;
+					nearest = c;
+				}
+			}
+			changed[i] = assignments[i] != nearest;
+			assignments[i] = nearest;
+		}, 0, 1024);
+		if(std::find(changed.begin(), changed.end(), 1) == changed.end()){
+			break;
+		}
+		std::fill(cluster_start.begin(), cluster_start.end(), 0);
+		for(size_t i = 0; i < num_points; i++){
+			cluster_start[assignments[i]+1]++;
+		}
+		for(int c = 0; c < k; c++){
+			cluster_start[c+1] += cluster_start[c];
+		}
+		std::vector<size_t> next_slot(cluster_start.begin(), cluster_start.end()-1);
+		for(size_t i = 0; i < num_points; i++){
+			cluster_members[next_slot[assignments[i]]++] = i;
+		}
+		// An empty cluster keeps its old mean
+		parallelFor(k, [&](size_t c, int thread_index){
+			if(cluster_start[c] == cluster_start[c+1]){
+				return;
+			}
+			std::vector<double> sum(num_dimensions, 0);
+			for(size_t m = cluster_start[c]; m < cluster_start[c+1]; m++){
+				for(size_t d = 0; d < num_dimensions; d++){
+					sum[d] += points[cluster_members[m]*num_dimensions+d];
+				}
+			}
+			for(size_t d = 0; d < num_dimensions; d++){
+				means[c*num_dimensions+d] = (float) (sum[d]/(cluster_start[c+1]-cluster_start[c]));
+			}
+		});
+	}
+}
+
+/* Cluster into (int) cdist clusters by K-means over the landmark MDS embedding of the sequences, see the top of this file.
+ * Clusters are numbered in order of their first member, and any left empty by K-means are dropped. */
+template<typename T>
+__host__
+int*
+landmarkMedoidIndices(T *gpu_sequences, size_t maxSeqLength, size_t num_sequences, size_t *sequence_lengths, int use_open_start, int use_open_end,
+                      double cdist, int num_landmarks, int *memberships){
+	auto calculatePairs = [&](const std::vector<size_t> &rows, const std::vector<size_t> &column_starts, const std::vector<size_t> &columns, float *distances){
+		calculatePairDistanceList(gpu_sequences, maxSeqLength, num_sequences, sequence_lengths, use_open_start, use_open_end, rows, column_starts, columns, distances);
+	};
+	if((size_t) num_landmarks > num_sequences){
+		num_landmarks = num_sequences;
+	}
+	std::cerr << std::endl << "Calculating the DTW distances to " << num_landmarks << " landmark sequences" << std::endl;
+	// Farthest-first from the median length sequence: each next landmark is the sequence farthest from all the landmarks so far
+	std::vector<size_t> landmarks(1, num_sequences/2);
+	std::vector<float> landmark_distances;
+	std::vector<float> nearest_landmark_distance(num_sequences, std::numeric_limits<float>::max());
+	while(true){
+		size_t landmark = landmarks.back();
+		std::vector<size_t> others, rows, column_starts, columns;
+		for(size_t i = 0; i < num_sequences; i++){
+			if(i != landmark){
+				others.push_back(i);
+			}
+		}
+		appendPairListRow(landmark, others, rows, column_starts, columns);
+		std::vector<float> distances(columns.size());
+		calculatePairs(rows, column_starts, columns, distances.data());
+		landmark_distances.resize(landmarks.size()*num_sequences);
+		float *distances_to_landmark = &landmark_distances[(landmarks.size()-1)*num_sequences];
+		for(size_t c = 0; c < columns.size(); c++){
+			distances_to_landmark[columns[c]] = distances[c];
+		}
+		distances_to_landmark[landmark] = 0;
+		size_t farthest = 0;
+		for(size_t i = 0; i < num_sequences; i++){
+			nearest_landmark_distance[i] = std::min(nearest_landmark_distance[i], distances_to_landmark[i]);
+			if(nearest_landmark_distance[i] > nearest_landmark_distance[farthest]){
+				farthest = i;
+			}
+		}
+		// Nothing left that isn't identical to a landmark
+		if(landmarks.size() == (size_t) num_landmarks || nearest_landmark_distance[farthest] == 0){
+			break;
+		}
+		landmarks.push_back(farthest);
+	}
+
+	std::vector<float> embedding;
+	size_t num_dimensions = landmarkEmbedding(landmark_distances, landmarks, num_sequences, embedding);
+	std::vector<float>().swap(landmark_distances);
+	int k = (int) cdist;
+	if((size_t) k > num_sequences){
+		k = num_sequences;
+	}
+	std::cerr << "Embedded the sequences in " << num_dimensions << " dimensions using " << landmarks.size() << " landmarks, K-means clustering them into " << k << " clusters" << std::endl;
+	std::vector<int> assignments;
+	std::vector<float> means;
+	if(num_dimensions){
+		kMeans(embedding, num_sequences, num_dimensions, k, assignments, means);
+	}
+	else{
+		// All the sequences are identical
+		assignments.assign(num_sequences, 0);
+	}
+
+	// Number the clusters in order of their first member
+	std::vector<int> cluster_number(k, -1), kmeans_cluster;
+	int num_clusters = 0;
+	for(size_t i = 0; i < num_sequences; i++){
+		if(cluster_number[assignments[i]] == -1){
+			cluster_number[assignments[i]] = num_clusters++;
+			kmeans_cluster.push_back(assignments[i]);
+		}
+		memberships[i] = cluster_number[assignments[i]];
+	}
+	std::vector<std::vector<size_t> > members(num_clusters);
+	for(size_t i = 0; i < num_sequences; i++){
+		members[memberships[i]].push_back(i);
+	}
+
+	// The medoid candidates are the members nearest their cluster's mean in the embedding, compared exactly with all the other members.
+	int *medoidIndices = new int[num_clusters];
+	std::vector<size_t> candidates, rows, column_starts, columns;
+	std::vector<int> candidate_cluster;
+	for(int c = 0; c < num_clusters; c++){
+		// Same as the dense case for up to two members: the longer one, which is the later one as sequences are sorted by length
+		medoidIndices[c] = members[c].back();
+		if(members[c].size() < 3 || !num_dimensions){
+			continue;
+		}
+		const float *mean = &means[kmeans_cluster[c]*num_dimensions];
+		std::vector<size_t> nearest(members[c]);
+		size_t num_candidates = std::min((size_t) LANDMARK_MEDOID_CANDIDATES, nearest.size());
+		std::partial_sort(nearest.begin(), nearest.begin()+num_candidates, nearest.end(), [&](size_t a, size_t b){
+			return squaredEuclidean(&embedding[a*num_dimensions], mean, num_dimensions) < squaredEuclidean(&embedding[b*num_dimensions], mean, num_dimensions); });
+		for(size_t n = 0; n < num_candidates; n++){
+			std::vector<size_t> others;
+			for(size_t m = 0; m < members[c].size(); m++){
+				if(members[c][m] != nearest[n]){
+					others.push_back(members[c][m]);
+				}
+			}
+			size_t first_row = rows.size();
+			appendPairListRow(nearest[n], others, rows, column_starts, columns);
+			candidates.insert(candidates.end(), rows.size()-first_row, nearest[n]);
+			candidate_cluster.insert(candidate_cluster.end(), rows.size()-first_row, c);
+		}
+	}
+	std::vector<float> distances(columns.size());
+	calculatePairs(rows, column_starts, columns, distances.data());
+	// Sum the squared distances of each candidate's (possibly several) rows
+	std::vector<double> lowest_sos(num_clusters, std::numeric_limits<double>::max());
+	for(size_t r = 0; r < rows.size(); ){
+		double sos = 0;
+		size_t next = r;
+		for(; next < rows.size() && candidates[next] == candidates[r]; next++){
+			for(size_t p = column_starts[next]; p < column_starts[next+1]; p++){
+				sos += (double) distances[p]*distances[p];
+			}
+		}
+		if(sos < lowest_sos[candidate_cluster[r]]){
+			lowest_sos[candidate_cluster[r]] = sos;
+			medoidIndices[candidate_cluster[r]] = candidates[r];
+		}
+		r = next;
+	}
+	std::cerr << "Found " << num_clusters << " clusters by landmark embedding" << std::endl;
+	return medoidIndices;
+}
+
+#endif
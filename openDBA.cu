@@ -15,20 +15,164 @@ int main(int argc, char **argv){
 	int prefix_to_skip = 0; // where do we start looking for a prefix when in open_prefix mode?
 	int prefix_length = 0; // if non-zero, look only at the first N segments after prefix_to_skip for alignment
 	
-	char c;
-	while( ( c = getopt (argc, argv, "n") ) != -1 ) {
+	dba_options options;
+	char *consensus_cut = 0; // which of the swept clustering thresholds to generate consensus for
+	
+	char *program_name = argv[0];
+	int c;
+	while( ( c = getopt (argc, argv, "nc:a:S:C:sp:kg:L:r:G:b:um:P:") ) != -1 ) {
 		switch(c) {
 			case 'n':
 				norm_sequences = 0;
 				break;
+			case 'c':
+				consensus_cut = optarg;
+				break;
+			case 'a':
+				options.append_prefix = optarg;
+				break;
+			case 'S':
+				// k/n, i.e. calculate the k-th of n shards of the all-vs-all DTW distances
+				if(sscanf(optarg, "%d/%d", &options.shard_index, &options.num_shards) != 2 || 
+				   options.num_shards < 1 || options.shard_index < 1 || options.shard_index > options.num_shards){
+					std::cerr << "Shard specification (" << optarg << ") is not in the expected format k/n, where 1 <= k <= n" << std::endl;
+					exit(1);
+				}
+				// Nothing left to do after the partial distance matrix is written
+				options.generate_consensus = false;
+				break;
+			case 'C':
+				options.distance_cache = optarg;
+				break;
+			case 's':
+				options.sums_only_medoid = true;
+				break;
+			case 'p':
+				if(!strcmp(optarg, "float")){
+					options.distance_precision = DISTANCE_PRECISION_FLOAT;
+				}
+				else if(!strcmp(optarg, "half")){
+					options.distance_precision = DISTANCE_PRECISION_HALF;
+				}
+#if BFLOAT16_SUPPORTED == 1
+				else if(!strcmp(optarg, "bfloat16")){
+					options.distance_precision = DISTANCE_PRECISION_BFLOAT16;
+				}
+#endif
+				else{
+					std::cerr << "Distance matrix precision (" << optarg << ") is not one of the accepted values 'float', 'half'" << 
+					             (BFLOAT16_SUPPORTED == 1 ? " or 'bfloat16'" : "") << std::endl;
+					exit(1);
+				}
+				break;
+			case 'k':
+				options.k_medoids = true;
+				break;
+			case 'g':
+				options.knn_neighbours = atoi(optarg);
+				if(options.knn_neighbours < 1){
+					std::cerr << "Number of nearest neighbours (" << optarg << ") must be a positive integer" << std::endl;
+					exit(1);
+				}
+				break;
+			case 'L':
+				options.num_landmarks = atoi(optarg);
+				if(options.num_landmarks < 1){
+					std::cerr << "Number of landmark sequences (" << optarg << ") must be a positive integer" << std::endl;
+					exit(1);
+				}
+				break;
+			case 'r':
+				options.reassignment_rounds = atoi(optarg);
+				if(options.reassignment_rounds < 1){
+					std::cerr << "Maximum number of reassignment rounds (" << optarg << ") must be a positive integer" << std::endl;
+					exit(1);
+				}
+				break;
+			case 'G':
+				// size or size,length
+				{
+					char grouping[16] = "";
+					if(sscanf(optarg, "%d,%15s", &options.group_size, grouping) < 1 || options.group_size < 2 || (*grouping && strcmp(grouping, "length"))){
+						std::cerr << "Group specification (" << optarg << ") is not in the expected format size[,length], where size is at least 2" << std::endl;
+						exit(1);
+					}
+					options.group_by_length = *grouping != '\0';
+				}
+				break;
+			case 'b':
+				options.bootstrap_replicates = atoi(optarg);
+				if(options.bootstrap_replicates < 1){
+					std::cerr << "Number of bootstrap replicates (" << optarg << ") must be a positive integer" << std::endl;
+					exit(1);
+				}
+				break;
+			case 'u':
+				options.cpu_dba_update = true;
+				break;
+			case 'm':
+				options.minibatch_size = atoi(optarg);
+				if(options.minibatch_size < 1){
+					std::cerr << "Mini-batch size (" << optarg << ") must be a positive integer" << std::endl;
+					exit(1);
+				}
+				break;
+			case 'P':
+				// round[,round2,...]
+				{
+					std::stringstream round_list(optarg);
+					std::string round_field;
+					while(std::getline(round_list, round_field, ',')){
+						options.path_rounds.push_back(atoi(round_field.c_str()));
+						if(options.path_rounds.back() < 1){
+							std::cerr << "DTW path round list (" << optarg << ") must be comma-separated positive integers" << std::endl;
+							exit(1);
+						}
+					}
+				}
+				break;
 			default:
 				/* You won't actually get here. */
 				break;
 		}
 	}
+	// Shift so the positional arguments below are at the same indices whether or not flags were given.
+	argc -= optind-1;
+	argv += optind-1;
+
+	// The paths subcommand converts a binary DTW path file written during consensus convergence to the text path files, then exits.
+	if(argc > 2 && !strcmp(argv[1], "paths")){
+		exit(convertDTWPathFile(argv[2], argc > 3 ? argv[3] : 0));
+	}
+
+	// The merge subcommand takes the number of shards, then the same arguments as the shard runs (and regular runs).
+	if(argc > 2 && !strcmp(argv[1], "merge")){
+		options.merge_shards = atoi(argv[2]);
+		if(options.merge_shards < 1){
+			std::cerr << "Number of shards to merge (" << argv[2] << ") must be a positive integer" << std::endl;
+			exit(1);
+		}
+		if(options.num_shards){
+			std::cerr << "The -S option cannot be used with the merge subcommand" << std::endl;
+			exit(1);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	// The stream subcommand takes the polling interval and idle timeout in seconds, then the usual arguments with directories or file lists to watch as the series.
+	else if(argc > 3 && !strcmp(argv[1], "stream")){
+		options.stream_poll_seconds = atoi(argv[2]);
+		options.stream_idle_seconds = atoi(argv[3]);
+		if(options.stream_poll_seconds < 1 || options.stream_idle_seconds < 1){
+			std::cerr << "Streaming poll interval (" << argv[2] << ") and idle timeout (" << argv[3] << ") must be positive integers (seconds)" << std::endl;
+			exit(1);
+		}
+		argc -= 3;
+		argv += 3;
+	}
 
 	if(argc < 9){
-		std::cout << "Usage: " << argv[0] << " <binary|text|tsv";
+		std::cout << "Usage: " << program_name << " [merge <number of shards>|stream <poll seconds> <idle seconds>] [-n] [-c consensus clustering threshold] [-a previous run's output prefix to append to] [-S shard k/n] [-C distance cache file] [-s] [-p distance matrix precision float|half|bfloat16] [-k] [-g number of nearest neighbours] [-L number of landmark sequences] [-r maximum reassignment rounds] [-G group size[,length]] [-b number of bootstrap replicates] [-u] [-m mini-batch size] [-P DTW path round[,round2,...]] <binary|text|tsv";
 #if SLOW5_SUPPORTED == 1
 		std::cout << "|slow5";
 #endif	
@@ -41,7 +185,8 @@ int main(int argc, char **argv){
 #else
 		std::cout << "<short|int|uint|ulong|float|double> " <<
 #endif
-		          "<global|open_start|open_end|open> <output files prefix> <minimum unimodal segment length for clustering[,for consensus generation]> <prefix sequence to remove|/dev/null> <clustering threshold> <series.tsv|<series1> <series2> [series3...]>\n";
+		          "<global|open_start|open_end|open> <output files prefix> <minimum unimodal segment length for clustering[,for consensus generation]> <prefix sequence to remove|/dev/null> <clustering threshold[,threshold2,...]> <series.tsv|<series1> <series2> [series3...]>\n";
+		std::cout << "   or: " << program_name << " paths <binary DTW path file> [text path files prefix]\n";
 		exit(1);
      	}
 
@@ -114,32 +259,125 @@ int main(int argc, char **argv){
 		seqprefix_filename = argv[6];
 	}
 
-	double cdist = (double) atof(argv[7]);
+	// A comma-separated list of thresholds cuts the same dendrogram at each, writing one cluster membership file per threshold.
+	// Consensus is only generated for the threshold given with -c (if any), otherwise the run stops after clustering.
+	std::stringstream cdist_list(argv[7]);
+	std::string cdist_field;
+	while(std::getline(cdist_list, cdist_field, ',')){
+		options.cdist_sweep.push_back(atof(cdist_field.c_str()));
+	}
+	double cdist = options.cdist_sweep.empty() ? 0 : options.cdist_sweep[0];
+	if(options.cdist_sweep.size() > 1){
+		for(int i = 0; i < options.cdist_sweep.size(); i++){
+			if(options.cdist_sweep[i] < 0){
+				std::cerr << "Negative clustering thresholds (" << options.cdist_sweep[i] << ") are not supported in a threshold list" << std::endl;
+				exit(1);
+			}
+		}
+		if(consensus_cut){
+			char *cut_end = 0;
+			cdist = strtod(consensus_cut, &cut_end);
+			if(cut_end == consensus_cut || *cut_end != '\0'){
+				std::cerr << "Consensus clustering threshold (" << consensus_cut << ") is not a number" << std::endl;
+				exit(1);
+			}
+			// Parsed the same way as the list entries, so an exact match is expected if it was in the list.
+			if(std::find(options.cdist_sweep.begin(), options.cdist_sweep.end(), cdist) == options.cdist_sweep.end()){
+				std::cerr << "Consensus clustering threshold (" << consensus_cut << ") is not one of the listed clustering thresholds (" << argv[7] << ")" << std::endl;
+				exit(1);
+			}
+		}
+		else{
+			std::cerr << "No consensus clustering threshold specified with -c, only the cluster memberships for each threshold will be generated" << std::endl;
+			options.generate_consensus = false;
+		}
+	}
+	else{
+		options.cdist_sweep.clear();
+		if(consensus_cut){
+			std::cerr << "Ignoring -c option as only one clustering threshold (" << cdist << ") was provided" << std::endl;
+		}
+	}
+
+	// Without the distance matrix there is nothing to cluster, share or checkpoint, only the single medoid of all the sequences can be found.
+	if(options.sums_only_medoid && (cdist != 1 || !options.cdist_sweep.empty() || options.num_shards || options.merge_shards || 
+	                                !options.append_prefix.empty() || !options.distance_cache.empty())){
+		std::cerr << "The -s option requires a clustering threshold of 1, and cannot be combined with -c, -a, -S, -C or merge" << std::endl;
+		exit(1);
+	}
+
+	// K-medoids needs the number of clusters, rather than silently cutting the dendrogram as if -k hadn't been given.
+	if(options.k_medoids && (options.cdist_sweep.empty() ? cdist <= 1 : 
+	                         std::find_if(options.cdist_sweep.begin(), options.cdist_sweep.end(), [](double threshold){ return threshold > 1; }) == options.cdist_sweep.end())){
+		std::cerr << "The -k option requires a clustering threshold greater than 1 (the number of clusters), or a threshold list including one" << std::endl;
+		exit(1);
+	}
+
+	// The nearest neighbour graph replaces the distance matrix that all these other options work with.
+	if(options.knn_neighbours && (cdist < 0 || cdist > 1 || !options.cdist_sweep.empty() || options.sums_only_medoid || options.k_medoids || options.num_shards || 
+	                              options.merge_shards || !options.append_prefix.empty() || !options.distance_cache.empty())){
+		std::cerr << "The -g option requires a clustering threshold between 0 and 1, and cannot be combined with -c, -s, -k, -a, -S, -C or merge" << std::endl;
+		exit(1);
+	}
+
+	// Likewise the landmark embedding, where the clustering threshold is the number of clusters.
+	if(options.num_landmarks && (cdist <= 1 || !options.cdist_sweep.empty() || options.sums_only_medoid || options.k_medoids || options.knn_neighbours || 
+	                             options.num_shards || options.merge_shards || !options.append_prefix.empty() || !options.distance_cache.empty())){
+		std::cerr << "The -L option requires a clustering threshold greater than 1 (the number of clusters), and cannot be combined with -c, -s, -k, -g, -a, -S, -C or merge" << std::endl;
+		exit(1);
+	}
+
+	// Reassignment refines the clusters whose consensus is generated.
+	if(options.reassignment_rounds && (cdist == 1 || !options.generate_consensus)){
+		std::cerr << "The -r option requires a clustering threshold other than 1, and a consensus to be generated" << std::endl;
+		exit(1);
+	}
+
+	// Each group is a regular run, but the groups' consensuses are what's clustered at the top level.
+	if(options.group_size && (!options.generate_consensus || !options.cdist_sweep.empty() || options.num_shards || options.merge_shards || !options.append_prefix.empty() || strchr(min_segment_length, ','))){
+		std::cerr << "The -G option requires a consensus to be generated with a single minimum segment length, and cannot be combined with threshold lists, -a, -S or merge" << std::endl;
+		exit(1);
+	}
+
+	// Bootstrapping reclusters subsets of the full distance matrix.
+	if(options.bootstrap_replicates && (cdist == 1 || options.sums_only_medoid || options.knn_neighbours || options.num_landmarks || options.num_shards || options.group_size)){
+		std::cerr << "The -b option requires a clustering threshold other than 1, and cannot be combined with -s, -g, -L, -S or -G" << std::endl;
+		exit(1);
+	}
+
+	// Streamed reads are assigned as they arrive, so nothing that needs all the sequences at once applies.
+	if(options.stream_poll_seconds && (cdist <= 0 || !options.cdist_sweep.empty() || seqprefix_filename || prefix_length || options.sums_only_medoid || options.k_medoids || 
+	                                   options.knn_neighbours || options.num_landmarks || options.reassignment_rounds || options.group_size || options.bootstrap_replicates || options.minibatch_size || !options.path_rounds.empty() || options.num_shards || 
+	                                   !options.append_prefix.empty() || !options.distance_cache.empty() || strchr(min_segment_length, ','))){
+		std::cerr << "The stream subcommand requires a positive distance threshold, a single minimum segment length and no prefix removal, " <<
+		             "and cannot be combined with threshold lists, -s, -k, -g, -L, -r, -G, -b, -m, -P, -a, -S or -C" << std::endl;
+		exit(1);
+	}
 
 	int argind = 8; // Where the file names start
 	// The following are all the data types supported by CUDA's atomicAdd() operation, so we support them too for best value precision maintenance.
 	if(!strcmp(argv[2],"int")){
-		setupAndRun<int>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length);
+		setupAndRun<int>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, false, options);
 	}
 	else if(!strcmp(argv[2],"uint")){
-		setupAndRun<unsigned int>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length);
+		setupAndRun<unsigned int>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, false, options);
 	}
 	else if(!strcmp(argv[2],"ulong")){
-		setupAndRun<unsigned long long>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length);
+		setupAndRun<unsigned long long>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, false, options);
 	}
 	else if(!strcmp(argv[2],"float")){
-		setupAndRun<float>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length);
+		setupAndRun<float>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, false, options);
 	}
 	// Only since CUDA 6.1 (Pascal and later architectures) is atomicAdd(double *...) supported.  Remove if you want to compile for earlier graphics cards.
 #if DOUBLE_UNSUPPORTED == 1
 #else
 	else if(!strcmp(argv[2],"double")){
-		setupAndRun<double>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length);
+		setupAndRun<double>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, false, options);
 	}
 #endif
 	else if(!strcmp(argv[2], "short")){
 		// Short is not properly supported in the hardware nor by z-normalization, we will convert to float  (last arg=1)
-		setupAndRun<float>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, 1);
+		setupAndRun<float>(seqprefix_filename, &argv[argind], num_series, output_prefix, read_mode, use_open_start, use_open_end, min_segment_length, norm_sequences, cdist, prefix_to_skip, prefix_length, true, options);
 	}
 	else{
 		std::cerr << "Second argument (" << argv[2] << ") was not one of the accepted numerical representations: 'int', 'uint', 'ulong', 'float' or 'double'" << std::endl;
@@ -2,17 +2,157 @@
 #define OPENDBA_H
 
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <vector>
 #include "cpu_utils.hpp"
 #include "dba.hpp"
 #include "segmentation.hpp"
+#include "streaming.hpp"
 #include "io_utils.hpp"
 #include "read_mode_codes.h"
+#include "dba_options.h"
 
+/* Divide and conquer for inputs too big for one all-vs-all distance matrix: split the sequences into groups of about options.group_size (at random,
+   or of similar lengths), cluster and generate the consensuses of each group (with output files prefixed <output_prefix>.group<N>), then cluster the group
+   consensuses and average them, each counting as many times as the number of sequences it represents. The top level output files cover all the input
+   sequences as usual, each sequence being in the final cluster of its group cluster's consensus. If group_weights is given, each group consensus' weight
+   (in group then cluster order) is copied there. */
 template<typename T>
 void
-setupAndRun(char *seqprefix_file_name, char **series_file_names, int num_series, char *output_prefix, int read_mode, int use_open_start, int use_open_end, char *min_segment_length_string, int norm_sequences, double cdist, const int prefix_start=0, const int prefix_length=0, bool is_short=false){
+performGroupedDBA(T **sequences, int num_sequences, size_t *sequence_lengths, char **sequence_names, int use_open_start, int use_open_end, char *output_prefix, int norm_sequences, 
+                  double cdist, char **series_file_names, int num_series, int read_mode, bool is_segmented, const dba_options &options, std::vector<unsigned int> *group_weights=0){
+	int num_groups = (num_sequences+options.group_size-1)/options.group_size;
+	std::vector<int> order(num_sequences);
+	for(int i = 0; i < num_sequences; i++){
+		order[i] = i;
+	}
+	if(options.group_by_length){
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return sequence_lengths[a] < sequence_lengths[b]; });
+	}
+	else{
+		// Seeded so that a rerun picks up the same groups' checkpoints
+		std::mt19937_64 random_generator(0);
+		std::shuffle(order.begin(), order.end(), random_generator);
+	}
+
+	// Per group: the input indices of its members, and their cluster within the group
+	std::vector<std::vector<int> > group_members(num_groups), group_memberships(num_groups);
+	std::vector<int> consensus_group, consensus_medoid; // the consensus' group, and its medoid's input index
+	std::vector<unsigned int> consensus_weight;
+	std::vector<std::string> group_avgs_files;
+	for(int g = 0; g < num_groups; g++){
+		// Spread the remainder so the group sizes differ by at most one
+		int group_start = (int) (((long long) num_sequences)*g/num_groups);
+		int group_size = (int) (((long long) num_sequences)*(g+1)/num_groups)-group_start;
+		T **group_sequences;
+		cudaMallocManaged(&group_sequences, sizeof(T *)*group_size); CUERR("Allocating managed memory for group sequence pointers");
+		char **group_names;
+		cudaMallocHost(&group_names, sizeof(char *)*group_size); CUERR("Allocating CPU memory for group sequence names");
+		size_t *group_lengths;
+		cudaMallocManaged(&group_lengths, sizeof(size_t)*group_size); CUERR("Allocating managed memory for group sequence lengths");
+		std::vector<char *> unsorted_names(group_size);
+		for(int m = 0; m < group_size; m++){
+			int i = order[group_start+m];
+			group_members[g].push_back(i);
+			group_sequences[m] = sequences[i];
+			group_names[m] = unsorted_names[m] = sequence_names[i];
+			group_lengths[m] = sequence_lengths[i];
+		}
+		std::string group_prefix = CONCAT3(output_prefix, ".group", std::to_string(g+1));
+		std::cerr << "Processing group " << (g+1) << " of " << num_groups << " (" << group_size << " sequences)" << std::endl;
+		performDBA<T>(group_sequences, group_size, group_lengths, group_names, use_open_start, use_open_end, &group_prefix[0], norm_sequences, cdist, 
+		              series_file_names, num_series, read_mode, is_segmented, CLUSTER_AND_CONSENSUS, options);
+
+		// performDBA() sorted its copy of the group by length, read the memberships back in the original order
+		group_memberships[g].assign(group_size, 0);
+		int *group_medoids;
+		int num_group_clusters = 1;
+		if(cdist != 1){
+			group_medoids = readMedoidIndices(CONCAT2(group_prefix, ".cluster_membership.txt").c_str(), group_size, unsorted_names.data(), group_memberships[g].data());
+			num_group_clusters = *std::max_element(group_memberships[g].begin(), group_memberships[g].end())+1;
+		}
+		else{
+			// As in performDBA(), the medoid is the name on the consensus line
+			std::ifstream avgs_file(CONCAT2(group_prefix, ".avg.txt").c_str());
+			std::string medoid_name;
+			std::getline(avgs_file, medoid_name, '\t');
+			group_medoids = new int[1];
+			group_medoids[0] = std::find_if(unsorted_names.begin(), unsorted_names.end(), [&](char *name){ return medoid_name == name; })-unsorted_names.begin();
+		}
+		for(int c = 0; c < num_group_clusters; c++){
+			consensus_group.push_back(g);
+			consensus_medoid.push_back(group_members[g][group_medoids[c]]);
+			consensus_weight.push_back(std::count(group_memberships[g].begin(), group_memberships[g].end(), c));
+		}
+		delete[] group_medoids;
+		group_avgs_files.push_back(CONCAT2(group_prefix, ".avg.txt"));
+		cudaFree(group_sequences); CUERR("Freeing managed memory for group sequence pointers");
+		cudaFreeHost(group_names); CUERR("Freeing CPU memory for group sequence names");
+		cudaFree(group_lengths); CUERR("Freeing managed memory for group sequence lengths");
+	}
+
+	// The group consensuses are in group then cluster order in their averages files
+	std::vector<char *> avgs_file_names;
+	for(int g = 0; g < num_groups; g++){
+		avgs_file_names.push_back(&group_avgs_files[g][0]);
+	}
+	T **consensuses = 0;
+	char **consensus_names = 0;
+	size_t *consensus_lengths = 0;
+	int num_consensuses = readSequenceTSVFiles<T>(avgs_file_names.data(), num_groups, &consensuses, &consensus_names, &consensus_lengths);
+	if(num_consensuses != (int) consensus_weight.size()){
+		std::cerr << "Expected " << consensus_weight.size() << " group consensus sequences, but read " << num_consensuses << ", aborting" << std::endl;
+		exit(CANNOT_READ_GROUP_CONSENSUSES);
+	}
+	unsigned int *weights;
+	cudaMallocManaged(&weights, sizeof(unsigned int)*num_consensuses); CUERR("Allocating managed memory for group consensus weights");
+	std::copy(consensus_weight.begin(), consensus_weight.end(), weights);
+	if(group_weights){
+		*group_weights = consensus_weight;
+	}
+	std::vector<char *> unsorted_consensus_names(consensus_names, consensus_names+num_consensuses);
+	std::cerr << "Clustering and averaging the " << num_consensuses << " group consensuses" << std::endl;
+	performDBA<T>(consensuses, num_consensuses, consensus_lengths, consensus_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, 
+	              series_file_names, num_series, read_mode, is_segmented, CLUSTER_AND_CONSENSUS, options, 0, weights);
+
+	// Replace the top level membership file (which lists the consensuses) with one listing all the input sequences
+	if(cdist != 1){
+		std::vector<int> consensus_memberships(num_consensuses);
+		int *consensus_medoids = readMedoidIndices(CONCAT2(output_prefix, ".cluster_membership.txt").c_str(), num_consensuses, unsorted_consensus_names.data(), consensus_memberships.data());
+		int num_clusters = *std::max_element(consensus_memberships.begin(), consensus_memberships.end())+1;
+		int *medoidIndices = new int[num_clusters];
+		for(int c = 0; c < num_clusters; c++){
+			medoidIndices[c] = consensus_medoid[consensus_medoids[c]];
+		}
+		std::vector<int> memberships(num_sequences);
+		int first_consensus = 0;
+		for(int g = 0; g < num_groups; g++){
+			for(size_t m = 0; m < group_members[g].size(); m++){
+				memberships[group_members[g][m]] = consensus_memberships[first_consensus+group_memberships[g][m]];
+			}
+			first_consensus += *std::max_element(group_memberships[g].begin(), group_memberships[g].end())+1;
+		}
+		writeClusterMembership(CONCAT2(output_prefix, ".cluster_membership.txt").c_str(), cdist, sequence_names, num_sequences, memberships.data(), medoidIndices);
+		delete[] consensus_medoids;
+		delete[] medoidIndices;
+	}
+
+	for(int i = 0; i < num_consensuses; i++){
+		cudaFree(consensuses[i]); CUERR("Freeing managed memory for a group consensus sequence");
+		cudaFreeHost(consensus_names[i]); CUERR("Freeing CPU memory for a group consensus name");
+	}
+	cudaFree(consensuses); CUERR("Freeing managed memory for the group consensus pointers");
+	cudaFreeHost(consensus_names); CUERR("Freeing CPU memory for the group consensus names");
+	cudaFree(consensus_lengths); CUERR("Freeing managed memory for the group consensus lengths");
+	cudaFree(weights); CUERR("Freeing managed memory for group consensus weights");
+}
+
+template<typename T>
+void
+setupAndRun(char *seqprefix_file_name, char **series_file_names, int num_series, char *output_prefix, int read_mode, int use_open_start, int use_open_end, char *min_segment_length_string, int norm_sequences, double cdist, const int prefix_start=0, const int prefix_length=0, bool is_short=false, const dba_options &options=dba_options()){
 	size_t *sequence_lengths = 0;
 	T **segmented_sequences = 0;
 	size_t *segmented_seq_lengths = 0;
@@ -20,6 +160,12 @@ setupAndRun(char *seqprefix_file_name, char **series_file_names, int num_series,
 	char** sequence_names;
 	int actual_num_series = 0; // excludes failed file reading
 
+	if(options.stream_poll_seconds){
+		streamClusters<T>(series_file_names, num_series, output_prefix, read_mode, use_open_start, use_open_end, atoi(min_segment_length_string), norm_sequences, 
+		                  cdist, options.stream_poll_seconds, options.stream_idle_seconds, is_short);
+		return;
+	}
+
 	// The minimum segment length specified can be either a number to be applied to both clustering and consensus generation like "4", 
 	// or two numbers separated by comma like "4,0" which would cluster a segmented sequence but generate consensus on the raw signals from those clusters.
 	int min_segment_length;
@@ -125,7 +271,7 @@ setupAndRun(char *seqprefix_file_name, char **series_file_names, int num_series,
 		if(min_segment_length_2 != -1){
 			std::cerr << "Performing cluster generation with segment size of " << min_segment_length << std::endl;
 			performDBA<T>(segmented_sequences, actual_num_series, segmented_seq_lengths, sequence_names, use_open_start, use_open_end, 
-				      output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CLUSTER_ONLY);
+				      output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CLUSTER_ONLY, options);
 
 			for (int i = 0; i < actual_num_series; i++){
 				cudaFree(segmented_sequences[i]); CUERR("Freeing managed memory for a segmented sequence after a clustering-only DBA call");
@@ -178,13 +324,23 @@ setupAndRun(char *seqprefix_file_name, char **series_file_names, int num_series,
 
 	// Step 3. The meat of this meal, running DBA proper!
 	if(min_segment_length_2 != -1){
-		// Will read the cluster membership info from the segmented seq performDBA call above.
-		std::cerr << "Performing consensus generation with segment size of " << min_segment_length_2 << std::endl;
-		performDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CONSENSUS_ONLY);
+		if(options.generate_consensus){
+			// Will read the cluster membership info from the segmented seq performDBA call above.
+			std::cerr << "Performing consensus generation with segment size of " << min_segment_length_2 << std::endl;
+			performDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CONSENSUS_ONLY, options);
+		}
+	}
+	else if(!options.generate_consensus){
+		std::cerr << "Performing clustering only with segment size of " << min_segment_length << std::endl;
+		performDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CLUSTER_ONLY, options);
+	}
+	else if(options.group_size && actual_num_series > options.group_size){
+		std::cerr << "Performing grouped clustering and consensus generation with segment size of " << min_segment_length << std::endl;
+		performGroupedDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, options);
 	}
 	else{	
 		std::cerr << "Performing both clustering and consensus generation with segment size of " << min_segment_length << std::endl;
-		performDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CLUSTER_AND_CONSENSUS);
+		performDBA<T>(sequences, actual_num_series, sequence_lengths, sequence_names, use_open_start, use_open_end, output_prefix, norm_sequences, cdist, series_file_names, num_series, read_mode, min_segment_length > 1, CLUSTER_AND_CONSENSUS, options);
 	}
 
 	// Cleanup
@@ -7,6 +7,10 @@ fi
 trap 'rm -f "$TMPFILE"' EXIT
 
 TMPFILE=$(mktemp) || exit 1
+# The consensus runs write the DTW paths in binary, convert them to the text files if that hasn't been done yet
+if ! ls $2.path[0-9]*.txt > /dev/null 2>&1 && [ -e $2.paths.bin ]; then
+    `dirname $0`/openDBA paths $2.paths.bin || exit 1
+fi
 perl -ane 'push @{$means{$F[2]}}, $F[1] unless $F[4] eq "OPEN_RIGHT" or $#F < 4;END{for (sort {$b <=> $a} keys %means){print '$1'-$_,"\t", join(",", @{$means{$_}}),"\n"}}' $2.path*.txt > $TMPFILE
 `dirname $0`/diptest.R $TMPFILE > $2.multimodal.diptest.txt
 `dirname $0`/kde_smoothing_plus_excess_mass.R $TMPFILE > $2.multimodal.kde_smoothing_plus_excess_mass.txt
@@ -0,0 +1,482 @@
+#ifndef __streaming_hpp_included
+#define __streaming_hpp_included
+
+/* Near real time clustering of reads as they are written (e.g. during a sequencing run), rather than all at once afterwards. Watched directories
+   (or files listing input file names, which may grow) are polled for new input files, and once a file's size is stable its reads are each assigned
+   to the cluster with the nearest consensus, if it's within the threshold distance, otherwise they seed new clusters. Consensuses are refined incrementally:
+   each assigned read is aligned to its cluster's consensus and its values pile up on the consensus positions, which are folded into the consensus
+   (a running average) once enough new members have accumulated. Reads are not kept after assignment, so memory use depends on the number of clusters
+   and their consensus lengths, not the number of reads.
+
+   The distance threshold is the root mean squared value difference per aligned element of the fully aligned sequence, so it doesn't depend on read length
+   (with Z-normalized values, 0.5 to 1 is a reasonable range to start with). */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(_WIN32)
+#else
+	#include <dirent.h>
+	#include <sys/stat.h>
+#endif
+
+#include "centroid_reassignment.hpp" // for dtwDistanceEarlyAbandon()
+#include "cpu_utils.hpp"
+#include "exit_codes.hpp"
+#include "read_mode_codes.h"
+#include "segmentation.hpp"
+
+// Fold a cluster's accumulated alignments into its consensus once there are this many new members, or this fraction of its members if more
+#define STREAM_MIN_REFRESH_MEMBERS 4
+#define STREAM_REFRESH_MEMBER_FRACTION 0.1
+
+#define STREAM_MOVE_START 0
+#define STREAM_MOVE_DIAGONAL 1
+#define STREAM_MOVE_UP 2
+#define STREAM_MOVE_RIGHT 3
+#define STREAM_MOVE_OPEN_RIGHT 4
+
+struct stream_cluster{
+	std::string name; // of the seed read
+	double seed_mean; // the seed read's value distribution, to rescale the consensus for output
+	double seed_sigma;
+	std::vector<double> consensus;
+	std::vector<double> weight; // number of read elements averaged into each consensus position so far
+	std::vector<double> pending_sum; // alignments since the last refresh
+	std::vector<double> pending_count;
+	size_t num_members;
+	size_t num_pending_members;
+};
+
+// Conversions between the DTW distance as normalized by dtwDistanceEarlyAbandon() and the per element RMS distance used for the streaming threshold.
+__host__
+double
+dtwDistanceToRMS(double distance, size_t first_seq_length, int use_open_start, int use_open_end){
+	return (use_open_end && !use_open_start || !use_open_end && use_open_start) ? distance*sqrt((double) first_seq_length) : distance/sqrt((double) first_seq_length);
+}
+
+__host__
+double
+rmsToDTWDistance(double rms, size_t first_seq_length, int use_open_start, int use_open_end){
+	return (use_open_end && !use_open_start || !use_open_end && use_open_start) ? rms/sqrt((double) first_seq_length) : rms*sqrt((double) first_seq_length);
+}
+
+// As in DBA, the shorter of the pair is the fully aligned (first) one in open end mode, otherwise it's the read.
+__host__
+bool
+consensusIsFirst(size_t read_length, size_t consensus_length, int use_open_end){
+	return use_open_end && consensus_length < read_length;
+}
+
+// RMS distance of the read to the consensus, or max() if it's more than abandon_above_rms.
+__host__
+double
+streamDistance(const double *read, size_t read_length, const stream_cluster &cluster, int use_open_start, int use_open_end, double abandon_above_rms){
+	bool flip = consensusIsFirst(read_length, cluster.consensus.size(), use_open_end);
+	size_t first_length = flip ? cluster.consensus.size() : read_length;
+	double distance = flip ? dtwDistanceEarlyAbandon(cluster.consensus.data(), cluster.consensus.size(), read, read_length, use_open_start, use_open_end,
+	                                                 rmsToDTWDistance(abandon_above_rms, first_length, use_open_start, use_open_end)) :
+	                         dtwDistanceEarlyAbandon(read, read_length, cluster.consensus.data(), cluster.consensus.size(), use_open_start, use_open_end,
+	                                                 rmsToDTWDistance(abandon_above_rms, first_length, use_open_start, use_open_end));
+	return distance == std::numeric_limits<double>::max() ? distance : dtwDistanceToRMS(distance, first_length, use_open_start, use_open_end);
+}
+
+/* The optimal DTW path of the read against the consensus (same step pattern as DTWDistance, kept in a one byte per cell move matrix), as the
+ * (consensus position, read position) pairs it aligns. Free moves along an open end don't align anything. The move matrix is only grown, so callers
+ * can keep one per thread across reads. */
+__host__
+void
+alignToConsensus(const double *read, size_t read_length, const std::vector<double> &consensus, int use_open_start, int use_open_end, std::vector<unsigned char> &moves,
+                 std::vector<std::pair<size_t,size_t> > &aligned){
+	bool flip = consensusIsFirst(read_length, consensus.size(), use_open_end);
+	const double *first_seq = flip ? consensus.data() : read;
+	const double *second_seq = flip ? read : consensus.data();
+	size_t m = flip ? consensus.size() : read_length;
+	size_t n = flip ? read_length : consensus.size();
+	if(moves.size() < m*n){
+		moves.resize(m*n);
+	}
+	std::vector<double> column(m), previous_column(m);
+	for(size_t j = 0; j < n; j++){
+		double diff = first_seq[0]-second_seq[j];
+		if(!j || use_open_start){
+			column[0] = use_open_start ? 0 : diff*diff;
+			moves[j*m] = STREAM_MOVE_START;
+		}
+		else{
+			column[0] = previous_column[0]+diff*diff;
+			moves[j*m] = STREAM_MOVE_RIGHT;
+		}
+		for(size_t i = 1; i < m; i++){
+			diff = first_seq[i]-second_seq[j];
+			double up_cost = column[i-1]+diff*diff;
+			if(!j){
+				column[i] = up_cost;
+				moves[i] = STREAM_MOVE_UP;
+				continue;
+			}
+			double diag_cost = previous_column[i-1]+diff*diff;
+			bool open_right = use_open_end && i == m-1;
+			double right_cost = previous_column[i]+(open_right ? 0 : diff*diff);
+			unsigned char right_move = open_right ? STREAM_MOVE_OPEN_RIGHT : STREAM_MOVE_RIGHT;
+			// White-Neely step pattern preferences, as in the GPU kernel
+			if(diag_cost > up_cost){
+				column[i] = up_cost > right_cost ? right_cost : up_cost;
+				moves[j*m+i] = up_cost > right_cost ? right_move : STREAM_MOVE_UP;
+			}
+			else{
+				column[i] = diag_cost > right_cost ? right_cost : diag_cost;
+				moves[j*m+i] = diag_cost > right_cost ? right_move : STREAM_MOVE_DIAGONAL;
+			}
+		}
+		column.swap(previous_column);
+	}
+	aligned.clear();
+	size_t i = m-1, j = n-1;
+	while(true){
+		unsigned char move = moves[j*m+i];
+		if(move != STREAM_MOVE_OPEN_RIGHT){
+			aligned.push_back(flip ? std::make_pair(i, j) : std::make_pair(j, i));
+		}
+		if(move == STREAM_MOVE_START){
+			break;
+		}
+		if(move != STREAM_MOVE_UP){
+			j--;
+		}
+		if(move == STREAM_MOVE_DIAGONAL || move == STREAM_MOVE_UP){
+			i--;
+		}
+	}
+}
+
+// Fold the pending alignments into the consensus as a running average.
+__host__
+void
+refreshConsensus(stream_cluster &cluster){
+	for(size_t t = 0; t < cluster.consensus.size(); t++){
+		if(cluster.pending_count[t]){
+			cluster.consensus[t] = (cluster.weight[t]*cluster.consensus[t]+cluster.pending_sum[t])/(cluster.weight[t]+cluster.pending_count[t]);
+			cluster.weight[t] += cluster.pending_count[t];
+			cluster.pending_sum[t] = cluster.pending_count[t] = 0;
+		}
+	}
+	cluster.num_pending_members = 0;
+}
+
+__host__
+void
+writeStreamConsensuses(const std::vector<stream_cluster> &clusters, int norm_sequences, const char *output_prefix){
+	// Written in full then renamed, so readers never see a partial file
+	std::string avgs_file_name = CONCAT2(output_prefix, ".avg.txt");
+	std::ofstream avgs_file((avgs_file_name+".tmp").c_str());
+	if(!avgs_file.is_open()){
+		std::cerr << "Cannot open sequence averages file " << avgs_file_name << ".tmp for writing" << std::endl;
+		exit(CANNOT_WRITE_DBA_AVG);
+	}
+	for(size_t c = 0; c < clusters.size(); c++){
+		avgs_file << clusters[c].name;
+		for(size_t t = 0; t < clusters[c].consensus.size(); t++){
+			avgs_file << "\t" << (norm_sequences ? clusters[c].seed_mean+clusters[c].consensus[t]*clusters[c].seed_sigma : clusters[c].consensus[t]);
+		}
+		avgs_file << std::endl;
+	}
+	avgs_file.close();
+	if(rename((avgs_file_name+".tmp").c_str(), avgs_file_name.c_str())){
+		std::cerr << "Cannot replace sequence averages file " << avgs_file_name << std::endl;
+		exit(CANNOT_WRITE_DBA_AVG);
+	}
+}
+
+#if defined(_WIN32)
+__host__
+void
+listStreamInputFiles(char **watched_paths, int num_watched_paths, std::map<std::string,long long> &file_sizes){
+	std::cerr << "Streaming mode is not supported on Windows" << std::endl;
+	exit(1);
+}
+#else
+// Current size of every input file: all the (non-hidden) files in the watched directories, or listed one per line in watched regular files.
+__host__
+void
+listStreamInputFiles(char **watched_paths, int num_watched_paths, std::map<std::string,long long> &file_sizes){
+	file_sizes.clear();
+	auto addFile = [&](const std::string &file_name){
+		struct stat file_stats;
+		if(stat(file_name.c_str(), &file_stats) == 0 && S_ISREG(file_stats.st_mode)){
+			file_sizes[file_name] = (long long) file_stats.st_size;
+		}
+	};
+	for(int p = 0; p < num_watched_paths; p++){
+		struct stat path_stats;
+		if(stat(watched_paths[p], &path_stats) != 0){
+			continue; // may not exist yet
+		}
+		if(S_ISDIR(path_stats.st_mode)){
+			DIR *dir = opendir(watched_paths[p]);
+			if(!dir){
+				continue;
+			}
+			for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir)){
+				if(entry->d_name[0] != '.'){
+					addFile(CONCAT3(watched_paths[p], "/", entry->d_name));
+				}
+			}
+			closedir(dir);
+		}
+		else{
+			std::ifstream list_file(watched_paths[p]);
+			for(std::string line; std::getline(list_file, line); ){
+				if(!line.empty()){
+					addFile(line);
+				}
+			}
+		}
+	}
+}
+#endif
+
+/* Run until no new input file has been seen for idle_timeout_seconds, checking every poll_interval_seconds. Each read's cluster, distance to its consensus
+ * (0 for a new cluster's seed) and latency (from when its file was first seen) is appended to <output_prefix>.stream_assignments.txt, and
+ * <output_prefix>.avg.txt is rewritten with the current consensuses whenever they change. */
+template<typename T>
+__host__
+void
+streamClusters(char **watched_paths, int num_watched_paths, char *output_prefix, int read_mode, int use_open_start, int use_open_end, int min_segment_length,
+               int norm_sequences, double threshold, int poll_interval_seconds, int idle_timeout_seconds, bool is_short){
+	typedef std::chrono::steady_clock clock;
+	std::ofstream assignments_file(CONCAT2(output_prefix, ".stream_assignments.txt").c_str(), std::ios::app);
+	if(!assignments_file.is_open()){
+		std::cerr << "Cannot open stream assignments file " << output_prefix << ".stream_assignments.txt for writing" << std::endl;
+		exit(CANNOT_WRITE_MEMBERSHIP);
+	}
+	std::vector<stream_cluster> clusters;
+	std::vector<std::vector<unsigned char> > thread_moves(getNumCPUThreads()); // alignment move matrices, reused across reads and files
+	std::set<std::string> processed_files;
+	std::map<std::string,long long> previous_sizes, current_sizes;
+	std::map<std::string,clock::time_point> first_seen;
+	clock::time_point last_new_file = clock::now();
+	size_t total_reads = 0;
+	double total_latency_ms = 0;
+	std::cerr << "Streaming mode: watching " << num_watched_paths << " input location(s) every " << poll_interval_seconds << "s, until idle for " << idle_timeout_seconds << "s" << std::endl;
+	while(true){
+		listStreamInputFiles(watched_paths, num_watched_paths, current_sizes);
+		// Forget files that are no longer listed (e.g. moved away once processed), so a long session's bookkeeping tracks only what's currently there
+		for(auto file = processed_files.begin(); file != processed_files.end(); ){
+			file = current_sizes.count(*file) ? std::next(file) : processed_files.erase(file);
+		}
+		for(auto file = first_seen.begin(); file != first_seen.end(); ){
+			file = current_sizes.count(file->first) ? std::next(file) : first_seen.erase(file);
+		}
+		std::vector<std::string> ready_files;
+		for(auto file = current_sizes.begin(); file != current_sizes.end(); ++file){
+			if(processed_files.count(file->first)){
+				continue;
+			}
+			if(!first_seen.count(file->first)){
+				first_seen[file->first] = clock::now();
+				last_new_file = clock::now();
+			}
+			// Unchanged since the last poll, so probably finished being written
+			auto previous = previous_sizes.find(file->first);
+			if(previous != previous_sizes.end() && previous->second == file->second && file->second > 0){
+				ready_files.push_back(file->first);
+			}
+		}
+		previous_sizes.swap(current_sizes);
+		if(ready_files.empty()){
+			if(std::chrono::duration_cast<std::chrono::seconds>(clock::now()-last_new_file).count() >= idle_timeout_seconds){
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::seconds(poll_interval_seconds));
+			continue;
+		}
+
+		for(size_t f = 0; f < ready_files.size(); f++){
+			processed_files.insert(ready_files[f]);
+			char *file_name = &ready_files[f][0];
+			T **sequences = 0;
+			char **sequence_names = 0;
+			size_t *sequence_lengths = 0;
+			int num_reads = 0;
+			if(read_mode == BINARY_READ_MODE){ num_reads = readSequenceBinaryFiles<T>(&file_name, 1, &sequences, &sequence_names, &sequence_lengths, is_short); }
+			else if(read_mode == TSV_READ_MODE){ num_reads = readSequenceTSVFiles<T>(&file_name, 1, &sequences, &sequence_names, &sequence_lengths); }
+#if SLOW5_SUPPORTED == 1
+			else if(read_mode == SLOW5_READ_MODE){ num_reads = readSequenceSLOW5Files<T>(&file_name, 1, &sequences, &sequence_names, &sequence_lengths); }
+#endif
+#if HDF5_SUPPORTED == 1
+			else if(read_mode == FAST5_READ_MODE){ num_reads = readSequenceFAST5Files<T>(&file_name, 1, &sequences, &sequence_names, &sequence_lengths); }
+#endif
+			else{ num_reads = readSequenceTextFiles<T>(&file_name, 1, &sequences, &sequence_names, &sequence_lengths); }
+			if(num_reads < 1){
+				cudaFree(sequences); CUERR("Freeing managed memory for the streamed read pointers");
+				cudaFreeHost(sequence_names); CUERR("Freeing CPU memory for the streamed read names");
+				cudaFree(sequence_lengths); CUERR("Freeing managed memory for the streamed read lengths");
+				continue;
+			}
+			for(int r = 0; r < num_reads; r++){ char *z = strchr(sequence_names[r], '.'); if(z) *z = '\0';}
+			T **read_values = sequences;
+			size_t *read_lengths = sequence_lengths;
+			T **segmented_sequences = 0;
+			size_t *segmented_lengths = 0;
+			if(min_segment_length > 0){
+				adaptive_segmentation<T>(sequences, sequence_lengths, num_reads, min_segment_length, &segmented_sequences, &segmented_lengths, 0);
+				read_values = segmented_sequences;
+				read_lengths = segmented_lengths;
+			}
+
+			// Z-normalize (or just copy) to double precision, the consensuses' value type
+			std::vector<std::vector<double> > reads(num_reads);
+			std::vector<double> read_means(num_reads, 0), read_sigmas(num_reads, 1);
+			parallelFor(num_reads, [&](size_t r, int thread_index){
+				reads[r].assign(read_values[r], read_values[r]+read_lengths[r]);
+				if(norm_sequences && !reads[r].empty()){
+					double sum = 0, sum_squares = 0;
+					for(size_t t = 0; t < reads[r].size(); t++){
+						sum += reads[r][t];
+						sum_squares += reads[r][t]*reads[r][t];
+					}
+					read_means[r] = sum/reads[r].size();
+					read_sigmas[r] = sqrt(std::max(0.0, sum_squares/reads[r].size()-read_means[r]*read_means[r]));
+					for(size_t t = 0; t < reads[r].size(); t++){
+						reads[r][t] = read_sigmas[r] ? (reads[r][t]-read_means[r])/read_sigmas[r] : 0;
+					}
+				}
+			});
+
+			// The nearest existing consensus within the threshold, abandoning comparisons that can't beat the best so far
+			std::vector<int> assigned_cluster(num_reads, -1);
+			std::vector<double> assigned_distance(num_reads, 0);
+			size_t num_existing_clusters = clusters.size();
+			parallelFor(num_reads, [&](size_t r, int thread_index){
+				if(reads[r].size() < 2){
+					return;
+				}
+				double nearest_distance = threshold;
+				for(size_t c = 0; c < num_existing_clusters; c++){
+					double distance = streamDistance(reads[r].data(), reads[r].size(), clusters[c], use_open_start, use_open_end, nearest_distance);
+					if(distance <= nearest_distance){
+						nearest_distance = distance;
+						assigned_cluster[r] = c;
+						assigned_distance[r] = distance;
+					}
+				}
+			});
+			// Reads not near any existing consensus are compared to the clusters seeded by earlier reads in this file, or seed one themselves.
+			for(int r = 0; r < num_reads; r++){
+				if(assigned_cluster[r] != -1 || reads[r].size() < 2){
+					continue;
+				}
+				double nearest_distance = threshold;
+				for(size_t c = num_existing_clusters; c < clusters.size(); c++){
+					double distance = streamDistance(reads[r].data(), reads[r].size(), clusters[c], use_open_start, use_open_end, nearest_distance);
+					if(distance <= nearest_distance){
+						nearest_distance = distance;
+						assigned_cluster[r] = c;
+						assigned_distance[r] = distance;
+					}
+				}
+				if(assigned_cluster[r] == -1){
+					stream_cluster seed;
+					seed.name = sequence_names[r];
+					seed.seed_mean = read_means[r];
+					seed.seed_sigma = read_sigmas[r];
+					seed.consensus = reads[r];
+					seed.weight.assign(reads[r].size(), 1);
+					seed.pending_sum.assign(reads[r].size(), 0);
+					seed.pending_count.assign(reads[r].size(), 0);
+					seed.num_members = 1;
+					seed.num_pending_members = 0;
+					assigned_cluster[r] = clusters.size();
+					assigned_distance[r] = 0;
+					clusters.push_back(seed);
+					std::vector<double>().swap(reads[r]); // nothing to align
+				}
+			}
+
+			// Align the new members to their consensuses, and pile their values up per consensus position
+			std::vector<std::vector<std::pair<size_t,size_t> > > alignments(num_reads);
+			parallelFor(num_reads, [&](size_t r, int thread_index){
+				if(assigned_cluster[r] != -1 && !reads[r].empty()){
+					alignToConsensus(reads[r].data(), reads[r].size(), clusters[assigned_cluster[r]].consensus, use_open_start, use_open_end, thread_moves[thread_index], alignments[r]);
+				}
+			});
+			bool consensus_changed = clusters.size() > num_existing_clusters;
+			for(int r = 0; r < num_reads; r++){
+				if(alignments[r].empty()){
+					continue;
+				}
+				stream_cluster &cluster = clusters[assigned_cluster[r]];
+				for(size_t a = 0; a < alignments[r].size(); a++){
+					cluster.pending_sum[alignments[r][a].first] += reads[r][alignments[r][a].second];
+					cluster.pending_count[alignments[r][a].first]++;
+				}
+				cluster.num_members++;
+				cluster.num_pending_members++;
+				if(cluster.num_pending_members >= std::max((double) STREAM_MIN_REFRESH_MEMBERS, STREAM_REFRESH_MEMBER_FRACTION*cluster.num_members)){
+					refreshConsensus(cluster);
+					consensus_changed = true;
+				}
+			}
+
+			clock::time_point done = clock::now();
+			double latency_ms = std::chrono::duration_cast<std::chrono::microseconds>(done-first_seen[ready_files[f]]).count()/1000.0;
+			first_seen.erase(ready_files[f]); // only needed until the file's processed
+			int num_assigned = 0;
+			for(int r = 0; r < num_reads; r++){
+				if(assigned_cluster[r] != -1){
+					assignments_file << sequence_names[r] << "\t" << assigned_cluster[r] << "\t" << assigned_distance[r] << "\t" << latency_ms << std::endl;
+					num_assigned++;
+				}
+			}
+			assignments_file.flush();
+			total_reads += num_assigned;
+			total_latency_ms += num_assigned*latency_ms;
+			std::cerr << "Assigned " << num_assigned << " reads from " << ready_files[f] << " (" << (clusters.size()-num_existing_clusters) << " new clusters, "
+			          << clusters.size() << " total) with a latency of " << latency_ms << "ms since the file was first seen" << std::endl;
+			if(consensus_changed){
+				writeStreamConsensuses(clusters, norm_sequences, output_prefix);
+			}
+
+			if(segmented_sequences){
+				for(int r = 0; r < num_reads; r++){
+					cudaFree(segmented_sequences[r]); CUERR("Freeing managed memory for a streamed segmented read");
+				}
+				cudaFree(segmented_sequences); CUERR("Freeing managed memory for the streamed segmented read pointers");
+				cudaFree(segmented_lengths); CUERR("Freeing managed memory for the streamed segmented read lengths");
+			}
+			for(int r = 0; r < num_reads; r++){
+				cudaFree(sequences[r]); CUERR("Freeing managed memory for a streamed read");
+				cudaFreeHost(sequence_names[r]); CUERR("Freeing CPU memory for a streamed read name");
+			}
+			cudaFree(sequences); CUERR("Freeing managed memory for the streamed read pointers");
+			cudaFreeHost(sequence_names); CUERR("Freeing CPU memory for the streamed read names");
+			cudaFree(sequence_lengths); CUERR("Freeing managed memory for the streamed read lengths");
+		}
+	}
+	// Fold in whatever's left
+	for(size_t c = 0; c < clusters.size(); c++){
+		if(clusters[c].num_pending_members){
+			refreshConsensus(clusters[c]);
+		}
+	}
+	if(!clusters.empty()){
+		writeStreamConsensuses(clusters, norm_sequences, output_prefix);
+	}
+	std::cerr << "No new input for " << idle_timeout_seconds << "s, stopping after assigning " << total_reads << " reads to " << clusters.size() << " clusters";
+	if(total_reads){
+		std::cerr << " (mean latency " << total_latency_ms/total_reads << "ms)";
+	}
+	std::cerr << std::endl;
+}
+
+#endif
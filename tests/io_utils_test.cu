@@ -41,6 +41,204 @@ char* stringToChar(std::string tmp_string){
 	return cstr;
 }
 
+TEST_CASE( " Pairwise Distance Checkpoint " ){
+
+	const char *checkpoint_file_name = "io_utils_test.pair_dists.ckpt";
+	remove(checkpoint_file_name);
+	remove(CONCAT2(checkpoint_file_name, ".manifest").c_str());
+
+	size_t num_sequences = 6;
+	size_t num_values = ARITH_SERIES_SUM(num_sequences-1);
+	unsigned long long fingerprint = 12345;
+	std::vector<float> distances(num_values);
+	for(size_t i = 0; i < num_values; i++){
+		distances[i] = 0.5f*i+1;
+	}
+	// Rows [0,2) hold the first values up to where row 2 starts
+	size_t row2_start = ARITH_SERIES_SUM(num_sequences-1)-ARITH_SERIES_SUM(num_sequences-2-1);
+	std::vector<float> read_distances(num_values, -1);
+
+	SECTION("No Checkpoint"){
+		std::cerr << "------TEST PAIRDISTCHECKPOINT NONE------" << std::endl;
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, fingerprint) == 0 );
+	}
+
+	SECTION("Resume After Partial Rows"){
+		std::cerr << "------TEST PAIRDISTCHECKPOINT PARTIAL------" << std::endl;
+		writePairDistCheckpoint(checkpoint_file_name, distances.data(), 0, row2_start, 2, num_sequences, fingerprint);
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, fingerprint) == 2 );
+		for(size_t i = 0; i < row2_start; i++){
+			REQUIRE( read_distances[i] == distances[i] );
+		}
+		REQUIRE( read_distances[row2_start] == -1 );
+
+		// Only the rows since the last checkpoint are written the second time
+		writePairDistCheckpoint(checkpoint_file_name, distances.data(), row2_start, num_values-row2_start, num_sequences-1, num_sequences, fingerprint);
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, fingerprint) == num_sequences-1 );
+		for(size_t i = 0; i < num_values; i++){
+			REQUIRE( read_distances[i] == distances[i] );
+		}
+	}
+
+	SECTION("Different Input"){
+		std::cerr << "------TEST PAIRDISTCHECKPOINT DIFFERENT INPUT------" << std::endl;
+		writePairDistCheckpoint(checkpoint_file_name, distances.data(), 0, num_values, num_sequences-1, num_sequences, fingerprint);
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, fingerprint+1) == 0 );
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences+1, fingerprint) == 0 );
+		std::vector<double> double_distances(num_values);
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, double_distances.data(), num_sequences, fingerprint) == 0 );
+	}
+
+	SECTION("Truncated Checkpoint"){
+		std::cerr << "------TEST PAIRDISTCHECKPOINT TRUNCATED------" << std::endl;
+		writePairDistCheckpoint(checkpoint_file_name, distances.data(), 0, num_values, num_sequences-1, num_sequences, fingerprint);
+		std::ofstream checkpoint_file(checkpoint_file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+		checkpoint_file.write((const char *) distances.data(), sizeof(float)*row2_start);
+		checkpoint_file.close();
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, fingerprint) == 0 );
+	}
+
+	remove(checkpoint_file_name);
+	remove(CONCAT2(checkpoint_file_name, ".manifest").c_str());
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Distance Storage Precision " ){
+
+	SECTION("Narrow and Widen"){
+		std::cerr << "------TEST DISTANCEPRECISION NARROW WIDEN------" << std::endl;
+		// Small integers and halves are exact in all the formats
+		for(float distance = 0; distance < 128; distance += 0.5f){
+			REQUIRE( widenDistance(narrowDistance<float>(distance)) == distance );
+			REQUIRE( widenDistance(narrowDistance<__half>(distance)) == distance );
+#if BFLOAT16_SUPPORTED == 1
+			REQUIRE( widenDistance(narrowDistance<__nv_bfloat16>(distance)) == distance );
+#endif
+		}
+		// Otherwise to within the formats' relative precision (11 and 8 significant bits)
+		for(float distance = 0.001f; distance < 60000; distance *= 1.7f){
+			REQUIRE( widenDistance(narrowDistance<__half>(distance)) == Approx(distance).epsilon(1.0/2048) );
+#if BFLOAT16_SUPPORTED == 1
+			REQUIRE( widenDistance(narrowDistance<__nv_bfloat16>(distance)) == Approx(distance).epsilon(1.0/256) );
+			REQUIRE( widenDistance(narrowDistance<__nv_bfloat16>(distance*1e10f)) == Approx(distance*1e10f).epsilon(1.0/256) );
+#endif
+		}
+	}
+
+	SECTION("Checkpoint Precision"){
+		std::cerr << "------TEST DISTANCEPRECISION CHECKPOINT------" << std::endl;
+		const char *checkpoint_file_name = "io_utils_test.half.pair_dists.ckpt";
+		size_t num_sequences = 4;
+		std::vector<__half> distances(ARITH_SERIES_SUM(num_sequences-1));
+		for(size_t i = 0; i < distances.size(); i++){
+			distances[i] = narrowDistance<__half>(i+0.25f);
+		}
+		writePairDistCheckpoint(checkpoint_file_name, distances.data(), 0, distances.size(), num_sequences-1, num_sequences, 7);
+		std::vector<__half> read_distances(distances.size());
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, read_distances.data(), num_sequences, 7) == num_sequences-1 );
+		for(size_t i = 0; i < distances.size(); i++){
+			REQUIRE( widenDistance(read_distances[i]) == i+0.25f );
+		}
+		// Neither a different size nor a different format of the same size is loaded
+		std::vector<float> float_distances(distances.size());
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, float_distances.data(), num_sequences, 7) == 0 );
+#if BFLOAT16_SUPPORTED == 1
+		std::vector<__nv_bfloat16> bfloat16_distances(distances.size());
+		REQUIRE( readPairDistCheckpoint(checkpoint_file_name, bfloat16_distances.data(), num_sequences, 7) == 0 );
+#endif
+		remove(checkpoint_file_name);
+		remove(CONCAT2(checkpoint_file_name, ".manifest").c_str());
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Read Previous Pairwise Distances " ){
+
+	const char *previous_prefix = "io_utils_test.previous";
+	std::string checkpoint_file_name = std::string(previous_prefix)+".pair_dists.ckpt";
+	remove(checkpoint_file_name.c_str());
+	remove((checkpoint_file_name+".manifest").c_str());
+
+	// Upper right matrix text as written by a previous run, including the pro forma last line
+	std::ofstream mats((std::string(previous_prefix)+".pair_dists.txt").c_str());
+	mats << "seqA\t0\t1.5\t2.5\t3.5\n";
+	mats << "seqB\t\t0\t4.5\t5.5\n";
+	mats << "seqC\t\t\t0\t6.5\n";
+	mats << "seqD\t\t\t\t0\n";
+	mats.close();
+	std::vector<float> text_distances = {1.5, 2.5, 3.5, 4.5, 5.5, 6.5};
+
+	std::vector<std::string> sequence_names;
+	std::vector<float> distances;
+
+	SECTION("Text Only"){
+		std::cerr << "------TEST READPREVIOUSPAIRDISTS TEXT------" << std::endl;
+		readPreviousPairDists(previous_prefix, sequence_names, distances);
+		REQUIRE( sequence_names.size() == 4 );
+		REQUIRE( sequence_names[0] == "seqA" );
+		REQUIRE( sequence_names[3] == "seqD" );
+		REQUIRE( distances == text_distances );
+	}
+
+	SECTION("Full Precision Checkpoint"){
+		std::cerr << "------TEST READPREVIOUSPAIRDISTS CHECKPOINT------" << std::endl;
+		// A complete checkpoint for the same sequences is preferred over the rounded text values
+		std::vector<float> checkpoint_distances = {1.51f, 2.51f, 3.51f, 4.51f, 5.51f, 6.51f};
+		writePairDistCheckpoint(checkpoint_file_name.c_str(), checkpoint_distances.data(), 0, checkpoint_distances.size(), 3, 4, 0);
+		readPreviousPairDists(previous_prefix, sequence_names, distances);
+		REQUIRE( distances == checkpoint_distances );
+	}
+
+	SECTION("Incomplete Checkpoint"){
+		std::cerr << "------TEST READPREVIOUSPAIRDISTS INCOMPLETE CHECKPOINT------" << std::endl;
+		std::vector<float> checkpoint_distances = {1.51f, 2.51f, 3.51f, 4.51f, 5.51f, 6.51f};
+		writePairDistCheckpoint(checkpoint_file_name.c_str(), checkpoint_distances.data(), 0, 5, 2, 4, 0);
+		readPreviousPairDists(previous_prefix, sequence_names, distances);
+		REQUIRE( distances == text_distances );
+	}
+
+	remove((std::string(previous_prefix)+".pair_dists.txt").c_str());
+	remove(checkpoint_file_name.c_str());
+	remove((checkpoint_file_name+".manifest").c_str());
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Cluster Membership Round Trip " ){
+	std::cerr << "------TEST CLUSTERMEMBERSHIP ROUNDTRIP------" << std::endl;
+
+	const char *membership_file_name = "io_utils_test.cluster_membership.txt";
+	int num_sequences = 7;
+	std::vector<std::string> names = {"read_a", "read_b", "read_c", "read_d", "read_e", "read_f", "read_g"};
+	std::vector<char *> sequence_names(num_sequences);
+	for(int i = 0; i < num_sequences; i++){
+		sequence_names[i] = &names[i][0];
+	}
+	int memberships[] = {2, 0, 1, 2, 0, 3, 2};
+	int medoids[] = {4, 2, 6, 5};
+	writeClusterMembership(membership_file_name, 0.3, sequence_names.data(), num_sequences, memberships, medoids);
+
+	// Read back with the names in a different order, as a caller with its own sequence order would
+	std::vector<int> order = {6, 3, 0, 5, 1, 4, 2};
+	std::vector<char *> reordered_names(num_sequences);
+	for(int i = 0; i < num_sequences; i++){
+		reordered_names[i] = sequence_names[order[i]];
+	}
+	std::vector<int> read_memberships(num_sequences, -1);
+	int *read_medoids = readMedoidIndices(membership_file_name, num_sequences, reordered_names.data(), read_memberships.data());
+	for(int i = 0; i < num_sequences; i++){
+		REQUIRE( read_memberships[i] == memberships[order[i]] );
+	}
+	// Every cluster up to the highest numbered one has its medoid
+	for(int c = 0; c < 4; c++){
+		REQUIRE( order[read_medoids[c]] == medoids[c] );
+	}
+	delete[] read_medoids;
+
+	remove(membership_file_name);
+	std::cerr << std::endl;
+}
+
 #if SLOW5_SUPPORTED == 1
 TEST_CASE( " Write Slow5 Output " ){
 	
@@ -6,6 +6,10 @@
 
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <set>
+#include <numeric>
+#include <sstream>
 
 #if defined(_WIN32)
 	#include <direct.h>
@@ -307,3 +311,1743 @@ TEST_CASE( " Setup and Run " ){
 	cudaDeviceReset(); CUERR("Resetting GPU device");
 	
 }
+
+// Distances between num_groups tight groups of group_size sequences (sequence i is in group i/group_size), all far from each other.
+std::vector<float> groupedPairDists(size_t num_groups, size_t group_size){
+	size_t num_sequences = num_groups*group_size;
+	std::vector<float> distances(ARITH_SERIES_SUM(num_sequences-1));
+	for(size_t i = 0; i < num_sequences; i++){
+		for(size_t j = i+1; j < num_sequences; j++){
+			distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1] = i/group_size == j/group_size ? 1+(i+j)%5 : 100+(i*j)%7;
+		}
+	}
+	return distances;
+}
+
+// Sequence names seq0, seq1, ... as the clustering and output functions expect them.
+std::vector<char *> testSequenceNames(size_t num_sequences){
+	std::vector<char *> names(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		names[i] = strdup(("seq"+std::to_string(i)).c_str());
+	}
+	return names;
+}
+
+// Noisy sine waves named as by testSequenceNames(), their buffers freed when it goes out of scope.
+struct test_sine_sequences{
+	std::vector<std::vector<double> > values;
+	std::vector<double *> sequences; // the values, or managed memory copies of them for the GPU functions
+	std::vector<size_t> lengths;
+	std::vector<char *> names;
+	bool managed = false;
+
+	test_sine_sequences() = default;
+	test_sine_sequences(test_sine_sequences &&) = default;
+	~test_sine_sequences(){
+		for(size_t s = 0; s < names.size(); s++){
+			free(names[s]);
+			if(managed){
+				cudaFree(sequences[s]); CUERR("Freeing managed memory for a test sequence");
+			}
+		}
+	}
+};
+
+// Sequence s has first_length+s*length_step values sin(i*frequency) plus Gaussian noise of the given standard deviation.
+test_sine_sequences randomSineSequences(std::mt19937 &rng, size_t num_sequences, size_t first_length, size_t length_step, double frequency=0.3, double noise=0.2, 
+                                        bool managed=false){
+	std::normal_distribution<double> normal(0, 1);
+	test_sine_sequences fixture;
+	fixture.values.resize(num_sequences);
+	fixture.sequences.resize(num_sequences);
+	fixture.lengths.resize(num_sequences);
+	fixture.names = testSequenceNames(num_sequences);
+	fixture.managed = managed;
+	for(size_t s = 0; s < num_sequences; s++){
+		fixture.lengths[s] = first_length+s*length_step;
+		for(size_t i = 0; i < fixture.lengths[s]; i++){
+			fixture.values[s].push_back(std::sin(i*frequency)+noise*normal(rng));
+		}
+		if(managed){
+			cudaMallocManaged(&fixture.sequences[s], sizeof(double)*fixture.lengths[s]); CUERR("Allocating managed memory for a test sequence");
+			std::copy(fixture.values[s].begin(), fixture.values[s].end(), fixture.sequences[s]);
+		}
+		else{
+			fixture.sequences[s] = fixture.values[s].data();
+		}
+	}
+	return fixture;
+}
+
+TEST_CASE( " Cut Dendrogram " ){
+
+	size_t num_groups = 3;
+	size_t group_size = 5;
+	size_t num_sequences = num_groups*group_size;
+	std::vector<float> distances = groupedPairDists(num_groups, group_size);
+	std::vector<float> linkage_distances(distances);
+	std::vector<int> merge(2*(num_sequences-1));
+	std::vector<double> height(num_sequences-1);
+	completeLinkage(num_sequences, linkage_distances.data(), 106.0f, merge.data(), height.data());
+	std::vector<int> memberships(num_sequences);
+
+	SECTION("Fixed Height"){
+		std::cerr << "------TEST CUTDENDROGRAM FIXED HEIGHT------" << std::endl;
+		REQUIRE( cutDendrogram(num_sequences, merge.data(), height.data(), 0.5, memberships.data(), false) == 3 );
+		for(size_t i = 0; i < num_sequences; i++){
+			for(size_t j = 0; j < num_sequences; j++){
+				REQUIRE( (memberships[i] == memberships[j]) == (i/group_size == j/group_size) );
+			}
+		}
+	}
+
+	SECTION("K Clusters"){
+		std::cerr << "------TEST CUTDENDROGRAM K CLUSTERS------" << std::endl;
+		REQUIRE( cutDendrogram(num_sequences, merge.data(), height.data(), 3, memberships.data(), false) == 3 );
+		for(size_t i = 0; i < num_sequences; i++){
+			REQUIRE( (memberships[i] == memberships[0]) == (i/group_size == 0) );
+		}
+	}
+
+	SECTION("One Cluster"){
+		std::cerr << "------TEST CUTDENDROGRAM ONE CLUSTER------" << std::endl;
+		REQUIRE( cutDendrogram(num_sequences, merge.data(), height.data(), 1, memberships.data(), false) == 1 );
+		for(size_t i = 0; i < num_sequences; i++){
+			REQUIRE( memberships[i] == 0 );
+		}
+	}
+
+	SECTION("Threshold Sweep"){
+		std::cerr << "------TEST SWEEPDENDROGRAMCUTS------" << std::endl;
+		std::vector<char *> names = testSequenceNames(num_sequences);
+		std::vector<size_t> lengths(num_sequences, 10);
+		std::vector<double> dtwSoS(num_sequences, 0);
+		for(size_t i = 0; i < num_sequences; i++){
+			for(size_t j = i+1; j < num_sequences; j++){
+				double distance = distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1];
+				dtwSoS[i] += distance*distance;
+				dtwSoS[j] += distance*distance;
+			}
+		}
+		std::vector<double> cdist_sweep = {0.5, 1};
+		char output_prefix[] = "openDBA_test_sweep";
+		sweepDendrogramCuts(cdist_sweep, num_sequences, merge.data(), height.data(), distances.data(), dtwSoS.data(), lengths.data(), names.data(), output_prefix, false);
+
+		// Each cut's memberships match cutting the dendrogram on its own, and each cluster's medoid is one of its members
+		for(size_t cut = 0; cut < cdist_sweep.size(); cut++){
+			std::vector<int> cut_memberships(num_sequences);
+			int num_clusters = cutDendrogram(num_sequences, merge.data(), height.data(), cdist_sweep[cut], memberships.data(), false);
+			std::ostringstream cut_name;
+			cut_name << cdist_sweep[cut];
+			int *medoidIndices = readMedoidIndices(("openDBA_test_sweep.cluster_membership."+cut_name.str()+".txt").c_str(), num_sequences, names.data(), cut_memberships.data());
+			for(size_t i = 0; i < num_sequences; i++){
+				REQUIRE( cut_memberships[i] == memberships[i] );
+			}
+			for(int c = 0; c < num_clusters; c++){
+				REQUIRE( memberships[medoidIndices[c]] == c );
+			}
+			delete[] medoidIndices;
+		}
+		for(size_t i = 0; i < num_sequences; i++){
+			free(names[i]);
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Reuse Previous Pairwise Distances " ){
+
+	// The previous run compared seq0..seq4, with pair (i,j) at distance 10*i+j
+	size_t num_previous_sequences = 5;
+	std::vector<char *> previous_names = testSequenceNames(num_previous_sequences);
+	std::vector<float> previous_distances(ARITH_SERIES_SUM(num_previous_sequences-1));
+	for(size_t i = 0; i < num_previous_sequences; i++){
+		for(size_t j = i+1; j < num_previous_sequences; j++){
+			previous_distances[PAIRWISE_DIST_ROW(i, num_previous_sequences)+j-i-1] = 10*i+j;
+		}
+	}
+	std::vector<double> previous_dtwSoS(num_previous_sequences, 0);
+	std::ofstream mats("openDBA_test_previous.pair_dists.txt");
+	summarizePairwiseDistances(previous_distances.data(), num_previous_sequences, previous_names.data(), mats, previous_dtwSoS.data());
+	mats << previous_names[num_previous_sequences-1] << std::string(num_previous_sequences, '\t') << "0" << std::endl;
+	mats.close();
+
+	// This run drops seq3, adds a new sequence, and has seq1 and seq2 in the opposite order
+	size_t num_sequences = 5;
+	std::vector<char *> names = {strdup("seq0"), strdup("seqNew"), strdup("seq2"), strdup("seq1"), strdup("seq4")};
+	size_t previous_index[] = {0, 99, 2, 1, 4};
+	std::vector<float> distances(ARITH_SERIES_SUM(num_sequences-1), -1);
+	std::vector<size_t> new_seq_indices(num_sequences);
+	std::vector<std::vector<size_t> > reoriented_columns(num_sequences);
+
+	SECTION("Global Alignment"){
+		std::cerr << "------TEST LOADPREVIOUSPAIRDISTS GLOBAL------" << std::endl;
+		REQUIRE( loadPreviousPairDists("openDBA_test_previous", names.data(), num_sequences, distances.data(), new_seq_indices.data(), 0, 0, reoriented_columns) == 1 );
+		REQUIRE( new_seq_indices[0] == 1 );
+		for(size_t i = 0; i < num_sequences; i++){
+			REQUIRE( reoriented_columns[i].empty() );
+			for(size_t j = i+1; j < num_sequences; j++){
+				float distance = distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1];
+				if(i == 1 || j == 1){
+					REQUIRE( distance == -1 );
+				}
+				else{
+					REQUIRE( distance == 10*std::min(previous_index[i], previous_index[j])+std::max(previous_index[i], previous_index[j]) );
+				}
+			}
+		}
+	}
+
+	SECTION("Open End Reorientation"){
+		std::cerr << "------TEST LOADPREVIOUSPAIRDISTS OPEN END------" << std::endl;
+		REQUIRE( loadPreviousPairDists("openDBA_test_previous", names.data(), num_sequences, distances.data(), new_seq_indices.data(), 0, 1, reoriented_columns) == 1 );
+		// Only seq2 vs. seq1 was aligned the other way around last time, so it's recalculated rather than reused
+		REQUIRE( reoriented_columns[2] == std::vector<size_t>(1, 3) );
+		REQUIRE( distances[PAIRWISE_DIST_ROW(2, num_sequences)] == -1 );
+		REQUIRE( distances[PAIRWISE_DIST_ROW(2, num_sequences)+1] == 24 );
+		REQUIRE( distances[PAIRWISE_DIST_ROW(0, num_sequences)+2] == 1 );
+		for(size_t i = 0; i < num_sequences; i++){
+			if(i != 2){
+				REQUIRE( reoriented_columns[i].empty() );
+			}
+		}
+	}
+
+	SECTION("Shard Rows"){
+		std::cerr << "------TEST LOADPREVIOUSPAIRDISTS SHARD------" << std::endl;
+		// A shard's buffer holds just its rows, filled in the same as those rows of the whole matrix
+		REQUIRE( loadPreviousPairDists("openDBA_test_previous", names.data(), num_sequences, distances.data(), new_seq_indices.data(), 0, 0, reoriented_columns) == 1 );
+		size_t first_row = 2, last_row = 4;
+		std::vector<float> shard_distances(PAIRWISE_DIST_ROW(last_row, num_sequences)-PAIRWISE_DIST_ROW(first_row, num_sequences), -1);
+		REQUIRE( loadPreviousPairDists("openDBA_test_previous", names.data(), num_sequences, shard_distances.data(), new_seq_indices.data(), 0, 0, reoriented_columns,
+		                               first_row, last_row) == 1 );
+		REQUIRE( std::equal(shard_distances.begin(), shard_distances.end(), distances.begin()+PAIRWISE_DIST_ROW(first_row, num_sequences)) );
+	}
+
+	for(size_t i = 0; i < num_sequences; i++){
+		free(names[i]);
+	}
+	for(size_t i = 0; i < num_previous_sequences; i++){
+		free(previous_names[i]);
+	}
+	remove("openDBA_test_previous.pair_dists.txt");
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Pairwise Distance Shards " ){
+
+	size_t num_sequences = 40;
+	std::vector<size_t> lengths(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		lengths[i] = 10+i*i; // sorted by length, like the real input
+	}
+	std::vector<float> distances = groupedPairDists(4, 10);
+	int num_shards = 3;
+
+	SECTION("Row Ranges"){
+		std::cerr << "------TEST SHARDROWRANGE------" << std::endl;
+		size_t expected_first_row = 0;
+		for(int shard = 1; shard <= num_shards; shard++){
+			size_t first_row, last_row;
+			shardRowRange(lengths.data(), num_sequences, shard, num_shards, &first_row, &last_row);
+			REQUIRE( first_row == expected_first_row );
+			REQUIRE( first_row < last_row );
+			expected_first_row = last_row;
+		}
+		REQUIRE( expected_first_row == num_sequences-1 );
+
+		// Work is balanced, so the first shard (longest rows, shortest sequences) has more rows than the last
+		size_t first_row, last_row, last_first_row, last_last_row;
+		shardRowRange(lengths.data(), num_sequences, 1, num_shards, &first_row, &last_row);
+		shardRowRange(lengths.data(), num_sequences, num_shards, num_shards, &last_first_row, &last_last_row);
+		REQUIRE( last_row-first_row > last_last_row-last_first_row );
+	}
+
+	SECTION("Merge Shards"){
+		std::cerr << "------TEST MERGEPAIRDISTSHARDS------" << std::endl;
+		for(int shard = 1; shard <= num_shards; shard++){
+			size_t first_row, last_row;
+			shardRowRange(lengths.data(), num_sequences, shard, num_shards, &first_row, &last_row);
+			// A shard only holds its own rows
+			std::vector<float> shard_distances(distances.begin()+PAIRWISE_DIST_ROW(first_row, num_sequences), distances.begin()+PAIRWISE_DIST_ROW(last_row, num_sequences));
+			writePairDistShard(pairDistShardFileName("openDBA_test_shards", shard, num_shards).c_str(), shard_distances.data(), num_sequences, first_row, last_row, 42);
+		}
+		std::vector<float> merged_distances(distances.size(), -1);
+		mergePairDistShards("openDBA_test_shards", num_shards, merged_distances.data(), num_sequences, 42);
+		REQUIRE( merged_distances == distances );
+		for(int shard = 1; shard <= num_shards; shard++){
+			remove(pairDistShardFileName("openDBA_test_shards", shard, num_shards).c_str());
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Pairwise Distance Cache " ){
+
+	const char *cache_file_name = "openDBA_test.dist_cache";
+	remove(cache_file_name);
+	unsigned long long mode = distanceCacheMode<float,float>(0, 1);
+	distance_cache cache;
+	double distance;
+
+	// A new cache file has nothing to look up yet, but can still be added to
+	openDistanceCache(cache_file_name, &cache);
+	REQUIRE( cache.fd != -1 );
+	REQUIRE( !lookupDistanceCache(&cache, 1, 2, mode, &distance) );
+	releaseDistanceCache(&cache);
+	beginDistanceCacheUpdate(&cache, 10);
+	for(unsigned long long i = 1; i <= 10; i++){
+		addToDistanceCache(&cache, i, i+1, mode, 0.5*i);
+	}
+	endDistanceCacheUpdate(&cache);
+	closeDistanceCache(&cache);
+
+	SECTION("Reopen"){
+		std::cerr << "------TEST DISTANCECACHE REOPEN------" << std::endl;
+		REQUIRE( openDistanceCache(cache_file_name, &cache) );
+		for(unsigned long long i = 1; i <= 10; i++){
+			REQUIRE( lookupDistanceCache(&cache, i, i+1, mode, &distance) );
+			REQUIRE( distance == 0.5*i );
+		}
+		// Keyed on the alignment order and settings too
+		REQUIRE( !lookupDistanceCache(&cache, 2, 1, mode, &distance) );
+		REQUIRE( !lookupDistanceCache(&cache, 1, 2, distanceCacheMode<float,float>(0, 0), &distance) );
+		REQUIRE( !lookupDistanceCache(&cache, 1, 2, distanceCacheMode<double,float>(0, 1), &distance) );
+		closeDistanceCache(&cache);
+	}
+
+	SECTION("Grow"){
+		std::cerr << "------TEST DISTANCECACHE GROW------" << std::endl;
+		REQUIRE( openDistanceCache(cache_file_name, &cache) );
+		releaseDistanceCache(&cache);
+		size_t num_new_entries = 4*DISTANCE_CACHE_MIN_SLOTS;
+		beginDistanceCacheUpdate(&cache, num_new_entries);
+		for(unsigned long long i = 1; i <= num_new_entries; i++){
+			addToDistanceCache(&cache, 100+i, i, mode, i);
+		}
+		endDistanceCacheUpdate(&cache);
+		closeDistanceCache(&cache);
+		REQUIRE( !file_exists("openDBA_test.dist_cache.tmp") );
+
+		REQUIRE( openDistanceCache(cache_file_name, &cache) );
+		REQUIRE( cache.header->num_entries == 10+num_new_entries );
+		REQUIRE( cache.header->num_slots*DISTANCE_CACHE_MAX_LOAD >= cache.header->num_entries );
+		for(unsigned long long i = 1; i <= 10; i++){
+			REQUIRE( lookupDistanceCache(&cache, i, i+1, mode, &distance) );
+			REQUIRE( distance == 0.5*i );
+		}
+		for(unsigned long long i = 1; i <= num_new_entries; i++){
+			REQUIRE( lookupDistanceCache(&cache, 100+i, i, mode, &distance) );
+			REQUIRE( distance == i );
+		}
+		closeDistanceCache(&cache);
+	}
+
+	remove(cache_file_name);
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Summarize Pairwise Distances " ){
+	std::cerr << "------TEST SUMMARIZEPAIRWISEDISTANCES------" << std::endl;
+
+	size_t num_sequences = 30; // several blocks of rows
+	std::vector<float> distances = groupedPairDists(3, 10);
+	std::vector<char *> names = testSequenceNames(num_sequences);
+	std::vector<double> dtwSoS(num_sequences, 0);
+	std::ostringstream mats;
+	REQUIRE( summarizePairwiseDistances(distances.data(), num_sequences, names.data(), mats, dtwSoS.data()) == 106.0f );
+
+	std::vector<double> expected_dtwSoS(num_sequences, 0);
+	std::ostringstream expected_mats;
+	for(size_t i = 0; i < num_sequences-1; i++){
+		expected_mats << names[i] << std::string(i, '\t') << "\t0";
+		for(size_t j = i+1; j < num_sequences; j++){
+			float distance = distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1];
+			expected_mats << "\t" << distance;
+			expected_dtwSoS[i] += ((double) distance)*distance;
+			expected_dtwSoS[j] += ((double) distance)*distance;
+		}
+		expected_mats << "\n";
+	}
+	REQUIRE( mats.str() == expected_mats.str() );
+	for(size_t i = 0; i < num_sequences; i++){
+		REQUIRE( dtwSoS[i] == Approx(expected_dtwSoS[i]) );
+		free(names[i]);
+	}
+
+	std::cerr << std::endl;
+}
+
+// Leaf members of every cluster formed in an R hclust convention merge array, keyed by its height
+std::multiset<std::pair<double,std::set<int> > > dendrogramClusters(size_t num_sequences, int *merge, double *height){
+	std::vector<std::set<int> > step_members(num_sequences-1);
+	std::multiset<std::pair<double,std::set<int> > > clusters;
+	for(size_t step = 0; step < num_sequences-1; step++){
+		for(int side = 0; side < 2; side++){
+			int node = merge[step+side*(num_sequences-1)];
+			if(node < 0){
+				step_members[step].insert(-node-1);
+			}
+			else{
+				step_members[step].insert(step_members[node-1].begin(), step_members[node-1].end());
+			}
+		}
+		clusters.insert(std::make_pair(height[step], step_members[step]));
+	}
+	return clusters;
+}
+
+TEST_CASE( " Complete Linkage " ){
+	std::cerr << "------TEST COMPLETELINKAGE------" << std::endl;
+
+	size_t num_sequences = 60;
+	std::mt19937 rng(34);
+	std::uniform_real_distribution<float> uniform(1, 1000);
+	std::vector<float> distances(ARITH_SERIES_SUM(num_sequences-1));
+	float max_distance = 0;
+	for(size_t i = 0; i < distances.size(); i++){
+		distances[i] = uniform(rng);
+		max_distance = std::max(max_distance, distances[i]);
+	}
+
+	// Brute force: repeatedly merge the two clusters with the smallest maximum member distance
+	std::vector<std::set<int> > clusters(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		clusters[i].insert(i);
+	}
+	std::multiset<std::pair<double,std::set<int> > > expected_clusters;
+	while(clusters.size() > 1){
+		float best_distance = std::numeric_limits<float>::max();
+		size_t best_a = 0, best_b = 1;
+		for(size_t a = 0; a < clusters.size(); a++){
+			for(size_t b = a+1; b < clusters.size(); b++){
+				float cluster_distance = 0;
+				for(int i : clusters[a]){
+					for(int j : clusters[b]){
+						cluster_distance = std::max(cluster_distance, distances[PAIRWISE_DIST_ROW(std::min(i,j), num_sequences)+std::max(i,j)-std::min(i,j)-1]);
+					}
+				}
+				if(cluster_distance < best_distance){
+					best_distance = cluster_distance;
+					best_a = a;
+					best_b = b;
+				}
+			}
+		}
+		clusters[best_a].insert(clusters[best_b].begin(), clusters[best_b].end());
+		expected_clusters.insert(std::make_pair(best_distance/max_distance, clusters[best_a]));
+		clusters.erase(clusters.begin()+best_b);
+	}
+
+	std::vector<float> linkage_distances(distances);
+	std::vector<int> merge(2*(num_sequences-1));
+	std::vector<double> height(num_sequences-1);
+	completeLinkage(num_sequences, linkage_distances.data(), max_distance, merge.data(), height.data());
+	// The in place updates are undone before returning
+	REQUIRE( linkage_distances == distances );
+	// Merges are listed in increasing height, like hclust_fast()
+	for(size_t step = 1; step < num_sequences-1; step++){
+		REQUIRE( height[step-1] <= height[step] );
+	}
+	std::multiset<std::pair<double,std::set<int> > > linkage_clusters = dendrogramClusters(num_sequences, merge.data(), height.data());
+	REQUIRE( linkage_clusters.size() == expected_clusters.size() );
+	for(auto expected = expected_clusters.begin(), linkage = linkage_clusters.begin(); expected != expected_clusters.end(); ++expected, ++linkage){
+		REQUIRE( linkage->first == Approx(expected->first) );
+		REQUIRE( linkage->second == expected->second );
+	}
+
+	// Likewise for 16 bit storage, with some zero distances whose sign bit marks a swapped update just the same
+	std::vector<__half> half_distances(distances.size());
+	for(size_t i = 0; i < distances.size(); i++){
+		half_distances[i] = narrowDistance<__half>(i%7 ? distances[i] : 0);
+	}
+	std::vector<__half> half_linkage_distances(half_distances);
+	completeLinkage(num_sequences, half_linkage_distances.data(), max_distance, merge.data(), height.data());
+	for(size_t i = 0; i < distances.size(); i++){
+		REQUIRE( widenDistance(half_linkage_distances[i]) == widenDistance(half_distances[i]) );
+		REQUIRE( !std::signbit(widenDistance(half_linkage_distances[i])) );
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Permutation Test Supported Clusters " ){
+	std::cerr << "------TEST MERGECLUSTERS------" << std::endl;
+
+	// Small groups, so every merge within a group stands out from the distances to all the sequences outside of the merge
+	size_t num_groups = 6, group_size = 3;
+	size_t num_sequences = num_groups*group_size;
+	std::vector<float> distances = groupedPairDists(num_groups, group_size);
+	std::vector<float> linkage_distances(distances);
+	std::vector<int> merge(2*(num_sequences-1));
+	std::vector<double> height(num_sequences-1);
+	completeLinkage(num_sequences, linkage_distances.data(), 106.0f, merge.data(), height.data());
+
+	// Merges of separate groups don't, as some outside sequences are closer than the merge distance
+	std::vector<int> memberships(num_sequences);
+	REQUIRE( merge_clusters(num_sequences, distances.data(), merge.data(), 0.05, memberships.data(), false) == num_groups );
+	for(size_t i = 0; i < num_sequences; i++){
+		for(size_t j = 0; j < num_sequences; j++){
+			REQUIRE( (memberships[i] == memberships[j]) == (i/group_size == j/group_size) );
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " K-Medoids " ){
+	std::cerr << "------TEST KMEDOIDS------" << std::endl;
+
+	size_t num_groups = 4, group_size = 25;
+	size_t num_sequences = num_groups*group_size;
+	std::vector<float> distances = groupedPairDists(num_groups, group_size);
+	std::vector<int> memberships(num_sequences);
+	int *medoidIndices = kMedoids(num_sequences, distances.data(), num_groups, memberships.data(), false);
+
+	// Clusters are the groups, numbered in order of their first member
+	for(size_t i = 0; i < num_sequences; i++){
+		REQUIRE( memberships[i] == (int) (i/group_size) );
+	}
+	// Each medoid has the smallest total distance to its fellow cluster members
+	for(size_t c = 0; c < num_groups; c++){
+		REQUIRE( memberships[medoidIndices[c]] == (int) c );
+		std::vector<float> total_distance(group_size, 0);
+		for(size_t a = 0; a < group_size; a++){
+			for(size_t b = 0; b < group_size; b++){
+				if(a != b){
+					size_t i = std::min(a, b)+c*group_size, j = std::max(a, b)+c*group_size;
+					total_distance[a] += distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1];
+				}
+			}
+		}
+		REQUIRE( total_distance[medoidIndices[c]-c*group_size] == *std::min_element(total_distance.begin(), total_distance.end()) );
+	}
+	delete[] medoidIndices;
+
+	// Asking for more clusters than sequences gives every sequence its own
+	std::vector<int> small_memberships(3);
+	std::vector<float> small_distances = {1, 2, 3};
+	medoidIndices = kMedoids(3, small_distances.data(), 5, small_memberships.data(), false);
+	for(int i = 0; i < 3; i++){
+		REQUIRE( small_memberships[i] == i );
+		REQUIRE( medoidIndices[i] == i );
+	}
+	delete[] medoidIndices;
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Find Cluster Medoids " ){
+
+	size_t num_sequences = 50;
+	std::mt19937 rng(37);
+	std::uniform_real_distribution<float> uniform(1, 100);
+	std::vector<float> distances(ARITH_SERIES_SUM(num_sequences-1));
+	for(size_t i = 0; i < distances.size(); i++){
+		distances[i] = uniform(rng);
+	}
+	std::vector<size_t> lengths(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		lengths[i] = 100+(i*37)%11;
+	}
+	// The member with the smallest sum of squared distances to the others in the given set
+	auto bruteForceMedoid = [&](const std::vector<size_t> &members){
+		size_t medoid = members[0];
+		double lowest_SoS = std::numeric_limits<double>::max();
+		for(size_t i : members){
+			double SoS = 0;
+			for(size_t j : members){
+				if(i != j){
+					double distance = distances[PAIRWISE_DIST_ROW(std::min(i,j), num_sequences)+std::max(i,j)-std::min(i,j)-1];
+					SoS += distance*distance;
+				}
+			}
+			if(SoS < lowest_SoS){
+				lowest_SoS = SoS;
+				medoid = i;
+			}
+		}
+		return medoid;
+	};
+
+	SECTION("Many Clusters"){
+		std::cerr << "------TEST FINDCLUSTERMEDOIDS MANY------" << std::endl;
+		// Interleaved clusters, plus a two member and a single member one
+		int num_clusters = 5;
+		std::vector<int> memberships(num_sequences);
+		std::vector<std::vector<size_t> > members(num_clusters);
+		for(size_t i = 0; i < num_sequences; i++){
+			memberships[i] = i == 7 || i == 30 ? 3 : (i == 12 ? 4 : i%3);
+			members[memberships[i]].push_back(i);
+		}
+		std::vector<double> dtwSoS(num_sequences, 0);
+		int *medoidIndices = findClusterMedoids(distances.data(), dtwSoS.data(), num_sequences, lengths.data(), memberships.data(), num_clusters, false);
+		for(int c = 0; c < 3; c++){
+			REQUIRE( medoidIndices[c] == (int) bruteForceMedoid(members[c]) );
+		}
+		REQUIRE( medoidIndices[3] == (lengths[7] > lengths[30] ? 7 : 30) );
+		REQUIRE( medoidIndices[4] == 12 );
+		delete[] medoidIndices;
+	}
+
+	SECTION("One Cluster"){
+		std::cerr << "------TEST FINDCLUSTERMEDOIDS ONE------" << std::endl;
+		// The sums of squares over all the sequences were already accumulated with the pairwise distances
+		std::vector<double> dtwSoS(num_sequences, 0);
+		std::vector<size_t> all_members(num_sequences);
+		for(size_t i = 0; i < num_sequences; i++){
+			all_members[i] = i;
+			for(size_t j = i+1; j < num_sequences; j++){
+				double distance = distances[PAIRWISE_DIST_ROW(i, num_sequences)+j-i-1];
+				dtwSoS[i] += distance*distance;
+				dtwSoS[j] += distance*distance;
+			}
+		}
+		std::vector<int> memberships(num_sequences, 0);
+		int *medoidIndices = findClusterMedoids(distances.data(), dtwSoS.data(), num_sequences, lengths.data(), memberships.data(), 1, false);
+		REQUIRE( medoidIndices[0] == (int) bruteForceMedoid(all_members) );
+		delete[] medoidIndices;
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " K Nearest Neighbour Graph " ){
+
+	SECTION("Lower Bound"){
+		std::cerr << "------TEST KNN LOWER BOUND------" << std::endl;
+		// Sorted by length, as the input always is
+		size_t num_sequences = 20, maxSeqLength = 80;
+		std::mt19937 rng(38);
+		std::normal_distribution<double> normal(0, 1);
+		std::vector<size_t> lengths(num_sequences);
+		std::vector<double> sequences(num_sequences*maxSeqLength);
+		for(size_t i = 0; i < num_sequences; i++){
+			lengths[i] = 20+3*i;
+			double offset = (i%4)*0.5;
+			for(size_t j = 0; j < lengths[i]; j++){
+				sequences[i*maxSeqLength+j] = offset+normal(rng);
+			}
+		}
+		std::vector<dtw_lower_bound_summary> summaries;
+		double bin_start, bin_width;
+		summarizeForLowerBound(sequences.data(), maxSeqLength, num_sequences, lengths.data(), summaries, &bin_start, &bin_width);
+		for(int mode = 0; mode < 3; mode++){
+			int use_open_start = mode == 2, use_open_end = mode > 0;
+			for(size_t i = 0; i < num_sequences; i++){
+				for(size_t j = i+1; j < num_sequences; j++){
+					double distance = dtwDistanceEarlyAbandon(&sequences[i*maxSeqLength], lengths[i], &sequences[j*maxSeqLength], lengths[j], use_open_start, use_open_end, 
+					                                          std::numeric_limits<double>::max());
+					REQUIRE( lowerBoundDistance(summaries, lengths.data(), i, j, use_open_start, use_open_end, bin_start, bin_width) <= distance*(1+1e-6) );
+				}
+			}
+		}
+	}
+
+	SECTION("NN-Descent"){
+		std::cerr << "------TEST KNN DESCENT------" << std::endl;
+		// Points in the plane stand in for sequences, with no useful lower bound
+		size_t num_points = 300;
+		int k = 8;
+		std::mt19937 rng(38);
+		std::uniform_real_distribution<float> uniform(0, 1);
+		std::vector<float> x(num_points), y(num_points);
+		for(size_t i = 0; i < num_points; i++){
+			x[i] = uniform(rng);
+			y[i] = uniform(rng);
+		}
+		auto pointDistance = [&](size_t i, size_t j){ return std::sqrt((x[i]-x[j])*(x[i]-x[j])+(y[i]-y[j])*(y[i]-y[j])); };
+		size_t num_calculated = 0, max_batch_size = 0;
+		std::vector<std::vector<knn_neighbour> > neighbours;
+		knnDescent(num_points, k, [](size_t first, size_t second){ return 0.0f; },
+		           [&](std::vector<size_t> &rows, std::vector<size_t> &column_starts, std::vector<size_t> &columns, float *distances){
+		               for(size_t r = 0; r < rows.size(); r++){
+		                   for(size_t c = column_starts[r]; c < column_starts[r+1]; c++){
+		                       distances[c] = pointDistance(rows[r], columns[c]);
+		                   }
+		               }
+		               num_calculated += columns.size();
+		               max_batch_size = std::max(max_batch_size, columns.size());
+		           }, neighbours);
+		REQUIRE( num_calculated < ARITH_SERIES_SUM(num_points-1) );
+		// The neighbours of neighbours are calculated in O(N*K) sized batches
+		REQUIRE( max_batch_size <= num_points*k );
+
+		// Lists are sorted, and almost all of the true K nearest neighbours are found
+		size_t num_found = 0;
+		for(size_t i = 0; i < num_points; i++){
+			REQUIRE( neighbours[i].size() == (size_t) k );
+			std::vector<std::pair<float,size_t> > true_neighbours;
+			for(size_t j = 0; j < num_points; j++){
+				if(j != i){
+					true_neighbours.push_back(std::make_pair(pointDistance(i, j), j));
+				}
+			}
+			std::sort(true_neighbours.begin(), true_neighbours.end());
+			for(int n = 0; n < k; n++){
+				REQUIRE( neighbours[i][n].index != i );
+				REQUIRE( neighbours[i][n].distance == pointDistance(i, neighbours[i][n].index) );
+				if(n){
+					REQUIRE( neighbours[i][n-1].distance <= neighbours[i][n].distance );
+				}
+				for(int t = 0; t < k; t++){
+					num_found += neighbours[i][n].index == true_neighbours[t].second;
+				}
+			}
+		}
+		REQUIRE( num_found >= 0.9*num_points*k );
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Landmark Clustering " ){
+
+	// Three well separated blobs of points in 3D, standing in for sequences with Euclidean distances between them
+	size_t num_blobs = 3, blob_size = 40, num_dimensions = 3;
+	size_t num_points = num_blobs*blob_size;
+	std::mt19937 rng(39);
+	std::normal_distribution<double> normal(0, 1);
+	std::vector<float> points(num_points*num_dimensions);
+	for(size_t i = 0; i < num_points; i++){
+		for(size_t d = 0; d < num_dimensions; d++){
+			points[i*num_dimensions+d] = (d == i/blob_size ? 20 : 0)+normal(rng);
+		}
+	}
+
+	SECTION("Eigen Decomposition"){
+		std::cerr << "------TEST SYMMETRICEIGEN------" << std::endl;
+		size_t n = 4;
+		std::vector<double> matrix = {4, 1, 2, 0.5,  1, 3, 0, 1,  2, 0, 5, 1.5,  0.5, 1, 1.5, 2};
+		std::vector<double> original(matrix);
+		std::vector<double> eigenvalues, eigenvectors;
+		symmetricEigen(matrix, n, eigenvalues, eigenvectors);
+		for(size_t e = 0; e < n; e++){
+			for(size_t row = 0; row < n; row++){
+				double product = 0;
+				for(size_t col = 0; col < n; col++){
+					product += original[row*n+col]*eigenvectors[col*n+e];
+				}
+				REQUIRE( product == Approx(eigenvalues[e]*eigenvectors[row*n+e]).margin(1e-9) );
+			}
+		}
+	}
+
+	SECTION("Landmark Embedding"){
+		std::cerr << "------TEST LANDMARKEMBEDDING------" << std::endl;
+		std::vector<size_t> landmarks = {0, 5, 41, 47, 82, 99, 110};
+		std::vector<float> landmark_distances(landmarks.size()*num_points);
+		for(size_t l = 0; l < landmarks.size(); l++){
+			for(size_t i = 0; i < num_points; i++){
+				landmark_distances[l*num_points+i] = std::sqrt(squaredEuclidean(&points[landmarks[l]*num_dimensions], &points[i*num_dimensions], num_dimensions));
+			}
+		}
+		// Euclidean distances are reproduced exactly (up to rotation) in the original number of dimensions
+		std::vector<float> embedding;
+		REQUIRE( landmarkEmbedding(landmark_distances, landmarks, num_points, embedding) == num_dimensions );
+		for(size_t i = 0; i < num_points; i++){
+			for(size_t j = i+1; j < num_points; j++){
+				REQUIRE( squaredEuclidean(&embedding[i*num_dimensions], &embedding[j*num_dimensions], num_dimensions) == 
+				         Approx(squaredEuclidean(&points[i*num_dimensions], &points[j*num_dimensions], num_dimensions)).epsilon(1e-3).margin(1e-2) );
+			}
+		}
+	}
+
+	SECTION("K-Means"){
+		std::cerr << "------TEST KMEANS------" << std::endl;
+		std::vector<int> assignments;
+		std::vector<float> means;
+		kMeans(points, num_points, num_dimensions, num_blobs, assignments, means);
+		for(size_t i = 0; i < num_points; i++){
+			for(size_t j = 0; j < num_points; j++){
+				REQUIRE( (assignments[i] == assignments[j]) == (i/blob_size == j/blob_size) );
+			}
+		}
+		for(size_t b = 0; b < num_blobs; b++){
+			for(size_t d = 0; d < num_dimensions; d++){
+				REQUIRE( means[assignments[b*blob_size]*num_dimensions+d] == Approx(d == b ? 20 : 0).margin(1) );
+			}
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+// Reference DTW over the whole cost matrix, with the same step pattern, open ends and normalization as the DTWDistance kernel
+double fullMatrixDTWDistance(const std::vector<double> &first, const std::vector<double> &second, int use_open_start, int use_open_end){
+	size_t rows = first.size(), cols = second.size();
+	std::vector<double> cost(rows*cols);
+	for(size_t i = 0; i < rows; i++){
+		for(size_t j = 0; j < cols; j++){
+			double diff = first[i]-second[j];
+			double step_cost = i == 0 && use_open_start ? 0 : diff*diff;
+			if(i == 0){
+				cost[j] = (j ? cost[j-1] : 0)+step_cost;
+			}
+			else if(j == 0){
+				cost[i*cols] = cost[(i-1)*cols]+step_cost;
+			}
+			else{
+				double right_cost = cost[i*cols+j-1]+(use_open_end && i == rows-1 ? 0 : step_cost);
+				cost[i*cols+j] = std::min(cost[(i-1)*cols+j-1]+step_cost, std::min(cost[(i-1)*cols+j]+step_cost, right_cost));
+			}
+		}
+	}
+	double normalization = use_open_start != use_open_end ? rows : 1;
+	return std::sqrt(cost[rows*cols-1])/normalization;
+}
+
+// Runs the all-vs-all DTW step with distances stored as D, in sums only mode or with the full matrix, and checks each sequence's sum of squared distances
+// against one calculated directly over the full matrix of reference distances (rounded to D's precision if the matrix is stored).
+template<typename D>
+void requireSumsOfSquares(bool sums_only, double epsilon){
+	std::mt19937 rng(32);
+	std::normal_distribution<double> normal(0, 1);
+	size_t num_sequences = 12;
+	size_t *lengths;
+	cudaMallocManaged(&lengths, sizeof(size_t)*num_sequences); CUERR("Allocating managed memory for test sequence lengths");
+	for(size_t s = 0; s < num_sequences; s++){
+		lengths[s] = 20+2*s; // sorted by length, as performDBA() does
+	}
+	size_t max_length = lengths[num_sequences-1];
+	float *gpu_sequences;
+	cudaMallocManaged(&gpu_sequences, sizeof(float)*num_sequences*max_length); CUERR("Allocating managed memory for test sequences");
+	std::vector<std::vector<double> > sequence_values(num_sequences);
+	for(size_t s = 0; s < num_sequences; s++){
+		for(size_t i = 0; i < lengths[s]; i++){
+			gpu_sequences[s*max_length+i] = (float) (std::sin(i*0.3+s)+0.3*normal(rng));
+			sequence_values[s].push_back(gpu_sequences[s*max_length+i]);
+		}
+	}
+	std::vector<double> expected(num_sequences, 0);
+	for(size_t i = 0; i < num_sequences; i++){
+		for(size_t j = i+1; j < num_sequences; j++){
+			double distance = fullMatrixDTWDistance(sequence_values[i], sequence_values[j], 0, 0);
+			if(!sums_only){
+				distance = widenDistance(narrowDistance<D>((float) distance));
+			}
+			expected[i] += distance*distance;
+			expected[j] += distance*distance;
+		}
+	}
+
+	std::vector<char *> names = testSequenceNames(num_sequences);
+	std::vector<int> memberships(num_sequences);
+	std::vector<double> sums_of_squares(num_sequences, -1);
+	dba_options options;
+	options.sums_only_medoid = sums_only;
+	double cdist = 1;
+	char output_prefix[] = "openDBA_test_sums";
+	delete[] approximateMedoidIndices<float,D>(gpu_sequences, max_length, num_sequences, lengths, names.data(), 0, 0, output_prefix, &cdist, memberships.data(), 
+	                                           options, (cudaStream_t) 0, sums_of_squares.data());
+	for(size_t s = 0; s < num_sequences; s++){
+		REQUIRE( sums_of_squares[s] == Approx(expected[s]).epsilon(epsilon) );
+	}
+
+	remove("openDBA_test_sums.pair_dists.txt");
+	remove("openDBA_test_sums.pair_dists.ckpt");
+	for(size_t s = 0; s < num_sequences; s++){
+		free(names[s]);
+	}
+	cudaFree(gpu_sequences); CUERR("Freeing managed memory for test sequences");
+	cudaFree(lengths); CUERR("Freeing managed memory for test sequence lengths");
+}
+
+TEST_CASE( " Sums Only Medoid " ){
+
+	SECTION("Float Storage"){
+		std::cerr << "------TEST SUMS OF SQUARES FLOAT------" << std::endl;
+		requireSumsOfSquares<float>(true, 1e-4);
+		requireSumsOfSquares<float>(false, 1e-4);
+	}
+
+	SECTION("Half Storage"){
+		std::cerr << "------TEST SUMS OF SQUARES HALF------" << std::endl;
+		// The sums only mode accumulates the single precision distances whatever the storage type, the full matrix holds them rounded to 16 bits
+		requireSumsOfSquares<__half>(true, 1e-4);
+		requireSumsOfSquares<__half>(false, 5e-3);
+	}
+
+#if BFLOAT16_SUPPORTED == 1
+	SECTION("Bfloat16 Storage"){
+		std::cerr << "------TEST SUMS OF SQUARES BFLOAT16------" << std::endl;
+		requireSumsOfSquares<__nv_bfloat16>(true, 1e-4);
+		requireSumsOfSquares<__nv_bfloat16>(false, 2e-2);
+	}
+#endif
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Centroid Reassignment " ){
+
+	std::mt19937 rng(40);
+	std::normal_distribution<double> normal(0, 1);
+
+	SECTION("Early Abandoning DTW"){
+		std::cerr << "------TEST DTWDISTANCEEARLYABANDON------" << std::endl;
+		for(int trial = 0; trial < 60; trial++){
+			int use_open_start = trial%3 == 2, use_open_end = trial%3 > 0;
+			std::vector<double> first(5+trial%17), second(10+(trial*7)%23);
+			for(double &value : first) value = normal(rng);
+			for(double &value : second) value = normal(rng);
+			double distance = fullMatrixDTWDistance(first, second, use_open_start, use_open_end);
+			REQUIRE( dtwDistanceEarlyAbandon(first.data(), first.size(), second.data(), second.size(), use_open_start, use_open_end, std::numeric_limits<double>::max()) == 
+			         Approx(distance) );
+			// Never abandoned below the threshold, and either abandoned or the full distance above it
+			REQUIRE( dtwDistanceEarlyAbandon(first.data(), first.size(), second.data(), second.size(), use_open_start, use_open_end, distance*1.001) == Approx(distance) );
+			double abandoned = dtwDistanceEarlyAbandon(first.data(), first.size(), second.data(), second.size(), use_open_start, use_open_end, distance*0.999);
+			REQUIRE( (abandoned == std::numeric_limits<double>::max() || abandoned == Approx(distance)) );
+			// Every column has a zero cost cell with an open start, otherwise a far enough threshold is soon passed
+			if(!use_open_start){
+				REQUIRE( dtwDistanceEarlyAbandon(first.data(), first.size(), second.data(), second.size(), use_open_start, use_open_end, distance*0.01) == 
+				         std::numeric_limits<double>::max() );
+			}
+		}
+	}
+
+	SECTION("Reassign To Nearest Centroid"){
+		std::cerr << "------TEST REASSIGNTONEARESTCENTROIDS------" << std::endl;
+		// Two flat centroids at 0 and 10, sequences near one or the other but some assigned to the wrong one, including a medoid
+		int num_sequences = 20, num_clusters = 2;
+		std::vector<std::vector<double> > sequence_values(num_sequences);
+		std::vector<double *> sequences(num_sequences);
+		std::vector<size_t> lengths(num_sequences);
+		std::vector<int> memberships(num_sequences);
+		for(int i = 0; i < num_sequences; i++){
+			lengths[i] = 15+i;
+			sequence_values[i].resize(lengths[i]);
+			for(double &value : sequence_values[i]) value = (i%2 ? 10 : 0)+0.1*normal(rng);
+			sequences[i] = sequence_values[i].data();
+			memberships[i] = i < 4 ? 1-i%2 : i%2;
+		}
+		std::vector<double> low_centroid(20, 0), high_centroid(25, 10);
+		std::vector<double *> centroids = {low_centroid.data(), high_centroid.data()};
+		std::vector<size_t> centroid_lengths = {low_centroid.size(), high_centroid.size()};
+		int medoidIndices[] = {0, 5};
+		std::vector<char> cluster_changed;
+		REQUIRE( reassignToNearestCentroids(sequences.data(), lengths.data(), num_sequences, centroids.data(), centroid_lengths.data(), num_clusters, medoidIndices, 
+		                                    0, 1, memberships.data(), cluster_changed) == 3 );
+		REQUIRE( memberships[0] == 1 );
+		for(int i = 1; i < num_sequences; i++){
+			REQUIRE( memberships[i] == i%2 );
+		}
+		REQUIRE( cluster_changed == std::vector<char>(2, 1) );
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Streaming Alignment " ){
+
+	SECTION("RMS Conversion"){
+		std::cerr << "------TEST STREAMING RMS------" << std::endl;
+		// A read that's the consensus shifted by a constant is that far away per element in global mode
+		std::vector<double> consensus = {1, 3, 2, 5, 4, 4, 1}, read(consensus);
+		for(double &value : read) value += 0.5;
+		double distance = fullMatrixDTWDistance(read, consensus, 0, 0);
+		REQUIRE( dtwDistanceToRMS(distance, read.size(), 0, 0) == Approx(0.5) );
+		for(int mode = 0; mode < 3; mode++){
+			int use_open_start = mode == 2, use_open_end = mode > 0;
+			REQUIRE( rmsToDTWDistance(dtwDistanceToRMS(1.25, 17, use_open_start, use_open_end), 17, use_open_start, use_open_end) == Approx(1.25) );
+		}
+	}
+
+	SECTION("Align To Consensus"){
+		std::cerr << "------TEST ALIGNTOCONSENSUS------" << std::endl;
+		std::mt19937 rng(42);
+		std::normal_distribution<double> normal(0, 1);
+		std::vector<unsigned char> moves; // reused across trials of different sizes, as each streaming thread does
+		for(int trial = 0; trial < 40; trial++){
+			int use_open_end = trial%2;
+			std::vector<double> consensus(10+trial%13), read(8+(trial*5)%19);
+			for(double &value : consensus) value = normal(rng);
+			for(double &value : read) value = normal(rng);
+			std::vector<std::pair<size_t,size_t> > aligned;
+			alignToConsensus(read.data(), read.size(), consensus, 0, use_open_end, moves, aligned);
+
+			// The path is listed from the end, each step moving back along at least one of the sequences, and its cost is the DTW distance
+			bool consensus_first = consensusIsFirst(read.size(), consensus.size(), use_open_end);
+			const std::vector<double> &first = consensus_first ? consensus : read;
+			const std::vector<double> &second = consensus_first ? read : consensus;
+			double path_cost = 0;
+			for(size_t a = 0; a < aligned.size(); a++){
+				REQUIRE( aligned[a].first < consensus.size() );
+				REQUIRE( aligned[a].second < read.size() );
+				if(a){
+					REQUIRE( aligned[a].first <= aligned[a-1].first );
+					REQUIRE( aligned[a].second <= aligned[a-1].second );
+					REQUIRE( aligned[a].first+aligned[a].second < aligned[a-1].first+aligned[a-1].second );
+				}
+				double diff = consensus[aligned[a].first]-read[aligned[a].second];
+				path_cost += diff*diff;
+			}
+			REQUIRE( aligned.back() == std::make_pair((size_t) 0, (size_t) 0) );
+			if(!use_open_end){
+				REQUIRE( aligned.front() == std::make_pair(consensus.size()-1, read.size()-1) );
+			}
+			double distance = fullMatrixDTWDistance(first, second, 0, use_open_end)*(use_open_end ? first.size() : 1);
+			REQUIRE( path_cost == Approx(distance*distance) );
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Bootstrap Cluster Stability " ){
+
+	size_t num_groups = 3, group_size = 10;
+	size_t num_sequences = num_groups*group_size;
+	std::vector<float> distances = groupedPairDists(num_groups, group_size);
+	std::vector<char *> names = testSequenceNames(num_sequences);
+	std::vector<int> memberships(num_sequences);
+	for(size_t i = 0; i < num_sequences; i++){
+		memberships[i] = i/group_size;
+	}
+	char output_prefix[] = "openDBA_test_bootstrap";
+	int num_replicates = 20;
+	// Well separated clusters are found again in every replicate, whichever way they're clustered
+	auto requireStable = [&](){
+		std::ifstream stability_file("openDBA_test_bootstrap.cluster_stability.txt");
+		REQUIRE( stability_file.is_open() );
+		std::string line;
+		size_t seq_index = 0, total_times_sampled = 0;
+		while(std::getline(stability_file, line)){
+			if(line[0] == '#'){
+				continue;
+			}
+			std::istringstream fields(line);
+			std::string name;
+			int cluster, times_sampled;
+			double same_cluster, other_cluster;
+			fields >> name >> cluster >> times_sampled >> same_cluster >> other_cluster;
+			REQUIRE( name == names[seq_index] );
+			REQUIRE( cluster == memberships[seq_index] );
+			REQUIRE( times_sampled <= num_replicates );
+			REQUIRE( same_cluster == 1 );
+			REQUIRE( other_cluster == 0 );
+			total_times_sampled += times_sampled;
+			seq_index++;
+		}
+		REQUIRE( seq_index == num_sequences );
+		// About 63% of the sequences are in each replicate
+		REQUIRE( total_times_sampled > 0.5*num_replicates*num_sequences );
+		REQUIRE( total_times_sampled < 0.75*num_replicates*num_sequences );
+	};
+
+	SECTION("Dendrogram Cut"){
+		std::cerr << "------TEST BOOTSTRAP DENDROGRAM------" << std::endl;
+		bootstrapClusterStability(num_sequences, distances.data(), 106.0f, 0.5, false, memberships.data(), num_groups, num_replicates, names.data(), output_prefix);
+		requireStable();
+	}
+
+	SECTION("K-Medoids"){
+		std::cerr << "------TEST BOOTSTRAP KMEDOIDS------" << std::endl;
+		bootstrapClusterStability(num_sequences, distances.data(), 106.0f, (double) num_groups, true, memberships.data(), num_groups, num_replicates, names.data(), output_prefix);
+		requireStable();
+	}
+
+	SECTION("Concurrent Replicates"){
+		std::cerr << "------TEST BOOTSTRAP CONCURRENCY------" << std::endl;
+		// Unstructured distances so the replicates cluster differently, which mustn't depend on how many of them run at once
+		std::mt19937 rng(43);
+		std::uniform_real_distribution<float> uniform(1, 100);
+		for(float &distance : distances) distance = uniform(rng);
+		auto readStability = [&](){
+			std::ifstream stability_file("openDBA_test_bootstrap.cluster_stability.txt");
+			std::stringstream contents;
+			contents << stability_file.rdbuf();
+			return contents.str();
+		};
+		for(double cdist : {0.5, -0.05}){
+			bootstrapClusterStability(num_sequences, distances.data(), 100.0f, cdist, false, memberships.data(), num_groups, num_replicates, names.data(), output_prefix, 1);
+			std::string serial_stability = readStability();
+			for(int max_concurrent : {2, 7, 0}){
+				bootstrapClusterStability(num_sequences, distances.data(), 100.0f, cdist, false, memberships.data(), num_groups, num_replicates, names.data(), output_prefix, max_concurrent);
+				REQUIRE( readStability() == serial_stability );
+			}
+		}
+	}
+
+	for(size_t i = 0; i < num_sequences; i++){
+		free(names[i]);
+	}
+	remove("openDBA_test_bootstrap.cluster_stability.txt");
+	std::cerr << std::endl;
+}
+
+// Reference global alignment DBA update: every cell of each sequence's optimal full matrix DTW path adds the sequence's value to the centroid position's average
+std::vector<double> referenceDBAUpdate(const std::vector<double> &centroid, const std::vector<std::vector<double> > &sequences){
+	std::vector<double> sums(centroid.size(), 0), counts(centroid.size(), 0);
+	for(const std::vector<double> &sequence : sequences){
+		size_t rows = sequence.size(), cols = centroid.size();
+		std::vector<double> cost(rows*cols);
+		for(size_t i = 0; i < rows; i++){
+			for(size_t j = 0; j < cols; j++){
+				double diff = sequence[i]-centroid[j];
+				double best = 0;
+				if(i && j) best = std::min(cost[(i-1)*cols+j-1], std::min(cost[(i-1)*cols+j], cost[i*cols+j-1]));
+				else if(i) best = cost[(i-1)*cols];
+				else if(j) best = cost[j-1];
+				cost[i*cols+j] = best+diff*diff;
+			}
+		}
+		// Backtrace preferring the diagonal, then up, on ties, as the kernel's White-Neely step pattern does
+		size_t i = rows-1, j = cols-1;
+		while(true){
+			sums[j] += sequence[i];
+			counts[j]++;
+			if(!i && !j) break;
+			if(!i) j--;
+			else if(!j) i--;
+			else{
+				double diag = cost[(i-1)*cols+j-1], up = cost[(i-1)*cols+j], right = cost[i*cols+j-1];
+				if(diag <= up && diag <= right){ i--; j--; }
+				else if(up <= right) i--;
+				else j--;
+			}
+		}
+	}
+	for(size_t j = 0; j < centroid.size(); j++){
+		sums[j] /= counts[j];
+	}
+	return sums;
+}
+
+TEST_CASE( " CPU DBA Update " ){
+
+	std::mt19937 rng(44);
+	size_t num_sequences = 12, centroid_length = 40;
+	test_sine_sequences input = randomSineSequences(rng, num_sequences, 30, 2);
+	std::vector<double> centroid(input.values[0].begin(), input.values[0].begin()+30);
+	centroid.resize(centroid_length, 0);
+	for(size_t j = 30; j < centroid_length; j++){
+		centroid[j] = std::sin(j*0.3);
+	}
+	std::vector<double> updated(centroid_length);
+
+	SECTION("Matches Reference"){
+		std::cerr << "------TEST DBAUPDATECPU REFERENCE------" << std::endl;
+		double delta = DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, updated.data(), 
+		                            (dtw_path_writer<double> *) 0);
+		std::vector<double> expected = referenceDBAUpdate(centroid, input.values);
+		double expected_delta = 0;
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( updated[j] == Approx(expected[j]) );
+			expected_delta = std::max(expected_delta, std::abs(expected[j]-centroid[j]));
+		}
+		REQUIRE( delta == Approx(expected_delta) );
+	}
+
+	SECTION("Weights"){
+		std::cerr << "------TEST DBAUPDATECPU WEIGHTS------" << std::endl;
+		// Counting a sequence three times is the same as having three copies of it
+		std::vector<unsigned int> weights(num_sequences, 1);
+		weights[4] = 3;
+		DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, updated.data(), 
+		             (dtw_path_writer<double> *) 0, weights.data());
+		std::vector<std::vector<double> > copies(input.values);
+		copies.push_back(input.values[4]);
+		copies.push_back(input.values[4]);
+		std::vector<double> expected = referenceDBAUpdate(centroid, copies);
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( updated[j] == Approx(expected[j]) );
+		}
+	}
+
+	SECTION("Identical Sequences"){
+		std::cerr << "------TEST DBAUPDATECPU IDENTICAL------" << std::endl;
+		// A centroid that is every sequence doesn't move (beyond summation rounding). Not with an open start, where as in updateCentroid() 
+		// the free start of the path isn't counted towards the consensus.
+		std::vector<double *> same_sequences(num_sequences, input.sequences[0]);
+		std::vector<size_t> same_lengths(num_sequences, input.lengths[0]);
+		for(int use_open_end = 0; use_open_end < 2; use_open_end++){
+			int use_open_start = 0;
+			REQUIRE( DBAUpdateCPU(input.sequences[0], input.lengths[0], same_sequences.data(), input.names.data(), num_sequences, same_lengths.data(), use_open_start, use_open_end, 
+			                      updated.data(), (dtw_path_writer<double> *) 0) < 1e-12 );
+			for(size_t j = 0; j < input.lengths[0]; j++){
+				REQUIRE( updated[j] == Approx(input.sequences[0][j]) );
+			}
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+std::string fileContents(const char *file_name){
+	std::ifstream file(file_name);
+	std::stringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
+
+TEST_CASE( " Run-Length DTW Paths " ){
+	std::cerr << "------TEST DTW PATH RUNS------" << std::endl;
+
+	std::mt19937 rng(45);
+	std::normal_distribution<double> normal(0, 1);
+	for(int trial = 0; trial < 60; trial++){
+		int use_open_start = trial%3 == 2, use_open_end = trial%3 > 0;
+		std::vector<double> seq(5+rng()%40), centroid(5+rng()%40);
+		for(double &value : seq) value = normal(rng);
+		for(double &value : centroid) value = normal(rng);
+		// As in DBAUpdateCPU(), the centroid is the first (Y axis) sequence if it gets the open end
+		int flip_seq_order = use_open_end && centroid.size() < seq.size();
+		size_t rows = flip_seq_order ? centroid.size() : seq.size(), columns = flip_seq_order ? seq.size() : centroid.size();
+		std::vector<unsigned char> pathMatrix(rows*columns);
+		if(flip_seq_order){
+			dtwPathMatrixCPU(centroid.data(), centroid.size(), seq.data(), seq.size(), use_open_start, use_open_end, pathMatrix.data(), columns, 1);
+		}
+		else{
+			dtwPathMatrixCPU(seq.data(), seq.size(), centroid.data(), centroid.size(), use_open_start, use_open_end, pathMatrix.data(), columns, 0);
+		}
+		std::vector<dtw_path_run> runs;
+		REQUIRE( dtwPathRunsCPU(pathMatrix.data(), columns, rows, columns, flip_seq_order, runs) );
+
+		// Same text as backtracing the matrix cell by cell
+		char seq_name[] = "seq";
+		{
+			std::ofstream path("openDBA_test_path_cells.txt");
+			writeDTWPath(pathMatrix.data(), &path, seq.data(), seq_name, seq.size(), centroid.data(), centroid.size(), columns, rows, columns, flip_seq_order, 0, (int *) 0, seq.data());
+		}
+		{
+			std::ofstream path("openDBA_test_path_runs.txt");
+			writeDTWPathRuns(runs, &path, seq.data(), seq_name, centroid.data());
+		}
+		REQUIRE( fileContents("openDBA_test_path_runs.txt") == fileContents("openDBA_test_path_cells.txt") );
+
+		// Accumulating a run at a time is the same as a cell at a time
+		std::vector<double> sums(centroid.size(), 0), expected_sums(centroid.size(), 0);
+		std::vector<unsigned int> counts(centroid.size(), 0), expected_counts(centroid.size(), 0);
+		accumulateCentroidRunsCPU(runs, seq.data(), sums.data(), counts.data(), 2);
+		for(const dtw_path_run &run : runs){
+			if(run.move == OPEN_RIGHT || run.move == NIL_OPEN_RIGHT){
+				continue;
+			}
+			for(size_t k = 0; k < run.length; k++){
+				expected_sums[run.centroid_start+k*run.centroid_step] += 2*seq[run.seq_start+k*run.seq_step];
+				expected_counts[run.centroid_start+k*run.centroid_step] += 2;
+			}
+		}
+		REQUIRE( counts == expected_counts );
+		for(size_t j = 0; j < centroid.size(); j++){
+			REQUIRE( sums[j] == Approx(expected_sums[j]) );
+		}
+	}
+	remove("openDBA_test_path_cells.txt");
+	remove("openDBA_test_path_runs.txt");
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Incremental CPU DBA Update " ){
+
+	std::mt19937 rng(46);
+	std::normal_distribution<double> normal(0, 1);
+	size_t num_sequences = 10;
+	test_sine_sequences input = randomSineSequences(rng, num_sequences, 40, 3, 0.25, 0.3);
+
+	for(int mode = 0; mode < 3; mode++){
+		int use_open_start = mode == 2, use_open_end = mode > 0;
+		DYNAMIC_SECTION("Mode " << mode){
+			std::cerr << "------TEST DBAUPDATECPU INCREMENTAL MODE " << mode << "------" << std::endl;
+			size_t centroid_length = 50;
+			std::vector<double> centroid(input.values[num_sequences-1].begin(), input.values[num_sequences-1].begin()+centroid_length);
+			std::vector<double> full_update(centroid_length), incremental_update(centroid_length);
+			incremental_dba_state<double> incremental;
+			size_t num_resumed = 0;
+			// Convergence rounds, then rounds where only the end of the centroid moves (as in late rounds), then one where nothing does
+			for(int round = 0; round < 8; round++){
+				double full_delta = DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), use_open_start, use_open_end, 
+				                                 full_update.data(), (dtw_path_writer<double> *) 0);
+				double incremental_delta = DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), use_open_start, use_open_end, 
+				                                        incremental_update.data(), (dtw_path_writer<double> *) 0, (const unsigned int *) 0, &incremental);
+				REQUIRE( incremental_delta == full_delta );
+				REQUIRE( incremental_update == full_update );
+				num_resumed += incremental.num_resumed_alignments;
+				if(round < 4){
+					centroid = full_update;
+				}
+				else if(round < 6){
+					for(size_t j = centroid_length-5; j < centroid_length; j++){
+						centroid[j] += 0.05*normal(rng);
+					}
+				}
+			}
+			REQUIRE( incremental.num_resumed_alignments == num_sequences );
+			REQUIRE( incremental.num_calculated_cells == 0 );
+			REQUIRE( num_resumed > num_sequences );
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Mini-Batch Centroid Approach " ){
+
+	std::mt19937 rng(47);
+	size_t num_sequences = 12, centroid_length = 40;
+	test_sine_sequences input = randomSineSequences(rng, num_sequences, 30, 2);
+	std::vector<double> initial_centroid(input.values[num_sequences-1].begin(), input.values[num_sequences-1].begin()+centroid_length);
+	std::vector<double> centroid(initial_centroid);
+	const char *output_prefix = "minibatch_test";
+	std::string checkpoint_file_name = std::string(output_prefix) + ".0.evolving_centroid.txt";
+
+	SECTION("Whole Membership Batches"){
+		std::cerr << "------TEST APPROACHCENTROIDSTOCHASTICALLY WHOLE BATCHES------" << std::endl;
+		// With every member in each batch, the rounds are full DBA updates taken with the decaying step sizes
+		approachCentroidStochastically(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, num_sequences, 0, 1, 
+		                               std::string(output_prefix), (cudaStream_t) 0, (const unsigned int *) 0, true);
+		std::vector<double> expected(initial_centroid), update(centroid_length);
+		for(size_t round = 0; round < STOCHASTIC_DBA_EPOCHS; round++){
+			DBAUpdateCPU(expected.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, update.data(), (dtw_path_writer<double> *) 0);
+			double step_size = 1.0/(1.0+round*STOCHASTIC_DBA_STEP_DECAY);
+			double max_step = 0;
+			for(size_t j = 0; j < centroid_length; j++){
+				double stepped = expected[j]+step_size*(update[j]-expected[j]);
+				max_step = std::max(max_step, std::abs(stepped-expected[j]));
+				expected[j] = stepped;
+			}
+			if(max_step < STOCHASTIC_DBA_MIN_STEP){
+				break;
+			}
+		}
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( centroid[j] == Approx(expected[j]) );
+		}
+
+		// The evolving centroid checkpoint holds the final centroid
+		std::ifstream checkpoint(checkpoint_file_name.c_str());
+		REQUIRE( checkpoint.is_open() );
+		double value;
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( checkpoint >> value );
+			REQUIRE( value == Approx(centroid[j]) );
+		}
+		REQUIRE_FALSE( checkpoint >> value );
+	}
+
+	SECTION("Reproducible Batches"){
+		std::cerr << "------TEST APPROACHCENTROIDSTOCHASTICALLY REPRODUCIBLE------" << std::endl;
+		// The batches are drawn from a generator seeded with the cluster number, so reruns land on the same centroid
+		std::vector<double> rerun_centroid(initial_centroid);
+		approachCentroidStochastically(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, 4, 0, 1, 
+		                               std::string(output_prefix), (cudaStream_t) 0, (const unsigned int *) 0, true);
+		approachCentroidStochastically(rerun_centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, 4, 0, 1, 
+		                               std::string(output_prefix), (cudaStream_t) 0, (const unsigned int *) 0, true);
+		REQUIRE( centroid == rerun_centroid );
+		REQUIRE( centroid != initial_centroid );
+	}
+
+	remove(checkpoint_file_name.c_str());
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Mini-Batch Unaligned Positions " ){
+	std::cerr << "------TEST APPROACHCENTROIDSTOCHASTICALLY UNALIGNED POSITIONS------" << std::endl;
+
+	// In open end mode, short members skip the end of a longer centroid far from their own values, so no member aligns to those positions
+	size_t num_sequences = 6, centroid_length = 20, aligned_length = 10;
+	int unaligned_value = 1000;
+	std::vector<std::vector<int> > sequence_values(num_sequences);
+	std::vector<int *> sequences(num_sequences);
+	std::vector<size_t> lengths(num_sequences);
+	std::vector<char *> names = testSequenceNames(num_sequences);
+	for(size_t s = 0; s < num_sequences; s++){
+		lengths[s] = 8+s%3;
+		for(size_t i = 0; i < lengths[s]; i++){
+			sequence_values[s].push_back((int) (10*i+s));
+		}
+		sequences[s] = sequence_values[s].data();
+	}
+	std::vector<int> initial_centroid(centroid_length, unaligned_value);
+	for(size_t j = 0; j < aligned_length; j++){
+		initial_centroid[j] = (int) (10*j);
+	}
+
+	// An integer mean of no elements would be a division by zero, they keep their value instead
+	std::vector<int> updated(centroid_length);
+	DBAUpdateCPU(initial_centroid.data(), centroid_length, sequences.data(), names.data(), 2, lengths.data(), 0, 1, updated.data(), (dtw_path_writer<int> *) 0);
+	for(size_t j = aligned_length; j < centroid_length; j++){
+		REQUIRE( updated[j] == unaligned_value );
+	}
+
+	// Likewise across the mini-batch rounds, which don't step those positions
+	std::vector<int> centroid(initial_centroid);
+	const char *output_prefix = "minibatch_unaligned_test";
+	approachCentroidStochastically(centroid.data(), centroid_length, sequences.data(), names.data(), num_sequences, lengths.data(), 0, 1, 2, 0, 1, 
+	                               std::string(output_prefix), (cudaStream_t) 0, (const unsigned int *) 0, true);
+	for(size_t j = 0; j < aligned_length; j++){
+		REQUIRE( centroid[j] >= 0 );
+		REQUIRE( centroid[j] < unaligned_value );
+	}
+	for(size_t j = aligned_length; j < centroid_length; j++){
+		REQUIRE( centroid[j] == unaligned_value );
+	}
+
+	remove((std::string(output_prefix) + ".0.evolving_centroid.txt").c_str());
+	for(size_t s = 0; s < num_sequences; s++){
+		free(names[s]);
+	}
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " CPU DBA Update Thread Counts " ){
+
+	std::mt19937 rng(48);
+	size_t num_sequences = 9, centroid_length = 40;
+	test_sine_sequences input = randomSineSequences(rng, num_sequences, 35, 1);
+	std::vector<double> centroid(input.values[0].begin(), input.values[0].begin()+centroid_length-5);
+	for(size_t j = centroid.size(); j < centroid_length; j++){
+		centroid.push_back(std::sin(j*0.3));
+	}
+	std::vector<double> expected = referenceDBAUpdate(centroid, input.values);
+
+	SECTION("Same Update"){
+		std::cerr << "------TEST DBAUPDATECPU THREAD COUNTS------" << std::endl;
+		// Only the order the per thread sums are added in changes, including when asked for more threads than sequences
+		int thread_counts[] = {1, 2, 3, 4, 0, (int) num_sequences+3};
+		for(int num_threads : thread_counts){
+			std::vector<double> updated(centroid_length);
+			DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, updated.data(), 
+			             (dtw_path_writer<double> *) 0, (const unsigned int *) 0, (incremental_dba_state<double> *) 0, num_threads);
+			for(size_t j = 0; j < centroid_length; j++){
+				REQUIRE( updated[j] == Approx(expected[j]) );
+			}
+		}
+	}
+
+	SECTION("Incremental"){
+		std::cerr << "------TEST DBAUPDATECPU THREAD COUNTS INCREMENTAL------" << std::endl;
+		// The saved alignments are per sequence, so a state can be carried between rounds that use different thread counts
+		incremental_dba_state<double> incremental;
+		std::vector<double> updated(centroid_length), resumed(centroid_length);
+		DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, updated.data(), 
+		             (dtw_path_writer<double> *) 0, (const unsigned int *) 0, &incremental, 1);
+		DBAUpdateCPU(centroid.data(), centroid_length, input.sequences.data(), input.names.data(), num_sequences, input.lengths.data(), 0, 0, resumed.data(), 
+		             (dtw_path_writer<double> *) 0, (const unsigned int *) 0, &incremental, 4);
+		REQUIRE( incremental.num_resumed_alignments == num_sequences );
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( updated[j] == Approx(expected[j]) );
+			REQUIRE( resumed[j] == Approx(expected[j]) );
+		}
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Concurrent Cluster Thread Shares " ){
+	std::cerr << "------TEST CPUTHREADSHARES------" << std::endl;
+
+	// One big cluster and many small ones, more clusters than threads, as when the big one sets the wall time
+	int num_threads = 16;
+	size_t big_size = 1000, small_size = 10;
+	int num_small = 20;
+	cpu_thread_shares shares(num_threads);
+	shares.start(0, big_size);
+	for(int c = 1; c <= num_small; c++){
+		shares.start(c, small_size);
+	}
+	// Starting again (e.g. pre-registered before its turn) doesn't count it twice
+	shares.start(0, big_size);
+	REQUIRE( shares.share(0) == (int) (num_threads*big_size/(big_size+num_small*small_size)) );
+	REQUIRE( shares.share(0) > num_threads/2 );
+	for(int c = 1; c <= num_small; c++){
+		REQUIRE( shares.share(c) == 1 );
+	}
+
+	// The small clusters' threads go to the big one as they finish
+	int previous_share = shares.share(0);
+	for(int c = 1; c <= num_small; c++){
+		shares.finish(c);
+		REQUIRE( shares.share(0) >= previous_share );
+		previous_share = shares.share(0);
+	}
+	REQUIRE( shares.share(0) == num_threads );
+
+	// Evenly sized clusters split the threads evenly
+	cpu_thread_shares even_shares(num_threads);
+	for(int c = 0; c < 4; c++){
+		even_shares.start(c, small_size);
+	}
+	for(int c = 0; c < 4; c++){
+		REQUIRE( even_shares.share(c) == num_threads/4 );
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " DBA Update Workspace " ){
+	std::cerr << "------TEST DBAUPDATE WORKSPACE------" << std::endl;
+
+	// A round of short members and centroid, a round of longer ones, then the short ones again, all through one workspace
+	std::mt19937 rng(49);
+	size_t num_sequences = 6;
+	size_t centroid_lengths[] = {30, 60};
+	test_sine_sequences inputs[] = {randomSineSequences(rng, num_sequences, centroid_lengths[0]-5, 2, 0.3, 0.2, true), 
+	                                randomSineSequences(rng, num_sequences, centroid_lengths[1]-5, 2, 0.3, 0.2, true)};
+	std::vector<double *> centroids(2);
+	for(int size = 0; size < 2; size++){
+		cudaMallocManaged(&centroids[size], sizeof(double)*centroid_lengths[size]); CUERR("Allocating managed memory for workspace test centroid");
+		for(size_t j = 0; j < centroid_lengths[size]; j++){
+			centroids[size][j] = std::sin(j*0.3);
+		}
+	}
+
+	dba_workspace<double> workspace;
+	double *centroid_sums = 0;
+	unsigned char *path_matrix = 0;
+	size_t cost_capacity = 0, path_width = 0, path_height = 0;
+	int round_sizes[] = {0, 1, 0};
+	for(int round = 0; round < 3; round++){
+		int size = round_sizes[round];
+		size_t centroid_length = centroid_lengths[size];
+		std::vector<double> fresh(centroid_length), reused(centroid_length);
+		setupPercentageDisplay("Workspace test round " + std::to_string(round+1));
+		double fresh_delta = DBAUpdate(centroids[size], centroid_length, inputs[size].sequences.data(), inputs[size].names.data(), num_sequences, inputs[size].lengths.data(), 0, 0, fresh.data(), 
+		                               std::string(""), (cudaStream_t) 0);
+		double reused_delta = DBAUpdate(centroids[size], centroid_length, inputs[size].sequences.data(), inputs[size].names.data(), num_sequences, inputs[size].lengths.data(), 0, 0, reused.data(), 
+		                                std::string(""), (cudaStream_t) 0, (const unsigned int *) 0, &workspace);
+		teardownPercentageDisplay();
+		// The same update as with buffers allocated just for the call (up to the order of the atomic additions)
+		REQUIRE( reused_delta == Approx(fresh_delta) );
+		for(size_t j = 0; j < centroid_length; j++){
+			REQUIRE( reused[j] == Approx(fresh[j]) );
+		}
+
+		dba_device_workspace<double> &device = workspace.devices[0];
+		REQUIRE( workspace.centroidCapacity == centroid_lengths[round ? 1 : 0] );
+		REQUIRE( device.pathMatrix != 0 );
+		if(round == 1){
+			// Grown for the longer round
+			REQUIRE( device.costCapacity > cost_capacity );
+			REQUIRE( device.pathWidth*device.pathHeight > path_width*path_height );
+		}
+		else if(round == 2){
+			// Kept as they were, not freed or reallocated for the shorter round
+			REQUIRE( workspace.gpu_centroidAlignmentSums == centroid_sums );
+			REQUIRE( device.pathMatrix == path_matrix );
+			REQUIRE( device.costCapacity == cost_capacity );
+			REQUIRE( device.pathWidth == path_width );
+			REQUIRE( device.pathHeight == path_height );
+		}
+		centroid_sums = workspace.gpu_centroidAlignmentSums;
+		path_matrix = device.pathMatrix;
+		cost_capacity = device.costCapacity;
+		path_width = device.pathWidth;
+		path_height = device.pathHeight;
+	}
+
+	for(int size = 0; size < 2; size++){
+		cudaFree(centroids[size]); CUERR("Freeing managed memory for workspace test centroid");
+	}
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " DTW Path Files " ){
+
+	std::mt19937 rng(50);
+	std::normal_distribution<double> normal(0, 1);
+	char seq_name[] = "seq";
+
+	SECTION("Stripe Backtrace"){
+		std::cerr << "------TEST DTW STRIPE PATH RUNS------" << std::endl;
+		// Backtracing stripe by stripe from the right, as the GPU DBAUpdate() does, gives the same runs as the whole matrix at once
+		for(int trial = 0; trial < 60; trial++){
+			int use_open_start = (trial/2)%2, use_open_end = trial%2;
+			std::vector<double> seq(5+rng()%40), centroid(5+rng()%40);
+			for(double &value : seq) value = normal(rng);
+			for(double &value : centroid) value = normal(rng);
+			int flip_seq_order = use_open_end && centroid.size() < seq.size();
+			size_t rows = flip_seq_order ? centroid.size() : seq.size(), columns = flip_seq_order ? seq.size() : centroid.size();
+			std::vector<unsigned char> pathMatrix(rows*columns);
+			if(flip_seq_order){
+				dtwPathMatrixCPU(centroid.data(), centroid.size(), seq.data(), seq.size(), use_open_start, use_open_end, pathMatrix.data(), columns, 1);
+			}
+			else{
+				dtwPathMatrixCPU(seq.data(), seq.size(), centroid.data(), centroid.size(), use_open_start, use_open_end, pathMatrix.data(), columns, 0);
+			}
+			std::vector<dtw_path_run> runs, stripe_runs;
+			REQUIRE( dtwPathRunsCPU(pathMatrix.data(), columns, rows, columns, flip_seq_order, runs) );
+			size_t stripe_width = 1+rng()%9;
+			int stripe_rows = rows;
+			for(long offset = ((columns-1)/stripe_width)*stripe_width; offset >= 0; offset -= stripe_width){
+				dtwStripePathRunsCPU(pathMatrix.data()+offset, std::min(stripe_width, columns-offset), columns, flip_seq_order, offset, &stripe_rows, stripe_runs);
+			}
+			std::reverse(stripe_runs.begin(), stripe_runs.end());
+			REQUIRE( stripe_runs.size() == runs.size() );
+			for(size_t r = 0; r < runs.size(); r++){
+				REQUIRE( stripe_runs[r].seq_start == runs[r].seq_start );
+				REQUIRE( stripe_runs[r].centroid_start == runs[r].centroid_start );
+				REQUIRE( stripe_runs[r].length == runs[r].length );
+				REQUIRE( stripe_runs[r].move == runs[r].move );
+			}
+			{
+				std::ofstream path("openDBA_test_path_stripes.txt");
+				writeDTWPathRuns(stripe_runs, &path, seq.data(), seq_name, centroid.data());
+			}
+			{
+				std::ofstream path("openDBA_test_path_runs.txt");
+				writeDTWPathRuns(runs, &path, seq.data(), seq_name, centroid.data());
+			}
+			REQUIRE( fileContents("openDBA_test_path_stripes.txt") == fileContents("openDBA_test_path_runs.txt") );
+		}
+		remove("openDBA_test_path_stripes.txt");
+		remove("openDBA_test_path_runs.txt");
+	}
+
+	SECTION("Binary Round Trip"){
+		std::cerr << "------TEST DTW PATH WRITER------" << std::endl;
+		// The text files converted from a binary path file are the ones writeDTWPathRuns() would have written directly
+		size_t num_sequences = 6;
+		std::vector<double> centroid(30);
+		for(size_t j = 0; j < centroid.size(); j++){
+			centroid[j] = std::sin(j*0.3);
+		}
+		std::vector<std::vector<double> > sequence_values(num_sequences);
+		std::vector<std::vector<dtw_path_run> > sequence_runs(num_sequences);
+		std::vector<char *> names = testSequenceNames(num_sequences);
+		for(size_t s = 0; s < num_sequences; s++){
+			sequence_values[s].resize(20+3*s);
+			for(size_t i = 0; i < sequence_values[s].size(); i++){
+				sequence_values[s][i] = std::sin(i*0.3)+0.2*normal(rng);
+			}
+			int flip_seq_order = centroid.size() < sequence_values[s].size();
+			size_t rows = flip_seq_order ? centroid.size() : sequence_values[s].size(), columns = flip_seq_order ? sequence_values[s].size() : centroid.size();
+			std::vector<unsigned char> pathMatrix(rows*columns);
+			if(flip_seq_order){
+				dtwPathMatrixCPU(centroid.data(), centroid.size(), sequence_values[s].data(), sequence_values[s].size(), 0, 1, pathMatrix.data(), columns, 1);
+			}
+			else{
+				dtwPathMatrixCPU(sequence_values[s].data(), sequence_values[s].size(), centroid.data(), centroid.size(), 0, 1, pathMatrix.data(), columns, 0);
+			}
+			REQUIRE( dtwPathRunsCPU(pathMatrix.data(), columns, rows, columns, flip_seq_order, sequence_runs[s]) );
+		}
+
+		// One writer, two files one after the other, alignments in no particular order
+		dtw_path_writer<double> writer;
+		writer.open("openDBA_test_first.paths.bin", centroid.data(), centroid.size());
+		for(size_t s = num_sequences; s-- > 0;){
+			writer.write(s, names[s], sequence_values[s].data(), sequence_values[s].size(), sequence_runs[s]);
+		}
+		writer.close();
+		writer.open("openDBA_test_second.paths.bin", centroid.data(), centroid.size());
+		writer.write(2, names[2], sequence_values[2].data(), sequence_values[2].size(), sequence_runs[2]);
+		writer.finish();
+
+		REQUIRE( convertDTWPathFile("openDBA_test_first.paths.bin") == 0 );
+		REQUIRE( convertDTWPathFile("openDBA_test_second.paths.bin", "openDBA_test_renamed") == 0 );
+		for(size_t s = 0; s < num_sequences; s++){
+			{
+				std::ofstream path("openDBA_test_path_expected.txt");
+				writeDTWPathRuns(sequence_runs[s], &path, sequence_values[s].data(), names[s], centroid.data());
+			}
+			std::string text_file_name = "openDBA_test_first.path" + std::to_string(s) + ".txt";
+			REQUIRE( fileContents(text_file_name.c_str()) == fileContents("openDBA_test_path_expected.txt") );
+			remove(text_file_name.c_str());
+		}
+		{
+			std::ofstream path("openDBA_test_path_expected.txt");
+			writeDTWPathRuns(sequence_runs[2], &path, sequence_values[2].data(), names[2], centroid.data());
+		}
+		REQUIRE( fileContents("openDBA_test_renamed.path2.txt") == fileContents("openDBA_test_path_expected.txt") );
+		std::ifstream other_text_file("openDBA_test_renamed.path0.txt");
+		REQUIRE_FALSE( other_text_file.is_open() );
+
+		// A cut short file is reported rather than converted
+		std::string truncated = fileContents("openDBA_test_first.paths.bin");
+		truncated.resize(truncated.size()-5);
+		{
+			std::ofstream truncated_file("openDBA_test_truncated.paths.bin", std::ios::out | std::ios::binary);
+			truncated_file << truncated;
+		}
+		REQUIRE( convertDTWPathFile("openDBA_test_truncated.paths.bin", "openDBA_test_truncated") == DTW_PATH_FILE_FORMAT_VIOLATION );
+		REQUIRE( convertDTWPathFile("openDBA_test_missing.paths.bin") == CANNOT_READ_DTW_PATH );
+
+		for(size_t s = 0; s < num_sequences; s++){
+			std::string text_file_name = "openDBA_test_truncated.path" + std::to_string(s) + ".txt";
+			remove(text_file_name.c_str());
+			free(names[s]);
+		}
+		remove("openDBA_test_renamed.path2.txt");
+		remove("openDBA_test_path_expected.txt");
+		remove("openDBA_test_first.paths.bin");
+		remove("openDBA_test_second.paths.bin");
+		remove("openDBA_test_truncated.paths.bin");
+	}
+
+	std::cerr << std::endl;
+}
+
+TEST_CASE( " Grouped DBA " ){
+	std::cerr << "------TEST GROUPED DBA------" << std::endl;
+
+	// Two shapes spread over groups smaller than the whole set
+	std::mt19937 rng(41);
+	std::normal_distribution<double> normal(0, 1);
+	int num_sequences = 14;
+	float **sequences;
+	cudaMallocManaged(&sequences, sizeof(float *)*num_sequences); CUERR("Allocating managed memory for test sequence pointers");
+	size_t *lengths;
+	cudaMallocManaged(&lengths, sizeof(size_t)*num_sequences); CUERR("Allocating managed memory for test sequence lengths");
+	for(int s = 0; s < num_sequences; s++){
+		lengths[s] = 30+s;
+		cudaMallocManaged(&sequences[s], sizeof(float)*lengths[s]); CUERR("Allocating managed memory for a test sequence");
+		for(size_t i = 0; i < lengths[s]; i++){
+			sequences[s][i] = (float) ((s%2 ? std::sin(i*0.3) : 2*std::cos(i*0.1))+0.1*normal(rng));
+		}
+	}
+	std::vector<char *> names = testSequenceNames(num_sequences);
+
+	dba_options options;
+	options.group_size = 5;
+	int num_groups = (num_sequences+options.group_size-1)/options.group_size;
+	char output_prefix[] = "openDBA_test_grouped";
+	std::vector<unsigned int> group_weights;
+	performGroupedDBA<float>(sequences, num_sequences, lengths, names.data(), 0, 0, output_prefix, 0, 0.5, (char **) 0, 0, TEXT_READ_MODE, false, 
+	                         options, &group_weights);
+
+	// Every group contributes at least one consensus, each standing for as many sequences as are in its cluster
+	REQUIRE( (int) group_weights.size() >= num_groups );
+	REQUIRE( std::accumulate(group_weights.begin(), group_weights.end(), 0u) == (unsigned int) num_sequences );
+
+	// The top level membership file lists each input sequence exactly once, in a cluster whose medoid is an input sequence
+	std::ifstream membership_file("openDBA_test_grouped.cluster_membership.txt");
+	REQUIRE( membership_file.is_open() );
+	std::set<std::string> name_set(names.begin(), names.end()), seen_names;
+	std::string line;
+	int num_lines = 0;
+	while(std::getline(membership_file, line)){
+		if(line.empty() || line[0] == '#'){
+			continue;
+		}
+		std::istringstream fields(line);
+		std::string name, medoid_name;
+		int cluster = -1;
+		fields >> name >> cluster >> medoid_name;
+		REQUIRE( name_set.count(name) == 1 );
+		REQUIRE( seen_names.insert(name).second );
+		REQUIRE( cluster >= 0 );
+		REQUIRE( name_set.count(medoid_name) == 1 );
+		num_lines++;
+	}
+	REQUIRE( num_lines == num_sequences );
+	membership_file.close();
+
+	for(int g = 0; g <= num_groups; g++){
+		std::string prefix = std::string(output_prefix) + (g ? ".group"+std::to_string(g) : std::string());
+		remove((prefix + ".avg.txt").c_str());
+		remove((prefix + ".cluster_membership.txt").c_str());
+		remove((prefix + ".pair_dists.txt").c_str());
+		remove((prefix + ".pair_dists.ckpt").c_str());
+	}
+	for(int s = 0; s < num_sequences; s++){
+		free(names[s]);
+		cudaFree(sequences[s]); CUERR("Freeing managed memory for a test sequence");
+	}
+	cudaFree(sequences); CUERR("Freeing managed memory for test sequence pointers");
+	cudaFree(lengths); CUERR("Freeing managed memory for test sequence lengths");
+	std::cerr << std::endl;
+}